@@ -0,0 +1,10 @@
+#!/bin/bash -x
+
+# Assume we are run from the compiled source.
+# Only the tests that bring their own fake target, the others need tgtd.
+# The benchmarks print their timings for information, they only fail
+# when a command completes wrongly or the target sees a bad pdu.
+cd tests || exit 1
+for TEST in test_0050_*.sh test_2110_*.sh test_3*.sh; do
+	sh "$TEST" || exit 1
+done
@@ -52,6 +52,8 @@ typedef pid_t iscsi_tid_t;
 #endif /* HAVE_PTHREAD */
 
 iscsi_tid_t iscsi_mt_get_tid(void);
+/* the CPU the calling thread runs on, or -1 if that is not known */
+int iscsi_mt_get_cpu(void);
 
 
 
@@ -59,6 +61,8 @@ int iscsi_mt_sem_init(libiscsi_sem_t *sem, int value);
 int iscsi_mt_sem_destroy(libiscsi_sem_t *sem);
 int iscsi_mt_sem_post(libiscsi_sem_t *sem);
 int iscsi_mt_sem_wait(libiscsi_sem_t *sem);
+/* returns -1 if the semaphore was not posted within timeout_ms */
+int iscsi_mt_sem_timedwait(libiscsi_sem_t *sem, int timeout_ms);
 
 #endif /* HAVE_MULTITHREADING */
 
@@ -28,29 +28,63 @@
 #endif
 
 #include "iscsi.h"
+#include "scsi-lowlevel.h"
 
+/*
+ * Counters and lists that threads update without holding iscsi_lock.
+ * The gcc and clang builtins work on plain integers and pointers, the
+ * <stdatomic.h> functions want _Atomic types with some compilers.
+ * ATOMIC_CAS() may fail spuriously and then stores the current value in
+ * *(old), so it belongs in a loop. ATOMIC_EXCHANGE() is only there for
+ * code that needs multithreading anyway.
+ */
 #ifdef HAVE_MULTITHREADING
-#ifdef HAVE_STDATOMIC_H
+#if defined(__GNUC__)
+#define ATOMIC_INC(rpc, x) \
+        __atomic_fetch_add(&(x), 1, __ATOMIC_RELAXED)
+#define ATOMIC_DEC(rpc, x) \
+        __atomic_fetch_sub(&(x), 1, __ATOMIC_RELAXED)
+#define ATOMIC_FETCH_ADD(rpc, x, n) \
+        __atomic_fetch_add(&(x), (n), __ATOMIC_RELAXED)
+#define ATOMIC_LOAD(rpc, x) \
+        __atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#define ATOMIC_STORE(rpc, x, v) \
+        __atomic_store_n(&(x), (v), __ATOMIC_RELEASE)
+#define ATOMIC_EXCHANGE(rpc, x, v) \
+        __atomic_exchange_n(&(x), (v), __ATOMIC_SEQ_CST)
+#define ATOMIC_CAS(rpc, x, old, v) \
+        __atomic_compare_exchange_n(&(x), (old), (v), 1, \
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+#elif defined(HAVE_STDATOMIC_H)
 #include <stdatomic.h>
 #define ATOMIC_INC(rpc, x) \
-        atomic_fetch_add_explicit(&x, 1, memory_order_relaxed)
+        atomic_fetch_add_explicit(&(x), 1, memory_order_relaxed)
 #define ATOMIC_DEC(rpc, x) \
-        atomic_fetch_sub_explicit(&x, 1, memory_order_relaxed)
-#else /* HAVE_STDATOMIC_H */
-#define ATOMIC_INC(rpc, x)                              \
-        iscs_mt_mutex_lock(&iscs->atomic_int_mutex);    \
-        }                                               \
-	x++;                                            \
-        iscsi_mt_mutex_unlock(&iscsi->atomic_int_mutex);
-#define ATOMIC_DEC(rpc, x)                              \
-        nfs_mt_mutex_lock(&rpc->atomic_int_mutex);      \
-	x--;                                            \
-        nfs_mt_mutex_unlock(&rpc->atomic_int_mutex);
-#endif /* HAVE_STDATOMIC_H */
+        atomic_fetch_sub_explicit(&(x), 1, memory_order_relaxed)
+#define ATOMIC_FETCH_ADD(rpc, x, n) \
+        atomic_fetch_add_explicit(&(x), (n), memory_order_relaxed)
+#define ATOMIC_LOAD(rpc, x) \
+        atomic_load_explicit(&(x), memory_order_acquire)
+#define ATOMIC_STORE(rpc, x, v) \
+        atomic_store_explicit(&(x), (v), memory_order_release)
+#define ATOMIC_EXCHANGE(rpc, x, v) \
+        atomic_exchange_explicit(&(x), (v), memory_order_seq_cst)
+#define ATOMIC_CAS(rpc, x, old, v) \
+        atomic_compare_exchange_weak_explicit(&(x), (old), (v), \
+                                              memory_order_acq_rel, \
+                                              memory_order_acquire)
+#else
+#error "multithreading needs atomic operations"
+#endif
 #else /* HAVE_MULTITHREADING */
-/* no multithreading support, no need to protect the increment */
+/* no multithreading support, no need to protect anything */
 #define ATOMIC_INC(rpc, x) x++
 #define ATOMIC_DEC(rpc, x) x--
+#define ATOMIC_FETCH_ADD(rpc, x, n) (((x) += (n)) - (n))
+#define ATOMIC_LOAD(rpc, x) (x)
+#define ATOMIC_STORE(rpc, x, v) ((x) = (v))
+#define ATOMIC_CAS(rpc, x, old, v) \
+        ((x) == *(old) ? ((x) = (v), 1) : (*(old) = (x), 0))
 #endif /* HAVE_MULTITHREADING */
 
 #include "iscsi-multithreading.h"
@@ -78,8 +112,42 @@ extern "C" {
 #define ISCSI_HEADER_SIZE(hdr_digest) (ISCSI_RAW_HEADER_SIZE	\
   + (hdr_digest == ISCSI_HEADER_DIGEST_NONE?0:ISCSI_DIGEST_SIZE))
 
+/* largest pdu header we send or receive, BHS plus header digest */
+#define ISCSI_MAX_HEADER_SIZE (ISCSI_RAW_HEADER_SIZE + ISCSI_DIGEST_SIZE)
+
+/* max number of freed objects kept in each allocation cache */
 #define SMALL_ALLOC_MAX_FREE (128) /* must be power of 2 */
 
+/* max number of receive descriptors kept for reuse. We only read one pdu
+ * at a time so this does not need to be large.
+ */
+#define ISCSI_IN_PDU_POOL_SIZE (4)
+
+/*
+ * Cache of freed fixed size objects, see iscsi_cache_alloc().
+ * The free objects are chained through their first pointer.
+ */
+struct iscsi_alloc_cache {
+	void *head;
+	int count;
+};
+
+/* initial number of buckets in the ITT lookup table for queued/in-flight
+ * pdus, the table doubles whenever it holds more pdus than buckets */
+#define ISCSI_ITT_HASH_MIN_SIZE (256) /* must be power of 2 */
+
+/* how long to wait before checking a timed out WRITE again while its
+ * DATA-OUT is still being sent */
+#define ISCSI_TIMEOUT_RECHECK_MS (100)
+
+/* how much longer than scsi_timeout a sync caller waits for the service
+ * thread to expire its command before cancelling the command itself */
+#define ISCSI_SYNC_TIMEOUT_GRACE_MS (1000)
+
+/* how many more times, ISCSI_TIMEOUT_RECHECK_MS apart, it cancels the
+ * command before it gives up on it */
+#define ISCSI_SYNC_CANCEL_RETRIES (10)
+
 struct iscsi_in_pdu {
 	struct iscsi_in_pdu *next;
 
@@ -88,6 +156,7 @@ struct iscsi_in_pdu {
 
 	long long data_pos;
 	unsigned char *data;
+	size_t data_alloc;         /* allocated size of data */
 
 	/*
 	 * Some data structures wrt Data Digest (if negociated)
@@ -95,7 +164,15 @@ struct iscsi_in_pdu {
 	unsigned char data_digest_buf[ISCSI_DIGEST_SIZE];
 	int received_data_digest_bytes;
 	uint32_t calculated_data_digest;
+
+	/* the data segment of a DATA-IN was received straight into the
+	 * reassembly buffer of its task instead of into data */
+	bool data_placed;
+
+	/* must be last, recycled descriptors are cleared up to here */
+	unsigned char hdr_buf[ISCSI_MAX_HEADER_SIZE]; /* hdr points here */
 };
+struct iscsi_in_pdu *iscsi_get_iscsi_in_pdu(struct iscsi_context *iscsi);
 void iscsi_free_iscsi_in_pdu(struct iscsi_context *iscsi, struct iscsi_in_pdu *in);
 
 /* size of chap response field */
@@ -104,6 +181,13 @@ void iscsi_free_iscsi_in_pdu(struct iscsi_context *iscsi, struct iscsi_in_pdu *i
 /* max length of chap challange */
 #define MAX_CHAP_C_LENGTH 2048
 
+/* see ISCSI_QUEUE_* in slist.h */
+struct iscsi_pdu_queue {
+	struct iscsi_pdu *head;
+	struct iscsi_pdu *tail;
+	int count;
+};
+
 struct iscsi_context {
 	struct iscsi_transport *drv;
 	void *opaque;
@@ -156,6 +240,20 @@ struct iscsi_context {
 	int tcp_syncnt;
 	int tcp_nonblocking;
 
+	/* payloads of at least this size are sent with MSG_ZEROCOPY */
+	int zerocopy_threshold;
+	int zerocopy;		/* SO_ZEROCOPY is enabled on the socket */
+	uint32_t zc_next;	/* id of the next MSG_ZEROCOPY send */
+	uint32_t zc_done;	/* all sends before this id have completed */
+	/* commands that got their response before their zerocopy send
+	 * completed, see iscsi_zerocopy_park() */
+	struct iscsi_pdu_queue zc_parked;   /* Protected by iscsi_lock */
+
+	/* write data digests are computed by the submitting thread */
+	int data_digest_on_submit;
+
+	int uring_flags;	/* enum iscsi_uring_flags */
+
 	int current_phase;
 	int next_phase;
 #define ISCSI_LOGIN_SECNEG_PHASE_OFFER_CHAP         0
@@ -173,10 +271,50 @@ struct iscsi_context {
 	iscsi_command_cb socket_status_cb;
 	void *connect_data;
 
-	struct iscsi_pdu *outqueue;         /* Protected by iscsi_lock */
+	struct iscsi_pdu_queue outqueue;    /* Protected by iscsi_lock */
+	/* The outqueue starts with a priority lane holding the immediate
+	 * pdus followed by DATA-OUT for commands already sent. The rest of
+	 * the queue is kept in CmdSN order. These track the end of the
+	 * immediate pdus and of the whole priority lane.
+	 */
+	struct iscsi_pdu *outqueue_last_immediate; /* Protected by iscsi_lock */
+	struct iscsi_pdu *outqueue_last_prio;      /* Protected by iscsi_lock */
 	struct iscsi_pdu *outqueue_current; /* Protected by iscsi_lock */
-	struct iscsi_pdu *waitpdu;          /* Protected by iscsi_lock */
+	/* pdus queued by threads other than the service thread, pushed
+	 * without a lock and newest first, see iscsi_outqueue_submit() */
+	struct iscsi_pdu *submitted;
+	struct iscsi_pdu_queue waitpdu;     /* Protected by iscsi_lock */
 	struct iscsi_in_pdu *incoming;      /* Protected by iscsi_lock */
+	/* tasks without a callback complete here, see
+	 * iscsi_set_completion_queue() */
+	struct iscsi_completion_queue *cq;
+
+	/* optional receive buffer, see iscsi_set_recv_buffer_size() */
+	unsigned char *rx_buf;
+	size_t rx_buf_size;
+	size_t rx_pos;                      /* next byte to hand out */
+	size_t rx_len;                      /* bytes read into rx_buf */
+	int rx_fed;                         /* rx_buf was filled by the transport */
+
+	/* what iscsi_write_to_socket() gathers for one sendmsg(), allocated
+	 * on the first write. It is too big for the stack. */
+	struct iscsi_send_batch *send_batch;
+
+	struct iscsi_stats stats;
+
+	/* outqueue and waitpdu pdus hashed on their ITT */
+	struct iscsi_pdu **itt_hash;       /* Protected by iscsi_lock */
+	uint32_t itt_hash_mask;            /* Protected by iscsi_lock */
+	/* Written under iscsi_lock with ATOMIC_STORE so that
+	 * iscsi_session_group_select() can read it without the lock. */
+	uint32_t itt_hash_count;
+
+	/* Min-heap, ordered on pdu->scsi_timeout, of the queued pdus that
+	 * can time out. Index 0 is unused.
+	 */
+	struct iscsi_pdu **timer_heap;     /* Protected by iscsi_lock */
+	int timer_heap_len;                /* Protected by iscsi_lock */
+	int timer_heap_size;               /* Protected by iscsi_lock */
 
 	uint32_t max_burst_length;
 	uint32_t first_burst_length;
@@ -186,6 +324,28 @@ struct iscsi_context {
 	enum iscsi_initial_r2t use_initial_r2t;
 	enum iscsi_immediate_data want_immediate_data;
 	enum iscsi_immediate_data use_immediate_data;
+	uint32_t want_max_outstanding_r2t;
+	uint32_t max_outstanding_r2t;
+	uint32_t want_max_connections;
+	uint32_t max_connections;
+
+	/* Multiple connections per session. The context that logged in
+	 * first is the leading connection. It holds the ITT and CmdSN
+	 * counters and the CmdSN window of the whole session, see
+	 * ISCSI_SESSION(). Connections added with iscsi_add_connection_async()
+	 * point back at it through leader and are chained on its
+	 * connections list. They stay allocated until the leading context
+	 * is destroyed.
+	 */
+	uint16_t tsih;
+	uint16_t cid;
+	struct iscsi_context *leader;
+	struct iscsi_context *connections;
+	struct iscsi_context *next_connection;
+	int connection_count;
+	int next_cid;
+	struct iscsi_context *stripe_next;  /* Protected by iscsi_lock */
+	int connection_failed;
 
 	int lun;
 	int no_auto_reconnect;
@@ -200,27 +360,88 @@ struct iscsi_context {
 	int reallocs;                              //needs protection?
 	int frees;                                 //needs protection?
 	int cache_allocations;                     //needs ptotection?
+	struct iscsi_alloc_cache pdu_cache;        /* Protected by alloc_lock */
+	struct iscsi_in_pdu *in_pdu_pool;          /* Protected by alloc_lock */
+	int in_pdu_pool_count;                     /* Protected by alloc_lock */
 
 	time_t next_reconnect;
-	int scsi_timeout;
+	int scsi_timeout;                  /* in milliseconds */
 	struct iscsi_context *old_iscsi;
 	int retry_cnt;
 	int no_ua_on_reconnect;
 	void (*fd_dup_cb)(struct iscsi_context *iscsi, void *opaque);
 	void *fd_dup_opaque;
+	/* the event loop watching this context, see iscsi_loop_add() */
+	struct iscsi_loop *loop;
+	int loop_slot;
 
+        /* A reconnect swaps everything above this line and keeps the
+         * threads, locks and counters below, so they must stay last.
+         */
 #ifdef HAVE_MULTITHREADING
         int multithreading_enabled;
+        /* Lock order: alloc_lock may be taken while holding iscsi_lock,
+         * never the other way around. No thread holds the iscsi_lock of
+         * two contexts at once, pdus that move between the connections
+         * of a session go through a local queue.
+         */
         libiscsi_spinlock_t iscsi_lock;
+        libiscsi_spinlock_t alloc_lock;
         libiscsi_mutex_t iscsi_mutex;
         libiscsi_thread_t service_thread;
         int poll_timeout;
-#ifndef HAVE_STDATOMIC_H
-        libiscsi_mutex_t atomic_int_mutex;
-#endif /* HAVE_STDATOMIC_H */
+        int wakeup_fd[2];       /* eventfd, or the ends of a pipe */
+        int wakeup_pending;     /* service thread awake or being woken */
+        int service_cpu;        /* CPU the service thread runs on, or -1 */
+        int submitters;         /* see iscsi_submit_enter() */
+        int service_gen;        /* bumped after every iscsi_service() of
+                                 * the service thread */
 #endif /* HAVE_MULTITHREADING */
 };
 
+/* the most connections we add to a session */
+#define ISCSI_MAX_CONNECTIONS (32)
+
+/* the context that holds the session wide state of a connection */
+#define ISCSI_SESSION(iscsi) ((iscsi)->leader ? (iscsi)->leader : (iscsi))
+
+/* visit the leading connection of a session and then all the others */
+#define ISCSI_FOR_EACH_CONNECTION(session, conn)			\
+	for (conn = (session); conn;					\
+	     conn = conn == (session) ? (session)->connections :	\
+		conn->next_connection)
+
+/* the most sessions in a session group */
+#define ISCSI_MAX_GROUP_SESSIONS (32)
+
+/* iscsi_session_group_select_lba() maps regions of 2048 blocks */
+#define ISCSI_GROUP_LBA_REGION_SHIFT (11)
+
+struct iscsi_completion_queue {
+	struct iscsi_context *owner;	/* the context that frees it */
+	/* completed tasks, pushed without a lock and newest first */
+	struct scsi_task *pushed;
+	/* taken over from pushed and not reaped yet, oldest first */
+	struct scsi_task *head;		/* Protected by lock */
+	libiscsi_mutex_t lock;
+	int fd[2];			/* eventfd, or the ends of a pipe */
+	int inflight;			/* queued for us, not pushed yet */
+};
+
+struct iscsi_session_group {
+	int count;
+	struct iscsi_context *members[ISCSI_MAX_GROUP_SESSIONS];
+	enum iscsi_session_group_dispatch dispatch;
+	unsigned int next;	/* where iscsi_session_group_select() starts */
+
+	/* iscsi_session_group_connect_async() in progress, only updated
+	 * with the ATOMIC_* operations */
+	int pending;
+	int failed;
+	iscsi_session_group_cb cb;
+	void *private_data;
+};
+
 #define ISCSI_PDU_IMMEDIATE		       0x40
 
 #define ISCSI_PDU_TEXT_FINAL		       0x80
@@ -277,10 +498,24 @@ struct iscsi_scsi_cbdata {
 	iscsi_command_cb          callback;
 	void                     *private_data;
 	struct scsi_task         *task;
+	/* where the task goes when it completes, if there is no callback */
+	struct iscsi_completion_queue *cq;
+	/* the task data was sent with MSG_ZEROCOPY, up to send zc_seq */
+	bool                      zc_pending;
+	uint32_t                  zc_seq;
+	/* the response, held back while the send is not complete */
+	struct iscsi_in_pdu      *zc_response;
 };
 
+/*
+ * The fields used for every pdu when it is queued, looked up by ITT and
+ * completed are kept together at the start so they share a cache line,
+ * followed by the header we send, which lives inline in the pdu.
+ */
 struct iscsi_pdu {
 	struct iscsi_pdu *next;
+	struct iscsi_pdu *prev;
+	struct iscsi_pdu *itt_next;   /* ITT hash chain */
 
 /* There will not be a response to this pdu, so delete it once it is sent on the wire. Don't put it on the wait-queue */
 #define ISCSI_PDU_DELETE_WHEN_SENT	0x00000001
@@ -290,36 +525,73 @@ struct iscsi_pdu {
 #define ISCSI_PDU_DROP_ON_RECONNECT	0x00000004
 /* stop sending after this PDU has been sent */
 #define ISCSI_PDU_CORK_WHEN_SENT	0x00000008
+/* The PDU is linked on the outqueue or the waitpdu queue and, unless it is
+ * a DATA-OUT or carries the reserved ITT, in the ITT hash table.
+ */
+#define ISCSI_PDU_IN_OUTQUEUE		0x00000010
+#define ISCSI_PDU_IN_WAITPDU		0x00000020
+/* The PDU belongs in the priority lane at the start of the outqueue */
+#define ISCSI_PDU_PRIO_LANE		0x00000040
+/* The PDU is part of a send that has been submitted but not completed */
+#define ISCSI_PDU_IN_SEND		0x00000080
+/* The PDU was freed while in a send, free it when the send completes */
+#define ISCSI_PDU_FREE_AFTER_SEND	0x00000100
+/* A NOP-Out that takes the CmdSN of a cancelled command so the CmdSN
+ * sequence of a session with several connections has no hole in it
+ */
+#define ISCSI_PDU_CMDSN_FILLER		0x00000200
 
 	uint32_t flags;
-
-	uint32_t lun;
 	uint32_t itt;
 	uint32_t cmdsn;
-	uint32_t datasn;
 	enum iscsi_opcode response_opcode;
 
 	iscsi_command_cb callback;
 	void *private_data;
 
-	/* Used to track writing the iscsi header to the socket */
+	uint32_t lun;
+
+	/* BHS and header digest, outdata.data points here */
+	unsigned char outhdr[ISCSI_MAX_HEADER_SIZE];
+
+	/* On the wire a pdu is the header, outdata_seg, the payload from
+	 * the task iovector, padding and the data digest.
+	 */
 	struct iscsi_data outdata; /* Header for PDU to send */
-	size_t outdata_written;	   /* How much of the header we have written */
+	struct iscsi_data outdata_seg; /* Data added with iscsi_pdu_add_data() */
+	size_t written;            /* How much of the pdu we have written */
 
 	/* Used to track writing the payload data to the socket */
 	uint32_t payload_offset;   /* Offset of payload data to write */
 	uint32_t payload_len;      /* Amount of payload data to write */
-	uint32_t payload_written;  /* How much of the payload we have written */
 
+	/* A DATA-OUT pdu queued for a whole burst describes the segment it
+	 * is at, and is cut into pdus by iscsi_data_out_next() as the
+	 * socket drains. 0 for any other pdu.
+	 */
+	uint32_t burst_end;        /* buffer offset the burst ends at */
 
 	struct iscsi_data indata;
+	size_t indata_alloc;       /* allocated size of indata.data */
 
 	struct iscsi_scsi_cbdata scsi_cbdata;
-	time_t scsi_timeout;
+	uint64_t scsi_timeout;     /* iscsi_clock_ms() deadline, 0 == none */
+	int timer_slot;            /* index in timer_heap, 0 if not armed */
 	uint32_t expxferlen;
 
-	uint32_t calculated_data_digest;
-	bool outdata_digest_computed;
+	uint32_t calculated_data_digest; /* of outdata_seg */
+	bool send_data_digest;     /* outdigest is sent after the data */
+	/* the payload is digested in chunks just ahead of sending it */
+	uint32_t payload_digest;
+	uint32_t payload_digest_len; /* bytes of payload in payload_digest */
+	bool data_digest_precomputed; /* outdigest was set at submission */
+	unsigned char outdigest[ISCSI_DIGEST_SIZE];
+
+	/* data digests of the write data of a command, one per segment of
+	 * seg_digest_len bytes, computed by iscsi_scsi_command_async() */
+	uint32_t *seg_digests;
+	uint32_t seg_digest_len;
+	int seg_digest_count;
 };
 
 struct iscsi_pdu *iscsi_allocate_pdu(struct iscsi_context *iscsi,
@@ -341,20 +613,46 @@ void iscsi_pdu_set_ritt(struct iscsi_pdu *pdu, uint32_t ritt);
 void iscsi_pdu_set_datasn(struct iscsi_pdu *pdu, uint32_t datasn);
 void iscsi_pdu_set_bufferoffset(struct iscsi_pdu *pdu, uint32_t bufferoffset);
 void iscsi_cancel_pdus(struct iscsi_context *iscsi);
+int iscsi_cancel_private_data(struct iscsi_context *iscsi, void *private_data);
+int iscsi_detach_private_data(struct iscsi_context *iscsi, void *private_data);
 void iscsi_cancel_lun_pdus(struct iscsi_context *iscsi, uint32_t lun);
 int iscsi_pdu_add_data(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
 		       const unsigned char *dptr, int dsize);
 void iscsi_queue_pdu(struct iscsi_context *iscsi, struct iscsi_pdu *pdu);
 int iscsi_add_data(struct iscsi_context *iscsi, struct iscsi_data *data,
-		   const unsigned char *dptr, int dsize, int pdualignment);
+		   const unsigned char *dptr, int dsize, int pdualignment,
+		   uint32_t *data_digest);
 
 void iscsi_add_to_outqueue(struct iscsi_context *iscsi, struct iscsi_pdu *pdu);
+void iscsi_wakeup_service_thread(struct iscsi_context *iscsi);
+#if defined(HAVE_MULTITHREADING) && defined(HAVE_PTHREAD)
+void iscsi_mt_service_thread_wakeup(struct iscsi_context *iscsi);
+#endif
+#ifdef HAVE_MULTITHREADING
+void iscsi_mt_service_thread_sync(struct iscsi_context *iscsi);
+#endif
+
+/* The following require the caller to hold iscsi_lock */
+int iscsi_itt_hash_init(struct iscsi_context *iscsi);
+void iscsi_itt_hash_add(struct iscsi_context *iscsi, struct iscsi_pdu *pdu);
+void iscsi_itt_hash_remove(struct iscsi_context *iscsi, struct iscsi_pdu *pdu);
+struct iscsi_pdu *iscsi_outqueue_find(struct iscsi_context *iscsi, uint32_t itt);
+void iscsi_outqueue_insert(struct iscsi_context *iscsi, struct iscsi_pdu *pdu);
+void iscsi_outqueue_remove(struct iscsi_context *iscsi, struct iscsi_pdu *pdu);
+void iscsi_outqueue_requeue(struct iscsi_context *iscsi, struct iscsi_pdu *pdu);
+struct iscsi_pdu *iscsi_waitpdu_find(struct iscsi_context *iscsi, uint32_t itt);
+void iscsi_waitpdu_add(struct iscsi_context *iscsi, struct iscsi_pdu *pdu);
+void iscsi_waitpdu_remove(struct iscsi_context *iscsi, struct iscsi_pdu *pdu);
+void iscsi_waitpdu_detach(struct iscsi_context *iscsi,
+			  struct iscsi_pdu_queue *queue);
 struct scsi_task;
 void iscsi_pdu_set_cdb(struct iscsi_pdu *pdu, struct scsi_task *task);
 
 int iscsi_get_pdu_data_size(const unsigned char *hdr);
 int iscsi_get_pdu_padding_size(const unsigned char *hdr);
 int iscsi_process_pdu(struct iscsi_context *iscsi, struct iscsi_in_pdu *in);
+int iscsi_verify_data_digest(struct iscsi_context *iscsi,
+			     struct iscsi_in_pdu *in);
 
 int iscsi_process_login_reply(struct iscsi_context *iscsi,
 			      struct iscsi_pdu *pdu,
@@ -387,6 +685,7 @@ void iscsi_set_error(struct iscsi_context *iscsi, const char *error_string,
 		     ...) __attribute__((format(printf, 2, 3)));
 
 struct scsi_iovector *iscsi_get_scsi_task_iovector_in(struct iscsi_context *iscsi, struct iscsi_in_pdu *in);
+unsigned char *iscsi_get_scsi_task_datain_buf(struct iscsi_context *iscsi, struct iscsi_in_pdu *in);
 struct scsi_iovector *iscsi_get_scsi_task_iovector_out(struct iscsi_context *iscsi, struct iscsi_pdu *pdu);
 void scsi_task_reset_iov(struct scsi_iovector *iovector);
 
@@ -395,12 +694,33 @@ void* iscsi_zmalloc(struct iscsi_context *iscsi, size_t size);
 void* iscsi_realloc(struct iscsi_context *iscsi, void* ptr, size_t size);
 void iscsi_free(struct iscsi_context *iscsi, void* ptr);
 char* iscsi_strdup(struct iscsi_context *iscsi, const char* str);
+void* iscsi_cache_alloc(struct iscsi_context *iscsi,
+			struct iscsi_alloc_cache *cache, size_t size);
+void iscsi_cache_free(struct iscsi_context *iscsi,
+		      struct iscsi_alloc_cache *cache, void *ptr);
+void iscsi_free_alloc_caches(struct iscsi_context *iscsi);
 
 uint32_t crc32c(uint8_t *buf, int len);
 void crc32c_init(uint32_t *crc_ptr);
 uint32_t crc32c_chain(uint32_t crc, uint8_t *buf, int len);
+uint32_t crc32c_chain_copy(uint32_t crc, uint8_t *dst, const uint8_t *src,
+			   size_t len);
 uint32_t crc32c_chain_done(uint32_t crc);
 
+/*
+ * CRC32C implementations. The fastest one the CPU supports is picked on
+ * first use. crc32c_select() forces a specific one and returns -1 if it
+ * is not available on this CPU/build, it is meant for tests and benchmarks.
+ */
+enum crc32c_impl {
+	CRC32C_IMPL_SW     = 0,	/* portable slicing-by-8 */
+	CRC32C_IMPL_SSE42  = 1,	/* crc32 instruction, 3 way interleaved */
+	CRC32C_IMPL_PCLMUL = 2,	/* as SSE42, lanes merged with pclmulqdq */
+};
+#define CRC32C_IMPL_MAX 3
+int crc32c_select(enum crc32c_impl impl);
+const char *crc32c_impl_name(enum crc32c_impl impl);
+
 struct scsi_task *iscsi_scsi_get_task_from_pdu(struct iscsi_pdu *pdu);
 
 void iscsi_decrement_iface_rr(void);
@@ -432,6 +752,65 @@ void iscsi_tcp_free_pdu(struct iscsi_context *iscsi, struct iscsi_pdu *pdu);
 
 int iscsi_service_reconnect_if_loggedin(struct iscsi_context *iscsi);
 
+/* The CmdSN counter is shared by several connections, or handed out to
+ * threads that do not hold iscsi_lock, so a connection must not renumber
+ * the commands it has queued. NOP-Outs fill the gaps instead.
+ */
+static inline int iscsi_cmdsn_shared(struct iscsi_context *iscsi)
+{
+#ifdef HAVE_MULTITHREADING
+	if (iscsi->multithreading_enabled) {
+		return 1;
+	}
+#endif
+	return iscsi->leader != NULL || iscsi->connections != NULL;
+}
+
+void iscsi_update_cmdsn_window(struct iscsi_context *iscsi,
+			       uint32_t expcmdsn, uint32_t maxcmdsn);
+
+/* Requires the caller to hold iscsi_lock */
+struct iscsi_pdu *iscsi_data_out_next(struct iscsi_context *iscsi,
+				      struct iscsi_pdu *burst);
+int iscsi_queue_cmdsn_filler(struct iscsi_context *iscsi,
+			     struct iscsi_pdu *pdu);
+struct iscsi_context *iscsi_stripe_connection(struct iscsi_context *iscsi);
+struct iscsi_context *iscsi_task_connection(struct iscsi_context *iscsi,
+					    struct scsi_task *task);
+void iscsi_connection_failed(struct iscsi_context *iscsi);
+void iscsi_inherit_settings(struct iscsi_context *to,
+			    struct iscsi_context *from);
+
+/* the most iovecs we gather into one send */
+#define ISCSI_SEND_BATCH_IOV 512
+
+/* the most payload bytes we data digest ahead of a send, the send then
+ * still finds them in the cache */
+#define ISCSI_DIGEST_AHEAD (128 * 1024)
+
+/*
+ * Consecutive pdus from the outqueue that are written with a single send.
+ * iov_zc[] holds the index + 1 of the pdu whose payload an iovec is part
+ * of when that payload goes out with MSG_ZEROCOPY, and 0 otherwise.
+ */
+struct iscsi_send_batch {
+	struct scsi_iovec iov[ISCSI_SEND_BATCH_IOV];
+	int iov_zc[ISCSI_SEND_BATCH_IOV];
+	struct iscsi_pdu *pdu[ISCSI_SEND_BATCH_IOV];
+	size_t len[ISCSI_SEND_BATCH_IOV];
+	int niov;
+	int npdu;
+};
+
+int iscsi_send_batch_build(struct iscsi_context *iscsi,
+			   struct iscsi_send_batch *batch);
+int iscsi_send_batch_done(struct iscsi_context *iscsi,
+			  struct iscsi_send_batch *batch, size_t count);
+
+int iscsi_zerocopy_park(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
+			struct iscsi_in_pdu *in);
+void iscsi_zerocopy_flush(struct iscsi_context *iscsi);
+
 void iscsi_dump_pdu_header(struct iscsi_context *iscsi, unsigned char *data);
 
 union socket_address;
@@ -445,8 +824,42 @@ typedef struct iscsi_transport {
 	int (*service)(struct iscsi_context *iscsi, int revents);
 	int (*get_fd)(struct iscsi_context *iscsi);
 	int (*which_events)(struct iscsi_context *iscsi);
+	/* optional, releases the transport state in iscsi->opaque */
+	void (*destroy)(struct iscsi_context *iscsi);
 } iscsi_transport;
 
+void iscsi_free_transport(struct iscsi_context *iscsi);
+
+int iscsi_tcp_connect(struct iscsi_context *iscsi, union socket_address *sa,
+		      int ai_family);
+int iscsi_tcp_disconnect(struct iscsi_context *iscsi);
+int iscsi_tcp_service(struct iscsi_context *iscsi, int revents);
+int iscsi_outqueue_enqueue(struct iscsi_context *iscsi, struct iscsi_pdu *pdu);
+int iscsi_outqueue_submit(struct iscsi_context *iscsi, struct iscsi_pdu *pdu);
+void iscsi_submit_enter(struct iscsi_context *iscsi);
+void iscsi_submit_leave(struct iscsi_context *iscsi);
+void iscsi_submit_fence(struct iscsi_context *iscsi);
+void iscsi_submit_unfence(struct iscsi_context *iscsi);
+/* Requires the caller to hold iscsi_lock */
+void iscsi_submitted_drain(struct iscsi_context *iscsi);
+
+void iscsi_cq_push(struct iscsi_completion_queue *cq, struct scsi_task *task);
+void iscsi_cq_destroy(struct iscsi_context *iscsi);
+
+/* The state of a context that is part of an event loop changed, and the
+ * loop has to look at its events and timers again */
+void iscsi_loop_touch(struct iscsi_context *iscsi);
+/* The socket of the context is about to be closed or was replaced */
+void iscsi_loop_reset_fd(struct iscsi_context *iscsi);
+int iscsi_loop_attach(struct iscsi_loop *loop, struct iscsi_context *iscsi);
+void iscsi_loop_detach(struct iscsi_context *iscsi);
+int iscsi_read_from_buffer(struct iscsi_context *iscsi, unsigned char *buf,
+			   size_t len);
+
+#ifdef HAVE_LINUX_IO_URING
+void iscsi_init_uring_transport(struct iscsi_context *iscsi);
+#endif
+
 static inline int iscsi_dup2(struct iscsi_context *iscsi, int oldfd, int newfd)
 {
 	int ret = dup2(oldfd, newfd);
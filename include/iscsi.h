@@ -58,7 +58,8 @@ struct scsi_iovec;
 
 enum iscsi_transport_type {
 	TCP_TRANSPORT = 0,
-	ISER_TRANSPORT = 1
+	ISER_TRANSPORT = 1,
+	URING_TRANSPORT = 2
 };
 
 EXTERN void iscsi_set_cache_allocations(struct iscsi_context *iscsi, int ca);
@@ -109,6 +110,8 @@ EXTERN int iscsi_out_queue_length(struct iscsi_context *iscsi);
  * intervals.
  * An easy way to do this is calling iscsi_service(iscsi, 0), i.e.
  * by passing 0 as the revents arguments once every second or so.
+ * Applications that want timeouts to trigger on time can instead use
+ * iscsi_next_timeout() as the timeout for poll().
  ************************************************************/
 
 /*
@@ -140,12 +143,51 @@ EXTERN int iscsi_out_queue_length(struct iscsi_context *iscsi);
  */
 EXTERN int iscsi_set_timeout(struct iscsi_context *iscsi, int timeout);
 
+/*
+ * Same as iscsi_set_timeout() but the timeout is in milliseconds.
+ */
+EXTERN int iscsi_set_timeout_ms(struct iscsi_context *iscsi, int timeout_ms);
+
+/*
+ * Returns the number of milliseconds until the next PDU times out,
+ * 0 if a PDU has already timed out or -1 if no PDU has a timeout pending.
+ * The value can be passed straight to poll() and iscsi_service() should
+ * be called when it expires.
+ */
+EXTERN int iscsi_next_timeout(struct iscsi_context *iscsi);
+
 /*
  * To set tcp keepalive for the session.
  * Only options supported by given platform (if any) are set.
  */
 EXTERN int iscsi_set_tcp_keepalive(struct iscsi_context *iscsi, int idle, int count, int interval);
 
+/*
+ * Read from the socket through a buffer of this many bytes.
+ * With a buffer a single recv() can pick up many small PDUs, such as
+ * a burst of SCSI responses, and they are then parsed out of the buffer.
+ * Large data segments are still read straight into the application
+ * buffers.
+ * Can not be changed while the buffer holds unparsed data.
+ *
+ * Default is 0 == no buffer.
+ */
+EXTERN int iscsi_set_recv_buffer_size(struct iscsi_context *iscsi, int size);
+
+/*
+ * Counters for how much work the context does on the socket.
+ * The syscall counters divided by commands gives the number of system
+ * calls spent per SCSI command.
+ */
+struct iscsi_stats {
+	uint64_t commands;     /* SCSI commands queued */
+	uint64_t tx_pdus;      /* PDUs written to the socket */
+	uint64_t rx_pdus;      /* PDUs read from the socket */
+	uint64_t tx_syscalls;  /* send() and writev() calls */
+	uint64_t rx_syscalls;  /* recv() and readv() calls */
+};
+EXTERN void iscsi_get_stats(struct iscsi_context *iscsi, struct iscsi_stats *stats);
+
 struct iscsi_url {
        char portal[MAX_STRING_SIZE + 1];
        char target[MAX_STRING_SIZE + 1];
@@ -185,6 +227,30 @@ enum iscsi_initial_r2t {
 EXTERN int
 iscsi_set_initial_r2t(struct iscsi_context *iscsi, enum iscsi_initial_r2t initial_r2t);
 
+/*
+ * This function is used to set how many R2Ts the target may have
+ * outstanding per write command, i.e. how many bursts of a write it can
+ * solicit without waiting for the previous one. It has to be called
+ * before the context is logged in to the target. Valid values are
+ * 1 to 65535.
+ *
+ * Default is for libiscsi to try to negotiate 1
+ */
+EXTERN int
+iscsi_set_max_outstanding_r2t(struct iscsi_context *iscsi, int max_r2t);
+
+/*
+ * This function is used to set how many connections we offer the target
+ * to use for the session. It has to be called before the context is
+ * logged in to the target. Valid values are 1 to 32. The target may
+ * accept fewer, and additional connections are only made through
+ * iscsi_add_connection_async().
+ *
+ * Default is for libiscsi to try to negotiate 1
+ */
+EXTERN int
+iscsi_set_max_connections(struct iscsi_context *iscsi, int max_connections);
+
 
 enum iscsi_chap_auth {
 	ISCSI_CHAP_MD5 = 5,
@@ -272,6 +338,13 @@ EXTERN int iscsi_destroy_context(struct iscsi_context *iscsi);
  * Sets and initializes the transport type for a context.
  * TCP_TRANSPORT is the default and is available on all platforms.
  * ISER_TRANSPORT is conditionally supported on Linux where available.
+ * URING_TRANSPORT is TCP driven by io_uring, on Linux 6.0 and later.
+ * iscsi_get_fd() then returns the fd of the ring instead of the socket.
+ * Received data is read into buffers the kernel picks from a ring of
+ * provided buffers, and the pdus that are ready to go out are sent with a
+ * single SENDMSG the next time iscsi_service() is called. For this
+ * transport the tx_syscalls counter of iscsi_get_stats() counts
+ * io_uring_enter() calls.
  *
  * Returns:
  *  0: success
@@ -517,6 +590,350 @@ EXTERN int iscsi_full_connect_async(struct iscsi_context *iscsi, const char *por
 EXTERN int iscsi_full_connect_sync(struct iscsi_context *iscsi, const char *portal,
 			    int lun);
 
+/*
+ * Asynchronous call to add one more connection to the session of a
+ * logged in context, if the target agreed to more than one connection
+ * during login, see iscsi_set_max_connections().
+ * The new connection logs in to the same portal with the same ISID and
+ * TSIH. Once it is logged in, SCSI commands queued on the context are
+ * striped round robin over all the connections of the session while
+ * the CmdSN numbering stays session wide.
+ * Keep using the original context for everything. The connections
+ * belong to it; they are serviced by iscsi_service() on their own
+ * file descriptors, see iscsi_get_connection(), or by the service
+ * thread when multithreading is enabled, and they are destroyed
+ * together with the context.
+ * If a connection fails, the whole session is reconnected.
+ *
+ * Returns:
+ *  0 if the call was initiated and the login will be attempted. Result
+ *    of the login will be reported through the callback function.
+ * <0 if there was an error. The callback function will not be invoked.
+ *
+ * Callback parameters :
+ * status can be either of :
+ *    SCSI_STATUS_GOOD     : The connection is logged in.
+ *    SCSI_STATUS_ERROR    : The connection could not be added.
+ */
+EXTERN int iscsi_add_connection_async(struct iscsi_context *iscsi,
+				      iscsi_command_cb cb, void *private_data);
+
+/*
+ * Synchronous call to add a connection to the session.
+ *
+ * Returns:
+ *  0 if the connection is logged in.
+ * <0 if there was an error.
+ */
+EXTERN int iscsi_add_connection_sync(struct iscsi_context *iscsi);
+
+/*
+ * Returns the number of connections of the session, counting the
+ * context itself.
+ */
+EXTERN int iscsi_get_connection_count(struct iscsi_context *iscsi);
+
+/*
+ * Returns connection number idx of the session, 0 being the context
+ * itself, or NULL. Applications that run their own event loop use this
+ * to poll and service every connection with iscsi_get_fd(),
+ * iscsi_which_events() and iscsi_service().
+ */
+EXTERN struct iscsi_context *
+iscsi_get_connection(struct iscsi_context *iscsi, int idx);
+
+/*
+ * Session groups, for targets that do not do multiple connections per
+ * session. A group is a set of independent sessions to the same LUN,
+ * each with its own context and its own ISID, and spreads SCSI commands
+ * over them.
+ *
+ * Create the group, configure the member contexts, see
+ * iscsi_session_group_get_context(), and log them all in with
+ * iscsi_session_group_connect_async(). Then ask
+ * iscsi_session_group_select() for the context to queue each command
+ * on, using any of the task functions below. Completions are reported
+ * through the callback of the task as usual.
+ * Every member reconnects on its own when its session fails. While it
+ * is reconnecting, new commands go to the other members and the
+ * commands already queued on it are sent again once it is back.
+ *
+ * To scale over several cores, give every member a service thread on
+ * its own CPU with iscsi_session_group_start_service_threads(), and
+ * pick members with ISCSI_SESSION_GROUP_LOCAL_CPU or
+ * iscsi_session_group_select_lba(). A command is then sent and completed
+ * on one core only.
+ */
+struct iscsi_session_group;
+
+typedef void (*iscsi_session_group_cb)(struct iscsi_session_group *group,
+				       int status, void *private_data);
+
+enum iscsi_session_group_dispatch {
+	/* the member with the fewest commands in flight */
+	ISCSI_SESSION_GROUP_LEAST_OUTSTANDING = 0,
+	ISCSI_SESSION_GROUP_ROUND_ROBIN       = 1,
+	/* the member whose service thread runs on the CPU of the caller,
+	 * round robin if the CPU is not known or that member is not
+	 * logged in */
+	ISCSI_SESSION_GROUP_LOCAL_CPU         = 2
+};
+
+/*
+ * Create a group of 1 to 32 sessions. The members get ISIDs that only
+ * differ in their qualifier.
+ * Returns NULL if the group could not be created.
+ */
+EXTERN struct iscsi_session_group *
+iscsi_create_session_group(const char *initiator_name, int sessions);
+
+/*
+ * Destroy the group and all its member contexts. This does not log the
+ * sessions out, see iscsi_session_group_logout_sync().
+ */
+EXTERN void
+iscsi_destroy_session_group(struct iscsi_session_group *group);
+
+/*
+ * Returns the number of sessions of the group.
+ */
+EXTERN int
+iscsi_session_group_get_count(struct iscsi_session_group *group);
+
+/*
+ * Returns member context idx of the group, or NULL. Use it to configure
+ * the member before it logs in, and to poll and service its file
+ * descriptor with iscsi_get_fd(), iscsi_which_events() and
+ * iscsi_service() in an application event loop. The context belongs to
+ * the group and must not be destroyed on its own.
+ */
+EXTERN struct iscsi_context *
+iscsi_session_group_get_context(struct iscsi_session_group *group, int idx);
+
+/*
+ * Set how iscsi_session_group_select() picks a member.
+ *
+ * Default is ISCSI_SESSION_GROUP_LEAST_OUTSTANDING
+ */
+EXTERN void
+iscsi_session_group_set_dispatch(struct iscsi_session_group *group,
+				 enum iscsi_session_group_dispatch dispatch);
+
+/*
+ * Set the target name on every member.
+ */
+EXTERN int
+iscsi_session_group_set_targetname(struct iscsi_session_group *group,
+				   const char *targetname);
+
+/*
+ * Spread the members over a comma separated list of interfaces. Member
+ * i binds to interface i modulo the number of interfaces, also when it
+ * reconnects. See iscsi_set_bind_interfaces().
+ */
+EXTERN int
+iscsi_session_group_set_bind_interfaces(struct iscsi_session_group *group,
+					const char *interfaces);
+
+/*
+ * Asynchronous call to connect and log in every member of the group
+ * to the portal and LUN, like iscsi_full_connect_async() does for a
+ * single context. The members log in in parallel.
+ *
+ * Returns:
+ *  0 if the logins were started. The callback is invoked once all of
+ *    them are done. With service threads running it runs on the thread
+ *    of the member that finishes last, possibly before this returns.
+ * <0 if no login could be started. The callback function will not be
+ *    invoked.
+ *
+ * Callback parameters :
+ * status can be either of :
+ *    SCSI_STATUS_GOOD     : All members are logged in.
+ *    SCSI_STATUS_ERROR    : One or more members failed to log in. See
+ *                           iscsi_get_error() of the members that are
+ *                           not logged in.
+ */
+EXTERN int
+iscsi_session_group_connect_async(struct iscsi_session_group *group,
+				  const char *portal, int lun,
+				  iscsi_session_group_cb cb,
+				  void *private_data);
+
+/*
+ * Synchronous call to log in every member of the group.
+ *
+ * Returns:
+ *  0 if all members are logged in.
+ * <0 if there was an error.
+ */
+EXTERN int
+iscsi_session_group_connect_sync(struct iscsi_session_group *group,
+				 const char *portal, int lun);
+
+/*
+ * Synchronous call to log out every member that is logged in.
+ *
+ * Returns:
+ *  0 if all of them logged out.
+ * <0 if there was an error.
+ */
+EXTERN int
+iscsi_session_group_logout_sync(struct iscsi_session_group *group);
+
+/*
+ * Returns the member context the next command should be queued on.
+ * Members that are not logged in, for instance because they are
+ * reconnecting, are only picked when no member is logged in.
+ * This may be called from any thread.
+ */
+EXTERN struct iscsi_context *
+iscsi_session_group_select(struct iscsi_session_group *group);
+
+/*
+ * Returns the member context a command for lba should be queued on. The
+ * LBAs are cut in regions of 2048 blocks that are hashed over the
+ * members, so all commands for a region go to the same member. If that
+ * member is not logged in this falls back to
+ * iscsi_session_group_select().
+ * This may be called from any thread.
+ */
+EXTERN struct iscsi_context *
+iscsi_session_group_select_lba(struct iscsi_session_group *group,
+			       uint64_t lba);
+
+/*
+ * Start a service thread for every member, see
+ * iscsi_mt_service_thread_start(), and bind the one of member i to CPU
+ * cpus[i % ncpus]. If cpus is NULL member i runs on CPU i. The commands
+ * of a member are sent and completed on its service thread.
+ *
+ * Returns:
+ *  0 if all service threads are running.
+ * <0 if one could not be started, see iscsi_get_error() of the members.
+ *    None of the threads are left running.
+ */
+EXTERN int
+iscsi_session_group_start_service_threads(struct iscsi_session_group *group,
+					  const int *cpus, int ncpus);
+
+/*
+ * Stop the service threads of all members. This is also done by
+ * iscsi_destroy_session_group().
+ */
+EXTERN void
+iscsi_session_group_stop_service_threads(struct iscsi_session_group *group);
+
+/*
+ * Event loops, for applications that drive many sessions from a few
+ * threads. A loop watches the file descriptors of all its sessions, and
+ * of their other connections, in one epoll set where the platform has
+ * it, and only services the contexts that are ready or have a command
+ * or a reconnect due. The events a context waits for are only updated
+ * when they change, so an idle session costs nothing per iteration.
+ *
+ * Add the sessions with iscsi_loop_add(), before or after logging them
+ * in, and call iscsi_loop_run() from the thread that owns the loop.
+ * All calls for the contexts of a loop, including the ones that queue
+ * commands, have to come from that thread. The contexts must not have
+ * a service thread. To use more threads give each one its own loop
+ * with its own share of the sessions.
+ *
+ * Example:
+ *   loop = iscsi_create_loop();
+ *   for (i = 0; i < luns; i++) {
+ *       iscsi_loop_add(loop, iscsi[i]);
+ *       iscsi_full_connect_async(iscsi[i], portal, i, connect_cb, NULL);
+ *   }
+ *   while (running) {
+ *       iscsi_loop_run(loop, -1);
+ *   }
+ */
+struct iscsi_loop;
+
+/*
+ * Called when iscsi_service() failed for a session of the loop. The
+ * session has been taken out of the loop already and can be destroyed,
+ * or added again once it is connected.
+ */
+typedef void (*iscsi_loop_error_cb)(struct iscsi_loop *loop,
+				    struct iscsi_context *iscsi,
+				    void *private_data);
+
+/*
+ * Create an empty loop.
+ * Returns NULL if the loop could not be created.
+ */
+EXTERN struct iscsi_loop *
+iscsi_create_loop(void);
+
+/*
+ * Take all sessions out of the loop and destroy it. The contexts are
+ * not destroyed.
+ */
+EXTERN void
+iscsi_destroy_loop(struct iscsi_loop *loop);
+
+/*
+ * Set the function that is called when a session fails. Without one
+ * the session is only taken out of the loop.
+ */
+EXTERN void
+iscsi_loop_set_error_cb(struct iscsi_loop *loop, iscsi_loop_error_cb cb,
+			void *private_data);
+
+/*
+ * Add a session to the loop. This takes the leading connection, the
+ * other connections of the session, including the ones added later, are
+ * watched as well. Destroying the context takes it out of the loop.
+ *
+ * Returns:
+ *  0 if the session was added.
+ * <0 if there was an error, see iscsi_get_error().
+ */
+EXTERN int
+iscsi_loop_add(struct iscsi_loop *loop, struct iscsi_context *iscsi);
+
+/*
+ * Take a session out of the loop.
+ *
+ * Returns:
+ *  0 if the session was removed.
+ * <0 if it was not part of the loop.
+ */
+EXTERN int
+iscsi_loop_remove(struct iscsi_loop *loop, struct iscsi_context *iscsi);
+
+/*
+ * Wait up to timeout_ms milliseconds, or forever if it is -1, for any
+ * context of the loop to become ready, and service the ones that are.
+ * Commands that time out and reconnects that are due are handled too.
+ *
+ * Returns:
+ * >=0 the number of contexts that were serviced.
+ * <0  if waiting failed, errno is set.
+ */
+EXTERN int
+iscsi_loop_run(struct iscsi_loop *loop, int timeout_ms);
+
+/*
+ * Returns a file descriptor that becomes readable when iscsi_loop_run()
+ * has work to do, to nest the loop in another event loop, or -1 where
+ * there is no epoll. Commands queued since the last iscsi_loop_run() and
+ * timeouts do not make it readable, so call iscsi_loop_run() with a
+ * timeout of 0 after queuing and at least every iscsi_loop_next_timeout()
+ * milliseconds.
+ */
+EXTERN int
+iscsi_loop_get_fd(struct iscsi_loop *loop);
+
+/*
+ * Returns the number of milliseconds until the next command of the loop
+ * times out or the next reconnect is due, or -1 if there is none.
+ */
+EXTERN int
+iscsi_loop_next_timeout(struct iscsi_loop *loop);
+
 /*
  * Disconnect a connection to a target.
  * You can not disconnect while being logged in to a target.
@@ -880,6 +1297,53 @@ EXTERN int iscsi_scsi_command_async(struct iscsi_context *iscsi, int lun,
 			     struct scsi_task *task, iscsi_command_cb cb,
 			     struct iscsi_data *data, void *private_data);
 
+/*
+ * Completion queue mode. Once it is enabled, SCSI commands that are
+ * queued with a NULL callback are put on the completion queue of the
+ * context when they complete, instead of being reported from the thread
+ * that runs iscsi_service() or the service thread. The application
+ * reaps them in batches with iscsi_reap_completions() from any of its
+ * threads. task->status holds the status the callback would have
+ * received, and scsi_get_task_private_ptr() returns the private_data
+ * the command was queued with. Commands that have a callback, which
+ * includes all the sync functions, are reported through it as before.
+ *
+ * Enable the queue before queuing commands without a callback. It can
+ * only be disabled again once every command that was queued for it has
+ * completed and been reaped, and not while other threads queue commands.
+ * Tasks that have not been reaped when the context is destroyed are
+ * freed.
+ *
+ * Returns:
+ *  0 on success
+ * <0 on error
+ */
+EXTERN int iscsi_set_completion_queue(struct iscsi_context *iscsi,
+				      int enable);
+
+/*
+ * Returns a file descriptor that is readable while completed tasks are
+ * waiting on the completion queue, for adding it to an event loop. Only
+ * the first completion after the queue ran empty signals it, and
+ * iscsi_reap_completions() resets it. Returns -1 if the queue is not
+ * enabled.
+ */
+EXTERN int iscsi_get_completion_fd(struct iscsi_context *iscsi);
+
+/*
+ * Take up to max completed tasks off the completion queue, oldest first,
+ * and store them in tasks. If there are none, wait up to timeout_ms for
+ * one: 0 does not wait and -1 waits forever. The tasks must be released
+ * with scsi_free_scsi_task().
+ *
+ * Returns:
+ * >=0 the number of tasks stored, 0 if the timeout expired
+ * <0 on error
+ */
+EXTERN int iscsi_reap_completions(struct iscsi_context *iscsi,
+				  struct scsi_task **tasks, int max,
+				  int timeout_ms);
+
 /*
  * Async commands for SCSI
  *
@@ -1684,6 +2148,39 @@ iscsi_set_tcp_keepintvl(struct iscsi_context *iscsi, int value);
 EXTERN void
 iscsi_set_tcp_syncnt(struct iscsi_context *iscsi, int value);
 
+/*
+ * This function is to send write payloads of threshold bytes or more with
+ * MSG_ZEROCOPY instead of copying them into the kernel. 0 disables it.
+ * It has to be called after iscsi context creation and applies each time
+ * a new socket is created. The callback of a command sent this way is not
+ * invoked until the kernel has released the data buffers.
+ * Only supported on Linux TCP sockets, elsewhere this is a no-op.
+ */
+EXTERN void
+iscsi_set_zerocopy_threshold(struct iscsi_context *iscsi, int threshold);
+
+/*
+ * This function is to compute the data digests of write data on the thread
+ * that submits the command instead of on the thread that writes the pdus
+ * to the socket. Useful with iscsi_mt_service_thread_start() so that the
+ * digest work is spread over the submitting threads. 0 disables it.
+ * The data buffers must not change after the command has been submitted.
+ */
+EXTERN void
+iscsi_set_data_digest_on_submit(struct iscsi_context *iscsi, int enable);
+
+/*
+ * Options for URING_TRANSPORT. They have to be set before connecting.
+ * ISCSI_URING_FIXED_FILE registers the socket with the ring so the kernel
+ * does not have to look it up for every request.
+ */
+enum iscsi_uring_flags {
+	ISCSI_URING_FIXED_FILE = 0x01
+};
+
+EXTERN void
+iscsi_set_uring_flags(struct iscsi_context *iscsi, int flags);
+
 /*
  * This function is to set the interface that outbound connections for this socket are bound to.
  * You max specify more than one interface here separated by comma.
@@ -1734,6 +2231,18 @@ EXTERN int iscsi_mt_service_thread_start(struct iscsi_context *iscsi);
  * Shutdown multithreading support.
  */
 EXTERN void iscsi_mt_service_thread_stop(struct iscsi_context *iscsi);
+/*
+ * Run the service threads of the context, and of the other connections
+ * of its session, on the given CPU only. -1 lets them run anywhere, which
+ * is the default. This can be called before or after the service thread
+ * is started.
+ *
+ * Returns:
+ *  0 on success
+ * <0 if the CPU is not valid or affinity is not supported here
+ */
+EXTERN int iscsi_mt_set_service_thread_cpu(struct iscsi_context *iscsi,
+					   int cpu);
 
 #ifdef __cplusplus
 }
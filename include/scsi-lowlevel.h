@@ -351,6 +351,10 @@ struct scsi_task {
 
 	struct scsi_iovector iovector_in;
 	struct scsi_iovector iovector_out;
+
+	/* links the task on a completion queue, see
+	 * iscsi_set_completion_queue() */
+	struct scsi_task *cq_next;
 };
 
 
@@ -53,4 +53,67 @@ do {                                                                    \
         }                                                               \
 } while (0)
 
+/*
+ * Doubly-linked queues. The queue is a struct with head, tail and count
+ * members and the items have next and prev pointers. Both ends are
+ * NULL terminated so a queue can be copied around by value.
+ * All operations are O(1).
+ */
+#define ISCSI_QUEUE_ADD(queue, item)                                    \
+do {                                                                    \
+        (item)->prev = NULL;                                            \
+        (item)->next = (queue)->head;                                   \
+        if ((queue)->head != NULL) {                                    \
+                (queue)->head->prev = (item);                           \
+        } else {                                                        \
+                (queue)->tail = (item);                                 \
+        }                                                               \
+        (queue)->head = (item);                                         \
+        (queue)->count++;                                               \
+} while (0)
+
+#define ISCSI_QUEUE_ADD_END(queue, item)                                \
+do {                                                                    \
+        (item)->next = NULL;                                            \
+        (item)->prev = (queue)->tail;                                   \
+        if ((queue)->tail != NULL) {                                    \
+                (queue)->tail->next = (item);                           \
+        } else {                                                        \
+                (queue)->head = (item);                                 \
+        }                                                               \
+        (queue)->tail = (item);                                         \
+        (queue)->count++;                                               \
+} while (0)
+
+/* insert item in front of pos, which must be on the queue */
+#define ISCSI_QUEUE_INSERT_BEFORE(queue, pos, item)                     \
+do {                                                                    \
+        (item)->next = (pos);                                           \
+        (item)->prev = (pos)->prev;                                     \
+        if ((pos)->prev != NULL) {                                      \
+                (pos)->prev->next = (item);                             \
+        } else {                                                        \
+                (queue)->head = (item);                                 \
+        }                                                               \
+        (pos)->prev = (item);                                           \
+        (queue)->count++;                                               \
+} while (0)
+
+#define ISCSI_QUEUE_REMOVE(queue, item)                                 \
+do {                                                                    \
+        if ((item)->prev != NULL) {                                     \
+                (item)->prev->next = (item)->next;                      \
+        } else {                                                        \
+                (queue)->head = (item)->next;                           \
+        }                                                               \
+        if ((item)->next != NULL) {                                     \
+                (item)->next->prev = (item)->prev;                      \
+        } else {                                                        \
+                (queue)->tail = (item)->prev;                           \
+        }                                                               \
+        (item)->next = NULL;                                            \
+        (item)->prev = NULL;                                            \
+        (queue)->count--;                                               \
+} while (0)
+
 #endif /* __iscsi_slist_h__ */
@@ -19,6 +19,8 @@
 #ifndef __iscsi_utils_h__
 #define __iscsi_utils_h__
 
+#include <stdint.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -30,6 +32,8 @@ struct iscsi_value_string {
 
 const char *iscsi_value_string_find(struct iscsi_value_string *values, int value, const char *not_found);
 
+uint64_t iscsi_clock_ms(void);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,344 @@
+/*
+   Copyright (C) 2026 by the libiscsi authors
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * Completion queue. SCSI commands that were queued without a callback
+ * are pushed onto a lock-free list when they complete, and the
+ * application reaps them in batches from its own threads. An eventfd, or
+ * a pipe where there is none, is readable while tasks are waiting.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_POLL_H
+#include <poll.h>
+#endif
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
+#include "iscsi.h"
+#include "iscsi-private.h"
+#include "scsi-lowlevel.h"
+#include "utils.h"
+
+#ifndef _WIN32
+
+static int
+iscsi_cq_open_fd(struct iscsi_context *iscsi,
+		 struct iscsi_completion_queue *cq)
+{
+#ifdef HAVE_SYS_EVENTFD_H
+	cq->fd[0] = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (cq->fd[0] == -1) {
+		iscsi_set_error(iscsi, "Failed to create eventfd: %s",
+				strerror(errno));
+		return -1;
+	}
+	cq->fd[1] = cq->fd[0];
+#else
+	int i;
+
+	if (pipe(cq->fd) != 0) {
+		iscsi_set_error(iscsi, "Failed to create pipe: %s",
+				strerror(errno));
+		return -1;
+	}
+	for (i = 0; i < 2; i++) {
+		fcntl(cq->fd[i], F_SETFD, FD_CLOEXEC);
+		fcntl(cq->fd[i], F_SETFL,
+		      fcntl(cq->fd[i], F_GETFL) | O_NONBLOCK);
+	}
+#endif
+	return 0;
+}
+
+static void
+iscsi_cq_signal(struct iscsi_completion_queue *cq)
+{
+#ifdef HAVE_SYS_EVENTFD_H
+	uint64_t one = 1;
+#else
+	char one = 1;
+#endif
+
+	/* a full pipe is readable already */
+	if (write(cq->fd[1], &one, sizeof(one)) < 0) {
+		return;
+	}
+}
+
+static void
+iscsi_cq_drain_fd(struct iscsi_completion_queue *cq)
+{
+	char buf[64];
+
+	while (read(cq->fd[0], buf, sizeof(buf)) > 0) {
+		;
+	}
+}
+
+static void
+iscsi_cq_free(struct iscsi_completion_queue *cq)
+{
+	if (cq->fd[1] != cq->fd[0]) {
+		close(cq->fd[1]);
+	}
+	close(cq->fd[0]);
+	iscsi_mt_mutex_destroy(&cq->lock);
+	free(cq);
+}
+
+int
+iscsi_set_completion_queue(struct iscsi_context *iscsi, int enable)
+{
+	struct iscsi_completion_queue *cq = iscsi->cq;
+
+	if (!enable) {
+		if (cq == NULL) {
+			return 0;
+		}
+		/* in flight first, its pushes happen before it drops */
+		if (ATOMIC_LOAD(iscsi, cq->inflight) != 0) {
+			iscsi_set_error(iscsi, "Commands for the completion "
+					"queue are still in flight");
+			return -1;
+		}
+		if (cq->head != NULL ||
+		    ATOMIC_LOAD(iscsi, cq->pushed) != NULL) {
+			iscsi_set_error(iscsi, "Completion queue is not empty");
+			return -1;
+		}
+		ATOMIC_STORE(iscsi, iscsi->cq, NULL);
+		iscsi_cq_free(cq);
+		return 0;
+	}
+	if (cq != NULL) {
+		return 0;
+	}
+
+	cq = calloc(1, sizeof(struct iscsi_completion_queue));
+	if (cq == NULL) {
+		iscsi_set_error(iscsi, "Failed to allocate completion queue");
+		return -1;
+	}
+	if (iscsi_cq_open_fd(iscsi, cq) != 0) {
+		free(cq);
+		return -1;
+	}
+	iscsi_mt_mutex_init(&cq->lock);
+	cq->owner = iscsi;
+	ATOMIC_STORE(iscsi, iscsi->cq, cq);
+	return 0;
+}
+
+int
+iscsi_get_completion_fd(struct iscsi_context *iscsi)
+{
+	if (iscsi->cq == NULL) {
+		return -1;
+	}
+	return iscsi->cq->fd[0];
+}
+
+/*
+ * Called from whatever thread completes the task. Only the push that
+ * finds the list empty signals the fd, so a burst of completions costs
+ * one write. The task no longer counts as in flight once it is pushed,
+ * and after that the queue may be freed under us.
+ */
+void
+iscsi_cq_push(struct iscsi_completion_queue *cq, struct scsi_task *task)
+{
+	struct scsi_task *head;
+	int inflight;
+
+	head = ATOMIC_LOAD(cq->owner, cq->pushed);
+	do {
+		task->cq_next = head;
+	} while (!ATOMIC_CAS(cq->owner, cq->pushed, &head, task));
+	if (head == NULL) {
+		iscsi_cq_signal(cq);
+	}
+	/* a CAS rather than ATOMIC_DEC, so the push is released with it */
+	inflight = ATOMIC_LOAD(cq->owner, cq->inflight);
+	while (!ATOMIC_CAS(cq->owner, cq->inflight, &inflight, inflight - 1)) {
+		;
+	}
+}
+
+/*
+ * Take up to max tasks, oldest first. The fd is drained right before
+ * the pushed list is taken over, so any task pushed after that signals
+ * it again. Tasks that did not fit keep the fd readable for the next
+ * reaper.
+ */
+static int
+iscsi_cq_take(struct iscsi_completion_queue *cq, struct scsi_task **tasks,
+	      int max)
+{
+	struct scsi_task *task, *next, *list;
+	int n = 0;
+
+	iscsi_mt_mutex_lock(&cq->lock);
+	while (n < max) {
+		if (cq->head == NULL) {
+			iscsi_cq_drain_fd(cq);
+			list = ATOMIC_LOAD(cq->owner, cq->pushed);
+			while (list != NULL &&
+			       !ATOMIC_CAS(cq->owner, cq->pushed, &list, NULL)) {
+				;
+			}
+			if (list == NULL) {
+				break;
+			}
+			/* the list is newest first */
+			for (task = list; task; task = next) {
+				next = task->cq_next;
+				task->cq_next = cq->head;
+				cq->head = task;
+			}
+		}
+		task = cq->head;
+		cq->head = task->cq_next;
+		task->cq_next = NULL;
+		tasks[n++] = task;
+	}
+	if (cq->head != NULL) {
+		iscsi_cq_signal(cq);
+	}
+	iscsi_mt_mutex_unlock(&cq->lock);
+
+	return n;
+}
+
+int
+iscsi_reap_completions(struct iscsi_context *iscsi, struct scsi_task **tasks,
+		       int max, int timeout_ms)
+{
+	struct iscsi_completion_queue *cq = iscsi->cq;
+	struct pollfd pfd;
+	uint64_t deadline = 0;
+	int n, ret, timeout;
+
+	if (cq == NULL) {
+		iscsi_set_error(iscsi, "Completion queue is not enabled");
+		return -1;
+	}
+	if (max <= 0) {
+		return 0;
+	}
+	if (timeout_ms > 0) {
+		deadline = iscsi_clock_ms() + timeout_ms;
+	}
+
+	for (;;) {
+		n = iscsi_cq_take(cq, tasks, max);
+		if (n > 0 || timeout_ms == 0) {
+			return n;
+		}
+
+		timeout = -1;
+		if (timeout_ms > 0) {
+			uint64_t now = iscsi_clock_ms();
+
+			if (now >= deadline) {
+				return 0;
+			}
+			timeout = deadline - now;
+		}
+		pfd.fd = cq->fd[0];
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		ret = poll(&pfd, 1, timeout);
+		if (ret < 0 && errno != EINTR) {
+			iscsi_set_error(iscsi, "Poll failed: %s",
+					strerror(errno));
+			return -1;
+		}
+	}
+}
+
+/*
+ * Only the context that enabled the queue frees it. The copy a reconnect
+ * keeps in old_iscsi shares it.
+ */
+void
+iscsi_cq_destroy(struct iscsi_context *iscsi)
+{
+	struct iscsi_completion_queue *cq = iscsi->cq;
+	struct scsi_task *task;
+
+	if (cq == NULL || cq->owner != iscsi) {
+		return;
+	}
+	iscsi->cq = NULL;
+
+	/* nobody can reap the tasks that are left any more */
+	while (iscsi_cq_take(cq, &task, 1) == 1) {
+		scsi_free_scsi_task(task);
+	}
+	iscsi_cq_free(cq);
+}
+
+#else /* _WIN32 */
+
+int
+iscsi_set_completion_queue(struct iscsi_context *iscsi, int enable)
+{
+	if (!enable) {
+		return 0;
+	}
+	iscsi_set_error(iscsi, "Completion queues are not supported");
+	return -1;
+}
+
+int
+iscsi_get_completion_fd(struct iscsi_context *iscsi)
+{
+	return -1;
+}
+
+void
+iscsi_cq_push(struct iscsi_completion_queue *cq, struct scsi_task *task)
+{
+}
+
+int
+iscsi_reap_completions(struct iscsi_context *iscsi, struct scsi_task **tasks,
+		       int max, int timeout_ms)
+{
+	iscsi_set_error(iscsi, "Completion queues are not supported");
+	return -1;
+}
+
+void
+iscsi_cq_destroy(struct iscsi_context *iscsi)
+{
+}
+
+#endif /* _WIN32 */
@@ -14,6 +14,10 @@
    You should have received a copy of the GNU Lesser General Public License
    along with this program; if not, see <http://www.gnu.org/licenses/>.
 */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 #if defined(_WIN32)
 #include "win32/win32_compat.h"
 #else
@@ -28,6 +32,7 @@
 #include <netinet/in.h>
 #endif
 
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -143,6 +148,7 @@ iscsi_inquiry_page_0x0_cb(struct iscsi_context *iscsi, int status,
 			if (!inq->rmb && inq->device_type == SCSI_INQUIRY_PERIPHERAL_DEVICE_TYPE_DIRECT_ACCESS) {
 				if (iscsi_inquiry_task_connect(iscsi, ct->lun, 1, 0x80, MAX_STRING_SIZE + 4,
 				                               iscsi_inquiry_page_0x80_cb, ct) != NULL) {
+					scsi_free_scsi_task(task);
 					return;
 				}
 				iscsi_set_error(iscsi, "iscsi_inquiry_task for evpd 0x80 failed.");
@@ -229,6 +235,7 @@ iscsi_testunitready_cb(struct iscsi_context *iscsi, int status,
 		iscsi_free(iscsi, ct);
 		return;
 	}
+	scsi_free_scsi_task(task);
 
 	if (iscsi_inquiry_task_connect(iscsi, ct->lun, 0, 0, 96,
 	                               iscsi_inquiry_page_0x0_cb, ct) == NULL) {
@@ -373,18 +380,349 @@ void iscsi_set_reconnect_max_retries(struct iscsi_context *iscsi, int count)
 
 void iscsi_defer_reconnect(struct iscsi_context *iscsi)
 {
+	struct iscsi_context *conn;
+
 	iscsi->reconnect_deferred = 1;
 
 	ISCSI_LOG(iscsi, 2, "reconnect deferred, cancelling all tasks");
 
 	iscsi_cancel_pdus(iscsi);
+
+	/* the session is gone, and with it all its other connections */
+	for (conn = iscsi->connections; conn; conn = conn->next_connection) {
+		conn->is_loggedin = 0;
+		if (conn->fd != -1) {
+			iscsi_disconnect(conn);
+		}
+		iscsi_cancel_pdus(conn);
+	}
+}
+
+/*
+ * Copy the settings of a context that a new context for the same target
+ * should use, for a reconnect or another connection of the session.
+ */
+void
+iscsi_inherit_settings(struct iscsi_context *to, struct iscsi_context *from)
+{
+	iscsi_set_targetname(to, from->target_name);
+	strncpy(to->alias, from->alias, MAX_STRING_SIZE);
+
+	iscsi_set_header_digest(to, from->want_header_digest);
+	iscsi_set_data_digest(to, from->want_data_digest);
+
+	iscsi_set_initiator_username_pwd(to, from->user, from->passwd);
+	iscsi_set_target_username_pwd(to, from->target_user, from->target_passwd);
+
+	iscsi_set_session_type(to, ISCSI_SESSION_NORMAL);
+	/* same ISID, so that the target reinstates the session and members
+	 * of a session group keep their distinct ISIDs */
+	memcpy(to->isid, from->isid, sizeof(to->isid));
+	iscsi_set_max_outstanding_r2t(to, from->want_max_outstanding_r2t);
+	iscsi_set_max_connections(to, from->want_max_connections);
+
+	strncpy(to->bind_interfaces, from->bind_interfaces, MAX_STRING_SIZE);
+	to->bind_interfaces_cnt = from->bind_interfaces_cnt;
+
+	strncpy(to->unit_serial_number, from->unit_serial_number, MAX_STRING_SIZE);
+
+	to->log_level = from->log_level;
+	to->log_fn = from->log_fn;
+	to->tcp_user_timeout = from->tcp_user_timeout;
+	to->tcp_keepidle = from->tcp_keepidle;
+	to->tcp_keepcnt = from->tcp_keepcnt;
+	to->tcp_keepintvl = from->tcp_keepintvl;
+	to->tcp_syncnt = from->tcp_syncnt;
+	to->zerocopy_threshold = from->zerocopy_threshold;
+	to->data_digest_on_submit = from->data_digest_on_submit;
+	to->uring_flags = from->uring_flags;
+	to->cache_allocations = from->cache_allocations;
+	to->scsi_timeout = from->scsi_timeout;
+	to->rx_buf_size = from->rx_buf_size;
+	to->stats = from->stats;
+	to->no_ua_on_reconnect = from->no_ua_on_reconnect;
+	to->fd_dup_cb = from->fd_dup_cb;
+	to->fd_dup_opaque = from->fd_dup_opaque;
+
+	to->reconnect_max_retries = from->reconnect_max_retries;
+}
+
+/*
+ * Get a connection of the session ready to log in (again). Parameters
+ * that are negotiated for the whole session are taken from the leading
+ * connection, the ones of the connection are negotiated afresh.
+ */
+static void
+iscsi_connection_reset(struct iscsi_context *conn)
+{
+	struct iscsi_context *leader = conn->leader;
+
+	conn->is_loggedin = 0;
+	conn->login_attempts = 0;
+	conn->current_phase = ISCSI_PDU_LOGIN_CSG_SECNEG;
+	conn->next_phase    = ISCSI_PDU_LOGIN_NSG_OPNEG;
+	conn->secneg_phase  = ISCSI_LOGIN_SECNEG_PHASE_OFFER_CHAP;
+	conn->header_digest = ISCSI_HEADER_DIGEST_NONE;
+	conn->data_digest   = ISCSI_DATA_DIGEST_NONE;
+	conn->want_header_digest = leader->want_header_digest;
+	conn->want_data_digest   = leader->want_data_digest;
+	conn->statsn = 0;
+	memcpy(conn->isid, leader->isid, sizeof(conn->isid));
+
+	conn->max_burst_length     = leader->max_burst_length;
+	conn->first_burst_length   = leader->first_burst_length;
+	conn->use_initial_r2t      = leader->use_initial_r2t;
+	conn->use_immediate_data   = leader->use_immediate_data;
+	conn->max_outstanding_r2t  = leader->max_outstanding_r2t;
+	conn->max_connections      = leader->max_connections;
+
+	conn->itt = iscsi_itt_post_increment(leader);
+        iscsi_mt_spin_lock(&leader->iscsi_lock);
+	conn->cmdsn    = leader->cmdsn;
+	conn->expcmdsn = leader->expcmdsn;
+	conn->maxcmdsn = leader->maxcmdsn;
+        iscsi_mt_spin_unlock(&leader->iscsi_lock);
+}
+
+struct iscsi_add_connection_state {
+	iscsi_command_cb cb;
+	void *private_data;
+};
+
+static void
+iscsi_add_connection_cb(struct iscsi_context *conn, int status,
+			void *command_data, void *private_data)
+{
+	struct iscsi_add_connection_state *state = private_data;
+	struct iscsi_context *leader = conn->leader;
+	iscsi_command_cb cb = state ? state->cb : NULL;
+	void *cb_data = state ? state->private_data : NULL;
+
+	iscsi_free(conn, state);
+
+	if (status != SCSI_STATUS_GOOD) {
+		ISCSI_LOG(leader, 1, "failed to add connection %u to the "
+			  "session: %s", conn->cid, iscsi_get_error(conn));
+		iscsi_set_error(leader, "Failed to add connection: %s",
+				iscsi_get_error(conn));
+		if (conn->fd != -1) {
+			iscsi_disconnect(conn);
+		}
+		conn->is_loggedin = 0;
+	} else {
+		ISCSI_LOG(leader, 2, "connection %u joined the session",
+			  conn->cid);
+	}
+
+	if (cb) {
+		cb(leader, status == SCSI_STATUS_GOOD ?
+		   SCSI_STATUS_GOOD : SCSI_STATUS_ERROR, NULL, cb_data);
+	}
+}
+
+static int
+iscsi_connection_login(struct iscsi_context *conn, iscsi_command_cb cb,
+		       void *private_data)
+{
+	struct iscsi_context *leader = conn->leader;
+	struct iscsi_add_connection_state *state;
+
+	state = iscsi_malloc(conn, sizeof(*state));
+	if (state == NULL) {
+		iscsi_set_error(leader, "Out-of-memory. Failed to allocate "
+				"connection state.");
+		return -1;
+	}
+	state->cb = cb;
+	state->private_data = private_data;
+
+	iscsi_connection_reset(conn);
+
+#ifdef HAVE_MULTITHREADING
+	/* the service thread of the connection runs the login, on the
+	 * same CPU as the one of the leader */
+	conn->service_cpu = leader->service_cpu;
+	if (leader->multithreading_enabled && !conn->multithreading_enabled &&
+	    iscsi_mt_service_thread_start(conn) != 0) {
+		iscsi_set_error(leader, "%s", iscsi_get_error(conn));
+		iscsi_free(conn, state);
+		return -1;
+	}
+#endif
+
+	if (iscsi_full_connect_async(conn, leader->connected_portal[0] ?
+				     leader->connected_portal : leader->portal,
+				     -1, iscsi_add_connection_cb, state) != 0) {
+		iscsi_set_error(leader, "Failed to connect: %s",
+				iscsi_get_error(conn));
+		iscsi_free(conn, state);
+		return -1;
+	}
+	return 0;
+}
+
+int
+iscsi_add_connection_async(struct iscsi_context *iscsi, iscsi_command_cb cb,
+			   void *private_data)
+{
+	struct iscsi_context *conn, *slot = NULL, **tail;
+	uint32_t active = 1;
+
+	if (iscsi->leader != NULL) {
+		iscsi_set_error(iscsi, "Connections can only be added through "
+				"the leading connection of the session.");
+		return -1;
+	}
+	if (iscsi->transport != TCP_TRANSPORT) {
+		iscsi_set_error(iscsi, "Multiple connections per session "
+				"are only supported on the TCP transport.");
+		return -1;
+	}
+	if (iscsi->session_type != ISCSI_SESSION_NORMAL ||
+	    iscsi->is_loggedin == 0 || iscsi->old_iscsi != NULL ||
+	    iscsi->connection_failed) {
+		iscsi_set_error(iscsi, "Trying to add a connection while "
+				"the session is not logged in.");
+		return -1;
+	}
+
+	tail = &iscsi->connections;
+	for (conn = iscsi->connections; conn; conn = conn->next_connection) {
+		if (conn->is_loggedin || conn->fd != -1) {
+			active++;
+		} else if (slot == NULL) {
+			slot = conn;
+		}
+		tail = &conn->next_connection;
+	}
+	if (active >= iscsi->max_connections) {
+		iscsi_set_error(iscsi, "The session already has the %u "
+				"connections the target allows.",
+				iscsi->max_connections);
+		return -1;
+	}
+
+	if (slot == NULL) {
+		slot = iscsi_create_context(iscsi->initiator_name);
+		if (slot == NULL) {
+			iscsi_set_error(iscsi, "Failed to create a context "
+					"for the connection.");
+			return -1;
+		}
+		/* the event loop of the session watches it as well */
+		if (iscsi->loop != NULL &&
+		    iscsi_loop_attach(iscsi->loop, slot) != 0) {
+			iscsi_set_error(iscsi, "%s", iscsi_get_error(slot));
+			iscsi_destroy_context(slot);
+			return -1;
+		}
+		iscsi_inherit_settings(slot, iscsi);
+		slot->lun    = iscsi->lun;
+		slot->leader = iscsi;
+		slot->cid    = ++iscsi->next_cid;
+
+		/* the service threads of the other connections walk the
+		 * list, so only link it in once it is set up */
+		*tail = slot;
+		iscsi->connection_count++;
+	}
+
+	return iscsi_connection_login(slot, cb, private_data);
+}
+
+int
+iscsi_get_connection_count(struct iscsi_context *iscsi)
+{
+	return 1 + iscsi->connection_count;
+}
+
+struct iscsi_context *
+iscsi_get_connection(struct iscsi_context *iscsi, int idx)
+{
+	struct iscsi_context *conn;
+
+	ISCSI_FOR_EACH_CONNECTION(iscsi, conn) {
+		if (idx-- == 0) {
+			return conn;
+		}
+	}
+	return NULL;
+}
+
+static void
+iscsi_relogin_cb(struct iscsi_context *iscsi, int status,
+		 void *command_data, void *private_data)
+{
+	if (status != SCSI_STATUS_GOOD) {
+		ISCSI_LOG(iscsi, 1, "connection did not rejoin the session "
+			  "after the reconnect");
+	}
+}
+
+/*
+ * Take all SCSI commands off the other connections of the session and
+ * stop them. The commands end up on the leading connection, where the
+ * reconnect sends them again once it has logged in. Everything else on
+ * the connections is cancelled.
+ */
+static void
+iscsi_quiesce_connections(struct iscsi_context *iscsi,
+			  struct iscsi_context *target)
+{
+	struct iscsi_pdu_queue tmp, moved;
+	struct iscsi_context *conn;
+	struct iscsi_pdu *pdu, *next_pdu;
+
+	for (conn = iscsi->connections; conn; conn = conn->next_connection) {
+#ifdef HAVE_MULTITHREADING
+		if (conn->multithreading_enabled) {
+			iscsi_mt_service_thread_stop(conn);
+		}
+#endif
+		conn->is_loggedin = 0;
+		if (conn->fd != -1) {
+			iscsi_disconnect(conn);
+		}
+
+		memset(&moved, 0, sizeof(moved));
+                iscsi_mt_spin_lock(&conn->iscsi_lock);
+		iscsi_submitted_drain(conn);
+		for (pdu = conn->outqueue.head; pdu; pdu = next_pdu) {
+			next_pdu = pdu->next;
+			if (pdu->flags & ISCSI_PDU_DROP_ON_RECONNECT) {
+				continue;
+			}
+			iscsi_outqueue_remove(conn, pdu);
+			ISCSI_QUEUE_ADD_END(&moved, pdu);
+		}
+		iscsi_waitpdu_detach(conn, &tmp);
+		while ((pdu = tmp.head)) {
+			ISCSI_QUEUE_REMOVE(&tmp, pdu);
+			if (pdu->flags & ISCSI_PDU_DROP_ON_RECONNECT) {
+				iscsi_waitpdu_add(conn, pdu);
+			} else {
+				ISCSI_QUEUE_ADD_END(&moved, pdu);
+			}
+		}
+                iscsi_mt_spin_unlock(&conn->iscsi_lock);
+
+		/* one iscsi_lock at a time, see struct iscsi_context */
+                iscsi_mt_spin_lock(&target->iscsi_lock);
+		while ((pdu = moved.head)) {
+			ISCSI_QUEUE_REMOVE(&moved, pdu);
+			iscsi_waitpdu_add(target, pdu);
+		}
+                iscsi_mt_spin_unlock(&target->iscsi_lock);
+
+		iscsi_cancel_pdus(conn);
+	}
 }
 
 void iscsi_reconnect_cb(struct iscsi_context *iscsi, int status,
                         void *command_data, void *private_data)
 {
-	struct iscsi_context *old_iscsi;
-        struct iscsi_pdu *tmp = NULL;
+	struct iscsi_context *old_iscsi, *conn;
+        struct iscsi_pdu_queue tmp;
 
 	if (status != SCSI_STATUS_GOOD) {
 		int backoff = ++iscsi->old_iscsi->retry_cnt;
@@ -409,20 +747,20 @@ void iscsi_reconnect_cb(struct iscsi_context *iscsi, int status,
 	old_iscsi = iscsi->old_iscsi;
 	iscsi->old_iscsi = NULL;
 
-        iscsi_mt_spin_lock(&iscsi->iscsi_lock);
-	while (old_iscsi->outqueue) {
-		struct iscsi_pdu *pdu = old_iscsi->outqueue;
-		ISCSI_LIST_REMOVE(&old_iscsi->outqueue, pdu);
-		ISCSI_LIST_ADD_END(&old_iscsi->waitpdu, pdu);
+        iscsi_mt_spin_lock(&old_iscsi->iscsi_lock);
+	iscsi_submitted_drain(old_iscsi);
+	while (old_iscsi->outqueue.head) {
+		struct iscsi_pdu *pdu = old_iscsi->outqueue.head;
+		iscsi_outqueue_remove(old_iscsi, pdu);
+		iscsi_waitpdu_add(old_iscsi, pdu);
 	}
-        tmp = old_iscsi->waitpdu;
-        old_iscsi->waitpdu = NULL;
-        iscsi_mt_spin_unlock(&iscsi->iscsi_lock);
+        iscsi_waitpdu_detach(old_iscsi, &tmp);
+        iscsi_mt_spin_unlock(&old_iscsi->iscsi_lock);
 
-	while (tmp) {
-		struct iscsi_pdu *pdu = tmp;
+	while (tmp.head) {
+		struct iscsi_pdu *pdu = tmp.head;
 
-		ISCSI_LIST_REMOVE(&tmp, pdu);
+		ISCSI_QUEUE_REMOVE(&tmp, pdu);
 		if (pdu->itt == 0xffffffff) {
 			iscsi->drv->free_pdu(old_iscsi, pdu);
 			continue;
@@ -456,10 +794,14 @@ void iscsi_reconnect_cb(struct iscsi_context *iscsi, int status,
 					     pdu->scsi_cbdata.private_data)) {
 			/* not much we can really do at this point */
 		}
+		if (pdu->scsi_cbdata.cq != NULL) {
+			/* the requeued pdu counts it again */
+			ATOMIC_DEC(iscsi, pdu->scsi_cbdata.cq->inflight);
+		}
 		iscsi->drv->free_pdu(old_iscsi, pdu);
 	}
 
-        iscsi_mt_spin_lock(&iscsi->iscsi_lock);
+        iscsi_mt_spin_lock(&old_iscsi->iscsi_lock);
 	if (old_iscsi->incoming != NULL) {
 		iscsi_free_iscsi_in_pdu(old_iscsi, old_iscsi->incoming);
 	}
@@ -467,9 +809,14 @@ void iscsi_reconnect_cb(struct iscsi_context *iscsi, int status,
 	if (old_iscsi->outqueue_current != NULL && old_iscsi->outqueue_current->flags & ISCSI_PDU_DELETE_WHEN_SENT) {
 		iscsi->drv->free_pdu(old_iscsi, old_iscsi->outqueue_current);
 	}
-        iscsi_mt_spin_unlock(&iscsi->iscsi_lock);
+        iscsi_mt_spin_unlock(&old_iscsi->iscsi_lock);
 
-	iscsi_free(old_iscsi, old_iscsi->opaque);
+	iscsi_free_transport(old_iscsi);
+	iscsi_free(old_iscsi, old_iscsi->timer_heap);
+	iscsi_free(old_iscsi, old_iscsi->itt_hash);
+	iscsi_free(old_iscsi, old_iscsi->rx_buf);
+	iscsi_free(old_iscsi, old_iscsi->send_batch);
+	iscsi_free_alloc_caches(old_iscsi);
 
 	iscsi->mallocs += old_iscsi->mallocs;
 	iscsi->frees += old_iscsi->frees;
@@ -482,11 +829,43 @@ void iscsi_reconnect_cb(struct iscsi_context *iscsi, int status,
 	ISCSI_LOG(iscsi, 2, "reconnect was successful");
 
 	iscsi->pending_reconnect = 0;
+
+	/* and bring the other connections of the session back */
+	for (conn = iscsi->connections; conn; conn = conn->next_connection) {
+		if (iscsi_connection_login(conn, iscsi_relogin_cb, NULL) != 0) {
+			ISCSI_LOG(iscsi, 1, "failed to log in connection %u "
+				  "again: %s", conn->cid, iscsi_get_error(iscsi));
+		}
+	}
+}
+
+/*
+ * Take over the state of the new context tmp_iscsi. The threads, locks
+ * and counters at the end of the context stay as they are, the caller
+ * has made sure nothing else looks at the rest.
+ */
+static void
+iscsi_swap_context(struct iscsi_context *iscsi, struct iscsi_context *tmp_iscsi)
+{
+#ifdef HAVE_MULTITHREADING
+	memcpy(iscsi, tmp_iscsi,
+	       offsetof(struct iscsi_context, multithreading_enabled));
+        iscsi_mt_spin_destroy(&tmp_iscsi->iscsi_lock);
+        iscsi_mt_spin_destroy(&tmp_iscsi->alloc_lock);
+        iscsi_mt_mutex_destroy(&tmp_iscsi->iscsi_mutex);
+#else
+	memcpy(iscsi, tmp_iscsi, sizeof(struct iscsi_context));
+#endif
+	free(tmp_iscsi);
 }
 
 static int reconnect(struct iscsi_context *iscsi, int force)
 {
 	struct iscsi_context *tmp_iscsi;
+	int ret;
+#if defined(HAVE_MULTITHREADING) && defined(HAVE_PTHREAD)
+	int fenced = 0, restart = 0;
+#endif
 
 	/* if there is already a deferred reconnect do not try again */
 	if (iscsi->reconnect_deferred) {
@@ -518,6 +897,9 @@ static int reconnect(struct iscsi_context *iscsi, int force)
 		return -1;
 	}
 
+	/* commands that already have their response do not move over */
+	iscsi_zerocopy_flush(iscsi);
+
 	tmp_iscsi = iscsi_create_context(iscsi->initiator_name);
 	if (tmp_iscsi == NULL) {
 		ISCSI_LOG(iscsi, 2, "failed to create new context for reconnection");
@@ -534,59 +916,88 @@ static int reconnect(struct iscsi_context *iscsi, int force)
 
 	ISCSI_LOG(iscsi, 2, "reconnect initiated");
 
-	iscsi_set_targetname(tmp_iscsi, iscsi->target_name);
-
-	iscsi_set_header_digest(tmp_iscsi, iscsi->want_header_digest);
-	iscsi_set_data_digest(tmp_iscsi, iscsi->want_data_digest);
-
-	iscsi_set_initiator_username_pwd(tmp_iscsi, iscsi->user, iscsi->passwd);
-	iscsi_set_target_username_pwd(tmp_iscsi, iscsi->target_user, iscsi->target_passwd);
-
-	iscsi_set_session_type(tmp_iscsi, ISCSI_SESSION_NORMAL);
+	iscsi_inherit_settings(tmp_iscsi, iscsi);
 
 	tmp_iscsi->lun = iscsi->lun;
 
 	strncpy(tmp_iscsi->portal, iscsi->portal, MAX_STRING_SIZE);
 
-	strncpy(tmp_iscsi->bind_interfaces, iscsi->bind_interfaces, MAX_STRING_SIZE);
-	tmp_iscsi->bind_interfaces_cnt = iscsi->bind_interfaces_cnt;
-
-	strncpy(tmp_iscsi->unit_serial_number, iscsi->unit_serial_number, MAX_STRING_SIZE);
-
-	tmp_iscsi->log_level = iscsi->log_level;
-	tmp_iscsi->log_fn = iscsi->log_fn;
-	tmp_iscsi->tcp_user_timeout = iscsi->tcp_user_timeout;
-	tmp_iscsi->tcp_keepidle = iscsi->tcp_keepidle;
-	tmp_iscsi->tcp_keepcnt = iscsi->tcp_keepcnt;
-	tmp_iscsi->tcp_keepintvl = iscsi->tcp_keepintvl;
-	tmp_iscsi->tcp_syncnt = iscsi->tcp_syncnt;
-	tmp_iscsi->cache_allocations = iscsi->cache_allocations;
-	tmp_iscsi->scsi_timeout = iscsi->scsi_timeout;
-	tmp_iscsi->no_ua_on_reconnect = iscsi->no_ua_on_reconnect;
-	tmp_iscsi->fd_dup_cb = iscsi->fd_dup_cb;
-	tmp_iscsi->fd_dup_opaque = iscsi->fd_dup_opaque;
+	/* the first reconnect keeps the state of the session it replaces */
+	if (!iscsi->old_iscsi) {
+		tmp_iscsi->old_iscsi = malloc(sizeof(struct iscsi_context));
+		if (!tmp_iscsi->old_iscsi) {
+			free(tmp_iscsi);
+			return -1;
+		}
+	}
 
-	tmp_iscsi->reconnect_max_retries = iscsi->reconnect_max_retries;
+	/* the other connections of the session stay with the context, their
+	 * commands go with the old session. This also stops their service
+	 * threads. */
+	iscsi_quiesce_connections(iscsi, iscsi->old_iscsi ?
+				  iscsi->old_iscsi : iscsi);
+	tmp_iscsi->connections = iscsi->connections;
+	tmp_iscsi->connection_count = iscsi->connection_count;
+	tmp_iscsi->cq = iscsi->cq;
+	tmp_iscsi->loop = iscsi->loop;
+	tmp_iscsi->loop_slot = iscsi->loop_slot;
+	tmp_iscsi->next_cid = iscsi->next_cid;
+	iscsi->connections = NULL;
+	iscsi->connection_count = 0;
+
+#if defined(HAVE_MULTITHREADING) && defined(HAVE_PTHREAD)
+	/* Nothing may look at the context while it is copied and swapped
+	 * below. A service thread other than ourselves is stopped, before
+	 * the fence so it can not be stuck behind it, and threads that
+	 * queue commands wait at the fence.
+	 */
+	if (iscsi->multithreading_enabled) {
+		if (!pthread_equal(pthread_self(), iscsi->service_thread)) {
+			iscsi_mt_service_thread_stop(iscsi);
+			restart = 1;
+		}
+		iscsi_submit_fence(iscsi);
+		fenced = 1;
+	}
+#endif
+        iscsi_mt_spin_lock(&iscsi->iscsi_lock);
+	iscsi_submitted_drain(iscsi);
+        iscsi_mt_spin_unlock(&iscsi->iscsi_lock);
 
 	if (iscsi->old_iscsi) {
-		iscsi_free(iscsi, iscsi->opaque);
+		iscsi_free_transport(iscsi);
+		iscsi_free(iscsi, iscsi->timer_heap);
+		iscsi_free(iscsi, iscsi->itt_hash);
+		iscsi_free(iscsi, iscsi->rx_buf);
+		iscsi_free(iscsi, iscsi->send_batch);
+		iscsi_free_alloc_caches(iscsi);
 
 		iscsi->old_iscsi->mallocs += iscsi->mallocs;
 		iscsi->old_iscsi->frees += iscsi->frees;
 		tmp_iscsi->old_iscsi = iscsi->old_iscsi;
 	} else {
-		tmp_iscsi->old_iscsi = malloc(sizeof(struct iscsi_context));
-		if (!tmp_iscsi->old_iscsi) {
-			free(tmp_iscsi);
-			return -1;
-		}
 		memcpy(tmp_iscsi->old_iscsi, iscsi, sizeof(struct iscsi_context));
+		/* the event loop follows the context */
+		tmp_iscsi->old_iscsi->loop = NULL;
+#ifdef HAVE_MULTITHREADING
+		/* and so does the fence */
+		tmp_iscsi->old_iscsi->submitters = 0;
+#endif
 	}
-	memcpy(iscsi, tmp_iscsi, sizeof(struct iscsi_context));
-	free(tmp_iscsi);
+	iscsi_swap_context(iscsi, tmp_iscsi);
 
-	return iscsi_full_connect_async(iscsi, iscsi->portal,
-	                                iscsi->lun, iscsi_reconnect_cb, NULL);
+	ret = iscsi_full_connect_async(iscsi, iscsi->portal,
+	                               iscsi->lun, iscsi_reconnect_cb, NULL);
+
+#if defined(HAVE_MULTITHREADING) && defined(HAVE_PTHREAD)
+	if (restart && iscsi_mt_service_thread_start(iscsi) != 0) {
+		ret = -1;
+	}
+	if (fenced) {
+		iscsi_submit_unfence(iscsi);
+	}
+#endif
+	return ret;
 }
 
 int iscsi_reconnect(struct iscsi_context *iscsi)
@@ -14,14 +14,28 @@
    You should have received a copy of the GNU Lesser General Public License
    along with this program; if not, see <http://www.gnu.org/licenses/>.
 */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 #if defined(_WIN32)
 #else
 #include <unistd.h>
 #endif
 
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
 #include "iscsi.h"
 #include "iscsi-private.h"
 
+#if defined(__x86_64__) && defined(__GNUC__)
+#define CRC32C_X86
+#include <nmmintrin.h>
+#include <wmmintrin.h>
+#endif
+
 /*****************************************************************/
 /*                                                               */
 /* CRC LOOKUP TABLE                                              */
@@ -109,12 +123,356 @@ uint32_t crctable[256] = {
  0xBE2DA0A5L, 0x4C4623A6L, 0x5F16D052L, 0xAD7D5351L
 };
 
-uint32_t crc32c(uint8_t *buf, int len)
+#define CRC32C_POLY 0x82F63B78
+
+/* bytes copied before crc32c_chain_copy() checksums them */
+#define CRC32C_COPY_CHUNK 4096
+
+typedef uint32_t (*crc32c_fn_t)(uint32_t crc, const uint8_t *buf, size_t len);
+
+/*
+ * Slicing-by-8 tables. crc32c_slice[k][i] is the crc of byte i followed
+ * by k zero bytes, so eight input bytes can be folded in with eight
+ * independent lookups instead of eight dependent ones.
+ */
+static uint32_t crc32c_slice[8][256];
+
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t *buf, size_t len)
 {
-	uint32_t crc = 0xffffffff;
+	uint32_t lo, hi;
+
+	while (len > 0 && ((uintptr_t)buf & 7)) {
+		crc = (crc>>8) ^ crctable[(crc ^ (*buf++)) & 0xFF];
+		len--;
+	}
+	while (len >= 8) {
+		lo = crc ^ ((uint32_t)buf[0] | (uint32_t)buf[1] << 8 |
+			    (uint32_t)buf[2] << 16 | (uint32_t)buf[3] << 24);
+		hi = (uint32_t)buf[4] | (uint32_t)buf[5] << 8 |
+		     (uint32_t)buf[6] << 16 | (uint32_t)buf[7] << 24;
+		crc = crc32c_slice[7][lo & 0xFF] ^
+		      crc32c_slice[6][(lo >> 8) & 0xFF] ^
+		      crc32c_slice[5][(lo >> 16) & 0xFF] ^
+		      crc32c_slice[4][lo >> 24] ^
+		      crc32c_slice[3][hi & 0xFF] ^
+		      crc32c_slice[2][(hi >> 8) & 0xFF] ^
+		      crc32c_slice[1][(hi >> 16) & 0xFF] ^
+		      crc32c_slice[0][hi >> 24];
+		buf += 8;
+		len -= 8;
+	}
 	while (len-- > 0) {
 		crc = (crc>>8) ^ crctable[(crc ^ (*buf++)) & 0xFF];
 	}
+	return crc;
+}
+
+#ifdef CRC32C_X86
+/*
+ * The crc32 instruction has a latency of three cycles but can start a
+ * new one every cycle, so long buffers are cut into three lanes that are
+ * checksummed in parallel and then merged:
+ *   crc(A|B|C) = crc(A) * x^(16 * lane) ^ crc(B) * x^(8 * lane) ^ crc(C)
+ * where B and C are started from zero. The multiplications are done
+ * either with lookup tables or with a carry-less multiply.
+ */
+#define CRC32C_LONG_LANE  8192
+#define CRC32C_SHORT_LANE 256
+
+struct crc32c_lanes {
+	size_t len;
+	/* tables to multiply a crc by x^(8 * len) and x^(16 * len) */
+	uint32_t tab[2][4][256];
+	/* x^(8 * len - 33) and x^(16 * len - 33) for pclmulqdq */
+	uint64_t k[2];
+};
+
+static struct crc32c_lanes crc32c_long  = { CRC32C_LONG_LANE,  {{{0}}}, {0} };
+static struct crc32c_lanes crc32c_short = { CRC32C_SHORT_LANE, {{{0}}}, {0} };
+
+/* a * b modulo the crc polynomial, bit reflected like the crc itself */
+static uint32_t crc32c_multmodp(uint32_t a, uint32_t b)
+{
+	uint32_t m = 0x80000000, p = 0;
+
+	for (;;) {
+		if (a & m) {
+			p ^= b;
+			if ((a & (m - 1)) == 0) {
+				break;
+			}
+		}
+		m >>= 1;
+		b = b & 1 ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+	}
+	return p;
+}
+
+/* x^n modulo the crc polynomial */
+static uint32_t crc32c_xpow(uint64_t n)
+{
+	uint32_t p = 0x80000000, sq = 0x40000000;
+
+	while (n) {
+		if (n & 1) {
+			p = crc32c_multmodp(sq, p);
+		}
+		sq = crc32c_multmodp(sq, sq);
+		n >>= 1;
+	}
+	return p;
+}
+
+static void crc32c_init_lanes(struct crc32c_lanes *l)
+{
+	uint32_t k;
+	int i, b, j;
+
+	for (j = 0; j < 2; j++) {
+		k = crc32c_xpow(8 * (uint64_t)l->len * (j + 1));
+		for (b = 0; b < 4; b++) {
+			for (i = 0; i < 256; i++) {
+				l->tab[j][b][i] = i ? crc32c_multmodp(k,
+					(uint32_t)i << (8 * b)) : 0;
+			}
+		}
+		l->k[j] = crc32c_xpow(8 * (uint64_t)l->len * (j + 1) - 33);
+	}
+}
+
+static inline uint64_t crc32c_load64(const uint8_t *buf)
+{
+	uint64_t v;
+
+	memcpy(&v, buf, sizeof(v));
+	return v;
+}
+
+static inline uint32_t crc32c_shift_tab(const uint32_t tab[4][256],
+					uint32_t crc)
+{
+	return tab[0][crc & 0xFF] ^ tab[1][(crc >> 8) & 0xFF] ^
+	       tab[2][(crc >> 16) & 0xFF] ^ tab[3][crc >> 24];
+}
+
+__attribute__((target("sse4.2,pclmul")))
+static inline uint32_t crc32c_shift_clmul(uint64_t k, uint32_t crc)
+{
+	__m128i v;
+
+	/* the product lands one bit up, the crc32 folds in the other 32 */
+	v = _mm_clmulepi64_si128(_mm_cvtsi32_si128(crc),
+				 _mm_cvtsi64_si128(k), 0);
+	return (uint32_t)_mm_crc32_u64(0, (uint64_t)_mm_cvtsi128_si64(v));
+}
+
+__attribute__((target("sse4.2")))
+static inline const uint8_t *crc32c_hw_lanes(const uint8_t *buf, size_t lane,
+					     uint64_t *a, uint64_t *b,
+					     uint64_t *c)
+{
+	const uint8_t *end = buf + lane;
+
+	*b = *c = 0;
+	while (buf < end) {
+		*a = _mm_crc32_u64(*a, crc32c_load64(buf));
+		*b = _mm_crc32_u64(*b, crc32c_load64(buf + lane));
+		*c = _mm_crc32_u64(*c, crc32c_load64(buf + 2 * lane));
+		buf += 8;
+	}
+	return buf + 2 * lane;
+}
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw_serial(uint32_t crc, const uint8_t *buf, size_t len)
+{
+	uint64_t c = crc;
+
+	while (len >= 8) {
+		c = _mm_crc32_u64(c, crc32c_load64(buf));
+		buf += 8;
+		len -= 8;
+	}
+	crc = (uint32_t)c;
+	while (len-- > 0) {
+		crc = _mm_crc32_u8(crc, *buf++);
+	}
+	return crc;
+}
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const uint8_t *buf, size_t len)
+{
+	uint64_t a, b, c;
+
+	while (len > 0 && ((uintptr_t)buf & 7)) {
+		crc = _mm_crc32_u8(crc, *buf++);
+		len--;
+	}
+	while (len >= 3 * CRC32C_LONG_LANE) {
+		a = crc;
+		buf = crc32c_hw_lanes(buf, CRC32C_LONG_LANE, &a, &b, &c);
+		crc = crc32c_shift_tab(crc32c_long.tab[1], (uint32_t)a) ^
+		      crc32c_shift_tab(crc32c_long.tab[0], (uint32_t)b) ^
+		      (uint32_t)c;
+		len -= 3 * CRC32C_LONG_LANE;
+	}
+	while (len >= 3 * CRC32C_SHORT_LANE) {
+		a = crc;
+		buf = crc32c_hw_lanes(buf, CRC32C_SHORT_LANE, &a, &b, &c);
+		crc = crc32c_shift_tab(crc32c_short.tab[1], (uint32_t)a) ^
+		      crc32c_shift_tab(crc32c_short.tab[0], (uint32_t)b) ^
+		      (uint32_t)c;
+		len -= 3 * CRC32C_SHORT_LANE;
+	}
+	return crc32c_hw_serial(crc, buf, len);
+}
+
+__attribute__((target("sse4.2,pclmul")))
+static uint32_t crc32c_pclmul(uint32_t crc, const uint8_t *buf, size_t len)
+{
+	uint64_t a, b, c;
+
+	while (len > 0 && ((uintptr_t)buf & 7)) {
+		crc = _mm_crc32_u8(crc, *buf++);
+		len--;
+	}
+	while (len >= 3 * CRC32C_LONG_LANE) {
+		a = crc;
+		buf = crc32c_hw_lanes(buf, CRC32C_LONG_LANE, &a, &b, &c);
+		crc = crc32c_shift_clmul(crc32c_long.k[1], (uint32_t)a) ^
+		      crc32c_shift_clmul(crc32c_long.k[0], (uint32_t)b) ^
+		      (uint32_t)c;
+		len -= 3 * CRC32C_LONG_LANE;
+	}
+	while (len >= 3 * CRC32C_SHORT_LANE) {
+		a = crc;
+		buf = crc32c_hw_lanes(buf, CRC32C_SHORT_LANE, &a, &b, &c);
+		crc = crc32c_shift_clmul(crc32c_short.k[1], (uint32_t)a) ^
+		      crc32c_shift_clmul(crc32c_short.k[0], (uint32_t)b) ^
+		      (uint32_t)c;
+		len -= 3 * CRC32C_SHORT_LANE;
+	}
+	return crc32c_hw_serial(crc, buf, len);
+}
+#endif /* CRC32C_X86 */
+
+static const struct {
+	const char *name;
+	crc32c_fn_t fn;
+} crc32c_impls[CRC32C_IMPL_MAX] = {
+	[CRC32C_IMPL_SW]     = { "slicing-by-8", crc32c_sw },
+#ifdef CRC32C_X86
+	[CRC32C_IMPL_SSE42]  = { "sse4.2",       crc32c_sse42 },
+	[CRC32C_IMPL_PCLMUL] = { "pclmulqdq",    crc32c_pclmul },
+#else
+	[CRC32C_IMPL_SSE42]  = { "sse4.2",       NULL },
+	[CRC32C_IMPL_PCLMUL] = { "pclmulqdq",    NULL },
+#endif
+};
+
+static uint32_t crc32c_resolve(uint32_t crc, const uint8_t *buf, size_t len);
+
+/*
+ * Points at the resolver until the first checksum is computed. Threads
+ * that submit at once can all end up in the resolver, so the pointer is
+ * published with a release store once the tables it uses are built.
+ */
+static crc32c_fn_t crc32c_fn = crc32c_resolve;
+
+/* 0 before the tables are built, 1 while one thread builds them, 2 once
+ * they are ready */
+static int crc32c_tables;
+
+static void crc32c_init_tables(void)
+{
+	uint32_t c;
+	int i, k, state;
+
+	do {
+		state = 0;
+		if (ATOMIC_CAS(NULL, crc32c_tables, &state, 1)) {
+			break;
+		}
+		if (state == 2) {
+			return;
+		}
+		/* a spurious failure, or another thread builds them */
+	} while (1);
+
+	for (i = 0; i < 256; i++) {
+		crc32c_slice[0][i] = crctable[i];
+	}
+	for (k = 1; k < 8; k++) {
+		for (i = 0; i < 256; i++) {
+			c = crc32c_slice[k - 1][i];
+			crc32c_slice[k][i] = (c >> 8) ^ crctable[c & 0xFF];
+		}
+	}
+#ifdef CRC32C_X86
+	crc32c_init_lanes(&crc32c_long);
+	crc32c_init_lanes(&crc32c_short);
+#endif
+	ATOMIC_STORE(NULL, crc32c_tables, 2);
+}
+
+static int crc32c_supported(enum crc32c_impl impl)
+{
+	switch (impl) {
+	case CRC32C_IMPL_SW:
+		return 1;
+#ifdef CRC32C_X86
+	case CRC32C_IMPL_SSE42:
+		return __builtin_cpu_supports("sse4.2");
+	case CRC32C_IMPL_PCLMUL:
+		return __builtin_cpu_supports("sse4.2") &&
+			__builtin_cpu_supports("pclmul");
+#endif
+	default:
+		return 0;
+	}
+}
+
+int crc32c_select(enum crc32c_impl impl)
+{
+	if ((unsigned)impl >= CRC32C_IMPL_MAX || !crc32c_supported(impl)) {
+		return -1;
+	}
+	crc32c_init_tables();
+	ATOMIC_STORE(NULL, crc32c_fn, crc32c_impls[impl].fn);
+	return 0;
+}
+
+const char *crc32c_impl_name(enum crc32c_impl impl)
+{
+	if ((unsigned)impl >= CRC32C_IMPL_MAX) {
+		return NULL;
+	}
+	return crc32c_impls[impl].name;
+}
+
+static uint32_t crc32c_resolve(uint32_t crc, const uint8_t *buf, size_t len)
+{
+	int impl;
+
+	for (impl = CRC32C_IMPL_MAX - 1; impl > CRC32C_IMPL_SW; impl--) {
+		if (crc32c_select(impl) == 0) {
+			break;
+		}
+	}
+	if (impl == CRC32C_IMPL_SW) {
+		crc32c_select(CRC32C_IMPL_SW);
+	}
+	return ATOMIC_LOAD(NULL, crc32c_fn)(crc, buf, len);
+}
+
+uint32_t crc32c(uint8_t *buf, int len)
+{
+	uint32_t crc = 0xffffffff;
+
+	if (len > 0) {
+		crc = ATOMIC_LOAD(NULL, crc32c_fn)(crc, buf, len);
+	}
 	return crc^0xffffffff;
 }
 
@@ -126,8 +484,30 @@ void crc32c_init(uint32_t *crc_ptr)
 
 uint32_t crc32c_chain(uint32_t crc, uint8_t *buf, int len)
 {
-	while (len-- > 0) {
-		crc = (crc>>8) ^ crctable[(crc ^ (*buf++)) & 0xFF];
+	if (len > 0) {
+		crc = ATOMIC_LOAD(NULL, crc32c_fn)(crc, buf, len);
+	}
+	return crc;
+}
+
+/*
+ * Copy a buffer and fold it into the crc. The copy is done in chunks that
+ * the checksum then reads back from the L1 cache, so each byte is only
+ * pulled in from memory once.
+ */
+uint32_t crc32c_chain_copy(uint32_t crc, uint8_t *dst, const uint8_t *src,
+			   size_t len)
+{
+	crc32c_fn_t fn = ATOMIC_LOAD(NULL, crc32c_fn);
+	size_t chunk;
+
+	while (len > 0) {
+		chunk = MIN(len, CRC32C_COPY_CHUNK);
+		memcpy(dst, src, chunk);
+		crc = fn(crc, dst, chunk);
+		dst += chunk;
+		src += chunk;
+		len -= chunk;
 	}
 	return crc;
 }
@@ -136,4 +516,3 @@ uint32_t crc32c_chain_done(uint32_t crc)
 {
 	return crc^0xffffffff;
 }
-
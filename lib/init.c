@@ -38,6 +38,7 @@
 #include <stdarg.h>
 #include <sys/types.h>
 #include <time.h>
+#include <limits.h>
 #include "iscsi.h"
 #include "iscsi-private.h"
 #ifdef HAVE_LINUX_ISER
@@ -62,6 +63,11 @@ int iscsi_init_transport(struct iscsi_context *iscsi,
 	case ISER_TRANSPORT:
 		iscsi_init_iser_transport(iscsi);
 		break;
+#endif
+#ifdef HAVE_LINUX_IO_URING
+	case URING_TRANSPORT:
+		iscsi_init_uring_transport(iscsi);
+		break;
 #endif
 	default:
 		iscsi_set_error(iscsi, "Unfamiliar transport type");
@@ -71,6 +77,21 @@ int iscsi_init_transport(struct iscsi_context *iscsi,
 	return 0;
 }
 
+/* release whatever the transport keeps in iscsi->opaque */
+void iscsi_free_transport(struct iscsi_context *iscsi)
+{
+	if (iscsi->drv && iscsi->drv->destroy) {
+		iscsi->drv->destroy(iscsi);
+	}
+	iscsi_free(iscsi, iscsi->opaque);
+	iscsi->opaque = NULL;
+}
+
+void iscsi_set_uring_flags(struct iscsi_context *iscsi, int flags)
+{
+	iscsi->uring_flags = flags;
+}
+
 /**
  * Whether or not the internal memory allocator caches allocations. Disable
  * memory allocation caching to improve the accuracy of Valgrind reports.
@@ -78,6 +99,9 @@ int iscsi_init_transport(struct iscsi_context *iscsi,
 void iscsi_set_cache_allocations(struct iscsi_context *iscsi, int ca)
 {
 	iscsi->cache_allocations = ca;
+	if (!ca) {
+		iscsi_free_alloc_caches(iscsi);
+	}
 }
 
 void* iscsi_malloc(struct iscsi_context *iscsi, size_t size) {
@@ -115,6 +139,72 @@ char* iscsi_strdup(struct iscsi_context *iscsi, const char* str) {
 	return str2;
 }
 
+/*
+ * Allocate a zeroed object of a fixed size, reusing one that was
+ * earlier released with iscsi_cache_free() on the same cache if possible.
+ * All objects put on a cache must have the same size.
+ */
+void* iscsi_cache_alloc(struct iscsi_context *iscsi,
+			struct iscsi_alloc_cache *cache, size_t size) {
+	void *ptr;
+
+        iscsi_mt_spin_lock(&iscsi->alloc_lock);
+	ptr = cache->head;
+	if (ptr != NULL) {
+		cache->head = *(void **)ptr;
+		cache->count--;
+	}
+        iscsi_mt_spin_unlock(&iscsi->alloc_lock);
+
+	if (ptr == NULL) {
+		return iscsi_zmalloc(iscsi, size);
+	}
+	memset(ptr, 0, size);
+	return ptr;
+}
+
+void iscsi_cache_free(struct iscsi_context *iscsi,
+		      struct iscsi_alloc_cache *cache, void *ptr) {
+	if (ptr == NULL) return;
+
+	if (iscsi->cache_allocations) {
+                iscsi_mt_spin_lock(&iscsi->alloc_lock);
+		if (cache->count < SMALL_ALLOC_MAX_FREE) {
+			*(void **)ptr = cache->head;
+			cache->head = ptr;
+			cache->count++;
+			ptr = NULL;
+		}
+                iscsi_mt_spin_unlock(&iscsi->alloc_lock);
+	}
+	iscsi_free(iscsi, ptr);
+}
+
+static void iscsi_drain_alloc_cache(struct iscsi_context *iscsi,
+				    struct iscsi_alloc_cache *cache) {
+	void *ptr;
+
+	while ((ptr = cache->head) != NULL) {
+		cache->head = *(void **)ptr;
+		iscsi_free(iscsi, ptr);
+	}
+	cache->count = 0;
+}
+
+void iscsi_free_alloc_caches(struct iscsi_context *iscsi) {
+	struct iscsi_in_pdu *in;
+
+        iscsi_mt_spin_lock(&iscsi->alloc_lock);
+	iscsi_drain_alloc_cache(iscsi, &iscsi->pdu_cache);
+	while ((in = iscsi->in_pdu_pool) != NULL) {
+		iscsi->in_pdu_pool = in->next;
+		iscsi_free(iscsi, in->data);
+		iscsi_free(iscsi, in);
+	}
+	iscsi->in_pdu_pool_count = 0;
+        iscsi_mt_spin_unlock(&iscsi->alloc_lock);
+}
+
 static void
 iscsi_srand_init(struct iscsi_context *iscsi) {
 	unsigned int seed;
@@ -179,8 +269,11 @@ iscsi_create_context(const char *initiator_name)
 	memset(iscsi, 0, sizeof(struct iscsi_context));
 
         iscsi_mt_spin_init(&iscsi->iscsi_lock, PTHREAD_PROCESS_PRIVATE);
+        iscsi_mt_spin_init(&iscsi->alloc_lock, PTHREAD_PROCESS_PRIVATE);
         iscsi_mt_mutex_init(&iscsi->iscsi_mutex);
         iscsi->poll_timeout = 100;
+        iscsi->wakeup_fd[0] = iscsi->wakeup_fd[1] = -1;
+        iscsi->service_cpu = -1;
 
 	/* initalize transport of context */
 	if (iscsi_init_transport(iscsi, TCP_TRANSPORT)) {
@@ -188,6 +281,12 @@ iscsi_create_context(const char *initiator_name)
 		return NULL;
 	}
 
+	if (iscsi_itt_hash_init(iscsi)) {
+		iscsi_free_transport(iscsi);
+		free(iscsi);
+		return NULL;
+	}
+
 	strncpy(iscsi->initiator_name,initiator_name,MAX_ISCSI_NAME_SIZE);
 
 	iscsi->fd = -1;
@@ -209,6 +308,10 @@ iscsi_create_context(const char *initiator_name)
 	iscsi->use_initial_r2t                        = ISCSI_INITIAL_R2T_YES;
 	iscsi->want_immediate_data                    = ISCSI_IMMEDIATE_DATA_YES;
 	iscsi->use_immediate_data                     = ISCSI_IMMEDIATE_DATA_YES;
+	iscsi->want_max_outstanding_r2t               = 1;
+	iscsi->max_outstanding_r2t                    = 1;
+	iscsi->want_max_connections                   = 1;
+	iscsi->max_connections                        = 1;
 	iscsi->want_header_digest                     = ISCSI_HEADER_DIGEST_NONE_CRC32C;
 	iscsi->want_data_digest                       = ISCSI_DATA_DIGEST_NONE;
 
@@ -244,6 +347,14 @@ iscsi_create_context(const char *initiator_name)
 		iscsi_set_tcp_syncnt(iscsi,atoi(getenv("LIBISCSI_TCP_SYNCNT")));
 	}
 
+	if (getenv("LIBISCSI_ZEROCOPY_THRESHOLD") != NULL) {
+		iscsi_set_zerocopy_threshold(iscsi,atoi(getenv("LIBISCSI_ZEROCOPY_THRESHOLD")));
+	}
+
+	if (getenv("LIBISCSI_DATA_DIGEST_ON_SUBMIT") != NULL) {
+		iscsi_set_data_digest_on_submit(iscsi,atoi(getenv("LIBISCSI_DATA_DIGEST_ON_SUBMIT")));
+	}
+
 	if (getenv("LIBISCSI_BIND_INTERFACES") != NULL) {
 		iscsi_set_bind_interfaces(iscsi,getenv("LIBISCSI_BIND_INTERFACES"));
 	}
@@ -368,10 +479,26 @@ iscsi_get_unit_serial_number(struct iscsi_context *iscsi)
 int
 iscsi_destroy_context(struct iscsi_context *iscsi)
 {
+	struct iscsi_context *conn;
+
 	if (iscsi == NULL) {
 		return 0;
 	}
 
+	if (iscsi->loop != NULL) {
+		iscsi_loop_detach(iscsi);
+	}
+
+	/* the other connections of the session go first, their cancelled
+	 * commands still complete to the queue of the session */
+	while ((conn = iscsi->connections) != NULL) {
+		iscsi->connections = conn->next_connection;
+		conn->leader = NULL;
+		conn->cq = iscsi->cq;
+		conn->next_connection = NULL;
+		iscsi_destroy_context(conn);
+	}
+
 	iscsi_disconnect(iscsi);
 
 	iscsi_cancel_pdus(iscsi);
@@ -388,7 +515,12 @@ iscsi_destroy_context(struct iscsi_context *iscsi)
 
 	iscsi->connect_data = NULL;
 
-	iscsi_free(iscsi, iscsi->opaque);
+	iscsi_free_transport(iscsi);
+	iscsi_free(iscsi, iscsi->timer_heap);
+	iscsi_free(iscsi, iscsi->itt_hash);
+	iscsi_free(iscsi, iscsi->rx_buf);
+	iscsi_free(iscsi, iscsi->send_batch);
+	iscsi_free_alloc_caches(iscsi);
 
 	if (iscsi->mallocs != iscsi->frees) {
 		ISCSI_LOG(iscsi,1,"%d memory blocks lost at iscsi_destroy_context() after %d malloc(s), %d realloc(s), %d free(s)",iscsi->mallocs-iscsi->frees,iscsi->mallocs,iscsi->reallocs,iscsi->frees);
@@ -400,8 +532,10 @@ iscsi_destroy_context(struct iscsi_context *iscsi)
 		iscsi->old_iscsi->fd = -1;
 		iscsi_destroy_context(iscsi->old_iscsi);
 	}
+	iscsi_cq_destroy(iscsi);
 
         iscsi_mt_spin_destroy(&iscsi->iscsi_lock);
+        iscsi_mt_spin_destroy(&iscsi->alloc_lock);
         iscsi_mt_mutex_destroy(&iscsi->iscsi_mutex);
 
 	memset(iscsi, 0, sizeof(struct iscsi_context));
@@ -638,6 +772,24 @@ iscsi_parse_url(struct iscsi_context *iscsi, const char *url, int full)
 					return NULL;
 				}
 			}
+			if (!strcmp(key, "max_outstanding_r2t")) {
+				if (value == NULL ||
+				    iscsi_set_max_outstanding_r2t(iscsi,
+						atoi(value)) != 0) {
+					iscsi_set_error(iscsi,
+						"Invalid URL argument for max_outstanding_r2t: %s", value ? value : "");
+					return NULL;
+				}
+			}
+			if (!strcmp(key, "max_connections")) {
+				if (value == NULL ||
+				    iscsi_set_max_connections(iscsi,
+						atoi(value)) != 0) {
+					iscsi_set_error(iscsi,
+						"Invalid URL argument for max_connections: %s", value ? value : "");
+					return NULL;
+				}
+			}
 			if (!strcmp(key, "target_user")) {
 				target_user = value;
 			} else if (!strcmp(key, "target_password")) {
@@ -854,10 +1006,53 @@ iscsi_set_initial_r2t(struct iscsi_context *iscsi, enum iscsi_initial_r2t initia
 	return 0;
 }
 
+int
+iscsi_set_max_outstanding_r2t(struct iscsi_context *iscsi, int max_r2t)
+{
+	if (iscsi->is_loggedin != 0) {
+		iscsi_set_error(iscsi, "Already logged in when trying to set max_outstanding_r2t");
+		return -1;
+	}
+	if (max_r2t < 1 || max_r2t > 65535) {
+		iscsi_set_error(iscsi, "Invalid MaxOutstandingR2T %d", max_r2t);
+		return -1;
+	}
+
+	iscsi->want_max_outstanding_r2t = max_r2t;
+	return 0;
+}
+
+int
+iscsi_set_max_connections(struct iscsi_context *iscsi, int max_connections)
+{
+	if (iscsi->is_loggedin != 0) {
+		iscsi_set_error(iscsi, "Already logged in when trying to set max_connections");
+		return -1;
+	}
+	if (max_connections < 1 || max_connections > ISCSI_MAX_CONNECTIONS) {
+		iscsi_set_error(iscsi, "Invalid MaxConnections %d, must be "
+				"between 1 and %d", max_connections,
+				ISCSI_MAX_CONNECTIONS);
+		return -1;
+	}
+
+	iscsi->want_max_connections = max_connections;
+	return 0;
+}
+
 int
 iscsi_set_timeout(struct iscsi_context *iscsi, int timeout)
 {
-	iscsi->scsi_timeout = timeout;
+	if (timeout > INT_MAX / 1000) {
+		timeout = INT_MAX / 1000;
+	}
+	return iscsi_set_timeout_ms(iscsi, timeout * 1000);
+}
+
+int
+iscsi_set_timeout_ms(struct iscsi_context *iscsi, int timeout_ms)
+{
+	iscsi->scsi_timeout = timeout_ms;
 	return 0;
 }
 
@@ -44,6 +44,7 @@ iscsi_scsi_response_cb(struct iscsi_context *iscsi, int status,
 {
 	struct iscsi_scsi_cbdata *scsi_cbdata =
 	  (struct iscsi_scsi_cbdata *)private_data;
+	struct iscsi_completion_queue *cq;
 
 	switch (status) {
 	case SCSI_STATUS_RESERVATION_CONFLICT:
@@ -57,88 +58,199 @@ iscsi_scsi_response_cb(struct iscsi_context *iscsi, int status,
 	case SCSI_STATUS_ERROR:
 	case SCSI_STATUS_CANCELLED:
 	case SCSI_STATUS_TIMEOUT:
-		scsi_cbdata->task->status = status;
-		if (scsi_cbdata->callback) {
-			scsi_cbdata->callback(iscsi, status, scsi_cbdata->task,
-			                      scsi_cbdata->private_data);
-		}
-		return;
+		break;
 	default:
-		scsi_cbdata->task->status = SCSI_STATUS_ERROR;
 		iscsi_set_error(iscsi, "Cant handle  scsi status %d yet.",
 		                status);
-		if (scsi_cbdata->callback) {
-			scsi_cbdata->callback(iscsi, SCSI_STATUS_ERROR, scsi_cbdata->task,
-			                      scsi_cbdata->private_data);
+		status = SCSI_STATUS_ERROR;
+	}
+
+	scsi_cbdata->task->status = status;
+	if (scsi_cbdata->callback) {
+		scsi_cbdata->callback(iscsi, status, scsi_cbdata->task,
+		                      scsi_cbdata->private_data);
+		return;
+	}
+	/* without a callback the task is reaped from the completion queue,
+	 * with the private_data it was queued with. Until now the task
+	 * pointed at the pdu that is about to be freed. */
+	cq = scsi_cbdata->cq;
+	if (cq != NULL) {
+		scsi_set_task_private_ptr(scsi_cbdata->task,
+					  scsi_cbdata->private_data);
+		iscsi_cq_push(cq, scsi_cbdata->task);
+	}
+}
+
+/*
+ * Compute the data digest of every target_max_recv_data_segment_length
+ * segment of the write data so that the thread writing to the socket only
+ * has to copy them into the pdus. Runs on the submitting thread before the
+ * command is queued. Segments not covered by the iovector, or all of them
+ * if we run out of memory, are digested when they are sent instead.
+ */
+static void
+iscsi_precompute_data_digests(struct iscsi_context *iscsi,
+			      struct iscsi_pdu *pdu, struct scsi_task *task)
+{
+	static uint8_t padding_buf[3];
+	struct scsi_iovector *iovector = &task->iovector_out;
+	uint32_t seg = iscsi->target_max_recv_data_segment_length;
+	uint32_t total, done = 0, len, left, chunk;
+	uint32_t crc;
+	size_t pos = 0;
+	int i = 0, count;
+
+	if (seg == 0 || task->expxferlen <= 0 || iovector->iov == NULL) {
+		return;
+	}
+	total = task->expxferlen;
+	count = (total + seg - 1) / seg;
+	pdu->seg_digests = iscsi_malloc(iscsi, count * sizeof(uint32_t));
+	if (pdu->seg_digests == NULL) {
+		return;
+	}
+	pdu->seg_digest_len = seg;
+
+	while (pdu->seg_digest_count < count) {
+		len = MIN(seg, total - done);
+		crc32c_init(&crc);
+		for (left = len; left > 0; left -= chunk) {
+			if (i >= iovector->niov) {
+				return;
+			}
+			chunk = MIN(iovector->iov[i].iov_len - pos, left);
+			crc = crc32c_chain(crc,
+				(uint8_t *)iovector->iov[i].iov_base + pos,
+				chunk);
+			pos += chunk;
+			if (pos == iovector->iov[i].iov_len) {
+				i++;
+				pos = 0;
+			}
 		}
+		crc = crc32c_chain(crc, padding_buf,
+				   ((len + 3) & 0xfffffffc) - len);
+		pdu->seg_digests[pdu->seg_digest_count++] =
+			crc32c_chain_done(crc);
+		done += len;
 	}
 }
 
-static int
-iscsi_send_data_out(struct iscsi_context *iscsi, struct iscsi_pdu *cmd_pdu,
-		    uint32_t ttt, uint32_t offset, uint32_t tot_len)
+/*
+ * Use a digest computed by iscsi_precompute_data_digests() if the payload
+ * of the pdu is exactly one of the segments.
+ */
+static void
+iscsi_pdu_set_precomputed_digest(struct iscsi_pdu *cmd_pdu,
+				 struct iscsi_pdu *pdu)
 {
-	while (tot_len > 0) {
-		uint32_t len = tot_len;
-		struct iscsi_pdu *pdu;
-		int flags;
-
-		len = MIN(len, iscsi->target_max_recv_data_segment_length);
-
-		pdu = iscsi_allocate_pdu(iscsi,
-					 ISCSI_PDU_DATA_OUT,
-					 ISCSI_PDU_NO_PDU,
-					 cmd_pdu->itt,
-					 ISCSI_PDU_DROP_ON_RECONNECT|ISCSI_PDU_DELETE_WHEN_SENT);
-		if (pdu == NULL) {
-			iscsi_set_error(iscsi, "Out-of-memory, Failed to allocate "
-				"scsi data out pdu.");
-			goto error;
-		}
-		pdu->scsi_cbdata.task         = cmd_pdu->scsi_cbdata.task;
-		/* set the cmdsn in the pdu struct so we can compare with
-		 * maxcmdsn when sending to socket even if data-out pdus
-		 * do not carry a cmdsn on the wire */
-		pdu->cmdsn                    = cmd_pdu->cmdsn;
-
-		if (tot_len == len) {
-			flags = ISCSI_PDU_SCSI_FINAL;
-		} else {
-			flags = 0;
-		}
+	uint32_t idx, len, crc;
+
+	pdu->data_digest_precomputed = false;
+	if (cmd_pdu == NULL || cmd_pdu->seg_digests == NULL ||
+	    pdu->payload_len == 0 ||
+	    pdu->payload_offset % cmd_pdu->seg_digest_len) {
+		return;
+	}
+	idx = pdu->payload_offset / cmd_pdu->seg_digest_len;
+	if (idx >= (uint32_t)cmd_pdu->seg_digest_count) {
+		return;
+	}
+	len = MIN(cmd_pdu->seg_digest_len,
+		  cmd_pdu->scsi_cbdata.task->expxferlen - pdu->payload_offset);
+	if (pdu->payload_len != len) {
+		return;
+	}
 
-		/* flags */
-		iscsi_pdu_set_pduflags(pdu, flags);
+	crc = cmd_pdu->seg_digests[idx];
+	pdu->outdigest[3] = (crc >> 24);
+	pdu->outdigest[2] = (crc >> 16);
+	pdu->outdigest[1] = (crc >>  8);
+	pdu->outdigest[0] = (crc);
+	pdu->data_digest_precomputed = true;
+}
 
-		/* lun */
-		iscsi_pdu_set_lun(pdu, cmd_pdu->lun);
+/* point the header of a burst at its segment that starts at offset */
+static void
+iscsi_data_out_set_segment(struct iscsi_context *iscsi,
+			   struct iscsi_pdu *cmd_pdu, struct iscsi_pdu *pdu,
+			   uint32_t offset, uint32_t datasn)
+{
+	uint32_t len;
+
+	len = MIN(pdu->burst_end - offset,
+		  iscsi->target_max_recv_data_segment_length);
 
-		/* ttt */
-		iscsi_pdu_set_ttt(pdu, ttt);
+	iscsi_pdu_set_pduflags(pdu, offset + len == pdu->burst_end ?
+			       ISCSI_PDU_SCSI_FINAL : 0);
+	iscsi_pdu_set_datasn(pdu, datasn);
+	iscsi_pdu_set_bufferoffset(pdu, offset);
 
-		/* data sn */
-		iscsi_pdu_set_datasn(pdu, cmd_pdu->datasn++);
+	pdu->payload_offset = offset;
+	pdu->payload_len    = len;
 
-		/* buffer offset */
-		iscsi_pdu_set_bufferoffset(pdu, offset);
+	/* update data segment length */
+	scsi_set_uint32(&pdu->outdata.data[4], pdu->payload_len);
 
-		pdu->payload_offset = offset;
-		pdu->payload_len    = len;
+	iscsi_pdu_set_precomputed_digest(cmd_pdu, pdu);
+}
 
-		/* update data segment length */
-		scsi_set_uint32(&pdu->outdata.data[4], pdu->payload_len);
+/*
+ * Queue the data-out of one burst, either the unsolicited one or one
+ * asked for by an R2T. Each burst has its own DataSN sequence so the
+ * bursts of a command do not depend on each other and the target can
+ * have several of them outstanding.
+ * A single pdu is queued for the whole burst. It is cut into pdus of
+ * at most MaxRecvDataSegmentLength by iscsi_data_out_next() as they
+ * are sent.
+ */
+static int
+iscsi_send_data_out(struct iscsi_context *iscsi, struct iscsi_pdu *cmd_pdu,
+		    uint32_t ttt, uint32_t offset, uint32_t tot_len)
+{
+	struct iscsi_pdu *pdu;
 
-		iscsi_queue_pdu(iscsi, pdu);
+	if (tot_len == 0) {
+		return 0;
+	}
 
-		tot_len -= len;
-		offset  += len;
+	pdu = iscsi_allocate_pdu(iscsi,
+				 ISCSI_PDU_DATA_OUT,
+				 ISCSI_PDU_NO_PDU,
+				 cmd_pdu->itt,
+				 ISCSI_PDU_DROP_ON_RECONNECT|ISCSI_PDU_DELETE_WHEN_SENT);
+	if (pdu == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory, Failed to allocate "
+			"scsi data out pdu.");
+		goto error;
 	}
+	pdu->scsi_cbdata.task         = cmd_pdu->scsi_cbdata.task;
+	/* set the cmdsn in the pdu struct so we can compare with
+	 * maxcmdsn when sending to socket even if data-out pdus
+	 * do not carry a cmdsn on the wire */
+	pdu->cmdsn                    = cmd_pdu->cmdsn;
+
+	/* lun */
+	iscsi_pdu_set_lun(pdu, cmd_pdu->lun);
+
+	/* ttt */
+	iscsi_pdu_set_ttt(pdu, ttt);
+
+	pdu->burst_end = offset + tot_len;
+	iscsi_data_out_set_segment(iscsi, cmd_pdu, pdu, offset, 0);
+
+	iscsi_queue_pdu(iscsi, pdu);
 	return 0;
 
 error:
         iscsi_mt_spin_lock(&iscsi->iscsi_lock);
-	ISCSI_LIST_REMOVE(&iscsi->outqueue, cmd_pdu);
-	ISCSI_LIST_REMOVE(&iscsi->waitpdu, cmd_pdu);
+	if (cmd_pdu->flags & ISCSI_PDU_IN_OUTQUEUE) {
+		iscsi_outqueue_remove(iscsi, cmd_pdu);
+	}
+	if (cmd_pdu->flags & ISCSI_PDU_IN_WAITPDU) {
+		iscsi_waitpdu_remove(iscsi, cmd_pdu);
+	}
         iscsi_mt_spin_unlock(&iscsi->iscsi_lock);
 	if (cmd_pdu->callback) {
 		cmd_pdu->callback(iscsi, SCSI_STATUS_ERROR, NULL,
@@ -148,6 +260,53 @@ error:
 	return -1;
 }
 
+/*
+ * Return the pdu to send for the segment a burst queued by
+ * iscsi_send_data_out() is at. For the last segment that is the queued
+ * pdu itself. Before that it is a copy, and the queued pdu moves on to
+ * the next segment and stays where it is in the outqueue.
+ * Called with iscsi_lock held.
+ * Returns NULL if we are out of memory.
+ */
+struct iscsi_pdu *
+iscsi_data_out_next(struct iscsi_context *iscsi, struct iscsi_pdu *burst)
+{
+	struct iscsi_pdu *pdu, *cmd_pdu = NULL;
+	uint32_t offset = burst->payload_offset + burst->payload_len;
+
+	if (offset >= burst->burst_end) {
+		return burst;
+	}
+
+	pdu = iscsi_allocate_pdu(iscsi,
+				 ISCSI_PDU_DATA_OUT,
+				 ISCSI_PDU_NO_PDU,
+				 burst->itt,
+				 burst->flags & (ISCSI_PDU_DROP_ON_RECONNECT |
+						 ISCSI_PDU_DELETE_WHEN_SENT |
+						 ISCSI_PDU_PRIO_LANE));
+	if (pdu == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory, Failed to allocate "
+			"scsi data out pdu.");
+		return NULL;
+	}
+	memcpy(pdu->outdata.data, burst->outdata.data, ISCSI_RAW_HEADER_SIZE);
+	pdu->scsi_cbdata.task         = burst->scsi_cbdata.task;
+	pdu->cmdsn                    = burst->cmdsn;
+	pdu->payload_offset           = burst->payload_offset;
+	pdu->payload_len              = burst->payload_len;
+	pdu->data_digest_precomputed  = burst->data_digest_precomputed;
+	memcpy(pdu->outdigest, burst->outdigest, ISCSI_DIGEST_SIZE);
+
+	/* the command has been sent, so it waits for its response */
+	if (iscsi->data_digest != ISCSI_DATA_DIGEST_NONE) {
+		cmd_pdu = iscsi_waitpdu_find(iscsi, burst->itt);
+	}
+	iscsi_data_out_set_segment(iscsi, cmd_pdu, burst, offset,
+				   scsi_get_uint32(&burst->outdata.data[36]) + 1);
+	return pdu;
+}
+
 static int
 iscsi_send_unsolicited_data_out(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
 {
@@ -157,11 +316,8 @@ iscsi_send_unsolicited_data_out(struct iscsi_context *iscsi, struct iscsi_pdu *p
 				   pdu->payload_len, len);
 }
 
-/* Using 'struct iscsi_data *d' for data-out is optional
- * and will be converted into a one element data-out iovector.
- */
-int
-iscsi_scsi_command_async(struct iscsi_context *iscsi, int lun,
+static int
+iscsi_scsi_command_queue(struct iscsi_context *iscsi, int lun,
 			 struct scsi_task *task, iscsi_command_cb cb,
 			 struct iscsi_data *d, void *private_data)
 {
@@ -171,6 +327,8 @@ iscsi_scsi_command_async(struct iscsi_context *iscsi, int lun,
 	if (iscsi->old_iscsi) {
 		iscsi = iscsi->old_iscsi;
 		ISCSI_LOG(iscsi, 2, "iscsi_scsi_command_async: queuing cmd to old_iscsi while reconnecting");
+	} else if (iscsi->connections) {
+		iscsi = iscsi_stripe_connection(iscsi);
 	}
 
 	if (iscsi->session_type != ISCSI_SESSION_NORMAL) {
@@ -214,6 +372,15 @@ iscsi_scsi_command_async(struct iscsi_context *iscsi, int lun,
 	pdu->scsi_cbdata.task         = task;
 	pdu->scsi_cbdata.callback     = cb;
 	pdu->scsi_cbdata.private_data = private_data;
+	pdu->scsi_cbdata.cq           = NULL;
+	if (cb == NULL) {
+		/* the queue stays enabled until the task is pushed */
+		pdu->scsi_cbdata.cq = ATOMIC_LOAD(iscsi,
+						  ISCSI_SESSION(iscsi)->cq);
+		if (pdu->scsi_cbdata.cq != NULL) {
+			ATOMIC_INC(iscsi, pdu->scsi_cbdata.cq->inflight);
+		}
+	}
 
 	pdu->payload_offset = 0;
 	pdu->payload_len    = 0;
@@ -273,13 +440,17 @@ iscsi_scsi_command_async(struct iscsi_context *iscsi, int lun,
 	iscsi_pdu_set_expxferlen(pdu, task->expxferlen);
 
 	/* cmdsn */
-        iscsi_mt_spin_lock(&iscsi->iscsi_lock);
-	iscsi_pdu_set_cmdsn(pdu, iscsi->cmdsn++);
-        iscsi_mt_spin_unlock(&iscsi->iscsi_lock);
+	iscsi_pdu_set_cmdsn(pdu, ATOMIC_INC(iscsi, ISCSI_SESSION(iscsi)->cmdsn));
 
 	/* cdb */
 	iscsi_pdu_set_cdb(pdu, task);
 
+	if (task->xfer_dir == SCSI_XFER_WRITE && iscsi->data_digest_on_submit &&
+	    iscsi->data_digest != ISCSI_DATA_DIGEST_NONE) {
+		iscsi_precompute_data_digests(iscsi, pdu, task);
+		iscsi_pdu_set_precomputed_digest(pdu, pdu);
+	}
+
 	iscsi_queue_pdu(iscsi, pdu);
 
 	/* The F flag is not set. This means we haven't sent all the unsolicited
@@ -294,6 +465,23 @@ iscsi_scsi_command_async(struct iscsi_context *iscsi, int lun,
 	return 0;
 }
 
+/* Using 'struct iscsi_data *d' for data-out is optional
+ * and will be converted into a one element data-out iovector.
+ */
+int
+iscsi_scsi_command_async(struct iscsi_context *iscsi, int lun,
+			 struct scsi_task *task, iscsi_command_cb cb,
+			 struct iscsi_data *d, void *private_data)
+{
+	int ret;
+
+	iscsi_submit_enter(iscsi);
+	ret = iscsi_scsi_command_queue(iscsi, lun, task, cb, d, private_data);
+	iscsi_submit_leave(iscsi);
+
+	return ret;
+}
+
 /* Parse a sense key specific sense data descriptor */
 static void parse_sense_spec(struct scsi_sense *sense, const uint8_t inf[3])
 {
@@ -429,6 +617,7 @@ iscsi_process_scsi_reply(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
 
 		pdu->indata.data = NULL;
 		pdu->indata.size = 0;
+		pdu->indata_alloc = 0;
 
 		if (pdu->callback) {
 			pdu->callback(iscsi, SCSI_STATUS_GOOD, task,
@@ -506,6 +695,56 @@ iscsi_process_scsi_reply(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
 	return 0;
 }
 
+/*
+ * Make room for len bytes of DATA-IN at BufferOffset offset in the
+ * reassembly buffer of a task that has no user iovector. The buffer is
+ * sized for the whole transfer when the first DATA-IN arrives, so the
+ * segments are placed where they belong instead of growing the buffer
+ * for each of them, and need not arrive in order. A range the target
+ * skipped reads back as zeroes, not as whatever the heap held.
+ * Returns where the data goes or NULL on error.
+ */
+static unsigned char *
+iscsi_reserve_datain(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
+		     uint32_t offset, uint32_t len)
+{
+	size_t expxferlen = MAX(pdu->scsi_cbdata.task->expxferlen, 0);
+	size_t end = (size_t)offset + len;
+	unsigned char *buf;
+
+	if (offset > MAX(pdu->indata_alloc, expxferlen)) {
+		iscsi_set_error(iscsi, "DATA-IN BufferOffset %u is beyond the "
+				"expected transfer length %zu", offset,
+				expxferlen);
+		return NULL;
+	}
+	if (end > pdu->indata_alloc) {
+		/* only a residual overflow needs more than expxferlen */
+		if (pdu->indata.data == NULL) {
+			end = MAX(end, expxferlen);
+			buf = iscsi_malloc(iscsi, end);
+		} else {
+			buf = iscsi_realloc(iscsi, pdu->indata.data, end);
+		}
+		if (buf == NULL) {
+			iscsi_set_error(iscsi, "Out-of-memory: failed to add "
+					"data to pdu in buffer.");
+			return NULL;
+		}
+		pdu->indata.data = buf;
+		pdu->indata_alloc = end;
+		end = (size_t)offset + len;
+	}
+	if (end > pdu->indata.size) {
+		if ((size_t)offset > pdu->indata.size) {
+			memset(&pdu->indata.data[pdu->indata.size], 0,
+			       offset - pdu->indata.size);
+		}
+		pdu->indata.size = end;
+	}
+	return &pdu->indata.data[offset];
+}
+
 int
 iscsi_process_scsi_data_in(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
 			   struct iscsi_in_pdu *in, int *is_finished)
@@ -527,13 +766,17 @@ iscsi_process_scsi_data_in(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
 	}
 	dsl = scsi_get_uint32(&in->hdr[4]) & 0x00ffffff;
 
-	/* Don't add to reassembly buffer if we already have a user buffer */
-	if (task->iovector_in.iov == NULL) {
-		if (iscsi_add_data(iscsi, &pdu->indata, in->data, dsl, 0) != 0) {
-		    iscsi_set_error(iscsi, "Out-of-memory: failed to add data "
-				"to pdu in buffer.");
+	/* Don't add to reassembly buffer if we already have a user buffer
+	 * or if the data was received straight into it */
+	if (task->iovector_in.iov == NULL && !in->data_placed && dsl) {
+		unsigned char *buf;
+
+		buf = iscsi_reserve_datain(iscsi, pdu,
+					   scsi_get_uint32(&in->hdr[40]), dsl);
+		if (buf == NULL) {
 			return -1;
 		}
+		memcpy(buf, in->data, dsl);
 	}
 
 	if ((flags&ISCSI_PDU_DATA_FINAL) == 0) {
@@ -578,6 +821,7 @@ iscsi_process_scsi_data_in(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
 	
 	pdu->indata.data = NULL;
 	pdu->indata.size = 0;
+	pdu->indata_alloc = 0;
 
 	if (pdu->callback) {
 		pdu->callback(iscsi, status, task, pdu->private_data);
@@ -596,7 +840,6 @@ iscsi_process_r2t(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
 	offset = scsi_get_uint32(&in->hdr[40]);
 	len    = scsi_get_uint32(&in->hdr[44]);
 
-	pdu->datasn = 0;
 	iscsi_send_data_out(iscsi, pdu, ttt, offset, len);
 	return 0;
 }
@@ -2394,6 +2637,37 @@ iscsi_unmap_task(struct iscsi_context *iscsi, int lun, int anchor, int group,
 	return task;
 }
 
+/*
+ * Where the data segment of a DATA-IN for a task without a user iovector
+ * is received to: straight into the reassembly buffer of the task.
+ */
+unsigned char *
+iscsi_get_scsi_task_datain_buf(struct iscsi_context *iscsi, struct iscsi_in_pdu *in)
+{
+	struct iscsi_pdu *pdu;
+	uint32_t itt, dsl;
+
+	if ((in->hdr[0] & 0x3f) != ISCSI_PDU_DATA_IN) {
+		return NULL;
+	}
+	dsl = scsi_get_uint32(&in->hdr[4]) & 0x00ffffff;
+	if (dsl == 0) {
+		return NULL;
+	}
+
+	itt = scsi_get_uint32(&in->hdr[16]);
+        iscsi_mt_spin_lock(&iscsi->iscsi_lock);
+	pdu = iscsi_waitpdu_find(iscsi, itt);
+        iscsi_mt_spin_unlock(&iscsi->iscsi_lock);
+
+	if (pdu == NULL || pdu->scsi_cbdata.task->iovector_in.iov != NULL) {
+		return NULL;
+	}
+
+	return iscsi_reserve_datain(iscsi, pdu, scsi_get_uint32(&in->hdr[40]),
+				    dsl);
+}
+
 struct scsi_iovector *
 iscsi_get_scsi_task_iovector_in(struct iscsi_context *iscsi, struct iscsi_in_pdu *in)
 {
@@ -2406,11 +2680,7 @@ iscsi_get_scsi_task_iovector_in(struct iscsi_context *iscsi, struct iscsi_in_pdu
 
 	itt = scsi_get_uint32(&in->hdr[16]);
         iscsi_mt_spin_lock(&iscsi->iscsi_lock);
-	for (pdu = iscsi->waitpdu; pdu; pdu = pdu->next) {
-		if (pdu->itt == itt) {
-			break;
-		}
-	}
+	pdu = iscsi_waitpdu_find(iscsi, itt);
         iscsi_mt_spin_unlock(&iscsi->iscsi_lock);
 
 	if (pdu == NULL) {
@@ -2666,47 +2936,100 @@ iscsi_scsi_get_task_from_pdu(struct iscsi_pdu *pdu)
 	return pdu->scsi_cbdata.task;
 }
 
-int iscsi_scsi_is_task_in_outqueue(struct iscsi_context *iscsi, struct scsi_task *task)
+/*
+ * Commands are striped round robin over the connections of a session that
+ * are logged in. iscsi is the leading connection.
+ */
+struct iscsi_context *
+iscsi_stripe_connection(struct iscsi_context *iscsi)
 {
-	struct iscsi_pdu *pdu;
+	struct iscsi_context *conn, *start;
 
         iscsi_mt_spin_lock(&iscsi->iscsi_lock);
-	for (pdu = iscsi->outqueue; pdu; pdu = pdu->next) {
-		if (pdu->itt == task->itt) {
-                        iscsi_mt_spin_unlock(&iscsi->iscsi_lock);
-			return 1;
+	conn = start = iscsi->stripe_next ? iscsi->stripe_next : iscsi;
+	while (!conn->is_loggedin) {
+		conn = conn == iscsi ? iscsi->connections : conn->next_connection;
+		if (conn == NULL) {
+			conn = iscsi;
+		}
+		if (conn == start) {
+			break;
 		}
 	}
+	iscsi->stripe_next = conn == iscsi ? iscsi->connections : conn->next_connection;
         iscsi_mt_spin_unlock(&iscsi->iscsi_lock);
 
-	return 0;
+	return conn->is_loggedin ? conn : iscsi;
+}
+
+/* the connection of the session the task was queued on */
+struct iscsi_context *
+iscsi_task_connection(struct iscsi_context *iscsi, struct scsi_task *task)
+{
+	struct iscsi_context *conn;
+	int found;
+
+	if (iscsi->connections == NULL) {
+		return iscsi;
+	}
+	ISCSI_FOR_EACH_CONNECTION(iscsi, conn) {
+		iscsi_mt_spin_lock(&conn->iscsi_lock);
+		iscsi_submitted_drain(conn);
+		found = iscsi_outqueue_find(conn, task->itt) != NULL ||
+			iscsi_waitpdu_find(conn, task->itt) != NULL;
+		iscsi_mt_spin_unlock(&conn->iscsi_lock);
+		if (found) {
+			return conn;
+		}
+	}
+	return iscsi;
+}
+
+int iscsi_scsi_is_task_in_outqueue(struct iscsi_context *iscsi, struct scsi_task *task)
+{
+	int ret;
+
+	iscsi = iscsi_task_connection(iscsi, task);
+
+        iscsi_mt_spin_lock(&iscsi->iscsi_lock);
+	iscsi_submitted_drain(iscsi);
+	ret = iscsi_outqueue_find(iscsi, task->itt) != NULL;
+        iscsi_mt_spin_unlock(&iscsi->iscsi_lock);
+
+	return ret;
 }
 
 int
 iscsi_scsi_cancel_task(struct iscsi_context *iscsi,
 		       struct scsi_task *task)
 {
-	struct iscsi_pdu *pdu, *tmp;
+	struct iscsi_pdu_queue tmp = {NULL, NULL, 0};
+	struct iscsi_pdu *pdu;
 	struct iscsi_pdu *next_pdu;
 	uint32_t cmdsn_gap = 0;
 	int ret = -1;
+	int shared;
+
+	iscsi = iscsi_task_connection(iscsi, task);
+	shared = iscsi_cmdsn_shared(iscsi);
 
         iscsi_mt_spin_lock(&iscsi->iscsi_lock);
-	for (pdu = iscsi->waitpdu; pdu; pdu = pdu->next) {
-		if (pdu->itt == task->itt) {
-                        iscsi_mt_spin_unlock(&iscsi->iscsi_lock);
-			ISCSI_LIST_REMOVE(&iscsi->waitpdu, pdu);
-			if (pdu->callback) {
-				pdu->callback(iscsi, SCSI_STATUS_CANCELLED, NULL,
-				      pdu->private_data);
-			}
-			iscsi->drv->free_pdu(iscsi, pdu);
-			return 0;
+	iscsi_submitted_drain(iscsi);
+	pdu = iscsi_waitpdu_find(iscsi, task->itt);
+	if (pdu != NULL) {
+		iscsi_waitpdu_remove(iscsi, pdu);
+                iscsi_mt_spin_unlock(&iscsi->iscsi_lock);
+		if (pdu->callback) {
+			pdu->callback(iscsi, SCSI_STATUS_CANCELLED, NULL,
+			      pdu->private_data);
 		}
+		iscsi->drv->free_pdu(iscsi, pdu);
+		return 0;
 	}
-        
-        tmp = NULL;
-	for (pdu = iscsi->outqueue; pdu; pdu = next_pdu) {
+
+	/* only walk the outqueue if the command is still queued there */
+	pdu = iscsi_outqueue_find(iscsi, task->itt) ? iscsi->outqueue.head : NULL;
+	for (; pdu; pdu = next_pdu) {
 		next_pdu = pdu->next;
 
 		if (cmdsn_gap > 0) {
@@ -2714,27 +3037,31 @@ iscsi_scsi_cancel_task(struct iscsi_context *iscsi,
 		}
 
 		if (pdu->itt == task->itt) {
-			ISCSI_LIST_REMOVE(&iscsi->outqueue, pdu);
-                        ISCSI_LIST_ADD_END(&tmp, pdu);
+			iscsi_outqueue_remove(iscsi, pdu);
+                        ISCSI_QUEUE_ADD_END(&tmp, pdu);
+			/* keep the CmdSN sequence of the session intact */
+			if (shared &&
+			    (pdu->outdata.data[0] & 0x3f) == ISCSI_PDU_SCSI_REQUEST) {
+				iscsi_queue_cmdsn_filler(iscsi, pdu);
+			}
                 }
         }
         iscsi_mt_spin_unlock(&iscsi->iscsi_lock);
-	for (pdu = tmp; pdu; pdu = next_pdu) {
-		ISCSI_LIST_REMOVE(&tmp, pdu);
+	while ((pdu = tmp.head)) {
+		ISCSI_QUEUE_REMOVE(&tmp, pdu);
                 if (pdu->callback) {
                         pdu->callback(iscsi, SCSI_STATUS_CANCELLED, NULL,
 				      pdu->private_data);
                 }
                 if (!(pdu->outdata.data[0] & ISCSI_PDU_IMMEDIATE) &&
-                    (pdu->outdata.data[0] & 0x3f) != ISCSI_PDU_DATA_OUT) {
-                        iscsi_mt_spin_lock(&iscsi->iscsi_lock);
+                    (pdu->outdata.data[0] & 0x3f) != ISCSI_PDU_DATA_OUT &&
+                    !shared) {
                         iscsi->cmdsn--;
-                        iscsi_mt_spin_unlock(&iscsi->iscsi_lock);
                         cmdsn_gap++;
                 }
                 iscsi->drv->free_pdu(iscsi, pdu);
                 ret = 0;
-                if (!cmdsn_gap) {
+                if (!cmdsn_gap && !shared) {
                         break;
                 }
         }
@@ -2746,10 +3073,149 @@ iscsi_scsi_cancel_task(struct iscsi_context *iscsi,
 	return ret;
 }
 
+/*
+ * Cancel the command whose callback was given private_data. Sync callers
+ * use this to get their callback invoked when the command outlived its
+ * deadline. Returns -1 if no such command is queued.
+ */
+static int
+iscsi_cancel_conn_private_data(struct iscsi_context *iscsi,
+			       void *private_data)
+{
+	struct iscsi_pdu *pdu;
+	int i;
+
+        iscsi_mt_spin_lock(&iscsi->iscsi_lock);
+	iscsi_submitted_drain(iscsi);
+	for (i = 0; i < 2; i++) {
+		pdu = i ? iscsi->waitpdu.head : iscsi->outqueue.head;
+		for (; pdu; pdu = pdu->next) {
+			if (pdu->callback == iscsi_scsi_response_cb &&
+			    pdu->scsi_cbdata.task != NULL &&
+			    pdu->scsi_cbdata.private_data == private_data) {
+				iscsi_mt_spin_unlock(&iscsi->iscsi_lock);
+				return iscsi_scsi_cancel_task(iscsi,
+						pdu->scsi_cbdata.task);
+			}
+			/* other pdus still in the outqueue hold a CmdSN that
+			 * the ones behind them depend on, leave them to the
+			 * timeout scan */
+			if (i == 1 && pdu->callback != iscsi_scsi_response_cb &&
+			    pdu->private_data == private_data) {
+				iscsi_waitpdu_remove(iscsi, pdu);
+				iscsi_mt_spin_unlock(&iscsi->iscsi_lock);
+				if (pdu->callback) {
+					pdu->callback(iscsi, SCSI_STATUS_CANCELLED,
+						      NULL, pdu->private_data);
+				}
+				iscsi->drv->free_pdu(iscsi, pdu);
+				return 0;
+			}
+		}
+	}
+        iscsi_mt_spin_unlock(&iscsi->iscsi_lock);
+
+	return -1;
+}
+
+int
+iscsi_cancel_private_data(struct iscsi_context *iscsi, void *private_data)
+{
+	struct iscsi_context *conn;
+
+	ISCSI_FOR_EACH_CONNECTION(iscsi, conn) {
+		if (iscsi_cancel_conn_private_data(conn, private_data) == 0) {
+			return 0;
+		}
+	}
+	if (iscsi->old_iscsi) {
+		return iscsi_cancel_conn_private_data(iscsi->old_iscsi,
+						      private_data);
+	}
+
+	return -1;
+}
+
+/* what a detached command completes into */
+static void
+iscsi_detached_scsi_cb(struct iscsi_context *iscsi, int status,
+		       void *command_data, void *private_data)
+{
+	scsi_free_scsi_task(command_data);
+}
+
+static void
+iscsi_detached_cb(struct iscsi_context *iscsi, int status,
+		  void *command_data, void *private_data)
+{
+}
+
+static int
+iscsi_detach_conn_private_data(struct iscsi_context *iscsi,
+			       void *private_data)
+{
+	struct iscsi_pdu *pdu;
+	int i, count = 0;
+
+        iscsi_mt_spin_lock(&iscsi->iscsi_lock);
+	iscsi_submitted_drain(iscsi);
+	for (i = 0; i < 3; i++) {
+		pdu = i == 0 ? iscsi->outqueue.head :
+			i == 1 ? iscsi->waitpdu.head : iscsi->zc_parked.head;
+		for (; pdu; pdu = pdu->next) {
+			if (pdu->callback == iscsi_scsi_response_cb) {
+				if (pdu->scsi_cbdata.callback != NULL &&
+				    pdu->scsi_cbdata.private_data == private_data) {
+					pdu->scsi_cbdata.callback =
+						iscsi_detached_scsi_cb;
+					pdu->scsi_cbdata.private_data = NULL;
+					count++;
+				}
+			} else if (pdu->callback != NULL &&
+				   pdu->private_data == private_data) {
+				pdu->callback = iscsi_detached_cb;
+				pdu->private_data = NULL;
+				count++;
+			}
+		}
+	}
+        iscsi_mt_spin_unlock(&iscsi->iscsi_lock);
+
+	return count;
+}
+
+/*
+ * Make the commands whose callback was given private_data complete without
+ * calling it, for a sync caller that gives up on them. A SCSI task is freed
+ * once its command completes. A callback that a service thread has already
+ * picked up can still run, see iscsi_mt_service_thread_sync(). Returns the
+ * number of commands detached.
+ */
+int
+iscsi_detach_private_data(struct iscsi_context *iscsi, void *private_data)
+{
+	struct iscsi_context *conn;
+	int count = 0;
+
+	ISCSI_FOR_EACH_CONNECTION(iscsi, conn) {
+		count += iscsi_detach_conn_private_data(conn, private_data);
+	}
+	if (iscsi->old_iscsi) {
+		count += iscsi_detach_conn_private_data(iscsi->old_iscsi,
+							private_data);
+	}
+
+	return count;
+}
+
 void
 iscsi_scsi_cancel_all_tasks(struct iscsi_context *iscsi)
 {
-	iscsi_cancel_pdus(iscsi);
+	struct iscsi_context *conn;
+
+	ISCSI_FOR_EACH_CONNECTION(iscsi, conn) {
+		iscsi_cancel_pdus(conn);
+	}
 
 	if (iscsi->old_iscsi) {
 		iscsi_cancel_pdus(iscsi->old_iscsi);
@@ -335,7 +335,7 @@ iser_free_queued_pdu_tx_desc(struct iscsi_context *iscsi)
 	struct iser_pdu *iser_pdu;
 
         iscsi_mt_spin_lock(&iscsi->iscsi_lock);
-	for (pdu = iscsi->waitpdu; pdu; pdu = pdu->next) {
+	for (pdu = iscsi->waitpdu.head; pdu; pdu = pdu->next) {
 		iser_pdu = container_of(pdu, struct iser_pdu, iscsi_pdu);
 		if (iser_pdu->desc) {
 			iser_tx_desc_free(iscsi, iser_pdu->desc);
@@ -343,7 +343,7 @@ iser_free_queued_pdu_tx_desc(struct iscsi_context *iscsi)
 		}
 	}
 
-	for (pdu = iscsi->outqueue; pdu; pdu = pdu->next) {
+	for (pdu = iscsi->outqueue.head; pdu; pdu = pdu->next) {
 		iser_pdu = container_of(pdu, struct iser_pdu, iscsi_pdu);
 		if (iser_pdu->desc) {
 			iser_tx_desc_free(iscsi, iser_pdu->desc);
@@ -563,12 +563,15 @@ iscsi_iser_free_pdu(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
 		iser_pdu->desc = NULL;
 	}
 
-        iscsi_free(iscsi, pdu->outdata.data);
-	pdu->outdata.data = NULL;
+        iscsi_free(iscsi, pdu->outdata_seg.data);
+	pdu->outdata_seg.data = NULL;
 
         iscsi_free(iscsi, pdu->indata.data);
 	pdu->indata.data = NULL;
 
+	iscsi_free(iscsi, pdu->seg_digests);
+	pdu->seg_digests = NULL;
+
         iscsi_mt_spin_lock(&iscsi->iscsi_lock);
 	if (iscsi->outqueue_current == pdu) {
 		iscsi->outqueue_current = NULL;
@@ -667,7 +670,7 @@ static inline int
 get_data_size(struct iser_pdu *iser_pdu)
 {
 	if (!iser_pdu->iscsi_pdu.scsi_cbdata.task)
-		return iser_pdu->iscsi_pdu.outdata.size - ISCSI_RAW_HEADER_SIZE;
+		return iser_pdu->iscsi_pdu.outdata_seg.size;
 
 	return iser_pdu->iscsi_pdu.scsi_cbdata.task->expxferlen;
 }
@@ -690,14 +693,14 @@ iser_send_control(struct iser_conn *iser_conn, struct iser_pdu *iser_pdu) {
 		iscsi_set_error(iscsi, "Failed in iser_pdu");
 		return -1;
 	}
-	datalen = iser_pdu->iscsi_pdu.outdata.size - ISCSI_RAW_HEADER_SIZE;
+	datalen = iser_pdu->iscsi_pdu.outdata_seg.size;
 	tx_desc = iser_pdu->desc;
 	tx_desc->type = ISCSI_CONTROL;
 
 	iser_create_send_desc(iser_pdu);
 
 	if (datalen > 0) {
-		char* data = (char*)&iser_pdu->iscsi_pdu.outdata.data[ISCSI_RAW_HEADER_SIZE];
+		char* data = (char*)iser_pdu->iscsi_pdu.outdata_seg.data;
 		struct ibv_sge *tx_dsg = &tx_desc->tx_sg[1];
 
 		memcpy(tx_desc->data_buff, data, datalen);
@@ -913,7 +916,7 @@ iscsi_iser_send_pdu(struct iscsi_context *iscsi, struct iscsi_pdu *pdu) {
 
         iscsi_mt_spin_lock(&iscsi->iscsi_lock);
 	iscsi_pdu_set_expstatsn(pdu, iscsi->statsn + 1);
-	ISCSI_LIST_ADD_END(&iscsi->waitpdu, pdu);
+	iscsi_waitpdu_add(iscsi, pdu);
         iscsi_mt_spin_unlock(&iscsi->iscsi_lock);
 
 	/*
@@ -947,19 +950,22 @@ static int
 iscsi_iser_revive_queued_pdus(struct iscsi_context *iscsi) {
 	struct iscsi_pdu *pdu;
 
-	while (iscsi->outqueue) {
-		if (iscsi_serial32_compare(iscsi->outqueue->cmdsn, iscsi->maxcmdsn) > 0) {
+	while (iscsi->outqueue.head) {
+		if (iscsi_serial32_compare(iscsi->outqueue.head->cmdsn, iscsi->maxcmdsn) > 0) {
 			break;
 		}
 
                 iscsi_mt_spin_lock(&iscsi->iscsi_lock);
-		pdu = iscsi->outqueue;
-		ISCSI_LIST_REMOVE(&iscsi->outqueue, pdu);
+		pdu = iscsi->outqueue.head;
+		iscsi_outqueue_remove(iscsi, pdu);
                 iscsi_mt_spin_unlock(&iscsi->iscsi_lock);
 
 		if (iscsi_iser_send_pdu(iscsi, pdu) < 0) {
                         iscsi_mt_spin_lock(&iscsi->iscsi_lock);
-			ISCSI_LIST_ADD(&iscsi->outqueue, pdu);
+			if (pdu->flags & ISCSI_PDU_IN_WAITPDU) {
+				iscsi_waitpdu_remove(iscsi, pdu);
+			}
+			iscsi_outqueue_requeue(iscsi, pdu);
                         iscsi_mt_spin_unlock(&iscsi->iscsi_lock);
 			return -1;
 		}
@@ -992,7 +998,7 @@ iscsi_iser_queue_pdu(struct iscsi_context *iscsi, struct iscsi_pdu *pdu) {
 		return;
 	}
 
-	if (iscsi->outqueue ||
+	if (iscsi->outqueue.head ||
 		(iscsi_serial32_compare(pdu->cmdsn, iscsi->maxcmdsn) > 0
 		 && !(pdu->outdata.data[0] & ISCSI_PDU_IMMEDIATE))) {
 		iscsi_add_to_outqueue(iscsi, pdu);
@@ -1322,10 +1328,7 @@ iser_rcv_completion(struct iser_rx_desc *rx_desc,
 		goto no_waitpdu;
 
         iscsi_mt_spin_lock(&iscsi->iscsi_lock);
-	for (iscsi_pdu = iscsi->waitpdu ; iscsi_pdu ; iscsi_pdu = iscsi_pdu->next) {
-		if(iscsi_pdu->itt == itt)
-			break;
-	}
+	iscsi_pdu = iscsi_waitpdu_find(iscsi, itt);
         iscsi_mt_spin_unlock(&iscsi->iscsi_lock);
 
 	iser_pdu = container_of(iscsi_pdu, struct iser_pdu, iscsi_pdu);
@@ -143,8 +143,11 @@ iscsi_login_add_sessiontype(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
 {
 	char str[MAX_STRING_SIZE+1];
 
-	/* We only send SessionType during opneg or the first leg of secneg */
-	if (iscsi->secneg_phase != ISCSI_LOGIN_SECNEG_PHASE_OFFER_CHAP) {
+	/* We only send SessionType during opneg or the first leg of secneg,
+	 * and only on the leading connection of a session
+	 */
+	if (iscsi->secneg_phase != ISCSI_LOGIN_SECNEG_PHASE_OFFER_CHAP
+	    || iscsi->leader != NULL) {
 		return 0;
 	}
 
@@ -249,7 +252,8 @@ iscsi_login_add_initialr2t(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
 	char str[MAX_STRING_SIZE+1];
 
 	/* We only send InitialR2T during opneg */
-	if (iscsi->current_phase != ISCSI_PDU_LOGIN_CSG_OPNEG) {
+	if (iscsi->current_phase != ISCSI_PDU_LOGIN_CSG_OPNEG
+	    || iscsi->leader != NULL) {
 		return 0;
 	}
 
@@ -274,7 +278,8 @@ iscsi_login_add_immediatedata(struct iscsi_context *iscsi, struct iscsi_pdu *pdu
 	char str[MAX_STRING_SIZE+1];
 
 	/* We only send ImmediateData during opneg */
-	if (iscsi->current_phase != ISCSI_PDU_LOGIN_CSG_OPNEG) {
+	if (iscsi->current_phase != ISCSI_PDU_LOGIN_CSG_OPNEG
+	    || iscsi->leader != NULL) {
 		return 0;
 	}
 
@@ -299,7 +304,8 @@ iscsi_login_add_maxburstlength(struct iscsi_context *iscsi, struct iscsi_pdu *pd
 	char str[MAX_STRING_SIZE+1];
 
 	/* We only send MaxBurstLength during opneg */
-	if (iscsi->current_phase != ISCSI_PDU_LOGIN_CSG_OPNEG) {
+	if (iscsi->current_phase != ISCSI_PDU_LOGIN_CSG_OPNEG
+	    || iscsi->leader != NULL) {
 		return 0;
 	}
 
@@ -322,7 +328,8 @@ iscsi_login_add_firstburstlength(struct iscsi_context *iscsi, struct iscsi_pdu *
 	char str[MAX_STRING_SIZE+1];
 
 	/* We only send FirstBurstLength during opneg */
-	if (iscsi->current_phase != ISCSI_PDU_LOGIN_CSG_OPNEG) {
+	if (iscsi->current_phase != ISCSI_PDU_LOGIN_CSG_OPNEG
+	    || iscsi->leader != NULL) {
 		return 0;
 	}
 
@@ -368,7 +375,8 @@ iscsi_login_add_datapduinorder(struct iscsi_context *iscsi, struct iscsi_pdu *pd
 	char str[MAX_STRING_SIZE+1];
 
 	/* We only send DataPduInOrder during opneg */
-	if (iscsi->current_phase != ISCSI_PDU_LOGIN_CSG_OPNEG) {
+	if (iscsi->current_phase != ISCSI_PDU_LOGIN_CSG_OPNEG
+	    || iscsi->leader != NULL) {
 		return 0;
 	}
 
@@ -388,7 +396,8 @@ iscsi_login_add_defaulttime2wait(struct iscsi_context *iscsi, struct iscsi_pdu *
 	char str[MAX_STRING_SIZE+1];
 
 	/* We only send DefaultTime2Wait during opneg */
-	if (iscsi->current_phase != ISCSI_PDU_LOGIN_CSG_OPNEG) {
+	if (iscsi->current_phase != ISCSI_PDU_LOGIN_CSG_OPNEG
+	    || iscsi->leader != NULL) {
 		return 0;
 	}
 
@@ -408,7 +417,8 @@ iscsi_login_add_defaulttime2retain(struct iscsi_context *iscsi, struct iscsi_pdu
 	char str[MAX_STRING_SIZE+1];
 
 	/* We only send DefaultTime2Retain during opneg */
-	if (iscsi->current_phase != ISCSI_PDU_LOGIN_CSG_OPNEG) {
+	if (iscsi->current_phase != ISCSI_PDU_LOGIN_CSG_OPNEG
+	    || iscsi->leader != NULL) {
 		return 0;
 	}
 
@@ -467,12 +477,16 @@ iscsi_login_add_maxconnections(struct iscsi_context *iscsi, struct iscsi_pdu *pd
 {
 	char str[MAX_STRING_SIZE+1];
 
-	/* We only send MaxConnections during opneg */
-	if (iscsi->current_phase != ISCSI_PDU_LOGIN_CSG_OPNEG) {
+	/* We only send MaxConnections during opneg of the leading connection */
+	if (iscsi->current_phase != ISCSI_PDU_LOGIN_CSG_OPNEG
+	    || iscsi->leader != NULL) {
 		return 0;
 	}
 
-	strncpy(str,"MaxConnections=1",MAX_STRING_SIZE);
+	if (snprintf(str, MAX_STRING_SIZE, "MaxConnections=%u", iscsi->want_max_connections) == -1) {
+		iscsi_set_error(iscsi, "Out-of-memory: aprintf failed.");
+		return -1;
+	}
 	if (iscsi_pdu_add_data(iscsi, pdu, (unsigned char *)str, strlen(str)+1)
 	    != 0) {
 		iscsi_set_error(iscsi, "Out-of-memory: pdu add data failed.");
@@ -488,11 +502,16 @@ iscsi_login_add_maxoutstandingr2t(struct iscsi_context *iscsi, struct iscsi_pdu
 	char str[MAX_STRING_SIZE+1];
 
 	/* We only send MaxOutstandingR2T during opneg */
-	if (iscsi->current_phase != ISCSI_PDU_LOGIN_CSG_OPNEG) {
+	if (iscsi->current_phase != ISCSI_PDU_LOGIN_CSG_OPNEG
+	    || iscsi->leader != NULL) {
 		return 0;
 	}
 
-	strncpy(str,"MaxOutstandingR2T=1",MAX_STRING_SIZE);
+	if (snprintf(str, MAX_STRING_SIZE, "MaxOutstandingR2T=%u", iscsi->want_max_outstanding_r2t) == -1) {
+		iscsi_set_error(iscsi, "Out-of-memory: aprintf failed.");
+		return -1;
+	}
+
 	if (iscsi_pdu_add_data(iscsi, pdu, (unsigned char *)str, strlen(str)+1)
 	    != 0) {
 		iscsi_set_error(iscsi, "Out-of-memory: pdu add data failed.");
@@ -508,7 +527,8 @@ iscsi_login_add_errorrecoverylevel(struct iscsi_context *iscsi, struct iscsi_pdu
 	char str[MAX_STRING_SIZE+1];
 
 	/* We only send ErrorRecoveryLevel during opneg */
-	if (iscsi->current_phase != ISCSI_PDU_LOGIN_CSG_OPNEG) {
+	if (iscsi->current_phase != ISCSI_PDU_LOGIN_CSG_OPNEG
+	    || iscsi->leader != NULL) {
 		return 0;
 	}
 
@@ -528,7 +548,8 @@ iscsi_login_add_datasequenceinorder(struct iscsi_context *iscsi, struct iscsi_pd
 	char str[MAX_STRING_SIZE+1];
 
 	/* We only send DataSequenceInOrder during opneg */
-	if (iscsi->current_phase != ISCSI_PDU_LOGIN_CSG_OPNEG) {
+	if (iscsi->current_phase != ISCSI_PDU_LOGIN_CSG_OPNEG
+	    || iscsi->leader != NULL) {
 		return 0;
 	}
 
@@ -618,7 +639,8 @@ iscsi_login_add_rdma_extensions(struct iscsi_context *iscsi, struct iscsi_pdu *p
 	char str[MAX_STRING_SIZE+1];
 
 	/* We only send DataSequenceInOrder during opneg */
-	if (iscsi->current_phase != ISCSI_PDU_LOGIN_CSG_OPNEG) {
+	if (iscsi->current_phase != ISCSI_PDU_LOGIN_CSG_OPNEG
+	    || iscsi->leader != NULL) {
 		return 0;
 	}
 	/* RDMAExtensions is only valid for iSER transport */
@@ -1023,8 +1045,11 @@ iscsi_login_async(struct iscsi_context *iscsi, iscsi_command_cb cb,
 		return -1;
 	}
 
-	/* randomize cmdsn and itt */
-	if (!iscsi->current_phase && !iscsi->secneg_phase) {
+	/* randomize cmdsn and itt, a connection that joins a session takes
+	 * them from the session instead
+	 */
+	if (!iscsi->current_phase && !iscsi->secneg_phase
+	    && iscsi->leader == NULL) {
 		iscsi->itt = (uint32_t) rand();
 		iscsi->cmdsn = (uint32_t) rand();
 		iscsi->expcmdsn = iscsi->maxcmdsn = iscsi->min_cmdsn_waiting = iscsi->cmdsn;
@@ -1045,7 +1070,15 @@ iscsi_login_async(struct iscsi_context *iscsi, iscsi_command_cb cb,
 	iscsi_pdu_set_immediate(pdu);
 
 	/* cmdsn is not increased if Immediate delivery*/
-	iscsi_pdu_set_cmdsn(pdu, iscsi->cmdsn);
+	iscsi_pdu_set_cmdsn(pdu, ISCSI_SESSION(iscsi)->cmdsn);
+
+	/* a connection that joins a session logs in with its TSIH and
+	 * its own CID
+	 */
+	if (iscsi->leader != NULL) {
+		scsi_set_uint16(&pdu->outdata.data[14], iscsi->leader->tsih);
+		scsi_set_uint16(&pdu->outdata.data[20], iscsi->cid);
+	}
 
 	if (!iscsi->user[0]) {
 		iscsi->current_phase = ISCSI_PDU_LOGIN_CSG_OPNEG;
@@ -1385,6 +1418,22 @@ iscsi_process_login_reply(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
 			}
 		}
 
+		if (!strncmp(ptr, "MaxOutstandingR2T=", 18)) {
+			iscsi->max_outstanding_r2t = MIN(strtoul(ptr + 18, NULL, 10),
+							 iscsi->want_max_outstanding_r2t);
+			if (iscsi->max_outstanding_r2t == 0) {
+				iscsi->max_outstanding_r2t = 1;
+			}
+		}
+
+		if (!strncmp(ptr, "MaxConnections=", 15)) {
+			iscsi->max_connections = MIN(strtoul(ptr + 15, NULL, 10),
+						     iscsi->want_max_connections);
+			if (iscsi->max_connections == 0) {
+				iscsi->max_connections = 1;
+			}
+		}
+
 		if (!strncmp(ptr, "MaxBurstLength=", 15)) {
 			iscsi->max_burst_length = strtol(ptr + 15, NULL, 10);
 		}
@@ -1546,6 +1595,9 @@ iscsi_process_login_reply(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
 	if ((in->hdr[1] & ISCSI_PDU_LOGIN_TRANSIT)
 	&& (in->hdr[1] & ISCSI_PDU_LOGIN_NSG_FF) == ISCSI_PDU_LOGIN_NSG_FF) {
 		iscsi->is_loggedin = 1;
+		if (iscsi->leader == NULL) {
+			iscsi->tsih = scsi_get_uint16(&in->hdr[14]);
+		}
 		iscsi_itt_post_increment(iscsi);
 		iscsi->header_digest  = iscsi->want_header_digest;
 		iscsi->data_digest  = iscsi->want_data_digest;
@@ -1594,7 +1646,7 @@ iscsi_logout_async(struct iscsi_context *iscsi, iscsi_command_cb cb,
 	iscsi_pdu_set_pduflags(pdu, 0x80);
 
 	/* cmdsn is not increased if Immediate delivery*/
-	iscsi_pdu_set_cmdsn(pdu, iscsi->cmdsn);
+	iscsi_pdu_set_cmdsn(pdu, ISCSI_SESSION(iscsi)->cmdsn);
 
 	pdu->callback     = cb;
 	pdu->private_data = private_data;
@@ -1608,7 +1660,17 @@ int
 iscsi_process_logout_reply(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
 struct iscsi_in_pdu *in)
 {
+	struct iscsi_context *conn;
+
 	iscsi->is_loggedin = 0;
+	/* closing the session closed all its other connections too */
+	for (conn = iscsi->connections; conn; conn = conn->next_connection) {
+		if (conn->is_loggedin) {
+			conn->is_loggedin = 0;
+			iscsi_disconnect(conn);
+			iscsi_cancel_pdus(conn);
+		}
+	}
 	ISCSI_LOG(iscsi, 2, "logout successful");
 	if (pdu->callback) {
 		pdu->callback(iscsi, SCSI_STATUS_GOOD, NULL, pdu->private_data);
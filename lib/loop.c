@@ -0,0 +1,683 @@
+/*
+   Copyright (C) 2026 by the libiscsi authors
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * Event loop for many contexts. Every context of the loop has a slot
+ * that remembers the fd and the events it is registered with and when
+ * its next timer is due. Anything that may change them, queuing a pdu,
+ * servicing the context or replacing its socket, puts the slot on the
+ * dirty list, and only the slots on that list are looked at again
+ * before the loop waits. The timers of all slots are kept in a heap.
+ *
+ * iscsi_service() does not always read a socket until it would block,
+ * so the fds are registered level triggered.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_POLL_H
+#include <poll.h>
+#endif
+
+#if defined(_WIN32)
+#include <winsock2.h>
+#include "win32/win32_compat.h"
+#endif
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+#include "iscsi.h"
+#include "iscsi-private.h"
+#include "scsi-lowlevel.h"
+#include "utils.h"
+
+/* the most events taken from the kernel per iscsi_loop_run() */
+#define ISCSI_LOOP_EVENTS (256)
+/* how often a reconnect that is overdue is looked at */
+#define ISCSI_LOOP_RECONNECT_MS (100)
+
+struct iscsi_loop_slot {
+	struct iscsi_context *iscsi;    /* NULL if the slot is free */
+	uint32_t gen;                   /* bumped every time it is freed */
+	int fd;                         /* registered fd, or -1 */
+	int events;                     /* registered POLLIN/POLLOUT */
+	int queued;                     /* on the dirty list */
+	int timer_slot;                 /* in the timer heap, 0 if not */
+	uint64_t deadline;
+	int next_free;
+};
+
+struct iscsi_loop {
+	int epfd;
+	struct iscsi_loop_slot *slots;
+	int size;
+	int used;                       /* slots handed out so far */
+	int free;                       /* first free slot, or -1 */
+	int *dirty;
+	int ndirty;
+	int *timer_heap;                /* 1 based */
+	int timer_heap_len;
+	iscsi_loop_error_cb error_cb;
+	void *error_data;
+#ifdef HAVE_SYS_EPOLL_H
+	struct epoll_event events[ISCSI_LOOP_EVENTS];
+#else
+	struct pollfd *pfd;
+	uint64_t *pfd_key;
+#endif
+};
+
+/* events and timers can still be reported for a slot that has been
+ * freed and handed out again, the generation tells them apart */
+static uint64_t
+iscsi_loop_key(struct iscsi_loop *loop, int slot)
+{
+	return (uint64_t)loop->slots[slot].gen << 32 | (uint32_t)slot;
+}
+
+static struct iscsi_loop_slot *
+iscsi_loop_lookup(struct iscsi_loop *loop, uint64_t key)
+{
+	struct iscsi_loop_slot *s = &loop->slots[(uint32_t)key];
+
+	if (s->iscsi == NULL || s->gen != (uint32_t)(key >> 32)) {
+		return NULL;
+	}
+	return s;
+}
+
+static void
+iscsi_loop_timer_set(struct iscsi_loop *loop, int heap_slot, int slot)
+{
+	loop->timer_heap[heap_slot] = slot;
+	loop->slots[slot].timer_slot = heap_slot;
+}
+
+static uint64_t
+iscsi_loop_timer_deadline(struct iscsi_loop *loop, int heap_slot)
+{
+	return loop->slots[loop->timer_heap[heap_slot]].deadline;
+}
+
+static void
+iscsi_loop_timer_up(struct iscsi_loop *loop, int heap_slot)
+{
+	int slot = loop->timer_heap[heap_slot];
+
+	while (heap_slot > 1 && iscsi_loop_timer_deadline(loop, heap_slot / 2) >
+	       loop->slots[slot].deadline) {
+		iscsi_loop_timer_set(loop, heap_slot,
+				     loop->timer_heap[heap_slot / 2]);
+		heap_slot /= 2;
+	}
+	iscsi_loop_timer_set(loop, heap_slot, slot);
+}
+
+static void
+iscsi_loop_timer_down(struct iscsi_loop *loop, int heap_slot)
+{
+	int slot = loop->timer_heap[heap_slot];
+	int child;
+
+	while ((child = heap_slot * 2) <= loop->timer_heap_len) {
+		if (child < loop->timer_heap_len &&
+		    iscsi_loop_timer_deadline(loop, child + 1) <
+		    iscsi_loop_timer_deadline(loop, child)) {
+			child++;
+		}
+		if (loop->slots[slot].deadline <=
+		    iscsi_loop_timer_deadline(loop, child)) {
+			break;
+		}
+		iscsi_loop_timer_set(loop, heap_slot, loop->timer_heap[child]);
+		heap_slot = child;
+	}
+	iscsi_loop_timer_set(loop, heap_slot, slot);
+}
+
+/* arm the timer of a slot for deadline, or disarm it if that is 0 */
+static void
+iscsi_loop_timer(struct iscsi_loop *loop, int slot, uint64_t deadline)
+{
+	struct iscsi_loop_slot *s = &loop->slots[slot];
+	int heap_slot = s->timer_slot, last;
+
+	if (deadline == s->deadline && (heap_slot || deadline == 0)) {
+		return;
+	}
+	s->deadline = deadline;
+	if (heap_slot == 0) {
+		if (deadline) {
+			loop->timer_heap[++loop->timer_heap_len] = slot;
+			iscsi_loop_timer_up(loop, loop->timer_heap_len);
+		}
+		return;
+	}
+	if (deadline == 0) {
+		s->timer_slot = 0;
+		last = loop->timer_heap[loop->timer_heap_len--];
+		if (last == slot) {
+			return;
+		}
+		iscsi_loop_timer_set(loop, heap_slot, last);
+	}
+	if (heap_slot > 1 && iscsi_loop_timer_deadline(loop, heap_slot / 2) >
+	    iscsi_loop_timer_deadline(loop, heap_slot)) {
+		iscsi_loop_timer_up(loop, heap_slot);
+	} else {
+		iscsi_loop_timer_down(loop, heap_slot);
+	}
+}
+
+/* register the fd of a slot for events, or unregister it if there are
+ * none */
+static int
+iscsi_loop_watch(struct iscsi_loop *loop, int slot, int fd, int events)
+{
+	struct iscsi_loop_slot *s = &loop->slots[slot];
+#ifdef HAVE_SYS_EPOLL_H
+	struct epoll_event ev;
+	int op;
+#endif
+
+	if (fd < 0) {
+		events = 0;
+	}
+	if (fd == s->fd && events == s->events) {
+		return 0;
+	}
+#ifdef HAVE_SYS_EPOLL_H
+	if (s->fd >= 0 && (fd != s->fd || events == 0)) {
+		epoll_ctl(loop->epfd, EPOLL_CTL_DEL, s->fd, NULL);
+		s->fd = -1;
+		s->events = 0;
+	}
+	if (events == 0) {
+		return 0;
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = (events & POLLIN ? EPOLLIN : 0) |
+		(events & POLLOUT ? EPOLLOUT : 0);
+	ev.data.u64 = iscsi_loop_key(loop, slot);
+	op = s->fd == fd ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+	if (epoll_ctl(loop->epfd, op, fd, &ev) != 0) {
+		/* the socket was replaced behind our back */
+		if (errno == EEXIST) {
+			op = EPOLL_CTL_MOD;
+		} else if (errno == ENOENT) {
+			op = EPOLL_CTL_ADD;
+		} else {
+			op = -1;
+		}
+		if (op == -1 || epoll_ctl(loop->epfd, op, fd, &ev) != 0) {
+			iscsi_set_error(s->iscsi, "Failed to watch fd %d: %s",
+					fd, strerror(errno));
+			s->fd = -1;
+			s->events = 0;
+			return -1;
+		}
+	}
+#endif
+	s->fd = events ? fd : -1;
+	s->events = events;
+	return 0;
+}
+
+/* when the next pdu of the context times out, or the next reconnect is
+ * due. Neither happens while there is no socket to service */
+static uint64_t
+iscsi_loop_deadline(struct iscsi_context *iscsi, int fd)
+{
+	uint64_t now = iscsi_clock_ms(), deadline = 0;
+	time_t t;
+	int ms;
+
+	if (fd < 0) {
+		return 0;
+	}
+	ms = iscsi_next_timeout(iscsi);
+	if (ms >= 0) {
+		deadline = now + ms;
+	}
+	if (iscsi->pending_reconnect) {
+		/* a reconnect that is due but did not happen, because the
+		 * context has no socket of its own yet, is retried later */
+		t = time(NULL);
+		ms = iscsi->next_reconnect > t ?
+			(iscsi->next_reconnect - t) * 1000 :
+			ISCSI_LOOP_RECONNECT_MS;
+		if (deadline == 0 || now + ms < deadline) {
+			deadline = now + ms;
+		}
+	}
+	return deadline;
+}
+
+static void
+iscsi_loop_fail(struct iscsi_loop *loop, struct iscsi_context *iscsi)
+{
+	struct iscsi_context *session = ISCSI_SESSION(iscsi);
+
+	if (session->loop != loop) {
+		return;
+	}
+	ISCSI_LOG(session, 1, "removing the session from the event loop: %s",
+		  iscsi_get_error(iscsi));
+	iscsi_loop_remove(loop, session);
+	if (loop->error_cb) {
+		loop->error_cb(loop, session, loop->error_data);
+	}
+}
+
+static int
+iscsi_loop_service(struct iscsi_loop *loop, int slot, int revents)
+{
+	struct iscsi_context *iscsi = loop->slots[slot].iscsi;
+
+	if (iscsi_service(iscsi, revents) < 0) {
+		iscsi_loop_fail(loop, iscsi);
+	}
+	return 1;
+}
+
+/* look at the events and timers of the slots that changed */
+static void
+iscsi_loop_flush(struct iscsi_loop *loop)
+{
+	struct iscsi_loop_slot *s;
+	struct iscsi_context *iscsi;
+	int slot, fd;
+
+	while (loop->ndirty > 0) {
+		slot = loop->dirty[--loop->ndirty];
+		s = &loop->slots[slot];
+		s->queued = 0;
+		iscsi = s->iscsi;
+		if (iscsi == NULL) {
+			continue;
+		}
+		/* another connection of the session failed, this puts the
+		 * slot back on the list */
+		if (iscsi->connection_failed) {
+			iscsi_loop_service(loop, slot, 0);
+			continue;
+		}
+
+		fd = iscsi_get_fd(iscsi);
+		if (iscsi_loop_watch(loop, slot, fd,
+				     fd < 0 ? 0 : iscsi_which_events(iscsi))) {
+			iscsi_loop_fail(loop, iscsi);
+			continue;
+		}
+		iscsi_loop_timer(loop, slot, iscsi_loop_deadline(iscsi, fd));
+	}
+}
+
+static int
+iscsi_loop_grow(struct iscsi_loop *loop)
+{
+	struct iscsi_loop_slot *slots;
+	int size = loop->size ? loop->size * 2 : 64;
+	int *dirty, *heap, i;
+#ifndef HAVE_SYS_EPOLL_H
+	struct pollfd *pfd;
+	uint64_t *pfd_key;
+#endif
+
+	slots = realloc(loop->slots, size * sizeof(*slots));
+	if (slots == NULL) {
+		return -1;
+	}
+	loop->slots = slots;
+	dirty = realloc(loop->dirty, size * sizeof(*dirty));
+	if (dirty == NULL) {
+		return -1;
+	}
+	loop->dirty = dirty;
+	heap = realloc(loop->timer_heap, (size + 1) * sizeof(*heap));
+	if (heap == NULL) {
+		return -1;
+	}
+	loop->timer_heap = heap;
+#ifndef HAVE_SYS_EPOLL_H
+	pfd = realloc(loop->pfd, size * sizeof(*pfd));
+	if (pfd == NULL) {
+		return -1;
+	}
+	loop->pfd = pfd;
+	pfd_key = realloc(loop->pfd_key, size * sizeof(*pfd_key));
+	if (pfd_key == NULL) {
+		return -1;
+	}
+	loop->pfd_key = pfd_key;
+#endif
+
+	/* the new slots go on the free list in order */
+	for (i = size - 1; i >= loop->size; i--) {
+		memset(&slots[i], 0, sizeof(slots[i]));
+		slots[i].fd = -1;
+		slots[i].next_free = loop->free;
+		loop->free = i;
+	}
+	loop->size = size;
+	return 0;
+}
+
+void
+iscsi_loop_touch(struct iscsi_context *iscsi)
+{
+	struct iscsi_loop *loop = iscsi->loop;
+	struct iscsi_loop_slot *s = &loop->slots[iscsi->loop_slot];
+
+	if (!s->queued) {
+		s->queued = 1;
+		loop->dirty[loop->ndirty++] = iscsi->loop_slot;
+	}
+}
+
+void
+iscsi_loop_reset_fd(struct iscsi_context *iscsi)
+{
+	/* the fd may already refer to a new socket, the old one is gone
+	 * from the epoll set then */
+	iscsi_loop_watch(iscsi->loop, iscsi->loop_slot, -1, 0);
+	iscsi_loop_touch(iscsi);
+}
+
+int
+iscsi_loop_attach(struct iscsi_loop *loop, struct iscsi_context *iscsi)
+{
+	struct iscsi_loop_slot *s;
+	int slot;
+
+	if (loop->free < 0 && iscsi_loop_grow(loop) != 0) {
+		iscsi_set_error(iscsi, "Out-of-memory: failed to grow the "
+				"event loop");
+		return -1;
+	}
+	slot = loop->free;
+	s = &loop->slots[slot];
+	loop->free = s->next_free;
+	if (slot >= loop->used) {
+		loop->used = slot + 1;
+	}
+
+	s->iscsi = iscsi;
+	s->fd = -1;
+	s->events = 0;
+	s->deadline = 0;
+	iscsi->loop = loop;
+	iscsi->loop_slot = slot;
+	iscsi_loop_touch(iscsi);
+	return 0;
+}
+
+void
+iscsi_loop_detach(struct iscsi_context *iscsi)
+{
+	struct iscsi_loop *loop = iscsi->loop;
+	int slot = iscsi->loop_slot;
+	struct iscsi_loop_slot *s = &loop->slots[slot];
+
+	iscsi_loop_watch(loop, slot, -1, 0);
+	iscsi_loop_timer(loop, slot, 0);
+	/* a slot that is still on the dirty list stays there and is
+	 * skipped, or looked at for the next context that gets it */
+	s->iscsi = NULL;
+	s->gen++;
+	s->next_free = loop->free;
+	loop->free = slot;
+	iscsi->loop = NULL;
+}
+
+struct iscsi_loop *
+iscsi_create_loop(void)
+{
+	struct iscsi_loop *loop;
+
+	loop = calloc(1, sizeof(struct iscsi_loop));
+	if (loop == NULL) {
+		return NULL;
+	}
+	loop->free = -1;
+#ifdef HAVE_SYS_EPOLL_H
+	loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (loop->epfd == -1) {
+		free(loop);
+		return NULL;
+	}
+#else
+	loop->epfd = -1;
+#endif
+	if (iscsi_loop_grow(loop) != 0) {
+		iscsi_destroy_loop(loop);
+		return NULL;
+	}
+	return loop;
+}
+
+void
+iscsi_destroy_loop(struct iscsi_loop *loop)
+{
+	int slot;
+
+	if (loop == NULL) {
+		return;
+	}
+	for (slot = 0; slot < loop->used; slot++) {
+		if (loop->slots[slot].iscsi) {
+			iscsi_loop_detach(loop->slots[slot].iscsi);
+		}
+	}
+	if (loop->epfd != -1) {
+		close(loop->epfd);
+	}
+	free(loop->slots);
+	free(loop->dirty);
+	free(loop->timer_heap);
+#ifndef HAVE_SYS_EPOLL_H
+	free(loop->pfd);
+	free(loop->pfd_key);
+#endif
+	free(loop);
+}
+
+void
+iscsi_loop_set_error_cb(struct iscsi_loop *loop, iscsi_loop_error_cb cb,
+			void *private_data)
+{
+	loop->error_cb = cb;
+	loop->error_data = private_data;
+}
+
+int
+iscsi_loop_add(struct iscsi_loop *loop, struct iscsi_context *iscsi)
+{
+	struct iscsi_context *conn;
+
+	if (iscsi->leader != NULL) {
+		iscsi_set_error(iscsi, "Only the leading connection of a "
+				"session can be added to an event loop.");
+		return -1;
+	}
+	if (iscsi->loop != NULL) {
+		iscsi_set_error(iscsi, "The context is already part of an "
+				"event loop.");
+		return -1;
+	}
+#ifdef HAVE_MULTITHREADING
+	if (iscsi->multithreading_enabled) {
+		iscsi_set_error(iscsi, "A context with a service thread can "
+				"not be added to an event loop.");
+		return -1;
+	}
+#endif
+
+	ISCSI_FOR_EACH_CONNECTION(iscsi, conn) {
+		if (iscsi_loop_attach(loop, conn) != 0) {
+			if (conn != iscsi) {
+				iscsi_set_error(iscsi, "%s",
+						iscsi_get_error(conn));
+			}
+			iscsi_loop_remove(loop, iscsi);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int
+iscsi_loop_remove(struct iscsi_loop *loop, struct iscsi_context *iscsi)
+{
+	struct iscsi_context *conn;
+
+	if (iscsi->loop != loop || iscsi->leader != NULL) {
+		return -1;
+	}
+	ISCSI_FOR_EACH_CONNECTION(iscsi, conn) {
+		if (conn->loop == loop) {
+			iscsi_loop_detach(conn);
+		}
+	}
+	return 0;
+}
+
+static int
+iscsi_loop_timeout(struct iscsi_loop *loop)
+{
+	uint64_t now, deadline;
+
+	if (loop->timer_heap_len == 0) {
+		return -1;
+	}
+	now = iscsi_clock_ms();
+	deadline = iscsi_loop_timer_deadline(loop, 1);
+	if (deadline <= now) {
+		return 0;
+	}
+	if (deadline - now > INT_MAX) {
+		return INT_MAX;
+	}
+	return deadline - now;
+}
+
+int
+iscsi_loop_next_timeout(struct iscsi_loop *loop)
+{
+	iscsi_loop_flush(loop);
+	return iscsi_loop_timeout(loop);
+}
+
+int
+iscsi_loop_get_fd(struct iscsi_loop *loop)
+{
+	return loop->epfd;
+}
+
+int
+iscsi_loop_run(struct iscsi_loop *loop, int timeout_ms)
+{
+	struct iscsi_loop_slot *s;
+	uint64_t now;
+	int timeout, slot, serviced = 0, n, i;
+#ifdef HAVE_SYS_EPOLL_H
+	int revents;
+#else
+	int npfd;
+#endif
+
+	/* commands queued since the last run */
+	iscsi_loop_flush(loop);
+
+	timeout = iscsi_loop_timeout(loop);
+	if (timeout < 0 || (timeout_ms >= 0 && timeout_ms < timeout)) {
+		timeout = timeout_ms;
+	}
+
+#ifdef HAVE_SYS_EPOLL_H
+	n = epoll_wait(loop->epfd, loop->events, ISCSI_LOOP_EVENTS, timeout);
+	if (n < 0 && errno != EINTR) {
+		return -1;
+	}
+	for (i = 0; i < n; i++) {
+		s = iscsi_loop_lookup(loop, loop->events[i].data.u64);
+		if (s == NULL) {
+			continue;
+		}
+		revents = loop->events[i].events;
+		revents = (revents & EPOLLIN ? POLLIN : 0) |
+			(revents & EPOLLOUT ? POLLOUT : 0) |
+			(revents & EPOLLERR ? POLLERR : 0) |
+			(revents & EPOLLHUP ? POLLHUP : 0);
+		serviced += iscsi_loop_service(loop, s - loop->slots, revents);
+	}
+#else
+	npfd = 0;
+	for (slot = 0; slot < loop->used; slot++) {
+		s = &loop->slots[slot];
+		if (s->iscsi == NULL || s->fd < 0) {
+			continue;
+		}
+		loop->pfd[npfd].fd = s->fd;
+		loop->pfd[npfd].events = s->events;
+		loop->pfd[npfd].revents = 0;
+		loop->pfd_key[npfd++] = iscsi_loop_key(loop, slot);
+	}
+	n = poll(loop->pfd, npfd, timeout);
+	if (n < 0 && errno != EINTR) {
+		return -1;
+	}
+	for (i = 0; n > 0 && i < npfd; i++) {
+		if (loop->pfd[i].revents == 0) {
+			continue;
+		}
+		n--;
+		s = iscsi_loop_lookup(loop, loop->pfd_key[i]);
+		if (s == NULL) {
+			continue;
+		}
+		serviced += iscsi_loop_service(loop, s - loop->slots,
+					       loop->pfd[i].revents);
+	}
+#endif
+
+	/* the commands that timed out and the reconnects that are due.
+	 * A timer is rearmed by the flush after servicing the slot. */
+	now = iscsi_clock_ms();
+	while (loop->timer_heap_len > 0 &&
+	       iscsi_loop_timer_deadline(loop, 1) <= now) {
+		slot = loop->timer_heap[1];
+		iscsi_loop_timer(loop, slot, 0);
+		serviced += iscsi_loop_service(loop, slot, 0);
+	}
+
+	/* and what servicing changed */
+	iscsi_loop_flush(loop);
+	return serviced;
+}
@@ -50,6 +50,26 @@ iscsi_tid_t iscsi_mt_get_tid(void)
 {
     return GetCurrentThreadId();
 }
+
+int iscsi_mt_get_cpu(void)
+{
+    return GetCurrentProcessorNumber();
+}
+
+static int iscsi_mt_set_affinity(struct iscsi_context* iscsi)
+{
+    if (iscsi->service_cpu < 0) {
+        return 0;
+    }
+    if (iscsi->service_cpu >= (int)(sizeof(DWORD_PTR) * 8) ||
+        SetThreadAffinityMask(iscsi->iscsii->service_thread,
+                              (DWORD_PTR)1 << iscsi->service_cpu) == 0) {
+        iscsi_set_error(iscsi, "Failed to bind service thread to CPU %d",
+                        iscsi->service_cpu);
+        return -1;
+    }
+    return 0;
+}
 static void* iscsi_mt_service_thread(void* arg)
 {
     struct iscsi_context* iscsi = (struct iscsi_context*)arg;
@@ -76,6 +96,8 @@ static void* iscsi_mt_service_thread(void* arg)
             if (revents != -1)
                 iscsi_set_error(iscsi, "iscsi_service failed");
         }
+        /* only we write it, release what the callbacks did */
+        ATOMIC_STORE(iscsi, iscsi->service_gen, iscsi->service_gen + 1);
     }
     return NULL;
 }
@@ -104,6 +126,10 @@ int iscsi_mt_service_thread_start(struct iscsi_context* iscsi)
     while (iscsi->multithreading_enabled == 0) {
         Sleep(100);
     }
+    if (iscsi_mt_set_affinity(iscsi) != 0) {
+        iscsi_mt_service_thread_stop(iscsi);
+        return -1;
+    }
     return 0;
 }
 
@@ -113,6 +139,24 @@ void iscsi_mt_service_thread_stop(struct iscsi_context* iscsi)
     while (WaitForSingleObject(iscsi->iscsii->service_thread, INFINITE) != WAIT_OBJECT_0);
 }
 
+void iscsi_mt_service_thread_sync(struct iscsi_context* iscsi)
+{
+    struct iscsi_context* conn;
+    int gen;
+
+    ISCSI_FOR_EACH_CONNECTION(iscsi, conn) {
+        if (!conn->multithreading_enabled ||
+            GetThreadId(conn->iscsii->service_thread) == GetCurrentThreadId()) {
+            continue;
+        }
+        gen = ATOMIC_LOAD(conn, conn->service_gen);
+        while (conn->multithreading_enabled &&
+               ATOMIC_LOAD(conn, conn->service_gen) == gen) {
+            Sleep(1);
+        }
+    }
+}
+
 int iscsi_mt_sem_init(libiscsi_sem_t* sem, int value)
 {
     *sem = CreateSemaphoreA(NULL, 0, 16, NULL);
@@ -137,19 +181,33 @@ int iscsi_mt_sem_wait(libiscsi_sem_t* sem)
     return 0;
 }
 
+int iscsi_mt_sem_timedwait(libiscsi_sem_t* sem, int timeout_ms)
+{
+    if (WaitForSingleObject(*sem, timeout_ms) != WAIT_OBJECT_0) {
+        return -1;
+    }
+    return 0;
+}
+
 #elif defined(HAVE_PTHREAD) /* WIN32 */
 
 #include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
-#include <signal.h>
 #include <unistd.h>
 #include <sys/syscall.h>
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
 #if defined(__FreeBSD__) || defined(__DragonFly__)
 #include <pthread_np.h>
 #endif
 #if defined(__NetBSD__)
 #include <lwp.h>
 #endif
+#if defined(HAVE_PTHREAD_SETAFFINITY_NP) || defined(HAVE_SCHED_GETCPU)
+#include <sched.h>
+#endif
 
 iscsi_tid_t iscsi_mt_get_tid(void)
 {
@@ -174,70 +232,260 @@ iscsi_tid_t iscsi_mt_get_tid(void)
 #endif
 }
 
-static void on_sigusr1(int _unused)
+int iscsi_mt_get_cpu(void)
 {
+#ifdef HAVE_SCHED_GETCPU
+        return sched_getcpu();
+#else
+        return -1;
+#endif
+}
+
+/* pin the running service thread to service_cpu */
+static int iscsi_mt_set_affinity(struct iscsi_context *iscsi)
+{
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+        cpu_set_t set;
+        int err;
+#endif
+
+        if (iscsi->service_cpu < 0) {
+                return 0;
+        }
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+        if (iscsi->service_cpu >= CPU_SETSIZE) {
+                err = EINVAL;
+        } else {
+                CPU_ZERO(&set);
+                CPU_SET(iscsi->service_cpu, &set);
+                err = pthread_setaffinity_np(iscsi->service_thread,
+                                             sizeof(set), &set);
+        }
+        if (err != 0) {
+                iscsi_set_error(iscsi, "Failed to bind service thread to "
+                                "CPU %d: %s", iscsi->service_cpu,
+                                strerror(err));
+                return -1;
+        }
+        return 0;
+#else
+        iscsi_set_error(iscsi, "CPU affinity is not supported");
+        return -1;
+#endif
+}
+
+/*
+ * The service thread is woken up through an eventfd, or a pipe where there
+ * is none, that it polls together with the socket.
+ */
+static int iscsi_mt_wakeup_open(struct iscsi_context *iscsi)
+{
+#ifdef HAVE_SYS_EVENTFD_H
+        iscsi->wakeup_fd[0] = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (iscsi->wakeup_fd[0] == -1) {
+                iscsi_set_error(iscsi, "Failed to create eventfd: %s",
+                                strerror(errno));
+                return -1;
+        }
+        iscsi->wakeup_fd[1] = iscsi->wakeup_fd[0];
+#else
+        int i;
+
+        if (pipe(iscsi->wakeup_fd) != 0) {
+                iscsi_set_error(iscsi, "Failed to create pipe: %s",
+                                strerror(errno));
+                return -1;
+        }
+        for (i = 0; i < 2; i++) {
+                fcntl(iscsi->wakeup_fd[i], F_SETFD, FD_CLOEXEC);
+                fcntl(iscsi->wakeup_fd[i], F_SETFL,
+                      fcntl(iscsi->wakeup_fd[i], F_GETFL) | O_NONBLOCK);
+        }
+#endif
+        iscsi->wakeup_pending = 0;
+        return 0;
+}
+
+static void iscsi_mt_wakeup_close(struct iscsi_context *iscsi)
+{
+        if (iscsi->wakeup_fd[1] != iscsi->wakeup_fd[0]) {
+                close(iscsi->wakeup_fd[1]);
+        }
+        close(iscsi->wakeup_fd[0]);
+        iscsi->wakeup_fd[0] = iscsi->wakeup_fd[1] = -1;
+}
+
+static void iscsi_mt_wakeup_write(struct iscsi_context *iscsi)
+{
+#ifdef HAVE_SYS_EVENTFD_H
+        uint64_t one = 1;
+#else
+        char one = 1;
+#endif
+
+        /* a full pipe or counter already wakes the thread up */
+        if (write(iscsi->wakeup_fd[1], &one, sizeof(one)) < 0) {
+                return;
+        }
+}
+
+static void iscsi_mt_wakeup_drain(struct iscsi_context *iscsi)
+{
+        char buf[64];
+
+        while (read(iscsi->wakeup_fd[0], buf, sizeof(buf)) > 0) {
+                ;
+        }
+}
+
+/*
+ * Make the service thread look at the outqueue. wakeup_pending is set
+ * while the thread is awake or a wakeup is on its way, so a batch of
+ * submissions costs at most one write.
+ */
+void iscsi_mt_service_thread_wakeup(struct iscsi_context *iscsi)
+{
+        if (ATOMIC_EXCHANGE(iscsi, iscsi->wakeup_pending, 1)) {
+                return;
+        }
+        iscsi_mt_wakeup_write(iscsi);
+}
+
+/*
+ * Wait until every service thread of the session, other than our own, has
+ * finished the iscsi_service() call it may be in. After that none of them
+ * runs a callback it took off a queue before we looked at the queues.
+ */
+void iscsi_mt_service_thread_sync(struct iscsi_context *iscsi)
+{
+        struct iscsi_context *conn;
+        int gen;
+
+        ISCSI_FOR_EACH_CONNECTION(iscsi, conn) {
+                if (!conn->multithreading_enabled ||
+                    pthread_equal(conn->service_thread, pthread_self())) {
+                        continue;
+                }
+                gen = ATOMIC_LOAD(conn, conn->service_gen);
+                /* a sleeping thread has nothing in flight, but it is
+                 * quicker to wake it than to tell */
+                iscsi_mt_service_thread_wakeup(conn);
+                while (conn->multithreading_enabled &&
+                       ATOMIC_LOAD(conn, conn->service_gen) == gen) {
+                        struct timespec ts = {0, 100000};
+                        nanosleep(&ts, NULL);
+                }
+        }
 }
 
 static void *iscsi_mt_service_thread(void *arg)
 {
         struct iscsi_context *iscsi = (struct iscsi_context *)arg;
-	struct pollfd pfd;
+	struct pollfd pfd[2];
 	int revents;
+	int timeout;
 	int ret;
-        
-        /* set signal to break poll when we need to send more data */
-        signal(SIGUSR1, on_sigusr1);
-        
+
         iscsi->multithreading_enabled = 1;
 
-        /* TODO: add timeout scanning */
+        /* iscsi_service() completes the pdus that have timed out and
+         * poll only sleeps until the next one is due */
 	while (iscsi->multithreading_enabled) {
-		pfd.fd = iscsi_get_fd(iscsi);
-		pfd.events = iscsi_which_events(iscsi);
-		pfd.revents = 0;
-        
-		ret = poll(&pfd, 1, iscsi->poll_timeout);
+		/* from here on new pdus have to wake us up. This is done
+		 * before we look at the outqueue in iscsi_which_events()
+		 * so a pdu queued in between is not missed. */
+		ATOMIC_EXCHANGE(iscsi, iscsi->wakeup_pending, 0);
+
+		pfd[0].fd = iscsi_get_fd(iscsi);
+		pfd[0].events = iscsi_which_events(iscsi);
+		pfd[0].revents = 0;
+		pfd[1].fd = iscsi->wakeup_fd[0];
+		pfd[1].events = POLLIN;
+		pfd[1].revents = 0;
+
+		timeout = iscsi_next_timeout(iscsi);
+		if (timeout < 0 || timeout > iscsi->poll_timeout) {
+			timeout = iscsi->poll_timeout;
+		}
+
+		ret = poll(pfd, 2, timeout);
+		ATOMIC_EXCHANGE(iscsi, iscsi->wakeup_pending, 1);
                 if (ret < 0 && errno == EINTR) {
-                        /*
-                         * Got a signal. Assume it is because we need to start writing new PDUs
-                         * to the socket.
-                         */
-                        revents = POLLOUT;
-                        goto call_service;
+                        continue;
                 }
                 if (ret < 0) {
 			iscsi_set_error(iscsi, "Poll failed");
 			revents = -1;
 		} else {
-			revents = pfd.revents;
+			revents = pfd[0].revents;
+			if (pfd[1].revents) {
+				/* woken up to send new PDUs */
+				iscsi_mt_wakeup_drain(iscsi);
+				revents |= POLLOUT;
+			}
 		}
-        call_service:                
 		if (iscsi_service(iscsi, revents) < 0) {
 			if (revents != -1)
 				iscsi_set_error(iscsi, "iscsi_service failed");
 		}
+		/* only we write it, release what the callbacks did */
+		ATOMIC_STORE(iscsi, iscsi->service_gen,
+			     iscsi->service_gen + 1);
 	}
         return NULL;
 }
 
 int iscsi_mt_service_thread_start(struct iscsi_context *iscsi)
 {
+        struct iscsi_context *conn;
+
+        if (iscsi_mt_wakeup_open(iscsi) != 0) {
+                return -1;
+        }
         if (pthread_create(&iscsi->service_thread, NULL,
                            &iscsi_mt_service_thread, iscsi)) {
                 iscsi_set_error(iscsi, "Failed to start service thread");
+                iscsi_mt_wakeup_close(iscsi);
                 return -1;
         }
         while (iscsi->multithreading_enabled == 0) {
                 struct timespec ts = {0, 1000000};
                 nanosleep(&ts, NULL);
         }
+        if (iscsi_mt_set_affinity(iscsi) != 0) {
+                iscsi_mt_service_thread_stop(iscsi);
+                return -1;
+        }
+
+        /* every connection of the session gets its own service thread */
+        for (conn = iscsi->connections; conn; conn = conn->next_connection) {
+                conn->service_cpu = iscsi->service_cpu;
+                if (!conn->multithreading_enabled &&
+                    iscsi_mt_service_thread_start(conn) != 0) {
+                        iscsi_set_error(iscsi, "%s", iscsi_get_error(conn));
+                        iscsi_mt_service_thread_stop(iscsi);
+                        return -1;
+                }
+        }
         return 0;
 }
 
 void iscsi_mt_service_thread_stop(struct iscsi_context *iscsi)
 {
+        struct iscsi_context *conn;
+
+        for (conn = iscsi->connections; conn; conn = conn->next_connection) {
+                if (conn->multithreading_enabled) {
+                        iscsi_mt_service_thread_stop(conn);
+                }
+        }
+
         iscsi->multithreading_enabled = 0;
+        /* do not wait for the poll timeout, and do not let a thread that
+         * is awake swallow the wakeup */
+        iscsi_mt_wakeup_write(iscsi);
         pthread_join(iscsi->service_thread, NULL);
+        iscsi_mt_wakeup_close(iscsi);
 }
         
 #if defined(__APPLE__) && defined(HAVE_DISPATCH_DISPATCH_H)
@@ -266,6 +514,15 @@ int iscsi_mt_sem_wait(libiscsi_sem_t *sem)
         return 0;
 }
 
+int iscsi_mt_sem_timedwait(libiscsi_sem_t *sem, int timeout_ms)
+{
+        if (dispatch_semaphore_wait(*sem, dispatch_time(DISPATCH_TIME_NOW,
+                        (int64_t)timeout_ms * NSEC_PER_MSEC)) != 0) {
+                return -1;
+        }
+        return 0;
+}
+
 #else
 int iscsi_mt_sem_init(libiscsi_sem_t *sem, int value)
 {
@@ -286,9 +543,47 @@ int iscsi_mt_sem_wait(libiscsi_sem_t *sem)
 {
         return sem_wait(sem);
 }
+
+int iscsi_mt_sem_timedwait(libiscsi_sem_t *sem, int timeout_ms)
+{
+        struct timespec ts;
+        int ret;
+
+        /* sem_timedwait only takes an absolute CLOCK_REALTIME time */
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += timeout_ms / 1000;
+        ts.tv_nsec += (timeout_ms % 1000) * 1000000L;
+        if (ts.tv_nsec >= 1000000000L) {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000L;
+        }
+        while ((ret = sem_timedwait(sem, &ts)) != 0 && errno == EINTR) {
+                ;
+        }
+        return ret ? -1 : 0;
+}
 #endif
 
 #endif /* HAVE_PTHREAD */
 
+int iscsi_mt_set_service_thread_cpu(struct iscsi_context *iscsi, int cpu)
+{
+        struct iscsi_context *conn;
+        int ret = 0;
+
+        ISCSI_FOR_EACH_CONNECTION(iscsi, conn) {
+                conn->service_cpu = cpu < 0 ? -1 : cpu;
+                if (conn->multithreading_enabled &&
+                    iscsi_mt_set_affinity(conn) != 0) {
+                        if (conn != iscsi) {
+                                iscsi_set_error(iscsi, "%s",
+                                                iscsi_get_error(conn));
+                        }
+                        ret = -1;
+                }
+        }
+        return ret;
+}
+
 #endif /* HAVE_MULTITHREADING */
 
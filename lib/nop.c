@@ -29,6 +29,7 @@ int
 iscsi_nop_out_async(struct iscsi_context *iscsi, iscsi_command_cb cb,
 		    unsigned char *data, int len, void *private_data)
 {
+	struct iscsi_context *session = ISCSI_SESSION(iscsi);
 	struct iscsi_pdu *pdu;
 
 	if (iscsi->old_iscsi || iscsi->pending_reconnect) {
@@ -44,12 +45,14 @@ iscsi_nop_out_async(struct iscsi_context *iscsi, iscsi_command_cb cb,
 		return -1;
 	}
 
+	iscsi_submit_enter(iscsi);
 	pdu = iscsi_allocate_pdu(iscsi,
 				 ISCSI_PDU_NOP_OUT,
 				 ISCSI_PDU_NOP_IN,
 				 iscsi_itt_post_increment(iscsi),
 				 ISCSI_PDU_DROP_ON_RECONNECT);
 	if (pdu == NULL) {
+		iscsi_submit_leave(iscsi);
 		iscsi_set_error(iscsi, "Failed to allocate nop-out pdu");
 		return -1;
 	}
@@ -66,22 +69,20 @@ iscsi_nop_out_async(struct iscsi_context *iscsi, iscsi_command_cb cb,
 	/* lun */
 	iscsi_pdu_set_lun(pdu, 0);
 
-	/* cmdsn */
-        iscsi_mt_spin_lock(&iscsi->iscsi_lock);
-	iscsi_pdu_set_cmdsn(pdu, iscsi->cmdsn);
-
 	if (data != NULL && len > 0) {
 		if (iscsi_pdu_add_data(iscsi, pdu, data, len) != 0) {
-                        iscsi_mt_spin_unlock(&iscsi->iscsi_lock);
 			iscsi_set_error(iscsi, "Failed to add outdata to nop-out");
 			iscsi->drv->free_pdu(iscsi, pdu);
+			iscsi_submit_leave(iscsi);
 			return -1;
 		}
 	}
-	iscsi->cmdsn++;
-        iscsi_mt_spin_unlock(&iscsi->iscsi_lock);
+
+	/* cmdsn */
+	iscsi_pdu_set_cmdsn(pdu, ATOMIC_INC(session, session->cmdsn));
 
 	iscsi_queue_pdu(iscsi, pdu);
+	iscsi_submit_leave(iscsi);
 
 	iscsi->nops_in_flight++;
 	ISCSI_LOG(iscsi, (iscsi->nops_in_flight > 1) ? 1 : 6,
@@ -119,7 +120,7 @@ iscsi_send_target_nop_out(struct iscsi_context *iscsi, uint32_t ttt, uint32_t lu
 	iscsi_pdu_set_lun(pdu, lun);
 
 	/* cmdsn is not increased if Immediate delivery*/
-	iscsi_pdu_set_cmdsn(pdu, iscsi->cmdsn);
+	iscsi_pdu_set_cmdsn(pdu, ISCSI_SESSION(iscsi)->cmdsn);
 
 	iscsi_queue_pdu(iscsi, pdu);
 
@@ -136,12 +137,17 @@ iscsi_process_nop_out_reply(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
 {
 	struct iscsi_data data;
 
+	/* stood in for a cancelled command, nobody waits for it */
+	if (pdu->flags & ISCSI_PDU_CMDSN_FILLER) {
+		return 0;
+	}
+
         iscsi_mt_spin_lock(&iscsi->iscsi_lock);
 	ISCSI_LOG(iscsi, (iscsi->nops_in_flight > 1) ? 1 : 6,
 	          "NOP-In received (pdu->itt %08x, pdu->ttt %08x, iscsi->maxcmdsn %08x, iscsi->expcmdsn %08x, iscsi->statsn %08x)",
 	          pdu->itt, 0xffffffff, iscsi->maxcmdsn, iscsi->expcmdsn, iscsi->statsn); 
 
-	if (iscsi->waitpdu->cmdsn == iscsi->min_cmdsn_waiting) {
+	if (iscsi->waitpdu.head->cmdsn == iscsi->min_cmdsn_waiting) {
 		ISCSI_LOG(iscsi, 2, "Oldest element in waitqueue is unchanged since last NOP-In (iscsi->min_cmdsn_waiting %08x)",
 		          iscsi->min_cmdsn_waiting); 
 		if (getenv("LIBISCSI_IGNORE_NOP_OUT_ON_STUCK_WAITPDU_QUEUE") == NULL) {
@@ -150,7 +156,7 @@ iscsi_process_nop_out_reply(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
 	} else {
 		iscsi->nops_in_flight = 0;
 	}
-	iscsi->min_cmdsn_waiting = iscsi->waitpdu->cmdsn;
+	iscsi->min_cmdsn_waiting = iscsi->waitpdu.head->cmdsn;
         iscsi_mt_spin_unlock(&iscsi->iscsi_lock);
 
 	if (pdu->callback == NULL) {
@@ -44,6 +44,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include "iscsi.h"
 #include "iscsi-private.h"
 #include "scsi-lowlevel.h"
@@ -68,20 +69,401 @@ iscsi_serial32_compare(uint32_t s1, uint32_t s2) {
 	return -1;
 }
 
+/* ITTs are unique within the session, not just the connection */
 uint32_t
 iscsi_itt_post_increment(struct iscsi_context *iscsi) {
+	struct iscsi_context *session = ISCSI_SESSION(iscsi);
 	uint32_t old_itt;
 
-        iscsi_mt_spin_lock(&iscsi->iscsi_lock);
-        old_itt = iscsi->itt++;
 	/* 0xffffffff is a reserved value */
-	if (iscsi->itt == 0xffffffff) {
-		iscsi->itt = 0;
-	}
-        iscsi_mt_spin_unlock(&iscsi->iscsi_lock);
+	do {
+		old_itt = ATOMIC_INC(session, session->itt);
+	} while (old_itt == 0xffffffff);
 	return old_itt;
 }
 
+/*
+ * ITTs are handed out sequentially by iscsi_itt_post_increment() so the
+ * low bits of the ITT spread the pdus evenly over the hash buckets.
+ * DATA-OUT pdus share the ITT of their command and unsolicited NOP-Outs use
+ * the reserved ITT, neither of them is ever looked up so they are not hashed.
+ */
+static int
+iscsi_itt_hash_wanted(struct iscsi_pdu *pdu)
+{
+	return pdu->itt != 0xffffffff &&
+		(pdu->outdata.data[0] & 0x3f) != ISCSI_PDU_DATA_OUT;
+}
+
+int
+iscsi_itt_hash_init(struct iscsi_context *iscsi)
+{
+	iscsi->itt_hash = iscsi_zmalloc(iscsi, ISCSI_ITT_HASH_MIN_SIZE *
+					sizeof(*iscsi->itt_hash));
+	if (iscsi->itt_hash == NULL) {
+		return -1;
+	}
+	iscsi->itt_hash_mask = ISCSI_ITT_HASH_MIN_SIZE - 1;
+	iscsi->itt_hash_count = 0;
+	return 0;
+}
+
+/*
+ * Double the table once it holds more pdus than buckets so the chains stay
+ * short however deep the queue gets. If we can not get the memory we keep
+ * the old table, lookups just walk longer chains.
+ */
+static void
+iscsi_itt_hash_grow(struct iscsi_context *iscsi)
+{
+	uint32_t mask = iscsi->itt_hash_mask * 2 + 1;
+	struct iscsi_pdu **table, *pdu;
+	uint32_t i;
+
+	table = iscsi_zmalloc(iscsi, (mask + 1) * sizeof(*table));
+	if (table == NULL) {
+		return;
+	}
+	for (i = 0; i <= iscsi->itt_hash_mask; i++) {
+		while ((pdu = iscsi->itt_hash[i]) != NULL) {
+			iscsi->itt_hash[i] = pdu->itt_next;
+			pdu->itt_next = table[pdu->itt & mask];
+			table[pdu->itt & mask] = pdu;
+		}
+	}
+	iscsi_free(iscsi, iscsi->itt_hash);
+	iscsi->itt_hash = table;
+	iscsi->itt_hash_mask = mask;
+}
+
+void
+iscsi_itt_hash_add(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
+{
+	struct iscsi_pdu **bucket;
+
+	if (!iscsi_itt_hash_wanted(pdu)) {
+		return;
+	}
+	if (iscsi->itt_hash_count > iscsi->itt_hash_mask) {
+		iscsi_itt_hash_grow(iscsi);
+	}
+	bucket = &iscsi->itt_hash[pdu->itt & iscsi->itt_hash_mask];
+	pdu->itt_next = *bucket;
+	*bucket = pdu;
+	ATOMIC_STORE(iscsi, iscsi->itt_hash_count, iscsi->itt_hash_count + 1);
+}
+
+void
+iscsi_itt_hash_remove(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
+{
+	struct iscsi_pdu **bucket;
+
+	bucket = &iscsi->itt_hash[pdu->itt & iscsi->itt_hash_mask];
+	while (*bucket) {
+		if (*bucket == pdu) {
+			*bucket = pdu->itt_next;
+			ATOMIC_STORE(iscsi, iscsi->itt_hash_count,
+				     iscsi->itt_hash_count - 1);
+			break;
+		}
+		bucket = &(*bucket)->itt_next;
+	}
+	pdu->itt_next = NULL;
+}
+
+static struct iscsi_pdu *
+iscsi_itt_hash_find(struct iscsi_context *iscsi, uint32_t itt, uint32_t queue)
+{
+	struct iscsi_pdu *pdu;
+
+	for (pdu = iscsi->itt_hash[itt & iscsi->itt_hash_mask];
+	     pdu; pdu = pdu->itt_next) {
+		if (pdu->itt == itt && pdu->flags & queue) {
+			return pdu;
+		}
+	}
+	return NULL;
+}
+
+struct iscsi_pdu *
+iscsi_outqueue_find(struct iscsi_context *iscsi, uint32_t itt)
+{
+	return iscsi_itt_hash_find(iscsi, itt, ISCSI_PDU_IN_OUTQUEUE);
+}
+
+static void
+iscsi_timer_heap_set(struct iscsi_context *iscsi, int slot,
+		     struct iscsi_pdu *pdu)
+{
+	iscsi->timer_heap[slot] = pdu;
+	pdu->timer_slot = slot;
+}
+
+static void
+iscsi_timer_heap_up(struct iscsi_context *iscsi, int slot)
+{
+	struct iscsi_pdu *pdu = iscsi->timer_heap[slot];
+
+	while (slot > 1 &&
+	       iscsi->timer_heap[slot / 2]->scsi_timeout > pdu->scsi_timeout) {
+		iscsi_timer_heap_set(iscsi, slot, iscsi->timer_heap[slot / 2]);
+		slot /= 2;
+	}
+	iscsi_timer_heap_set(iscsi, slot, pdu);
+}
+
+static void
+iscsi_timer_heap_down(struct iscsi_context *iscsi, int slot)
+{
+	struct iscsi_pdu *pdu = iscsi->timer_heap[slot];
+	int child;
+
+	while ((child = slot * 2) <= iscsi->timer_heap_len) {
+		if (child < iscsi->timer_heap_len &&
+		    iscsi->timer_heap[child + 1]->scsi_timeout <
+		    iscsi->timer_heap[child]->scsi_timeout) {
+			child++;
+		}
+		if (pdu->scsi_timeout <= iscsi->timer_heap[child]->scsi_timeout) {
+			break;
+		}
+		iscsi_timer_heap_set(iscsi, slot, iscsi->timer_heap[child]);
+		slot = child;
+	}
+	iscsi_timer_heap_set(iscsi, slot, pdu);
+}
+
+/* start tracking the timeout of a queued pdu */
+static void
+iscsi_timer_arm(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
+{
+	if (pdu->scsi_timeout == 0 || pdu->timer_slot) {
+		return;
+	}
+	if (iscsi->timer_heap_len + 1 >= iscsi->timer_heap_size) {
+		int size = iscsi->timer_heap_size ? iscsi->timer_heap_size * 2 : 64;
+		struct iscsi_pdu **heap;
+
+		if (iscsi->timer_heap == NULL) {
+			heap = iscsi_malloc(iscsi, size * sizeof(*heap));
+		} else {
+			heap = iscsi_realloc(iscsi, iscsi->timer_heap,
+					     size * sizeof(*heap));
+		}
+		if (heap == NULL) {
+			ISCSI_LOG(iscsi, 1, "Out-of-memory: pdu %08x will not "
+				  "time out", pdu->itt);
+			return;
+		}
+		iscsi->timer_heap = heap;
+		iscsi->timer_heap_size = size;
+	}
+	iscsi->timer_heap[++iscsi->timer_heap_len] = pdu;
+	iscsi_timer_heap_up(iscsi, iscsi->timer_heap_len);
+}
+
+static void
+iscsi_timer_disarm(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
+{
+	int slot = pdu->timer_slot;
+	struct iscsi_pdu *last;
+
+	if (slot == 0) {
+		return;
+	}
+	pdu->timer_slot = 0;
+	last = iscsi->timer_heap[iscsi->timer_heap_len--];
+	if (last == pdu) {
+		return;
+	}
+	iscsi_timer_heap_set(iscsi, slot, last);
+	if (slot > 1 &&
+	    iscsi->timer_heap[slot / 2]->scsi_timeout > last->scsi_timeout) {
+		iscsi_timer_heap_up(iscsi, slot);
+	} else {
+		iscsi_timer_heap_down(iscsi, slot);
+	}
+}
+
+/* immediate pdus and DATA-OUT do not time out while in the outqueue */
+static void
+iscsi_outqueue_timer_arm(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
+{
+	if (pdu->outdata.data[0] & ISCSI_PDU_IMMEDIATE ||
+	    (pdu->outdata.data[0] & 0x3f) == ISCSI_PDU_DATA_OUT) {
+		return;
+	}
+	iscsi_timer_arm(iscsi, pdu);
+}
+
+static void
+iscsi_outqueue_insert_after(struct iscsi_context *iscsi,
+			    struct iscsi_pdu *pos, struct iscsi_pdu *pdu)
+{
+	struct iscsi_pdu *next;
+
+	if (pos == NULL) {
+		ISCSI_QUEUE_ADD(&iscsi->outqueue, pdu);
+	} else if (pos->next == NULL) {
+		ISCSI_QUEUE_ADD_END(&iscsi->outqueue, pdu);
+	} else {
+		next = pos->next;
+		ISCSI_QUEUE_INSERT_BEFORE(&iscsi->outqueue, next, pdu);
+	}
+}
+
+/*
+ * Queue pdus in ascending order of CmdSN and keep pdus with the same CmdSN
+ * in FIFO order.
+ * Immediate pdus are queued in FIFO order in front of the queue with the
+ * CmdSN of the first cmd pdu in the outqueue.
+ * DATA-OUT for a command that has already been sent does not need to wait
+ * for anything else so it goes right behind the immediate pdus. Unsolicited
+ * DATA-OUT queued together with its command goes behind the command.
+ *
+ * CmdSN is allocated in increasing order so all but a few cases are a
+ * plain append to one of the lanes.
+ */
+void
+iscsi_outqueue_insert(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
+{
+	struct iscsi_pdu *current;
+
+	pdu->flags |= ISCSI_PDU_IN_OUTQUEUE;
+
+	if (pdu->outdata.data[0] & ISCSI_PDU_IMMEDIATE) {
+		if (iscsi->outqueue_last_immediate == NULL &&
+		    iscsi->outqueue_last_prio != NULL) {
+			current = iscsi->outqueue_last_prio->next;
+		} else {
+			current = iscsi->outqueue.head;
+		}
+		/* only unsolicited DATA-OUT for a command that is already
+		 * being written can be in the way here */
+		while (current &&
+		       (current->outdata.data[0] & 0x3f) == ISCSI_PDU_DATA_OUT) {
+			current = current->next;
+		}
+		if (current) {
+			iscsi_pdu_set_cmdsn(pdu, current->cmdsn);
+		}
+		iscsi_outqueue_insert_after(iscsi,
+					    iscsi->outqueue_last_immediate, pdu);
+		if (iscsi->outqueue_last_prio == iscsi->outqueue_last_immediate) {
+			iscsi->outqueue_last_prio = pdu;
+		}
+		iscsi->outqueue_last_immediate = pdu;
+		pdu->flags |= ISCSI_PDU_PRIO_LANE;
+		goto finished;
+	}
+
+	if ((pdu->outdata.data[0] & 0x3f) == ISCSI_PDU_DATA_OUT &&
+	    iscsi_outqueue_find(iscsi, pdu->itt) == NULL) {
+		iscsi_outqueue_insert_after(iscsi,
+					    iscsi->outqueue_last_prio, pdu);
+		iscsi->outqueue_last_prio = pdu;
+		pdu->flags |= ISCSI_PDU_PRIO_LANE;
+		goto finished;
+	}
+
+	/* walk back from the tail to the last pdu with CmdSN <= ours */
+	current = iscsi->outqueue.tail;
+	while (current != iscsi->outqueue_last_prio &&
+	       iscsi_serial32_compare(pdu->cmdsn, current->cmdsn) < 0) {
+		current = current->prev;
+	}
+	iscsi_outqueue_insert_after(iscsi, current, pdu);
+
+ finished:
+	iscsi_itt_hash_add(iscsi, pdu);
+	iscsi_outqueue_timer_arm(iscsi, pdu);
+}
+
+void
+iscsi_outqueue_remove(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
+{
+	/* the priority lane is a prefix of the queue so whatever is in
+	 * front of its last pdu is still in the lane */
+	if (pdu == iscsi->outqueue_last_immediate) {
+		iscsi->outqueue_last_immediate = pdu->prev;
+	}
+	if (pdu == iscsi->outqueue_last_prio) {
+		iscsi->outqueue_last_prio = pdu->prev;
+	}
+	ISCSI_QUEUE_REMOVE(&iscsi->outqueue, pdu);
+	pdu->flags &= ~ISCSI_PDU_IN_OUTQUEUE;
+	iscsi_itt_hash_remove(iscsi, pdu);
+	iscsi_timer_disarm(iscsi, pdu);
+}
+
+/* put a pdu that could not be sent back to the head of its lane */
+void
+iscsi_outqueue_requeue(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
+{
+	pdu->flags |= ISCSI_PDU_IN_OUTQUEUE;
+
+	if (pdu->outdata.data[0] & ISCSI_PDU_IMMEDIATE) {
+		iscsi_outqueue_insert_after(iscsi, NULL, pdu);
+		if (iscsi->outqueue_last_immediate == NULL) {
+			iscsi->outqueue_last_immediate = pdu;
+		}
+		if (iscsi->outqueue_last_prio == NULL) {
+			iscsi->outqueue_last_prio = pdu;
+		}
+	} else if (pdu->flags & ISCSI_PDU_PRIO_LANE) {
+		iscsi_outqueue_insert_after(iscsi,
+					    iscsi->outqueue_last_immediate, pdu);
+		if (iscsi->outqueue_last_prio == iscsi->outqueue_last_immediate) {
+			iscsi->outqueue_last_prio = pdu;
+		}
+	} else {
+		iscsi_outqueue_insert_after(iscsi,
+					    iscsi->outqueue_last_prio, pdu);
+	}
+	iscsi_itt_hash_add(iscsi, pdu);
+	iscsi_outqueue_timer_arm(iscsi, pdu);
+}
+
+struct iscsi_pdu *
+iscsi_waitpdu_find(struct iscsi_context *iscsi, uint32_t itt)
+{
+	return iscsi_itt_hash_find(iscsi, itt, ISCSI_PDU_IN_WAITPDU);
+}
+
+void
+iscsi_waitpdu_add(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
+{
+	ISCSI_QUEUE_ADD_END(&iscsi->waitpdu, pdu);
+	pdu->flags |= ISCSI_PDU_IN_WAITPDU;
+	iscsi_itt_hash_add(iscsi, pdu);
+	iscsi_timer_arm(iscsi, pdu);
+}
+
+void
+iscsi_waitpdu_remove(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
+{
+	ISCSI_QUEUE_REMOVE(&iscsi->waitpdu, pdu);
+	pdu->flags &= ~ISCSI_PDU_IN_WAITPDU;
+	iscsi_itt_hash_remove(iscsi, pdu);
+	iscsi_timer_disarm(iscsi, pdu);
+}
+
+/* Move every pdu on the waitpdu queue over to queue */
+void
+iscsi_waitpdu_detach(struct iscsi_context *iscsi,
+		     struct iscsi_pdu_queue *queue)
+{
+	struct iscsi_pdu *pdu;
+
+	for (pdu = iscsi->waitpdu.head; pdu; pdu = pdu->next) {
+		pdu->flags &= ~ISCSI_PDU_IN_WAITPDU;
+		iscsi_itt_hash_remove(iscsi, pdu);
+		iscsi_timer_disarm(iscsi, pdu);
+	}
+	*queue = iscsi->waitpdu;
+	memset(&iscsi->waitpdu, 0, sizeof(iscsi->waitpdu));
+}
+
 static const char *
 iscsi_opcode_str(int opcode)
 {
@@ -187,7 +569,7 @@ void iscsi_dump_pdu_header(struct iscsi_context *iscsi, unsigned char *data) {
 struct iscsi_pdu*
 iscsi_tcp_new_pdu(struct iscsi_context *iscsi, size_t size)
 {
-	return iscsi_zmalloc(iscsi, size);
+	return iscsi_cache_alloc(iscsi, &iscsi->pdu_cache, size);
 }
 
 struct iscsi_pdu *
@@ -204,13 +586,7 @@ iscsi_allocate_pdu(struct iscsi_context *iscsi, enum iscsi_opcode opcode,
 	}
 
 	pdu->outdata.size = ISCSI_HEADER_SIZE(iscsi->header_digest);
-	pdu->outdata.data = iscsi_zmalloc(iscsi, pdu->outdata.size);
-
-	if (pdu->outdata.data == NULL) {
-		iscsi_set_error(iscsi, "failed to allocate pdu header");
-		iscsi->drv->free_pdu(iscsi, pdu);
-		return NULL;
-	}
+	pdu->outdata.data = pdu->outhdr;
 
 	/* opcode */
 	pdu->outdata.data[0] = opcode;
@@ -242,22 +618,30 @@ iscsi_tcp_free_pdu(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
 		return;
 	}
 
-        iscsi_free(iscsi, pdu->outdata.data);
-	pdu->outdata.data = NULL;
+        iscsi_free(iscsi, pdu->outdata_seg.data);
+	pdu->outdata_seg.data = NULL;
 
         iscsi_free(iscsi, pdu->indata.data);
 	pdu->indata.data = NULL;
 
+	iscsi_free(iscsi, pdu->seg_digests);
+	pdu->seg_digests = NULL;
+
 	if (iscsi->outqueue_current == pdu) {
 		iscsi->outqueue_current = NULL;
 	}
 
-	iscsi_free(iscsi, pdu);
+	iscsi_cache_free(iscsi, &iscsi->pdu_cache, pdu);
 }
 
+/*
+ * Append dsize bytes to data. If data_digest is not NULL the appended
+ * bytes are folded into it while they are copied.
+ */
 int
 iscsi_add_data(struct iscsi_context *iscsi, struct iscsi_data *data,
-	       const unsigned char *dptr, int dsize, int pdualignment)
+	       const unsigned char *dptr, int dsize, int pdualignment,
+	       uint32_t *data_digest)
 {
 	size_t len, aligned;
 
@@ -285,7 +669,13 @@ iscsi_add_data(struct iscsi_context *iscsi, struct iscsi_data *data,
 		return -1;
 	}
 
-	memcpy(data->data + data->size, dptr, dsize);
+	if (data_digest) {
+		*data_digest = crc32c_chain_copy(*data_digest,
+						 data->data + data->size,
+						 dptr, dsize);
+	} else {
+		memcpy(data->data + data->size, dptr, dsize);
+	}
 	data->size += dsize;
 
 	if (len != aligned) {
@@ -310,14 +700,16 @@ iscsi_pdu_add_data(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
 		return -1;
 	}
 
-	if (iscsi_add_data(iscsi, &pdu->outdata, dptr, dsize, 1) != 0) {
+	/* the data digest of the segment is built up as it is appended,
+	 * the padding is added when the pdu is sent */
+	if (iscsi_add_data(iscsi, &pdu->outdata_seg, dptr, dsize, 1,
+			   &pdu->calculated_data_digest) != 0) {
 		iscsi_set_error(iscsi, "failed to add data to pdu buffer");
 		return -1;
 	}
 
 	/* update data segment length */
-	scsi_set_uint32(&pdu->outdata.data[4], pdu->outdata.size
-				- ISCSI_HEADER_SIZE(iscsi->header_digest));
+	scsi_set_uint32(&pdu->outdata.data[4], pdu->outdata_seg.size);
 
 	return 0;
 }
@@ -448,11 +840,7 @@ int iscsi_process_reject(struct iscsi_context *iscsi,
 	iscsi_dump_pdu_header(iscsi, in->data);
 
         iscsi_mt_spin_lock(&iscsi->iscsi_lock);
-	for (pdu = iscsi->waitpdu; pdu; pdu = pdu->next) {
-		if (pdu->itt == itt) {
-			break;
-		}
-	}
+	pdu = iscsi_waitpdu_find(iscsi, itt);
         iscsi_mt_spin_unlock(&iscsi->iscsi_lock);
 
 	if (pdu == NULL) {
@@ -468,12 +856,82 @@ int iscsi_process_reject(struct iscsi_context *iscsi,
 	}
 
         iscsi_mt_spin_lock(&iscsi->iscsi_lock);
-	ISCSI_LIST_REMOVE(&iscsi->waitpdu, pdu);
+	iscsi_waitpdu_remove(iscsi, pdu);
         iscsi_mt_spin_unlock(&iscsi->iscsi_lock);
 	iscsi->drv->free_pdu(iscsi, pdu);
 	return 0;
 }
 
+/*
+ * ExpCmdSN and MaxCmdSN belong to the session and may arrive on any of its
+ * connections. Every connection keeps a copy of the window to check its
+ * outqueue against, so raise them all and wake up the connections that
+ * were waiting for the window to open.
+ */
+void
+iscsi_update_cmdsn_window(struct iscsi_context *iscsi,
+			  uint32_t expcmdsn, uint32_t maxcmdsn)
+{
+	struct iscsi_context *session = ISCSI_SESSION(iscsi);
+	struct iscsi_context *conn;
+	int opened;
+
+	ISCSI_FOR_EACH_CONNECTION(session, conn) {
+		opened = 0;
+		iscsi_mt_spin_lock(&conn->iscsi_lock);
+		if (iscsi_serial32_compare(expcmdsn, conn->expcmdsn) > 0) {
+			conn->expcmdsn = expcmdsn;
+		}
+		if (iscsi_serial32_compare(maxcmdsn, conn->maxcmdsn) > 0) {
+			opened = conn->outqueue.head != NULL &&
+				iscsi_serial32_compare(conn->outqueue.head->cmdsn,
+						       conn->maxcmdsn) > 0;
+			conn->maxcmdsn = maxcmdsn;
+		}
+		iscsi_mt_spin_unlock(&conn->iscsi_lock);
+		if (opened && conn != iscsi) {
+			iscsi_wakeup_service_thread(conn);
+		}
+	}
+}
+
+/*
+ * Send a NOP-Out in place of a cancelled command that has not been sent yet.
+ * The other connections of the session keep sending commands with higher
+ * CmdSNs, and the target would wait forever for the one we took back. The
+ * NOP-Out takes over both the CmdSN and the ITT of the command.
+ *
+ * The caller must hold iscsi_lock.
+ */
+int
+iscsi_queue_cmdsn_filler(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
+{
+	struct iscsi_pdu *filler;
+
+	filler = iscsi_allocate_pdu(iscsi,
+				    ISCSI_PDU_NOP_OUT,
+				    ISCSI_PDU_NOP_IN,
+				    pdu->itt,
+				    ISCSI_PDU_DROP_ON_RECONNECT|ISCSI_PDU_CMDSN_FILLER);
+	if (filler == NULL) {
+		return -1;
+	}
+	iscsi_pdu_set_pduflags(filler, 0x80);
+	iscsi_pdu_set_ttt(filler, 0xffffffff);
+	iscsi_pdu_set_lun(filler, 0);
+	iscsi_pdu_set_cmdsn(filler, pdu->cmdsn);
+	iscsi_outqueue_insert(iscsi, filler);
+	return 0;
+}
+
+/* a command pdu that owns a CmdSN and has not been sent */
+static int
+iscsi_pdu_takes_cmdsn(struct iscsi_pdu *pdu)
+{
+	return !(pdu->outdata.data[0] & ISCSI_PDU_IMMEDIATE) &&
+		(pdu->outdata.data[0] & 0x3f) != ISCSI_PDU_DATA_OUT;
+}
+
 static void iscsi_process_pdu_serials(struct iscsi_context *iscsi, struct iscsi_in_pdu *in)
 {
 	uint32_t itt = scsi_get_uint32(&in->hdr[16]);
@@ -489,6 +947,10 @@ static void iscsi_process_pdu_serials(struct iscsi_context *iscsi, struct iscsi_
 		return;
 	}
 
+	if (iscsi_cmdsn_shared(iscsi)) {
+		iscsi_update_cmdsn_window(iscsi, expcmdsn, maxcmdsn);
+	}
+
         iscsi_mt_spin_lock(&iscsi->iscsi_lock);
 	if (iscsi_serial32_compare(maxcmdsn, iscsi->maxcmdsn) > 0) {
 		iscsi->maxcmdsn = maxcmdsn;
@@ -514,6 +976,34 @@ static void iscsi_process_pdu_serials(struct iscsi_context *iscsi, struct iscsi_
         iscsi_mt_spin_unlock(&iscsi->iscsi_lock);
 }
 
+/*
+ * Compare the data digest computed while the data segment was received
+ * with the one we received.
+ */
+int
+iscsi_verify_data_digest(struct iscsi_context *iscsi, struct iscsi_in_pdu *in)
+{
+	int dsl = scsi_get_uint32(&in->hdr[4]) & 0x00ffffff;
+	uint32_t crc, crc_rcvd = 0;
+
+	/* ... but only if some data is present. */
+	if (iscsi->data_digest == ISCSI_DATA_DIGEST_NONE || dsl == 0) {
+		return 0;
+	}
+
+	crc = crc32c_chain_done(in->calculated_data_digest);
+
+	crc_rcvd |= in->data_digest_buf[0];
+	crc_rcvd |= in->data_digest_buf[1] << 8;
+	crc_rcvd |= in->data_digest_buf[2] << 16;
+	crc_rcvd |= in->data_digest_buf[3] << 24;
+	if (crc != crc_rcvd) {
+		iscsi_set_error(iscsi, "data checksum verification failed: calculated 0x%" PRIx32 " received 0x%" PRIx32, crc, crc_rcvd);
+		return -1;
+	}
+	return 0;
+}
+
 int
 iscsi_process_pdu(struct iscsi_context *iscsi, struct iscsi_in_pdu *in)
 {
@@ -523,6 +1013,7 @@ iscsi_process_pdu(struct iscsi_context *iscsi, struct iscsi_in_pdu *in)
 	struct iscsi_pdu *pdu;
         enum iscsi_opcode expected_response;
         int is_finished = 1;
+        int parked;
 
 	/* verify header checksum */
 	if (iscsi->header_digest != ISCSI_HEADER_DIGEST_NONE) {
@@ -538,23 +1029,9 @@ iscsi_process_pdu(struct iscsi_context *iscsi, struct iscsi_in_pdu *in)
 		}
 	}
 
-	/* verify data checksum ... */
-	if (iscsi->data_digest != ISCSI_DATA_DIGEST_NONE) {
-		int dsl = scsi_get_uint32(&in->hdr[4]) & 0x00ffffff;
-		/* ... but only if some data is present. */
-		if (dsl) {
-			uint32_t crc_rcvd = 0;
-			uint32_t crc = crc32c_chain_done(in->calculated_data_digest);
-
-			crc_rcvd |= in->data_digest_buf[0];
-			crc_rcvd |= in->data_digest_buf[1] << 8;
-			crc_rcvd |= in->data_digest_buf[2] << 16;
-			crc_rcvd |= in->data_digest_buf[3] << 24;
-			if (crc != crc_rcvd) {
-				iscsi_set_error(iscsi, "data checksum verification failed: calculated 0x%" PRIx32 " received 0x%" PRIx32, crc, crc_rcvd);
-				return -1;
-			}
-		}
+	/* verify data checksum */
+	if (iscsi_verify_data_digest(iscsi, in) != 0) {
+		return -1;
 	}
 
 	if (ahslen != 0) {
@@ -590,7 +1067,8 @@ iscsi_process_pdu(struct iscsi_context *iscsi, struct iscsi_in_pdu *in)
 				ISCSI_LOG(iscsi, 2, "dropping connection to fix errors with broken DELL Equallogic firmware 7.x");
 				return -1;
 			}
-			iscsi_logout_async(iscsi, iscsi_reconnect_after_logout, NULL);
+			/* the logout closes the whole session */
+			iscsi_logout_async(ISCSI_SESSION(iscsi), iscsi_reconnect_after_logout, NULL);
 			return 0;
 		case 0x2:
 			ISCSI_LOG(iscsi, 2, "target will drop this connection. Time2Wait is %u seconds", param2);
@@ -602,7 +1080,7 @@ iscsi_process_pdu(struct iscsi_context *iscsi, struct iscsi_in_pdu *in)
 			return 0;
 		case 0x4:
 			ISCSI_LOG(iscsi, 2, "target requests parameter renogitiation.");
-			iscsi_logout_async(iscsi, iscsi_reconnect_after_logout, NULL);
+			iscsi_logout_async(ISCSI_SESSION(iscsi), iscsi_reconnect_after_logout, NULL);
 			return 0;
 		default:
 			ISCSI_LOG(iscsi, 1, "unhandled async event %u: param1 %u param2 %u param3 %u", event, param1, param2, param3);
@@ -622,11 +1100,7 @@ iscsi_process_pdu(struct iscsi_context *iscsi, struct iscsi_in_pdu *in)
 	}
 
         iscsi_mt_spin_lock(&iscsi->iscsi_lock);
-	for (pdu = iscsi->waitpdu; pdu; pdu = pdu->next) {
-		if (pdu->itt == itt) {
-			break;
-		}
-        }
+	pdu = iscsi_waitpdu_find(iscsi, itt);
         iscsi_mt_spin_unlock(&iscsi->iscsi_lock);
         if (pdu == NULL) {
                 iscsi_set_error(iscsi, "Got unsolicited response with "
@@ -659,11 +1133,20 @@ iscsi_process_pdu(struct iscsi_context *iscsi, struct iscsi_in_pdu *in)
                                 itt, opcode, pdu->response_opcode);
                 return -1;
         }
+        /* a write sent with MSG_ZEROCOPY must not complete while the
+         * kernel still holds on to the pages of its data */
+        if (opcode == ISCSI_PDU_SCSI_RESPONSE && pdu->scsi_cbdata.zc_pending) {
+                parked = iscsi_zerocopy_park(iscsi, pdu, in);
+                if (parked != 0) {
+                        return parked < 0 ? -1 : 0;
+                }
+        }
+
         switch (opcode) {
         case ISCSI_PDU_LOGIN_RESPONSE:
                 if (iscsi_process_login_reply(iscsi, pdu, in) != 0) {
                         iscsi_mt_spin_lock(&iscsi->iscsi_lock);
-                        ISCSI_LIST_REMOVE(&iscsi->waitpdu, pdu);
+                        iscsi_waitpdu_remove(iscsi, pdu);
                         iscsi_mt_spin_unlock(&iscsi->iscsi_lock);
                         iscsi->drv->free_pdu(iscsi, pdu);
                         iscsi_set_error(iscsi, "iscsi login reply "
@@ -674,7 +1157,7 @@ iscsi_process_pdu(struct iscsi_context *iscsi, struct iscsi_in_pdu *in)
         case ISCSI_PDU_TEXT_RESPONSE:
                 if (iscsi_process_text_reply(iscsi, pdu, in) != 0) {
                         iscsi_mt_spin_lock(&iscsi->iscsi_lock);
-                        ISCSI_LIST_REMOVE(&iscsi->waitpdu, pdu);
+                        iscsi_waitpdu_remove(iscsi, pdu);
                         iscsi_mt_spin_unlock(&iscsi->iscsi_lock);
                         iscsi->drv->free_pdu(iscsi, pdu);
                         iscsi_set_error(iscsi, "iscsi text reply "
@@ -685,7 +1168,7 @@ iscsi_process_pdu(struct iscsi_context *iscsi, struct iscsi_in_pdu *in)
         case ISCSI_PDU_LOGOUT_RESPONSE:
                 if (iscsi_process_logout_reply(iscsi, pdu, in) != 0) {
                         iscsi_mt_spin_lock(&iscsi->iscsi_lock);
-                        ISCSI_LIST_REMOVE(&iscsi->waitpdu, pdu);
+                        iscsi_waitpdu_remove(iscsi, pdu);
                         iscsi_mt_spin_unlock(&iscsi->iscsi_lock);
                         iscsi->drv->free_pdu(iscsi, pdu);
                         iscsi_set_error(iscsi, "iscsi logout reply "
@@ -696,7 +1179,7 @@ iscsi_process_pdu(struct iscsi_context *iscsi, struct iscsi_in_pdu *in)
         case ISCSI_PDU_SCSI_RESPONSE:
                 if (iscsi_process_scsi_reply(iscsi, pdu, in) != 0) {
                         iscsi_mt_spin_lock(&iscsi->iscsi_lock);
-                        ISCSI_LIST_REMOVE(&iscsi->waitpdu, pdu);
+                        iscsi_waitpdu_remove(iscsi, pdu);
                         iscsi_mt_spin_unlock(&iscsi->iscsi_lock);
                         iscsi->drv->free_pdu(iscsi, pdu);
                         iscsi_set_error(iscsi, "iscsi response reply "
@@ -708,7 +1191,7 @@ iscsi_process_pdu(struct iscsi_context *iscsi, struct iscsi_in_pdu *in)
                 if (iscsi_process_scsi_data_in(iscsi, pdu, in,
                                                &is_finished) != 0) {
                         iscsi_mt_spin_lock(&iscsi->iscsi_lock);
-                        ISCSI_LIST_REMOVE(&iscsi->waitpdu, pdu);
+                        iscsi_waitpdu_remove(iscsi, pdu);
                         iscsi_mt_spin_unlock(&iscsi->iscsi_lock);
                         iscsi->drv->free_pdu(iscsi, pdu);
                         iscsi_set_error(iscsi, "iscsi data in "
@@ -719,7 +1202,7 @@ iscsi_process_pdu(struct iscsi_context *iscsi, struct iscsi_in_pdu *in)
         case ISCSI_PDU_NOP_IN:
                 if (iscsi_process_nop_out_reply(iscsi, pdu, in) != 0) {
                         iscsi_mt_spin_lock(&iscsi->iscsi_lock);
-                        ISCSI_LIST_REMOVE(&iscsi->waitpdu, pdu);
+                        iscsi_waitpdu_remove(iscsi, pdu);
                         iscsi_mt_spin_unlock(&iscsi->iscsi_lock);
                         iscsi->drv->free_pdu(iscsi, pdu);
                         iscsi_set_error(iscsi, "iscsi nop-in failed");
@@ -730,7 +1213,7 @@ iscsi_process_pdu(struct iscsi_context *iscsi, struct iscsi_in_pdu *in)
                 if (iscsi_process_task_mgmt_reply(iscsi, pdu,
                                                   in) != 0) {
                         iscsi_mt_spin_lock(&iscsi->iscsi_lock);
-                        ISCSI_LIST_REMOVE(&iscsi->waitpdu, pdu);
+                        iscsi_waitpdu_remove(iscsi, pdu);
                         iscsi_mt_spin_unlock(&iscsi->iscsi_lock);
                         iscsi->drv->free_pdu(iscsi, pdu);
                         iscsi_set_error(iscsi, "iscsi task-mgmt failed");
@@ -740,7 +1223,7 @@ iscsi_process_pdu(struct iscsi_context *iscsi, struct iscsi_in_pdu *in)
         case ISCSI_PDU_R2T:
                 if (iscsi_process_r2t(iscsi, pdu, in) != 0) {
                         iscsi_mt_spin_lock(&iscsi->iscsi_lock);
-                        ISCSI_LIST_REMOVE(&iscsi->waitpdu, pdu);
+                        iscsi_waitpdu_remove(iscsi, pdu);
                         iscsi_mt_spin_unlock(&iscsi->iscsi_lock);
                         iscsi->drv->free_pdu(iscsi, pdu);
                         iscsi_set_error(iscsi, "iscsi r2t "
@@ -756,8 +1239,8 @@ iscsi_process_pdu(struct iscsi_context *iscsi, struct iscsi_in_pdu *in)
         }
 
         iscsi_mt_spin_lock(&iscsi->iscsi_lock);
-        if (is_finished && iscsi->waitpdu != NULL) {
-                ISCSI_LIST_REMOVE(&iscsi->waitpdu, pdu);
+        if (is_finished && pdu->flags & ISCSI_PDU_IN_WAITPDU) {
+                iscsi_waitpdu_remove(iscsi, pdu);
                 iscsi->drv->free_pdu(iscsi, pdu);
         }
         iscsi_mt_spin_unlock(&iscsi->iscsi_lock);
@@ -863,13 +1346,14 @@ iscsi_pdu_set_expxferlen(struct iscsi_pdu *pdu, uint32_t expxferlen)
  * 2, Once command w timeout and callback to uplayer, uplayers usually releases memory of
  *    iscsi task(include memory referenced by iovec.iov_base). DATAOUT[m] would access
  *    invalid memory iovce.iov_base.
+ *
+ * The caller must hold iscsi_lock.
  */
 static int iscsi_pdu_data_out_inprocess(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
 {
 	struct iscsi_pdu *tmp_pdu, *next_pdu;
 	enum scsi_opcode opcode = pdu->outdata.data[32];
-        int ret = 1;
-        
+
 	/* only care DATA OUT command here */
 	if ((pdu->outdata.data[0] & 0x3f) != ISCSI_PDU_SCSI_REQUEST) {
 		return 0;
@@ -884,64 +1368,76 @@ static int iscsi_pdu_data_out_inprocess(struct iscsi_context *iscsi, struct iscs
 			return 0;
 	};
 
-        iscsi_mt_spin_lock(&iscsi->iscsi_lock);
 	/* current outgoing one is part of the PDU? */
 	if (iscsi->outqueue_current && (iscsi->outqueue_current->scsi_cbdata.task == pdu->scsi_cbdata.task)) {
-                goto finished;
+		return 1;
 	}
 
 	/* any child DATAOUT PDU in outqueue? */
-	for (tmp_pdu = iscsi->outqueue; tmp_pdu; tmp_pdu = next_pdu) {
+	for (tmp_pdu = iscsi->outqueue.head; tmp_pdu; tmp_pdu = next_pdu) {
 		next_pdu = tmp_pdu->next;
 
 		if (tmp_pdu->scsi_cbdata.task == pdu->scsi_cbdata.task) {
-                        goto finished;
+			return 1;
 		}
 	}
 
-        ret = 0;
- finished:
-        iscsi_mt_spin_unlock(&iscsi->iscsi_lock);
-	return ret;
+	return 0;
 }
 
+/*
+ * Complete all pdus whose timeout has expired. Only the expired pdus are
+ * looked at, the rest stay in the timer heap.
+ */
 void
 iscsi_timeout_scan(struct iscsi_context *iscsi)
 {
-	struct iscsi_pdu *pdu, *tmp;
-	struct iscsi_pdu *next_pdu;
-	time_t t = time(NULL);
-	uint32_t cmdsn_gap = 0;
+	struct iscsi_pdu_queue outq = {NULL, NULL, 0};
+	struct iscsi_pdu_queue waitq = {NULL, NULL, 0};
+	struct iscsi_pdu *pdu, *next_pdu;
+	uint64_t now = 0;
 
         iscsi_mt_spin_lock(&iscsi->iscsi_lock);
-        tmp = NULL;
-	for (pdu = iscsi->outqueue; pdu; pdu = next_pdu) {
-		next_pdu = pdu->next;
-
-                if (cmdsn_gap > 0) {
-			iscsi_pdu_set_cmdsn(pdu, pdu->cmdsn - cmdsn_gap);
-                }
-		if (pdu->scsi_timeout == 0) {
-			/* no timeout for this pdu */
-			continue;
+	iscsi_submitted_drain(iscsi);
+	while (iscsi->timer_heap_len > 0) {
+		pdu = iscsi->timer_heap[1];
+		if (now == 0) {
+			now = iscsi_clock_ms();
 		}
-		if (t < pdu->scsi_timeout) {
+		if (now < pdu->scsi_timeout) {
 			/* not expired yet */
-			continue;
+			break;
 		}
-		if (!(pdu->outdata.data[0] & ISCSI_PDU_IMMEDIATE) &&
-		    (pdu->outdata.data[0] & 0x3f) != ISCSI_PDU_DATA_OUT) {
+		if (pdu->flags & ISCSI_PDU_IN_OUTQUEUE) {
+			if (iscsi_cmdsn_shared(iscsi)) {
+				/* higher CmdSNs may be sent or handed out */
+				iscsi_outqueue_remove(iscsi, pdu);
+				ISCSI_QUEUE_ADD_END(&outq, pdu);
+				iscsi_queue_cmdsn_filler(iscsi, pdu);
+				continue;
+			}
+			/* close the CmdSN gap this pdu leaves behind */
+			for (next_pdu = pdu->next; next_pdu; next_pdu = next_pdu->next) {
+				iscsi_pdu_set_cmdsn(next_pdu, next_pdu->cmdsn - 1);
+			}
 			iscsi->cmdsn--;
-			cmdsn_gap++;
-		} else {
+			iscsi_outqueue_remove(iscsi, pdu);
+			ISCSI_QUEUE_ADD_END(&outq, pdu);
 			continue;
 		}
-		ISCSI_LIST_REMOVE(&iscsi->outqueue, pdu);
-		ISCSI_LIST_ADD_END(&tmp, pdu);
+		if (iscsi_pdu_data_out_inprocess(iscsi, pdu)) {
+			iscsi_timer_disarm(iscsi, pdu);
+			pdu->scsi_timeout = now + ISCSI_TIMEOUT_RECHECK_MS;
+			iscsi_timer_arm(iscsi, pdu);
+			continue;
+		}
+		iscsi_waitpdu_remove(iscsi, pdu);
+		ISCSI_QUEUE_ADD_END(&waitq, pdu);
         }
         iscsi_mt_spin_unlock(&iscsi->iscsi_lock);
-	for (pdu = tmp; pdu; pdu = next_pdu) {
-		ISCSI_LIST_REMOVE(&tmp, pdu);
+
+	while ((pdu = outq.head)) {
+		ISCSI_QUEUE_REMOVE(&outq, pdu);
 		iscsi_set_error(iscsi, "command timed out from outqueue");
 		iscsi_dump_pdu_header(iscsi, pdu->outdata.data);
 		if (pdu->callback) {
@@ -950,29 +1446,8 @@ iscsi_timeout_scan(struct iscsi_context *iscsi)
 		}
 		iscsi->drv->free_pdu(iscsi, pdu);
 	}
-        
-        iscsi_mt_spin_lock(&iscsi->iscsi_lock);
-        tmp = NULL;
-	for (pdu = iscsi->waitpdu; pdu; pdu = next_pdu) {
-		next_pdu = pdu->next;
-
-		if (pdu->scsi_timeout == 0) {
-			/* no timeout for this pdu */
-			continue;
-		}
-		if (t < pdu->scsi_timeout) {
-			/* not expired yet */
-			continue;
-		}
-		if (iscsi_pdu_data_out_inprocess(iscsi, pdu)) {
-			continue;
-		}
-		ISCSI_LIST_REMOVE(&iscsi->waitpdu, pdu);
-		ISCSI_LIST_ADD_END(&tmp, pdu);
-        }
-        iscsi_mt_spin_unlock(&iscsi->iscsi_lock);
-	for (pdu = tmp; pdu; pdu = next_pdu) {
-		ISCSI_LIST_REMOVE(&tmp, pdu);
+	while ((pdu = waitq.head)) {
+		ISCSI_QUEUE_REMOVE(&waitq, pdu);
 		iscsi_set_error(iscsi, "command timed out from waitqueue");
 		iscsi_dump_pdu_header(iscsi, pdu->outdata.data);
 		if (pdu->callback) {
@@ -983,6 +1458,44 @@ iscsi_timeout_scan(struct iscsi_context *iscsi)
 	}
 }
 
+static int
+iscsi_next_timeout_ctx(struct iscsi_context *iscsi, uint64_t now)
+{
+	uint64_t deadline;
+	int ret = -1;
+
+        iscsi_mt_spin_lock(&iscsi->iscsi_lock);
+	if (iscsi->timer_heap_len > 0) {
+		deadline = iscsi->timer_heap[1]->scsi_timeout;
+		if (deadline <= now) {
+			ret = 0;
+		} else if (deadline - now > INT_MAX) {
+			ret = INT_MAX;
+		} else {
+			ret = deadline - now;
+		}
+	}
+        iscsi_mt_spin_unlock(&iscsi->iscsi_lock);
+
+	return ret;
+}
+
+int
+iscsi_next_timeout(struct iscsi_context *iscsi)
+{
+	uint64_t now = iscsi_clock_ms();
+	int ret, old;
+
+	ret = iscsi_next_timeout_ctx(iscsi, now);
+	if (iscsi->old_iscsi) {
+		old = iscsi_next_timeout_ctx(iscsi->old_iscsi, now);
+		if (old >= 0 && (ret < 0 || old < ret)) {
+			ret = old;
+		}
+	}
+	return ret;
+}
+
 void
 iscsi_queue_pdu(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
 {
@@ -992,27 +1505,55 @@ iscsi_queue_pdu(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
 void
 iscsi_cancel_pdus(struct iscsi_context *iscsi)
 {
-	struct iscsi_pdu *pdu, *tmp;
+	struct iscsi_pdu_queue tmp;
+	struct iscsi_pdu *pdu;
+
+	struct iscsi_pdu_queue fillers = {NULL, NULL, 0};
+	struct iscsi_pdu_queue gone = {NULL, NULL, 0};
+	int shared = iscsi_cmdsn_shared(iscsi);
+	/* a live connection of a session still has to account for the
+	 * CmdSNs of the commands it drops */
+	int fill = shared && iscsi->is_connected && iscsi->is_loggedin;
+
+	/* these already have their response */
+	iscsi_zerocopy_flush(iscsi);
 
         iscsi_mt_spin_lock(&iscsi->iscsi_lock);
-	while ((pdu = iscsi->outqueue)) {
-		ISCSI_LIST_REMOVE(&iscsi->outqueue, pdu);
+	iscsi_submitted_drain(iscsi);
+	while ((pdu = iscsi->outqueue.head)) {
+		iscsi_outqueue_remove(iscsi, pdu);
+		if (pdu->flags & ISCSI_PDU_CMDSN_FILLER && fill) {
+			ISCSI_QUEUE_ADD_END(&fillers, pdu);
+			continue;
+		}
 		if (pdu->callback) {
 			pdu->callback(iscsi, SCSI_STATUS_CANCELLED,
 			              NULL, pdu->private_data);
 		}
-		if (!(pdu->outdata.data[0] & ISCSI_PDU_IMMEDIATE) &&
-		    (pdu->outdata.data[0] & 0x3f) != ISCSI_PDU_DATA_OUT) {
-			iscsi->cmdsn--;
+		if (iscsi_pdu_takes_cmdsn(pdu)) {
+			if (!shared) {
+				iscsi->cmdsn--;
+			} else if (fill) {
+				ISCSI_QUEUE_ADD_END(&gone, pdu);
+				continue;
+			}
 		}
 		iscsi->drv->free_pdu(iscsi, pdu);
 	}
-        tmp = iscsi->waitpdu;
-        iscsi->waitpdu = NULL;
+	while ((pdu = fillers.head)) {
+		ISCSI_QUEUE_REMOVE(&fillers, pdu);
+		iscsi_outqueue_insert(iscsi, pdu);
+	}
+	while ((pdu = gone.head)) {
+		ISCSI_QUEUE_REMOVE(&gone, pdu);
+		iscsi_queue_cmdsn_filler(iscsi, pdu);
+		iscsi->drv->free_pdu(iscsi, pdu);
+	}
+        iscsi_waitpdu_detach(iscsi, &tmp);
         iscsi_mt_spin_unlock(&iscsi->iscsi_lock);
 
-	while ((pdu = tmp)) {
-		ISCSI_LIST_REMOVE(&tmp, pdu);
+	while ((pdu = tmp.head)) {
+		ISCSI_QUEUE_REMOVE(&tmp, pdu);
 		if (pdu->callback) {
 			pdu->callback(iscsi, SCSI_STATUS_CANCELLED,
 			              NULL, pdu->private_data);
@@ -1024,14 +1565,16 @@ iscsi_cancel_pdus(struct iscsi_context *iscsi)
 void
 iscsi_cancel_lun_pdus(struct iscsi_context *iscsi, uint32_t lun)
 {
-	struct iscsi_pdu *pdu, *tmp;
+	struct iscsi_pdu_queue tmp = {NULL, NULL, 0};
+	struct iscsi_pdu *pdu;
 	struct iscsi_pdu *next_pdu;
 	uint32_t cmdsn_gap = 0;
 	struct scsi_task * task = NULL;
+	int shared = iscsi_cmdsn_shared(iscsi);
 
         iscsi_mt_spin_lock(&iscsi->iscsi_lock);
-        tmp = NULL;
-	for (pdu = iscsi->outqueue; pdu; pdu = next_pdu) {
+	iscsi_submitted_drain(iscsi);
+	for (pdu = iscsi->outqueue.head; pdu; pdu = next_pdu) {
 		next_pdu = pdu->next;
 		task = iscsi_scsi_get_task_from_pdu(pdu);
 
@@ -1041,17 +1584,22 @@ iscsi_cancel_lun_pdus(struct iscsi_context *iscsi, uint32_t lun)
 		if (task == NULL || task->lun != lun) {
 			continue;
 		}
-		if (!(pdu->outdata.data[0] & ISCSI_PDU_IMMEDIATE) &&
-		    (pdu->outdata.data[0] & 0x3f) != ISCSI_PDU_DATA_OUT) {
+		if (iscsi_pdu_takes_cmdsn(pdu) && !shared) {
 			iscsi->cmdsn--;
 			cmdsn_gap++;
 		}
-		ISCSI_LIST_REMOVE(&iscsi->outqueue, pdu);
-		ISCSI_LIST_ADD_END(&tmp, pdu);
+		iscsi_outqueue_remove(iscsi, pdu);
+		ISCSI_QUEUE_ADD_END(&tmp, pdu);
         }
+	/* on a session the CmdSNs stay as they are and NOP-Outs fill in */
+	for (pdu = tmp.head; shared && pdu; pdu = pdu->next) {
+		if (iscsi_pdu_takes_cmdsn(pdu)) {
+			iscsi_queue_cmdsn_filler(iscsi, pdu);
+		}
+	}
         iscsi_mt_spin_unlock(&iscsi->iscsi_lock);
-	for (pdu = tmp; pdu; pdu = next_pdu) {
-		ISCSI_LIST_REMOVE(&tmp, pdu);
+	while ((pdu = tmp.head)) {
+		ISCSI_QUEUE_REMOVE(&tmp, pdu);
 		iscsi_set_error(iscsi, "command cancelled");
 		if (pdu->callback) {
 			pdu->callback(iscsi, SCSI_STATUS_CANCELLED,
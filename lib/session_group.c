@@ -0,0 +1,396 @@
+/*
+   Copyright (C) 2026 by the libiscsi authors
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "iscsi.h"
+#include "iscsi-private.h"
+#include "scsi-lowlevel.h"
+
+struct iscsi_session_group *
+iscsi_create_session_group(const char *initiator_name, int sessions)
+{
+	struct iscsi_session_group *group;
+	uint32_t rnd;
+	int i;
+
+	if (sessions < 1 || sessions > ISCSI_MAX_GROUP_SESSIONS) {
+		return NULL;
+	}
+
+	group = calloc(1, sizeof(struct iscsi_session_group));
+	if (group == NULL) {
+		return NULL;
+	}
+	group->dispatch = ISCSI_SESSION_GROUP_LEAST_OUTSTANDING;
+
+	for (i = 0; i < sessions; i++) {
+		group->members[i] = iscsi_create_context(initiator_name);
+		if (group->members[i] == NULL) {
+			iscsi_destroy_session_group(group);
+			return NULL;
+		}
+		group->count++;
+		iscsi_set_session_type(group->members[i], ISCSI_SESSION_NORMAL);
+	}
+
+	/* keep the random ISID of the first member and number them all
+	 * with the qualifier, so the ISIDs are distinct */
+	rnd = (group->members[0]->isid[1] << 16) |
+		(group->members[0]->isid[2] << 8) |
+		group->members[0]->isid[3];
+	for (i = 0; i < sessions; i++) {
+		iscsi_set_isid_random(group->members[i], rnd, i);
+	}
+
+	return group;
+}
+
+void
+iscsi_destroy_session_group(struct iscsi_session_group *group)
+{
+	int i;
+
+	if (group == NULL) {
+		return;
+	}
+	iscsi_session_group_stop_service_threads(group);
+	for (i = 0; i < group->count; i++) {
+		iscsi_destroy_context(group->members[i]);
+	}
+	free(group);
+}
+
+int
+iscsi_session_group_get_count(struct iscsi_session_group *group)
+{
+	return group->count;
+}
+
+struct iscsi_context *
+iscsi_session_group_get_context(struct iscsi_session_group *group, int idx)
+{
+	if (idx < 0 || idx >= group->count) {
+		return NULL;
+	}
+	return group->members[idx];
+}
+
+void
+iscsi_session_group_set_dispatch(struct iscsi_session_group *group,
+				 enum iscsi_session_group_dispatch dispatch)
+{
+	group->dispatch = dispatch;
+}
+
+int
+iscsi_session_group_set_targetname(struct iscsi_session_group *group,
+				   const char *targetname)
+{
+	int i;
+
+	for (i = 0; i < group->count; i++) {
+		if (iscsi_set_targetname(group->members[i], targetname) != 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int
+iscsi_session_group_set_bind_interfaces(struct iscsi_session_group *group,
+					const char *interfaces)
+{
+	char iface[MAX_STRING_SIZE + 1];
+	const char *start, *end;
+	int i, n, count = 1;
+	size_t len;
+
+	if (interfaces == NULL || interfaces[0] == '\0') {
+		return -1;
+	}
+	for (end = interfaces; (end = strchr(end, ',')) != NULL; end++) {
+		count++;
+	}
+
+	for (i = 0; i < group->count; i++) {
+		start = interfaces;
+		for (n = i % count; n > 0; n--) {
+			start = strchr(start, ',') + 1;
+		}
+		end = strchr(start, ',');
+		len = end ? (size_t)(end - start) : strlen(start);
+		if (len == 0 || len > MAX_STRING_SIZE) {
+			iscsi_set_error(group->members[i], "Invalid interface "
+					"list %s", interfaces);
+			return -1;
+		}
+		memcpy(iface, start, len);
+		iface[len] = '\0';
+		iscsi_set_bind_interfaces(group->members[i], iface);
+	}
+	return 0;
+}
+
+/*
+ * The last member to finish calls the group callback. With service
+ * threads the members log in on different threads, so the counters are
+ * only touched atomically. ATOMIC_CAS() orders the failures counted by
+ * the other members before the final check.
+ */
+static void
+iscsi_session_group_connect_done(struct iscsi_session_group *group)
+{
+	int pending = ATOMIC_LOAD(group, group->pending);
+
+	while (!ATOMIC_CAS(group, group->pending, &pending, pending - 1)) {
+		;
+	}
+	if (pending == 1) {
+		group->cb(group, ATOMIC_LOAD(group, group->failed) ?
+			  SCSI_STATUS_ERROR : SCSI_STATUS_GOOD,
+			  group->private_data);
+	}
+}
+
+static void
+iscsi_session_group_connect_cb(struct iscsi_context *iscsi, int status,
+			       void *command_data, void *private_data)
+{
+	struct iscsi_session_group *group = private_data;
+
+	if (status != SCSI_STATUS_GOOD) {
+		ISCSI_LOG(iscsi, 1, "session group member failed to log in: %s",
+			  iscsi_get_error(iscsi));
+		ATOMIC_INC(group, group->failed);
+	}
+	iscsi_session_group_connect_done(group);
+}
+
+int
+iscsi_session_group_connect_async(struct iscsi_session_group *group,
+				  const char *portal, int lun,
+				  iscsi_session_group_cb cb,
+				  void *private_data)
+{
+	int i, started = 0, idle = 0;
+
+	/* Count every member, and one more for ourselves, before the first
+	 * login starts. A member whose service thread runs can finish
+	 * before we get to the next one, and the callback must not fire
+	 * until all of them have been started. */
+	while (!ATOMIC_CAS(group, group->pending, &idle, group->count + 1)) {
+		if (idle != 0) {
+			return -1;
+		}
+	}
+	group->cb = cb;
+	group->private_data = private_data;
+	ATOMIC_STORE(group, group->failed, 0);
+
+	for (i = 0; i < group->count; i++) {
+		if (iscsi_full_connect_async(group->members[i], portal, lun,
+					     iscsi_session_group_connect_cb,
+					     group) != 0) {
+			ATOMIC_INC(group, group->failed);
+			iscsi_session_group_connect_done(group);
+			continue;
+		}
+		started++;
+	}
+	if (started == 0) {
+		/* nothing to wait for, and no callback */
+		ATOMIC_STORE(group, group->pending, 0);
+		return -1;
+	}
+	/* drop our own count, the callback fires here if every member
+	 * already finished */
+	iscsi_session_group_connect_done(group);
+	return 0;
+}
+
+int
+iscsi_session_group_connect_sync(struct iscsi_session_group *group,
+				 const char *portal, int lun)
+{
+	int i;
+
+	for (i = 0; i < group->count; i++) {
+		if (iscsi_full_connect_sync(group->members[i], portal,
+					    lun) != 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int
+iscsi_session_group_logout_sync(struct iscsi_session_group *group)
+{
+	int i, ret = 0;
+
+	for (i = 0; i < group->count; i++) {
+		if (group->members[i]->is_loggedin &&
+		    iscsi_logout_sync(group->members[i]) != 0) {
+			ret = -1;
+		}
+	}
+	return ret;
+}
+
+static int
+iscsi_session_group_usable(struct iscsi_context *iscsi)
+{
+	return iscsi->is_loggedin && iscsi->old_iscsi == NULL;
+}
+
+#ifdef HAVE_MULTITHREADING
+/*
+ * The member whose service thread runs on the CPU of the caller. This
+ * only reads, so threads on different CPUs do not share any cache line
+ * that is written to.
+ */
+static struct iscsi_context *
+iscsi_session_group_local(struct iscsi_session_group *group)
+{
+	struct iscsi_context *iscsi;
+	int i, cpu;
+
+	cpu = iscsi_mt_get_cpu();
+	if (cpu < 0) {
+		return NULL;
+	}
+	for (i = 0; i < group->count; i++) {
+		if (group->members[i]->service_cpu == cpu) {
+			break;
+		}
+	}
+	/* no member on this CPU, spread the CPUs over the members */
+	iscsi = group->members[i < group->count ? i : cpu % group->count];
+	return iscsi_session_group_usable(iscsi) ? iscsi : NULL;
+}
+#endif
+
+struct iscsi_context *
+iscsi_session_group_select(struct iscsi_session_group *group)
+{
+	struct iscsi_context *iscsi, *best = NULL;
+	int i, queued, best_queued = 0;
+	int start;
+
+#ifdef HAVE_MULTITHREADING
+	if (group->dispatch == ISCSI_SESSION_GROUP_LOCAL_CPU) {
+		iscsi = iscsi_session_group_local(group);
+		if (iscsi != NULL) {
+			return iscsi;
+		}
+	}
+#endif
+
+	/* unsigned, so the counter wraps around without going negative */
+	start = ATOMIC_FETCH_ADD(group, group->next, 1) %
+		(unsigned int)group->count;
+
+	for (i = 0; i < group->count; i++) {
+		iscsi = group->members[(start + i) % group->count];
+		if (!iscsi_session_group_usable(iscsi)) {
+			continue;
+		}
+		if (group->dispatch != ISCSI_SESSION_GROUP_LEAST_OUTSTANDING) {
+			return iscsi;
+		}
+
+		/* Read the count of hashed pdus without taking the lock of
+		 * every member. Commands still on the submitted list are not
+		 * counted until the service thread queues them, starting the
+		 * scan at a different member every time spreads the commands
+		 * over members that are tied. */
+		queued = ATOMIC_LOAD(iscsi, iscsi->itt_hash_count);
+		if (best == NULL || queued < best_queued) {
+			best = iscsi;
+			best_queued = queued;
+		}
+	}
+	if (best != NULL) {
+		return best;
+	}
+
+	/* nobody is logged in, queue it on a member that is reconnecting */
+	return group->members[start % group->count];
+}
+
+struct iscsi_context *
+iscsi_session_group_select_lba(struct iscsi_session_group *group,
+			       uint64_t lba)
+{
+	struct iscsi_context *iscsi;
+	uint64_t region = lba >> ISCSI_GROUP_LBA_REGION_SHIFT;
+
+	/* multiplicative hashing, so that strided I/O does not pile up
+	 * on a few members */
+	region = (region * 0x9e3779b97f4a7c15ULL) >> 32;
+	iscsi = group->members[region % group->count];
+	if (iscsi_session_group_usable(iscsi)) {
+		return iscsi;
+	}
+	return iscsi_session_group_select(group);
+}
+
+int
+iscsi_session_group_start_service_threads(struct iscsi_session_group *group,
+					  const int *cpus, int ncpus)
+{
+#ifdef HAVE_MULTITHREADING
+	struct iscsi_context *iscsi;
+	int i, cpu;
+
+	for (i = 0; i < group->count; i++) {
+		iscsi = group->members[i];
+		if (iscsi->multithreading_enabled) {
+			continue;
+		}
+		cpu = cpus && ncpus > 0 ? cpus[i % ncpus] : i;
+		if (iscsi_mt_set_service_thread_cpu(iscsi, cpu) != 0 ||
+		    iscsi_mt_service_thread_start(iscsi) != 0) {
+			iscsi_session_group_stop_service_threads(group);
+			return -1;
+		}
+	}
+	return 0;
+#else
+	iscsi_set_error(group->members[0], "Multithreading is not supported");
+	return -1;
+#endif
+}
+
+void
+iscsi_session_group_stop_service_threads(struct iscsi_session_group *group)
+{
+#ifdef HAVE_MULTITHREADING
+	int i;
+
+	for (i = 0; i < group->count; i++) {
+		if (group->members[i]->multithreading_enabled) {
+			iscsi_mt_service_thread_stop(group->members[i]);
+		}
+	}
+#endif
+}
@@ -62,11 +62,12 @@
 #include <sys/uio.h>
 #endif
 
-#ifdef HAVE_PTHREAD
-#include <signal.h>
+#ifdef HAVE_MSG_ZEROCOPY
+#include <linux/errqueue.h>
 #endif
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -78,6 +79,7 @@
 #include "iscsi.h"
 #include "iscsi-private.h"
 #include "slist.h"
+#include "utils.h"
 
 static uint32_t iface_rr = 0;
 struct iscsi_transport;
@@ -89,77 +91,197 @@ union socket_address {
 	struct sockaddr sa;
 };
 
-void
-iscsi_add_to_outqueue(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
+static void
+iscsi_pdu_set_timeout(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
 {
-	struct iscsi_pdu *current;
-	struct iscsi_pdu *last = NULL;
-
 	if (iscsi->scsi_timeout > 0) {
-		pdu->scsi_timeout = time(NULL) + iscsi->scsi_timeout;
+		pdu->scsi_timeout = iscsi_clock_ms() + iscsi->scsi_timeout;
 	} else {
 		pdu->scsi_timeout = 0;
 	}
+}
+
+/* The caller must hold iscsi_lock */
+static void
+iscsi_outqueue_insert_counted(struct iscsi_context *iscsi,
+			      struct iscsi_pdu *pdu)
+{
+	iscsi_outqueue_insert(iscsi, pdu);
+	if ((pdu->outdata.data[0] & 0x3f) == ISCSI_PDU_SCSI_REQUEST) {
+		iscsi->stats.commands++;
+	}
+}
+
+/*
+ * Put a pdu on the outqueue without trying to send it.
+ * Returns non-zero if it went to the head of the queue.
+ */
+int
+iscsi_outqueue_enqueue(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
+{
+	int is_head;
+
+	iscsi_pdu_set_timeout(iscsi, pdu);
 
         iscsi_mt_spin_lock(&iscsi->iscsi_lock);
+	iscsi_outqueue_insert_counted(iscsi, pdu);
+	is_head = iscsi->outqueue.head == pdu;
+        iscsi_mt_spin_unlock(&iscsi->iscsi_lock);
 
-        current = iscsi->outqueue;
-        if (iscsi->outqueue == NULL) {
-		iscsi->outqueue = pdu;
-		pdu->next = NULL;
-                goto finished;
-	}
-        
-	/* queue pdus in ascending order of CmdSN. 
-	 * ensure that pakets with the same CmdSN are kept in FIFO order.
-	 * immediate PDUs are queued in front of queue with the CmdSN
-	 * of the first cmd pdu in the outqueue.
-	 */
+	return is_head;
+}
 
-	if (pdu->outdata.data[0] & ISCSI_PDU_IMMEDIATE) {
-		do {
-			if ((current->outdata.data[0] & 0x3f) != ISCSI_PDU_DATA_OUT) {
-				iscsi_pdu_set_cmdsn(pdu, current->cmdsn);
-				break;
-			}
-			current = current->next;
-		} while (current != NULL);
+/*
+ * Queue a pdu from any thread. While a service thread runs, the other
+ * threads do not take iscsi_lock but push the pdu on the submitted list
+ * with a compare-and-swap. The service thread moves the whole list to
+ * the outqueue at once with iscsi_submitted_drain().
+ * Returns non-zero if the service thread has to look at the queue.
+ */
+int
+iscsi_outqueue_submit(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
+{
+#if defined(HAVE_MULTITHREADING) && defined(HAVE_PTHREAD)
+	struct iscsi_pdu *head;
 
-		current = iscsi->outqueue;
+	if (!iscsi->multithreading_enabled ||
+	    pthread_equal(pthread_self(), iscsi->service_thread)) {
+		return iscsi_outqueue_enqueue(iscsi, pdu);
 	}
 
+	iscsi_pdu_set_timeout(iscsi, pdu);
+
+	head = ATOMIC_LOAD(iscsi, iscsi->submitted);
 	do {
-		if (iscsi_serial32_compare(pdu->cmdsn, current->cmdsn) < 0 ||
-			(pdu->outdata.data[0] & ISCSI_PDU_IMMEDIATE && !(current->outdata.data[0] & ISCSI_PDU_IMMEDIATE))) {
-			/* insert PDU before the current */
-			if (last != NULL) {
-				last->next = pdu;
-			} else {
-				iscsi->outqueue = pdu;
-			}
-			pdu->next = current;
-                        goto finished;
+		pdu->next = head;
+	} while (!ATOMIC_CAS(iscsi, iscsi->submitted, &head, pdu));
+
+	/* whoever finds the list empty wakes the service thread up */
+	return head == NULL;
+#else
+	return iscsi_outqueue_enqueue(iscsi, pdu);
+#endif
+}
+
+/* set in submitters while a reconnect swaps the context */
+#define ISCSI_SUBMIT_FENCE 0x40000000
+
+/*
+ * Threads that queue commands count themselves in submitters from before
+ * they take a CmdSN until the pdu is queued. iscsi_submit_fence() waits
+ * for them to leave and holds new ones back, so a reconnect can swap the
+ * session state without a submitter seeing half of it.
+ */
+void
+iscsi_submit_enter(struct iscsi_context *iscsi)
+{
+#if defined(HAVE_MULTITHREADING) && defined(HAVE_PTHREAD)
+	struct timespec ts = {0, 100000};
+	int n;
+
+	n = ATOMIC_LOAD(iscsi, iscsi->submitters);
+	do {
+		while (n & ISCSI_SUBMIT_FENCE) {
+			nanosleep(&ts, NULL);
+			n = ATOMIC_LOAD(iscsi, iscsi->submitters);
 		}
-		last = current;
-		current = current->next;
-	} while (current != NULL);
-	
-	last->next = pdu;
-	pdu->next = NULL;
+	} while (!ATOMIC_CAS(iscsi, iscsi->submitters, &n, n + 1));
+#endif
+}
+
+void
+iscsi_submit_leave(struct iscsi_context *iscsi)
+{
+#if defined(HAVE_MULTITHREADING) && defined(HAVE_PTHREAD)
+	int n;
+
+	n = ATOMIC_LOAD(iscsi, iscsi->submitters);
+	while (!ATOMIC_CAS(iscsi, iscsi->submitters, &n, n - 1)) {
+		;
+	}
+#endif
+}
+
+void
+iscsi_submit_fence(struct iscsi_context *iscsi)
+{
+#if defined(HAVE_MULTITHREADING) && defined(HAVE_PTHREAD)
+	struct timespec ts = {0, 100000};
+	int n;
+
+	n = ATOMIC_LOAD(iscsi, iscsi->submitters);
+	while (!ATOMIC_CAS(iscsi, iscsi->submitters, &n,
+			   n | ISCSI_SUBMIT_FENCE)) {
+		;
+	}
+	while (ATOMIC_LOAD(iscsi, iscsi->submitters) != ISCSI_SUBMIT_FENCE) {
+		nanosleep(&ts, NULL);
+	}
+#endif
+}
+
+void
+iscsi_submit_unfence(struct iscsi_context *iscsi)
+{
+#if defined(HAVE_MULTITHREADING) && defined(HAVE_PTHREAD)
+	int n;
+
+	n = ATOMIC_LOAD(iscsi, iscsi->submitters);
+	while (!ATOMIC_CAS(iscsi, iscsi->submitters, &n,
+			   n & ~ISCSI_SUBMIT_FENCE)) {
+		;
+	}
+#endif
+}
+
+/*
+ * Move the pdus other threads have submitted to the outqueue, in the
+ * order they were submitted in. Anything that looks at the outqueue as
+ * a whole drains them first.
+ * The caller must hold iscsi_lock.
+ */
+void
+iscsi_submitted_drain(struct iscsi_context *iscsi)
+{
+#if defined(HAVE_MULTITHREADING) && defined(HAVE_PTHREAD)
+	struct iscsi_pdu *pdu, *next, *list = NULL;
+
+	if (ATOMIC_LOAD(iscsi, iscsi->submitted) == NULL) {
+		return;
+	}
+	pdu = ATOMIC_EXCHANGE(iscsi, iscsi->submitted, NULL);
+
+	/* the list is newest first */
+	for (; pdu; pdu = next) {
+		next = pdu->next;
+		pdu->next = list;
+		list = pdu;
+	}
+	for (pdu = list; pdu; pdu = next) {
+		next = pdu->next;
+		iscsi_outqueue_insert_counted(iscsi, pdu);
+	}
+#endif
+}
+
+void
+iscsi_add_to_outqueue(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
+{
+	int is_head = iscsi_outqueue_submit(iscsi, pdu);
 
- finished:
-        iscsi_mt_spin_unlock(&iscsi->iscsi_lock);
-        
 #if defined(HAVE_MULTITHREADING) && defined(HAVE_PTHREAD)
         if(iscsi->multithreading_enabled) {
-                if (current == NULL && pdu == iscsi->outqueue) {
-                        pthread_kill(iscsi->service_thread, SIGUSR1);
+                if (is_head) {
+                        iscsi_mt_service_thread_wakeup(iscsi);
                 }
         } else {
 #endif
-                if (iscsi->outqueue == pdu) {
+                if (is_head) {
                         iscsi->drv->service(iscsi, POLLOUT);
                 }
+                if (iscsi->loop != NULL) {
+                        iscsi_loop_touch(iscsi);
+                }
 #if defined(HAVE_MULTITHREADING) && defined(HAVE_PTHREAD)
         }
 #endif
@@ -167,6 +289,17 @@ iscsi_add_to_outqueue(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
         return;
 }
 
+/* make the service thread of a context look at its queues again */
+void
+iscsi_wakeup_service_thread(struct iscsi_context *iscsi)
+{
+#if defined(HAVE_MULTITHREADING) && defined(HAVE_PTHREAD)
+        if (iscsi->multithreading_enabled) {
+                iscsi_mt_service_thread_wakeup(iscsi);
+        }
+#endif
+}
+
 void iscsi_decrement_iface_rr() {
         /* TODO QQQ use an atomic here */
 	iface_rr--;
@@ -230,7 +363,23 @@ static int set_tcp_syncnt(struct iscsi_context *iscsi)
 	return 0;
 }
 
-static int iscsi_tcp_connect(struct iscsi_context *iscsi, union socket_address *sa, int ai_family) {
+static void set_zerocopy(struct iscsi_context *iscsi)
+{
+#ifdef HAVE_MSG_ZEROCOPY
+	int value = 1;
+
+	if (setsockopt(iscsi->fd, SOL_SOCKET, SO_ZEROCOPY, (char *)&value, sizeof(value)) != 0) {
+		ISCSI_LOG(iscsi, 1, "failed to set SO_ZEROCOPY sockopt: %s", strerror(errno));
+		return;
+	}
+	iscsi->zerocopy = 1;
+	ISCSI_LOG(iscsi, 3, "SO_ZEROCOPY set to 1");
+#else
+	ISCSI_LOG(iscsi, 1, "MSG_ZEROCOPY is not supported on this platform");
+#endif
+}
+
+int iscsi_tcp_connect(struct iscsi_context *iscsi, union socket_address *sa, int ai_family) {
 
 	int socksize;
 
@@ -262,6 +411,9 @@ static int iscsi_tcp_connect(struct iscsi_context *iscsi, union socket_address *
 		close(iscsi->fd);
 		iscsi->fd = iscsi->old_iscsi->fd;
 	}
+	if (iscsi->loop != NULL) {
+		iscsi_loop_reset_fd(iscsi);
+	}
 
 	iscsi->tcp_nonblocking = !set_nonblocking(iscsi->fd);
 
@@ -306,6 +458,12 @@ static int iscsi_tcp_connect(struct iscsi_context *iscsi, union socket_address *
 		ISCSI_LOG(iscsi,3,"TCP_NODELAY set to 1");
 	}
 
+	iscsi->zerocopy = 0;
+	iscsi->zc_next = iscsi->zc_done = 0;
+	if (iscsi->zerocopy_threshold > 0) {
+		set_zerocopy(iscsi);
+	}
+
 	if (connect(iscsi->fd, &sa->sa, socksize) != 0
 #if defined(_WIN32)
             && WSAGetLastError() != WSAEWOULDBLOCK
@@ -449,15 +607,20 @@ iscsi_connect_async(struct iscsi_context *iscsi, const char *portal,
 	return 0;
 }
 
-static int
+int
 iscsi_tcp_disconnect(struct iscsi_context *iscsi)
 {
+	iscsi_zerocopy_flush(iscsi);
+
 	if (iscsi->fd == -1) {
 		iscsi_set_error(iscsi, "Trying to disconnect "
 				"but not connected");
 		return -1;
 	}
 
+	if (iscsi->loop != NULL) {
+		iscsi_loop_reset_fd(iscsi);
+	}
 	if (iscsi->old_iscsi && iscsi->old_iscsi->fd == iscsi->fd) {
 		/* Reserve this fd because old_iscsi->fd will be reused */
 	} else {
@@ -470,6 +633,9 @@ iscsi_tcp_disconnect(struct iscsi_context *iscsi)
 	}
 
 	iscsi->fd  = -1;
+	/* anything still buffered belongs to the old connection */
+	iscsi->rx_pos = iscsi->rx_len = 0;
+	iscsi->zerocopy = 0;
 	iscsi->is_connected = 0;
 	iscsi->is_corked = 0;
 
@@ -512,10 +678,11 @@ iscsi_tcp_which_events(struct iscsi_context *iscsi)
 	}
 
         iscsi_mt_spin_lock(&iscsi->iscsi_lock);
+	iscsi_submitted_drain(iscsi);
 	if (iscsi->outqueue_current ||
-	    (iscsi->outqueue && !iscsi->is_corked &&
-	     (iscsi_serial32_compare(iscsi->outqueue->cmdsn, iscsi->maxcmdsn) <= 0 ||
-	      iscsi->outqueue->outdata.data[0] & ISCSI_PDU_IMMEDIATE)
+	    (iscsi->outqueue.head && !iscsi->is_corked &&
+	     (iscsi_serial32_compare(iscsi->outqueue.head->cmdsn, iscsi->maxcmdsn) <= 0 ||
+	      iscsi->outqueue.head->outdata.data[0] & ISCSI_PDU_IMMEDIATE)
 	    )
 	   ) {
 		events |= POLLOUT;
@@ -533,16 +700,11 @@ iscsi_which_events(struct iscsi_context *iscsi)
 int
 iscsi_queue_length(struct iscsi_context *iscsi)
 {
-	int i = 0;
-	struct iscsi_pdu *pdu;
+	int i;
 
         iscsi_mt_spin_lock(&iscsi->iscsi_lock);
-	for (pdu = iscsi->outqueue; pdu; pdu = pdu->next) {
-		i++;
-	}
-	for (pdu = iscsi->waitpdu; pdu; pdu = pdu->next) {
-		i++;
-	}
+	iscsi_submitted_drain(iscsi);
+	i = iscsi->outqueue.count + iscsi->waitpdu.count;
 	if (iscsi->is_connected == 0) {
 		i++;
 	}
@@ -554,18 +716,124 @@ iscsi_queue_length(struct iscsi_context *iscsi)
 int
 iscsi_out_queue_length(struct iscsi_context *iscsi)
 {
-	int i = 0;
-	struct iscsi_pdu *pdu;
+	int i;
 
         iscsi_mt_spin_lock(&iscsi->iscsi_lock);
-	for (pdu = iscsi->outqueue; pdu; pdu = pdu->next) {
-		i++;
-	}
+	iscsi_submitted_drain(iscsi);
+	i = iscsi->outqueue.count;
         iscsi_mt_spin_unlock(&iscsi->iscsi_lock);
 
 	return i;
 }
 
+/*
+ * Reads of less than half the receive buffer go through the buffer,
+ * larger ones go straight to the socket once the buffer is drained.
+ */
+static int
+iscsi_rx_want_fill(struct iscsi_context *iscsi, size_t len)
+{
+	return !iscsi->rx_fed && iscsi->rx_buf_size &&
+		iscsi->rx_pos == iscsi->rx_len &&
+		len < iscsi->rx_buf_size / 2;
+}
+
+/* returns the result of recv() */
+static ssize_t
+iscsi_rx_fill(struct iscsi_context *iscsi)
+{
+	ssize_t count;
+
+	if (iscsi->rx_buf == NULL) {
+		iscsi->rx_buf = iscsi_malloc(iscsi, iscsi->rx_buf_size);
+		if (iscsi->rx_buf == NULL) {
+			iscsi_set_error(iscsi, "Out-of-memory: failed to malloc "
+					"receive buffer");
+			errno = ENOMEM;
+			return -1;
+		}
+	}
+
+	iscsi->stats.rx_syscalls++;
+	count = recv(iscsi->fd, (void *)iscsi->rx_buf, iscsi->rx_buf_size, 0);
+	iscsi->rx_pos = 0;
+	iscsi->rx_len = count > 0 ? count : 0;
+	return count;
+}
+
+/*
+ * recv() that uses the receive buffer if there is one.
+ * If data_digest is not NULL the data is folded into it, data copied out
+ * of the receive buffer is digested as it is copied.
+ */
+static ssize_t
+iscsi_recv(struct iscsi_context *iscsi, void *buf, size_t len,
+	   uint32_t *data_digest)
+{
+	ssize_t count;
+
+	if (iscsi_rx_want_fill(iscsi, len)) {
+		count = iscsi_rx_fill(iscsi);
+		if (count <= 0) {
+			return count;
+		}
+	}
+
+	if (iscsi->rx_pos < iscsi->rx_len) {
+		count = MIN(len, iscsi->rx_len - iscsi->rx_pos);
+		if (data_digest) {
+			*data_digest = crc32c_chain_copy(*data_digest, buf,
+					&iscsi->rx_buf[iscsi->rx_pos], count);
+		} else {
+			memcpy(buf, &iscsi->rx_buf[iscsi->rx_pos], count);
+		}
+		iscsi->rx_pos += count;
+		return count;
+	}
+
+	if (iscsi->rx_fed) {
+		errno = EAGAIN;
+		return -1;
+	}
+	iscsi->stats.rx_syscalls++;
+	count = recv(iscsi->fd, buf, len, 0);
+	if (data_digest && count > 0) {
+		*data_digest = crc32c_chain(*data_digest, buf, count);
+	}
+	return count;
+}
+
+/* copy buffered data into an iovec array, like readv() would */
+static ssize_t
+iscsi_rx_copy_iov(struct iscsi_context *iscsi, struct iovec *iov, int niov,
+		  uint32_t *data_digest)
+{
+	ssize_t n = 0;
+	size_t len;
+	int i;
+
+	for (i = 0; i < niov && iscsi->rx_pos < iscsi->rx_len; i++) {
+		len = MIN(iov[i].iov_len, iscsi->rx_len - iscsi->rx_pos);
+		if (data_digest) {
+			*data_digest = crc32c_chain_copy(*data_digest,
+					iov[i].iov_base,
+					&iscsi->rx_buf[iscsi->rx_pos], len);
+		} else {
+			memcpy(iov[i].iov_base, &iscsi->rx_buf[iscsi->rx_pos],
+			       len);
+		}
+		iscsi->rx_pos += len;
+		n += len;
+	}
+	return n;
+}
+
+void
+iscsi_get_stats(struct iscsi_context *iscsi, struct iscsi_stats *stats)
+{
+	*stats = iscsi->stats;
+}
+
 ssize_t
 iscsi_iovector_readv_writev(struct iscsi_context *iscsi, struct scsi_iovector *iovector, uint32_t pos, ssize_t count, uint32_t *data_digest_ptr, int do_write)
 {
@@ -599,6 +867,13 @@ iscsi_iovector_readv_writev(struct iscsi_context *iscsi, struct scsi_iovector *i
 		return -1;
 	}
 
+	if (!do_write && iscsi_rx_want_fill(iscsi, count)) {
+		n = iscsi_rx_fill(iscsi);
+		if (n <= 0) {
+			return n;
+		}
+	}
+
 	/* iov is a pointer to the first iovec to pass */
 	iov = &iovector->iov[iovector->consumed];
 	pos -= iovector->offset;
@@ -646,8 +921,18 @@ iscsi_iovector_readv_writev(struct iscsi_context *iscsi, struct scsi_iovector *i
 	iov->iov_len -= pos;
 
 	if (do_write) {
+		iscsi->stats.tx_syscalls++;
 		n = writev(iscsi->fd, (struct iovec*) iov, niov);
+	} else if (iscsi->rx_pos < iscsi->rx_len) {
+		/* digested while it is copied */
+		n = iscsi_rx_copy_iov(iscsi, (struct iovec*) iov, niov,
+				      data_digest_ptr);
+		data_digest_ptr = NULL;
+	} else if (iscsi->rx_fed) {
+		errno = EAGAIN;
+		n = -1;
 	} else {
+		iscsi->stats.rx_syscalls++;
 		n = readv(iscsi->fd, (struct iovec*) iov, niov);
 	}
 
@@ -691,20 +976,12 @@ iscsi_read_from_socket(struct iscsi_context *iscsi)
 	do {
 		hdr_size = ISCSI_HEADER_SIZE(iscsi->header_digest);
 		if (iscsi->incoming == NULL) {
-			iscsi->incoming = iscsi_zmalloc(iscsi, sizeof(struct iscsi_in_pdu));
+			iscsi->incoming = iscsi_get_iscsi_in_pdu(iscsi);
 			if (iscsi->incoming == NULL) {
 				iscsi_set_error(iscsi, "Out-of-memory: failed to malloc iscsi_in_pdu");
                                 goto finished;
 			}
                 }
-		if (iscsi->incoming->hdr == NULL) {
-			crc32c_init(&(iscsi->incoming->calculated_data_digest));
-			iscsi->incoming->hdr = iscsi_malloc(iscsi, hdr_size);
-			if (iscsi->incoming->hdr == NULL) {
-				iscsi_set_error(iscsi, "Out-of-memory");
-                                goto finished;
-			}
-		}
 		in = iscsi->incoming;
 
 		/* first we must read the header, including any digests */
@@ -713,8 +990,8 @@ iscsi_read_from_socket(struct iscsi_context *iscsi)
 			 * no need to limit the read to what is available in the socket
 			 */
 			count = hdr_size - in->hdr_pos;
-			count = recv(iscsi->fd, (void *)&in->hdr[in->hdr_pos],
-                                     count, 0);
+			count = iscsi_recv(iscsi, (void *)&in->hdr[in->hdr_pos],
+					   count, NULL);
 			if (count == 0) {
 				/* remote side has closed the socket. */
                                 goto finished;
@@ -747,28 +1024,47 @@ iscsi_read_from_socket(struct iscsi_context *iscsi)
 			unsigned char padding_buf[3];
 			unsigned char *buf = padding_buf;
 			struct scsi_iovector * iovector_in;
+			unsigned char *datain = NULL;
 
 			count = data_size - in->data_pos;
 
 			/* first try to see if we already have a user buffer */
 			iovector_in = iscsi_get_scsi_task_iovector_in(iscsi, in);
+			if (iovector_in == NULL &&
+			    (in->data_pos == 0 || in->data_placed)) {
+				/* or a reassembly buffer */
+				datain = iscsi_get_scsi_task_datain_buf(iscsi, in);
+				in->data_placed = datain != NULL;
+			}
 			if (iovector_in != NULL && count > padding_size) {
 				uint32_t offset = scsi_get_uint32(&in->hdr[40]);
 				count = iscsi_iovector_readv_writev(iscsi, iovector_in, in->data_pos + offset, count - padding_size, do_data_digest ? &(in->calculated_data_digest) : NULL, 0);
 			} else {
-				if (iovector_in == NULL) {
-					if (in->data == NULL) {
-						in->data = iscsi_malloc(iscsi, data_size);
+				if (datain != NULL && count > padding_size) {
+					buf = &datain[in->data_pos];
+					count -= padding_size;
+				} else if (iovector_in == NULL && datain == NULL) {
+					if (in->data_alloc < (size_t)data_size) {
+						/* size recycled buffers for the
+						 * largest segment we accept */
+						size_t size = data_size;
+
+						if (iscsi->cache_allocations) {
+							size = MAX(size, (iscsi->initiator_max_recv_data_segment_length + 3) & 0xfffffffc);
+						}
+						iscsi_free(iscsi, in->data);
+						in->data_alloc = 0;
+						in->data = iscsi_malloc(iscsi, size);
 						if (in->data == NULL) {
 							iscsi_set_error(iscsi, "Out-of-memory: failed to malloc iscsi_in_pdu->data(%d)", (int)data_size);
                                                         goto finished;
 						}
+						in->data_alloc = size;
 					}
 					buf = &in->data[in->data_pos];
 				}
-				count = recv(iscsi->fd, (void *)buf, count, 0);
-				if (do_data_digest && count > 0)
-					in->calculated_data_digest = crc32c_chain(in->calculated_data_digest, buf, count);
+				count = iscsi_recv(iscsi, (void *)buf, count,
+						   do_data_digest ? &in->calculated_data_digest : NULL);
 			}
 			if (count == 0) {
 				/* remote side has closed the socket. */
@@ -791,7 +1087,7 @@ iscsi_read_from_socket(struct iscsi_context *iscsi)
 		if (data_size != 0 && do_data_digest &&
 			in->received_data_digest_bytes < ISCSI_DIGEST_SIZE) {
 
-			count = recv(iscsi->fd, (void *)(in->data_digest_buf + in->received_data_digest_bytes), ISCSI_DIGEST_SIZE - in->received_data_digest_bytes, 0);
+			count = iscsi_recv(iscsi, (void *)(in->data_digest_buf + in->received_data_digest_bytes), ISCSI_DIGEST_SIZE - in->received_data_digest_bytes, NULL);
 			if (count == 0) {
 				/* remote side has closed the socket. */
                                 goto finished;
@@ -810,18 +1106,54 @@ iscsi_read_from_socket(struct iscsi_context *iscsi)
 		}
 
                 iscsi->incoming = NULL;
+		iscsi->stats.rx_pdus++;
 		if (iscsi_process_pdu(iscsi, in) != 0) {
 			iscsi_free_iscsi_in_pdu(iscsi, in);
                         goto finished;
 		}
 		iscsi_free_iscsi_in_pdu(iscsi, in);
-        } while (iscsi->tcp_nonblocking && iscsi->waitpdu && iscsi->is_loggedin); //QQQ break the loop
+		/* poll() will not tell us about data we already buffered */
+        } while (iscsi->rx_pos < iscsi->rx_len ||
+		 (iscsi->tcp_nonblocking && iscsi->waitpdu.head && iscsi->is_loggedin)); //QQQ break the loop
 
         ret = 0;
  finished:
 	return ret;
 }
 
+/*
+ * Process data that the transport has already received into buf,
+ * instead of reading from the socket. All of it is consumed.
+ */
+int
+iscsi_read_from_buffer(struct iscsi_context *iscsi, unsigned char *buf,
+		       size_t len)
+{
+	unsigned char *rx_buf = iscsi->rx_buf;
+	int ret;
+
+	iscsi->rx_buf = buf;
+	iscsi->rx_pos = 0;
+	iscsi->rx_len = len;
+	iscsi->rx_fed = 1;
+
+	ret = iscsi_read_from_socket(iscsi);
+
+	/* a callback may have started a reconnect, in which case our
+	 * buffer went along with the rest of the context to old_iscsi */
+	if (iscsi->old_iscsi && iscsi->old_iscsi->rx_buf == buf) {
+		iscsi->old_iscsi->rx_buf = rx_buf;
+		iscsi->old_iscsi->rx_pos = iscsi->old_iscsi->rx_len = 0;
+		iscsi->old_iscsi->rx_fed = 0;
+	}
+	if (iscsi->rx_buf == buf) {
+		iscsi->rx_buf = rx_buf;
+		iscsi->rx_pos = iscsi->rx_len = 0;
+		iscsi->rx_fed = 0;
+	}
+	return ret;
+}
+
 static int iscsi_pdu_update_headerdigest(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
 {
 	uint32_t crc;
@@ -841,218 +1173,766 @@ static int iscsi_pdu_update_headerdigest(struct iscsi_context *iscsi, struct isc
 	return 0;
 }
 
-static int
-iscsi_write_to_socket(struct iscsi_context *iscsi)
+/* the most iovecs we pass to a single sendmsg() */
+#ifndef IOV_MAX
+#ifdef UIO_MAXIOV
+#define IOV_MAX UIO_MAXIOV
+#else
+#define IOV_MAX 16
+#endif
+#endif
+#define ISCSI_SEND_IOV_MAX MIN(IOV_MAX, ISCSI_SEND_BATCH_IOV)
+
+static ssize_t
+iscsi_sendv(struct iscsi_context *iscsi, struct iovec *iov, int niov,
+	    int socket_flags)
 {
-	ssize_t count, data_segment_len;
-	size_t total;
-	struct iscsi_pdu *pdu;
-	static char padding_buf[3];
-	int socket_flags = 0;
-	bool do_data_digest = (iscsi->data_digest != ISCSI_DATA_DIGEST_NONE), execute_data_digest = false;
+#if defined(_WIN32) || defined(AROS)
+	iscsi->stats.tx_syscalls++;
+	return writev(iscsi->fd, iov, niov);
+#else
+	struct msghdr msg;
+
 #ifdef MSG_NOSIGNAL
 	socket_flags |= MSG_NOSIGNAL;
 #elif SO_NOSIGPIPE
 	socket_flags |= SO_NOSIGPIPE;
 #endif
 
-	if (iscsi->fd == -1) {
-		iscsi_set_error(iscsi, "trying to write but not connected");
-		return -1;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = niov;
+
+	iscsi->stats.tx_syscalls++;
+	return sendmsg(iscsi->fd, &msg, socket_flags);
+#endif
+}
+
+/*
+ * Describe count bytes of an iovector starting at pos with at most max
+ * iovecs. The iovector itself is not modified.
+ * Returns the number of iovecs used and the number of bytes they cover
+ * in *len.
+ */
+static int
+iscsi_iovector_to_iov(struct scsi_iovector *iovector, uint32_t pos,
+		      size_t count, struct iovec *iov, int max, size_t *len)
+{
+	struct scsi_iovec *src;
+	size_t offset = iovector->offset, chunk;
+	int i = iovector->consumed, n = 0;
+
+	*len = 0;
+	if (pos < offset) {
+		return 0;
+	}
+	while (i < iovector->niov && offset + iovector->iov[i].iov_len <= pos) {
+		offset += iovector->iov[i++].iov_len;
+	}
+	pos -= offset;
+	while (count > 0 && i < iovector->niov && n < max) {
+		src = &iovector->iov[i++];
+		chunk = MIN(src->iov_len - pos, count);
+		iov[n].iov_base = (void *)((uintptr_t)src->iov_base + pos);
+		iov[n].iov_len = chunk;
+		n++;
+		*len += chunk;
+		count -= chunk;
+		pos = 0;
 	}
+	return n;
+}
 
-	while (iscsi->outqueue || iscsi->outqueue_current) {
-		if (iscsi->outqueue_current == NULL) {
-			if (iscsi->is_corked) {
-				/* connection is corked we are not allowed to send
-				 * additional PDUs */
-				ISCSI_LOG(iscsi, 6, "iscsi_write_to_socket: socket is corked");
-				return 0;
-			}
-			
-			if (iscsi_serial32_compare(iscsi->outqueue->cmdsn, iscsi->maxcmdsn) > 0
-				&& !(iscsi->outqueue->outdata.data[0] & ISCSI_PDU_IMMEDIATE)) {
-				/* stop sending for non-immediate PDUs. maxcmdsn is reached */
-				ISCSI_LOG(iscsi, 6,
-				          "iscsi_write_to_socket: maxcmdsn reached (outqueue[0]->cmdsnd %08x > maxcmdsn %08x)",
-				          iscsi->outqueue->cmdsn, iscsi->maxcmdsn);
-				return 0;
-			}
+/* skip the parts of the iovector that lie before pos */
+static void
+iscsi_iovector_advance(struct scsi_iovector *iovector, uint32_t pos)
+{
+	while (iovector->consumed < iovector->niov &&
+	       iovector->offset + iovector->iov[iovector->consumed].iov_len <= pos) {
+		iovector->offset += iovector->iov[iovector->consumed].iov_len;
+		iovector->consumed++;
+	}
+}
 
-			/* pop first element of the outqueue */
-			if (iscsi_serial32_compare(iscsi->outqueue->cmdsn, iscsi->expcmdsn) < 0 &&
-				(iscsi->outqueue->outdata.data[0] & 0x3f) != ISCSI_PDU_DATA_OUT) {
-				iscsi_set_error(iscsi, "iscsi_write_to_socket: outqueue[0]->cmdsn < expcmdsn (%08x < %08x) opcode %02x",
-				                iscsi->outqueue->cmdsn, iscsi->expcmdsn, iscsi->outqueue->outdata.data[0] & 0x3f);
-				return -1;
-			}
-                        
-                        iscsi_mt_spin_lock(&iscsi->iscsi_lock);
-			iscsi->outqueue_current = iscsi->outqueue;
-			
-			/* set exp statsn */
-			if((iscsi->outqueue->outdata.data[0] & 0x3f) != ISCSI_PDU_DATA_OUT)
-				iscsi_pdu_set_expstatsn(iscsi->outqueue_current, iscsi->statsn + 1);
-			else
-				iscsi_pdu_set_expstatsn(iscsi->outqueue_current, iscsi->statsn);
-
-			/* calculate header checksum */
-			if (iscsi->header_digest != ISCSI_HEADER_DIGEST_NONE &&
-				iscsi_pdu_update_headerdigest(iscsi, iscsi->outqueue_current) != 0) {
-                                iscsi_mt_spin_unlock(&iscsi->iscsi_lock);
-				return -1;
-			}
+static size_t
+iscsi_pdu_wire_len(struct iscsi_pdu *pdu)
+{
+	return pdu->outdata.size + ((pdu->outdata_seg.size + 3) & 0xfffffffc) +
+		((pdu->payload_len + 3) & 0xfffffffc) +
+		(pdu->send_data_digest ? ISCSI_DIGEST_SIZE : 0);
+}
 
-			ISCSI_LIST_REMOVE(&iscsi->outqueue, iscsi->outqueue_current);
-			if (!(iscsi->outqueue_current->flags & ISCSI_PDU_DELETE_WHEN_SENT)) {
-				/* we have to add the pdu to the waitqueue already here
-				   since the storage might sent a R2T as soon as it has
-				   received the header. if we sent immediate data in a
-				   cmd PDU the R2T might get lost otherwise. */
-				ISCSI_LIST_ADD_END(&iscsi->waitpdu, iscsi->outqueue_current);
-			}
-                        iscsi_mt_spin_unlock(&iscsi->iscsi_lock);
-		}
+/*
+ * Start the data digest of a pdu. The digest of outdata_seg was built up
+ * as it was added, the payload is digested by iscsi_pdu_digest_ahead()
+ * unless the submitting thread already filled in outdigest.
+ */
+static void
+iscsi_pdu_prepare_data_digest(struct iscsi_context *iscsi,
+			      struct iscsi_pdu *pdu)
+{
+	static uint8_t padding_buf[3];
 
-		pdu = iscsi->outqueue_current;
-		pdu->outdata.size = (pdu->outdata.size + 3) & 0xfffffffc;
+	pdu->send_data_digest = false;
+	if (iscsi->data_digest == ISCSI_DATA_DIGEST_NONE ||
+	    (pdu->outdata_seg.size == 0 && pdu->payload_len == 0)) {
+		return;
+	}
 
-		/* Write header and any immediate data */
-		if (pdu->outdata_written < pdu->outdata.size) {
-			count = send(iscsi->fd,
-				     (void *)(pdu->outdata.data +
-                                              pdu->outdata_written),
-				     pdu->outdata.size - pdu->outdata_written,
-				     socket_flags);
-			if (count == -1) {
-				if (errno == EAGAIN || errno == EWOULDBLOCK) {
-					return 0;
-				}
-				iscsi_set_error(iscsi, "Error when writing to "
-						"socket :%d", errno);
-				return -1;
-			}
-			pdu->outdata_written += count;
-		}
-		/* if we havent written the full header yet. */
-		if (pdu->outdata_written != pdu->outdata.size) {
-			return 0;
-		}
+	if (pdu->data_digest_precomputed) {
+		pdu->payload_digest_len = pdu->payload_len;
+		pdu->send_data_digest = true;
+		return;
+	}
 
-		
-		if (do_data_digest) {
-			data_segment_len = iscsi_get_pdu_data_size(pdu->outdata.data);
+	/* the data segment is zero padded by iscsi_add_data() */
+	pdu->payload_digest = crc32c_chain(pdu->calculated_data_digest,
+			padding_buf,
+			((pdu->outdata_seg.size + 3) & 0xfffffffc) -
+			pdu->outdata_seg.size);
+	pdu->payload_digest_len = 0;
+	pdu->send_data_digest = true;
+}
 
-			if (data_segment_len && !pdu->payload_len)
-				execute_data_digest = true;
-			else
-				execute_data_digest = false;
-		}
+/*
+ * Digest up to max more bytes of the payload of a pdu, and fill in
+ * outdigest once all of it is digested. Only what has been digested is
+ * handed to the socket, so the data is still cache hot when the kernel
+ * copies it.
+ * Returns the number of bytes digested or -1 on error.
+ */
+static ssize_t
+iscsi_pdu_digest_ahead(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
+		       size_t max)
+{
+	static uint8_t padding_buf[3];
+	struct scsi_iovector *iovector_out;
+	struct iovec iov[16];
+	uint32_t crc = pdu->payload_digest;
+	uint32_t pos = pdu->payload_offset + pdu->payload_digest_len;
+	size_t count, len, done = 0;
+	int i, niov;
+
+	if (!pdu->send_data_digest || pdu->data_digest_precomputed) {
+		return 0;
+	}
 
-		if (execute_data_digest && !pdu->outdata_digest_computed) {
-			uint8_t ahslen = pdu->outdata.data[4];
-			uint8_t head_len = iscsi->header_digest != ISCSI_HEADER_DIGEST_NONE ? 52 : 48;
-			uint32_t offset = head_len + ahslen * 4;
-			pdu->calculated_data_digest = crc32c_chain(pdu->calculated_data_digest, pdu->outdata.data + offset, pdu->outdata.size - offset);
-			pdu->outdata_digest_computed = true;
+	count = MIN(max, pdu->payload_len - pdu->payload_digest_len);
+	if (count) {
+		iovector_out = iscsi_get_scsi_task_iovector_out(iscsi, pdu);
+		if (iovector_out == NULL) {
+			iscsi_set_error(iscsi, "Can't find iovector data for DATA-OUT");
+			return -1;
+		}
+	}
+	while (done < count) {
+		niov = iscsi_iovector_to_iov(iovector_out, pos + done,
+					     count - done, iov, 16, &len);
+		if (len == 0) {
+			iscsi_set_error(iscsi, "Not enough iovector data "
+					"for DATA-OUT");
+			return -1;
 		}
+		for (i = 0; i < niov; i++) {
+			crc = crc32c_chain(crc, iov[i].iov_base,
+					   iov[i].iov_len);
+		}
+		done += len;
+	}
+	pdu->payload_digest = crc;
+	pdu->payload_digest_len += done;
+
+	if (pdu->payload_digest_len == pdu->payload_len) {
+		crc = crc32c_chain(crc, padding_buf,
+				   ((pdu->payload_len + 3) & 0xfffffffc) -
+				   pdu->payload_len);
+		crc = crc32c_chain_done(crc);
+		pdu->outdigest[3] = (crc >> 24);
+		pdu->outdigest[2] = (crc >> 16);
+		pdu->outdigest[1] = (crc >>  8);
+		pdu->outdigest[0] = (crc);
+	}
+	return done;
+}
+
+/*
+ * Add iovecs for the part of a buffer that has not been written yet.
+ * *skip is the number of bytes of this pdu that were already written,
+ * counted from the start of this buffer.
+ */
+static void
+iscsi_add_send_iov(void *buf, size_t size, size_t *skip,
+		   struct iovec *iov, int max, int *niov, size_t *len)
+{
+	if (*skip >= size) {
+		*skip -= size;
+		return;
+	}
+	if (*niov >= max) {
+		return;
+	}
+	iov[*niov].iov_base = (unsigned char *)buf + *skip;
+	iov[*niov].iov_len = size - *skip;
+	*len += size - *skip;
+	(*niov)++;
+	*skip = 0;
+}
 
-		/* Write any iovectors that might have been passed to us */
-		while (pdu->payload_written < pdu->payload_len) {
-			struct scsi_iovector* iovector_out;
+/*
+ * Add iovecs for the rest of a pdu to iov[]. Stops early if we run out
+ * of iovecs. The iovecs that point into the task data are returned in
+ * *payload_iov and *payload_niov.
+ * Returns the number of bytes added or -1 on error.
+ */
+static ssize_t
+iscsi_pdu_to_iov(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
+		 struct iovec *iov, int max, int *niov,
+		 int *payload_iov, int *payload_niov)
+{
+	static char padding_buf[3];
+	struct scsi_iovector *iovector_out;
+	size_t skip = pdu->written, len = 0, payload_len, avail;
+	int n;
+
+	iscsi_add_send_iov(pdu->outdata.data, pdu->outdata.size, &skip,
+			   iov, max, niov, &len);
+	if (pdu->outdata_seg.size) {
+		iscsi_add_send_iov(pdu->outdata_seg.data,
+				   (pdu->outdata_seg.size + 3) & 0xfffffffc,
+				   &skip, iov, max, niov, &len);
+	}
 
+	if (pdu->payload_len) {
+		/* only send what has been digested */
+		avail = pdu->send_data_digest ? pdu->payload_digest_len :
+			pdu->payload_len;
+		if (skip >= pdu->payload_len) {
+			skip -= pdu->payload_len;
+		} else if (skip >= avail) {
+			return len;
+		} else if (*niov < max) {
 			iovector_out = iscsi_get_scsi_task_iovector_out(iscsi, pdu);
-
 			if (iovector_out == NULL) {
 				iscsi_set_error(iscsi, "Can't find iovector data for DATA-OUT");
 				return -1;
 			}
-
-			count = iscsi_iovector_readv_writev(iscsi,
-				iovector_out,
-				pdu->payload_offset + pdu->payload_written,
-				pdu->payload_len - pdu->payload_written, do_data_digest ? &(pdu->calculated_data_digest) : NULL, 1);
-			if (count == -1) {
-				if (errno == EAGAIN || errno == EWOULDBLOCK) {
-					return 0;
+			n = iscsi_iovector_to_iov(iovector_out,
+						  pdu->payload_offset + skip,
+						  avail - skip,
+						  &iov[*niov], max - *niov,
+						  &payload_len);
+			*payload_iov = *niov;
+			*payload_niov = n;
+			*niov += n;
+			len += payload_len;
+			if (payload_len < pdu->payload_len - skip) {
+				if (*niov < max && payload_len < avail - skip) {
+					iscsi_set_error(iscsi, "Not enough iovector "
+							"data for DATA-OUT");
+					return -1;
 				}
-				return -1;
+				return len;
 			}
+			skip = 0;
+		}
+		iscsi_add_send_iov(padding_buf, ((pdu->payload_len + 3) &
+				   0xfffffffc) - pdu->payload_len,
+				   &skip, iov, max, niov, &len);
+	}
+
+	if (pdu->send_data_digest) {
+		iscsi_add_send_iov(pdu->outdigest, ISCSI_DIGEST_SIZE, &skip,
+				   iov, max, niov, &len);
+	}
+	return len;
+}
+
+/*
+ * Take the next pdu that we are allowed to send off the outqueue.
+ * Returns NULL if there is none and sets *err on error.
+ */
+static struct iscsi_pdu *
+iscsi_outqueue_pop(struct iscsi_context *iscsi, int *err)
+{
+	struct iscsi_pdu *pdu = iscsi->outqueue.head;
+
+	if (pdu == NULL) {
+		return NULL;
+	}
+
+	if (iscsi->is_corked) {
+		/* connection is corked we are not allowed to send
+		 * additional PDUs */
+		ISCSI_LOG(iscsi, 6, "iscsi_write_to_socket: socket is corked");
+		return NULL;
+	}
+
+	if (iscsi_serial32_compare(pdu->cmdsn, iscsi->maxcmdsn) > 0
+		&& !(pdu->outdata.data[0] & ISCSI_PDU_IMMEDIATE)) {
+		/* stop sending for non-immediate PDUs. maxcmdsn is reached */
+		ISCSI_LOG(iscsi, 6,
+		          "iscsi_write_to_socket: maxcmdsn reached (outqueue[0]->cmdsnd %08x > maxcmdsn %08x)",
+		          pdu->cmdsn, iscsi->maxcmdsn);
+		return NULL;
+	}
+
+	if (iscsi_serial32_compare(pdu->cmdsn, iscsi->expcmdsn) < 0 &&
+		(pdu->outdata.data[0] & 0x3f) != ISCSI_PDU_DATA_OUT) {
+		iscsi_set_error(iscsi, "iscsi_write_to_socket: outqueue[0]->cmdsn < expcmdsn (%08x < %08x) opcode %02x",
+		                pdu->cmdsn, iscsi->expcmdsn, pdu->outdata.data[0] & 0x3f);
+		*err = -1;
+		return NULL;
+	}
 
-			pdu->payload_written += count;
+        iscsi_mt_spin_lock(&iscsi->iscsi_lock);
+	if (pdu->burst_end) {
+		/* cut the next pdu off a DATA-OUT burst */
+		pdu = iscsi_data_out_next(iscsi, pdu);
+		if (pdu == NULL) {
+			iscsi_mt_spin_unlock(&iscsi->iscsi_lock);
+			*err = -1;
+			return NULL;
 		}
+	}
 
-		total = pdu->payload_len;
-		total = (total + 3) & 0xfffffffc;
+	/* set exp statsn */
+	if((pdu->outdata.data[0] & 0x3f) != ISCSI_PDU_DATA_OUT)
+		iscsi_pdu_set_expstatsn(pdu, iscsi->statsn + 1);
+	else
+		iscsi_pdu_set_expstatsn(pdu, iscsi->statsn);
+
+	/* calculate header checksum */
+	if (iscsi->header_digest != ISCSI_HEADER_DIGEST_NONE &&
+		iscsi_pdu_update_headerdigest(iscsi, pdu) != 0) {
+                iscsi_mt_spin_unlock(&iscsi->iscsi_lock);
+		*err = -1;
+		return NULL;
+	}
 
-		/* Write padding */
-		if (pdu->payload_written < total) {
-			count = send(iscsi->fd, padding_buf, total - pdu->payload_written, socket_flags);
-			if (count == -1) {
-				if (errno == EAGAIN || errno == EWOULDBLOCK) {
-					return 0;
-				}
-				iscsi_set_error(iscsi, "Error when writing to "
-						"socket :%d", errno);
-				return -1;
-			}
+	if (pdu->flags & ISCSI_PDU_IN_OUTQUEUE) {
+		iscsi_outqueue_remove(iscsi, pdu);
+	}
+	if (!(pdu->flags & ISCSI_PDU_DELETE_WHEN_SENT)) {
+		/* we have to add the pdu to the waitqueue already here
+		   since the storage might sent a R2T as soon as it has
+		   received the header. if we sent immediate data in a
+		   cmd PDU the R2T might get lost otherwise. */
+		iscsi_waitpdu_add(iscsi, pdu);
+	}
+        iscsi_mt_spin_unlock(&iscsi->iscsi_lock);
+
+	pdu->written = 0;
+	if ((pdu->outdata.data[0] & 0x3f) == ISCSI_PDU_SCSI_REQUEST) {
+		pdu->scsi_cbdata.zc_pending = false;
+	}
+	iscsi_pdu_prepare_data_digest(iscsi, pdu);
+	return pdu;
+}
+
+/* put a pdu that we popped but did not start to write back on the outqueue */
+static void
+iscsi_outqueue_unpop(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
+{
+        iscsi_mt_spin_lock(&iscsi->iscsi_lock);
+	if (pdu->flags & ISCSI_PDU_IN_WAITPDU) {
+		iscsi_waitpdu_remove(iscsi, pdu);
+	}
+	iscsi_outqueue_requeue(iscsi, pdu);
+        iscsi_mt_spin_unlock(&iscsi->iscsi_lock);
+}
+
+#ifdef HAVE_MSG_ZEROCOPY
+/*
+ * Complete the parked commands whose sends the kernel is done with, or
+ * all of them if all is set. They are taken off the queue first since
+ * the callbacks may disconnect or reconnect the context.
+ */
+static int
+iscsi_zerocopy_complete(struct iscsi_context *iscsi, int all)
+{
+	struct iscsi_pdu_queue done = {NULL, NULL, 0};
+	struct iscsi_pdu *pdu, *next_pdu;
+	struct iscsi_in_pdu *in;
+	int ret = 0;
+
+	if (iscsi->zc_parked.head == NULL) {
+		return 0;
+	}
 
-			if (do_data_digest)
-				pdu->calculated_data_digest = crc32c_chain(pdu->calculated_data_digest, (uint8_t *)padding_buf, count);
+        iscsi_mt_spin_lock(&iscsi->iscsi_lock);
+	for (pdu = iscsi->zc_parked.head; pdu; pdu = next_pdu) {
+		next_pdu = pdu->next;
+		if (!all && iscsi_serial32_compare(pdu->scsi_cbdata.zc_seq,
+						   iscsi->zc_done) >= 0) {
+			continue;
+		}
+		ISCSI_QUEUE_REMOVE(&iscsi->zc_parked, pdu);
+		ISCSI_QUEUE_ADD_END(&done, pdu);
+	}
+        iscsi_mt_spin_unlock(&iscsi->iscsi_lock);
 
-			pdu->payload_written += count;
+	while ((pdu = done.head)) {
+		ISCSI_QUEUE_REMOVE(&done, pdu);
+		in = pdu->scsi_cbdata.zc_response;
+		pdu->scsi_cbdata.zc_response = NULL;
+		if (iscsi_process_scsi_reply(iscsi, pdu, in) != 0) {
+			ret = -1;
 		}
+		iscsi_free_iscsi_in_pdu(iscsi, in);
+		iscsi->drv->free_pdu(iscsi, pdu);
+	}
+	return ret;
+}
 
-		/* if we havent written the full padding yet. */
-		if (pdu->payload_written < total) {
-			return 0;
+/* read the completions of MSG_ZEROCOPY sends off the socket error queue,
+ * and complete the commands that were waiting for them */
+static int
+iscsi_zerocopy_reap(struct iscsi_context *iscsi)
+{
+	char control[CMSG_SPACE(sizeof(struct sock_extended_err)) +
+		     CMSG_SPACE(sizeof(struct sockaddr_in6))];
+	struct sock_extended_err *serr;
+	struct cmsghdr *cm;
+	struct msghdr msg;
+
+	for (;;) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		if (recvmsg(iscsi->fd, &msg, MSG_ERRQUEUE) == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				return iscsi_zerocopy_complete(iscsi, 0);
+			}
+			iscsi_set_error(iscsi, "Failed to read zerocopy "
+					"completions :%d", errno);
+			return -1;
+		}
+		for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+			if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) &&
+			    !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)) {
+				continue;
+			}
+			serr = (struct sock_extended_err *)CMSG_DATA(cm);
+			if (serr->ee_errno != 0 ||
+			    serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+				continue;
+			}
+			if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+				ISCSI_LOG(iscsi, 9, "zerocopy sends %u-%u were copied",
+					  serr->ee_info, serr->ee_data);
+			}
+			/* TCP completes the sends in order, [ee_info, ee_data] */
+			if (iscsi_serial32_compare(serr->ee_data + 1,
+						   iscsi->zc_done) > 0) {
+				iscsi->zc_done = serr->ee_data + 1;
+			}
 		}
+	}
+}
+#endif
 
-		/*
-		 * Maybe update the total again, and write the digest, but only if
-		 * 1. DataDigest has been negociated, and
-		 * 2. We have actually written some data
-		 */
-		if (execute_data_digest || (do_data_digest && pdu->payload_written)) {
-			uint32_t data_digest = crc32c_chain_done(pdu->calculated_data_digest);
-			char data_digest_buf[ISCSI_DIGEST_SIZE];
-
-			total += ISCSI_DIGEST_SIZE;
-
-			data_digest_buf[3] = (data_digest >> 24);
-			data_digest_buf[2] = (data_digest >> 16);
-			data_digest_buf[1] = (data_digest >>  8);
-			data_digest_buf[0] = (data_digest);
-
-			/* Write data digest */
-			if (pdu->payload_written < total) {
-				int todo = total - pdu->payload_written;
-				count = send(iscsi->fd, data_digest_buf + (ISCSI_DIGEST_SIZE - todo), todo, socket_flags);
-				if (count == -1) {
-					if (errno == EAGAIN || errno == EWOULDBLOCK) {
-						return 0;
-					}
-					iscsi_set_error(iscsi, "Error when writing to "
-							"socket :%d", errno);
-					return -1;
-				}
+/*
+ * The response to a write sent with MSG_ZEROCOPY has arrived. If the
+ * kernel may still hold on to the pages of its data, take the response
+ * over and complete the command from iscsi_zerocopy_reap() once the send
+ * has completed, instead of waiting for it here.
+ * Returns 1 if the command was parked, 0 if it can complete now and -1 on
+ * error.
+ */
+int
+iscsi_zerocopy_park(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
+		    struct iscsi_in_pdu *in)
+{
+#ifdef HAVE_MSG_ZEROCOPY
+	struct iscsi_in_pdu *response;
+	unsigned char *data;
+	size_t data_alloc;
+
+	if (!iscsi->zerocopy ||
+	    iscsi_serial32_compare(pdu->scsi_cbdata.zc_seq,
+				   iscsi->zc_done) < 0) {
+		return 0;
+	}
 
-				pdu->payload_written += count;
+	response = iscsi_get_iscsi_in_pdu(iscsi);
+	if (response == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory: failed to allocate "
+				"zerocopy response");
+		return -1;
+	}
+	memcpy(response->hdr_buf, in->hdr, ISCSI_MAX_HEADER_SIZE);
+	response->hdr_pos = in->hdr_pos;
+	/* the data segment changes hands instead of being copied */
+	data = response->data;
+	data_alloc = response->data_alloc;
+	response->data = in->data;
+	response->data_alloc = in->data_alloc;
+	response->data_pos = in->data_pos;
+	in->data = data;
+	in->data_alloc = data_alloc;
+
+        iscsi_mt_spin_lock(&iscsi->iscsi_lock);
+	if (pdu->flags & ISCSI_PDU_IN_WAITPDU) {
+		iscsi_waitpdu_remove(iscsi, pdu);
+	}
+	pdu->scsi_cbdata.zc_response = response;
+	ISCSI_QUEUE_ADD_END(&iscsi->zc_parked, pdu);
+        iscsi_mt_spin_unlock(&iscsi->iscsi_lock);
+	return 1;
+#else
+	return 0;
+#endif
+}
+
+/*
+ * Complete the parked commands right away. The target has all of their
+ * data and the socket is going away.
+ */
+void
+iscsi_zerocopy_flush(struct iscsi_context *iscsi)
+{
+#ifdef HAVE_MSG_ZEROCOPY
+	iscsi_zerocopy_complete(iscsi, 1);
+#endif
+}
+
+/*
+ * Send the iovecs of a batch. Runs of iovecs that are the payload of a
+ * pdu at or above the zerocopy threshold go out with MSG_ZEROCOPY and the
+ * task remembers the id of that send.
+ * Returns the number of bytes written or -1 on error.
+ */
+static ssize_t
+iscsi_sendv_batch(struct iscsi_context *iscsi, struct iscsi_send_batch *batch)
+{
+	struct iovec *iov = (struct iovec *)batch->iov;
+	int *iov_zc = batch->iov_zc;
+	struct iscsi_scsi_cbdata *cbdata;
+	ssize_t count, total = 0;
+	size_t len;
+	int i, j, flags;
+
+	for (i = 0; i < batch->niov; i = j) {
+		len = 0;
+		for (j = i; j < batch->niov && iov_zc[j] == iov_zc[i]; j++) {
+			len += iov[j].iov_len;
+		}
+		flags = 0;
+#ifdef HAVE_MSG_ZEROCOPY
+		if (iov_zc[i]) {
+			flags = MSG_ZEROCOPY;
+		}
+#endif
+		count = iscsi_sendv(iscsi, &iov[i], j - i, flags);
+		if (count == -1 && flags && errno == ENOBUFS) {
+			/* out of notification memory, just copy this one */
+			flags = 0;
+			count = iscsi_sendv(iscsi, &iov[i], j - i, flags);
+		}
+		if (count == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				break;
 			}
+			return -1;
 		}
+		if (flags && count > 0) {
+			cbdata = scsi_get_task_private_ptr(batch->pdu[iov_zc[i] - 1]->scsi_cbdata.task);
+			cbdata->zc_pending = true;
+			cbdata->zc_seq = iscsi->zc_next++;
+		}
+		total += count;
+		if ((size_t)count < len) {
+			break;
+		}
+	}
+	return total;
+}
 
-		/* if we havent written everything yet. */
-		if (pdu->payload_written != total) {
-			return 0;
+/*
+ * Gather the headers, data, padding and digests of outqueue_current and
+ * the pdus we are allowed to send after it into one iovec array.
+ * Returns -1 on error. Any pdus already in the batch must still be passed
+ * to iscsi_send_batch_done().
+ */
+int
+iscsi_send_batch_build(struct iscsi_context *iscsi,
+		       struct iscsi_send_batch *batch)
+{
+	struct iovec *iov = (struct iovec *)batch->iov;
+	struct iscsi_pdu *pdu;
+	size_t digest_budget = ISCSI_DIGEST_AHEAD;
+	ssize_t len, digested;
+	int i, err = 0, first, payload_iov, payload_niov;
+
+	batch->niov = 0;
+	batch->npdu = 0;
+
+	/* send what other threads submitted in the same batch */
+        iscsi_mt_spin_lock(&iscsi->iscsi_lock);
+	iscsi_submitted_drain(iscsi);
+        iscsi_mt_spin_unlock(&iscsi->iscsi_lock);
+
+	pdu = iscsi->outqueue_current;
+	if (pdu == NULL) {
+		pdu = iscsi_outqueue_pop(iscsi, &err);
+	}
+	while (pdu != NULL) {
+		batch->pdu[batch->npdu] = pdu;
+		batch->len[batch->npdu] = 0;
+		batch->npdu++;
+		if (err) {
+			break;
+		}
+		digested = iscsi_pdu_digest_ahead(iscsi, pdu, digest_budget);
+		if (digested < 0) {
+			err = -1;
+			break;
+		}
+		digest_budget -= digested;
+		first = batch->niov;
+		payload_iov = payload_niov = 0;
+		len = iscsi_pdu_to_iov(iscsi, pdu, iov, ISCSI_SEND_IOV_MAX,
+				       &batch->niov, &payload_iov,
+				       &payload_niov);
+		if (len < 0) {
+			err = -1;
+			break;
+		}
+		batch->len[batch->npdu - 1] = len;
+		for (i = first; i < batch->niov; i++) {
+			batch->iov_zc[i] = 0;
+		}
+		if (iscsi->zerocopy && pdu->payload_len >=
+		    (uint32_t)iscsi->zerocopy_threshold) {
+			for (i = 0; i < payload_niov; i++) {
+				batch->iov_zc[payload_iov + i] = batch->npdu;
+			}
+		}
+		/* stop at a pdu we could not add all of */
+		if (batch->niov >= ISCSI_SEND_IOV_MAX ||
+		    pdu->written + len < iscsi_pdu_wire_len(pdu) ||
+		    pdu->flags & ISCSI_PDU_CORK_WHEN_SENT ||
+		    digest_budget == 0) {
+			break;
+		}
+		pdu = iscsi_outqueue_pop(iscsi, &err);
+	}
+	return err;
+}
+
+/*
+ * Account for count bytes of a batch having been written. A pdu that was
+ * only partly written is kept in outqueue_current and any pdus after it go
+ * back on the outqueue.
+ * Returns 1 if the whole batch was written and 0 if not.
+ */
+int
+iscsi_send_batch_done(struct iscsi_context *iscsi,
+		      struct iscsi_send_batch *batch, size_t count)
+{
+	struct iscsi_pdu *pdu;
+	size_t len, total = 0;
+	int i, sent, all_sent;
+
+	for (i = 0; i < batch->npdu; i++) {
+		total += batch->len[i];
+	}
+	all_sent = count >= total;
+
+	iscsi->outqueue_current = NULL;
+	for (i = 0; i < batch->npdu; i++) {
+		pdu = batch->pdu[i];
+		len = MIN(count, batch->len[i]);
+		pdu->written += len;
+		count -= len;
+
+		if (pdu->written < iscsi_pdu_wire_len(pdu)) {
+			break;
 		}
 
+		/* the task of a pdu freed during the send may be gone */
+		if (pdu->payload_len &&
+		    !(pdu->flags & ISCSI_PDU_FREE_AFTER_SEND)) {
+			iscsi_iovector_advance(&pdu->scsi_cbdata.task->iovector_out,
+					       pdu->payload_offset + pdu->payload_len);
+		}
+		iscsi->stats.tx_pdus++;
 		if (pdu->flags & ISCSI_PDU_CORK_WHEN_SENT) {
 			iscsi->is_corked = 1;
 		}
-		if (pdu->flags & ISCSI_PDU_DELETE_WHEN_SENT) {
+		if (pdu->flags & (ISCSI_PDU_DELETE_WHEN_SENT |
+				  ISCSI_PDU_FREE_AFTER_SEND)) {
+			iscsi->drv->free_pdu(iscsi, pdu);
+		}
+	}
+	sent = i;
+	if (sent < batch->npdu) {
+		pdu = batch->pdu[sent];
+		if (pdu->flags & ISCSI_PDU_FREE_AFTER_SEND) {
 			iscsi->drv->free_pdu(iscsi, pdu);
+		} else {
+			iscsi->outqueue_current = pdu;
+		}
+	}
+	/* pdus after a partial write have not been started, requeue
+	 * them in reverse so they keep their order */
+	for (i = batch->npdu - 1; i > sent; i--) {
+		pdu = batch->pdu[i];
+		if (pdu->flags & ISCSI_PDU_FREE_AFTER_SEND) {
+			iscsi->drv->free_pdu(iscsi, pdu);
+		} else {
+			iscsi_outqueue_unpop(iscsi, pdu);
+		}
+	}
+	return all_sent;
+}
+
+/*
+ * Write as many pdus as we can, one sendmsg() per batch.
+ */
+static int
+iscsi_write_to_socket(struct iscsi_context *iscsi)
+{
+	struct iscsi_send_batch *batch = iscsi->send_batch;
+	ssize_t count;
+	int err;
+
+	if (iscsi->fd == -1) {
+		iscsi_set_error(iscsi, "trying to write but not connected");
+		return -1;
+	}
+
+	if (batch == NULL) {
+		batch = iscsi_malloc(iscsi, sizeof(*batch));
+		if (batch == NULL) {
+			iscsi_set_error(iscsi, "Out-of-memory: failed to malloc "
+					"send batch");
+			return -1;
+		}
+		iscsi->send_batch = batch;
+	}
+
+	while (iscsi->outqueue.head || iscsi->outqueue_current) {
+		err = iscsi_send_batch_build(iscsi, batch);
+		if (batch->npdu == 0) {
+			return err;
+		}
+
+		count = 0;
+		if (!err && batch->niov) {
+			count = iscsi_sendv_batch(iscsi, batch);
+			if (count == -1) {
+				iscsi_set_error(iscsi, "Error when writing to "
+						"socket :%d", errno);
+				err = -1;
+				count = 0;
+			}
+		}
+
+		if (!iscsi_send_batch_done(iscsi, batch, count) || err) {
+			/* the socket is full or broken */
+			return err;
 		}
-		iscsi->outqueue_current = NULL;
 	}
 	return 0;
 }
@@ -1060,6 +1940,10 @@ iscsi_write_to_socket(struct iscsi_context *iscsi)
 int
 iscsi_service_reconnect_if_loggedin(struct iscsi_context *iscsi)
 {
+	if (iscsi->leader) {
+		iscsi_connection_failed(iscsi);
+		return 0;
+	}
 	if (iscsi->is_loggedin) {
 		if (iscsi_reconnect(iscsi) == 0) {
 			return 0;
@@ -1076,7 +1960,7 @@ iscsi_service_reconnect_if_loggedin(struct iscsi_context *iscsi)
 	return -1;
 }
 
-static int
+int
 iscsi_tcp_service(struct iscsi_context *iscsi, int revents)
 {
 	if (iscsi->fd < 0) {
@@ -1093,6 +1977,22 @@ iscsi_tcp_service(struct iscsi_context *iscsi, int revents)
 		}
 	}
 
+#ifdef HAVE_MSG_ZEROCOPY
+	if (revents & POLLERR && iscsi->zerocopy) {
+		struct pollfd pfd;
+
+		/* zerocopy completions on the error queue raise POLLERR
+		 * too. Only treat it as an error if it is still set once
+		 * they have been read. */
+		if (iscsi_zerocopy_reap(iscsi) == 0) {
+			pfd.fd = iscsi->fd;
+			pfd.events = 0;
+			if (poll(&pfd, 1, 0) == 0) {
+				revents &= ~POLLERR;
+			}
+		}
+	}
+#endif
 	if (revents & POLLERR) {
 		int err = 0;
 		socklen_t err_size = sizeof(err);
@@ -1190,10 +2090,48 @@ check_timeout:
 	return 0;
 }
 
+/*
+ * A connection of the session other than the leading one has failed.
+ * There is no recovery for a single connection at ErrorRecoveryLevel 0,
+ * so leave the commands where they are and have the leading connection
+ * reconnect the whole session, which takes them over.
+ */
+void
+iscsi_connection_failed(struct iscsi_context *iscsi)
+{
+	struct iscsi_context *leader = iscsi->leader;
+
+	iscsi_disconnect(iscsi);
+	if (!iscsi->is_loggedin) {
+		/* still logging in, fail the login */
+		iscsi_cancel_pdus(iscsi);
+		return;
+	}
+	ISCSI_LOG(iscsi, 1, "connection %u of the session failed: %s",
+		  iscsi->cid, iscsi_get_error(iscsi));
+	iscsi->is_loggedin = 0;
+	leader->connection_failed = 1;
+	iscsi_wakeup_service_thread(leader);
+	if (leader->loop != NULL) {
+		iscsi_loop_touch(leader);
+	}
+}
+
 int
 iscsi_service(struct iscsi_context *iscsi, int revents)
 {
-	return iscsi->drv->service(iscsi, revents);
+	int ret;
+
+	if (iscsi->connection_failed) {
+		iscsi->connection_failed = 0;
+		ret = iscsi_service_reconnect_if_loggedin(iscsi);
+	} else {
+		ret = iscsi->drv->service(iscsi, revents);
+	}
+	if (iscsi->loop != NULL) {
+		iscsi_loop_touch(iscsi);
+	}
+	return ret;
 }
 
 static void iscsi_tcp_queue_pdu(struct iscsi_context *iscsi,
@@ -1202,16 +2140,85 @@ static void iscsi_tcp_queue_pdu(struct iscsi_context *iscsi,
 	iscsi_add_to_outqueue(iscsi, pdu);
 }
 
+/*
+ * Get a receive descriptor, reusing one from the pool if we can.
+ * Recycled descriptors keep their data buffer.
+ */
+struct iscsi_in_pdu *
+iscsi_get_iscsi_in_pdu(struct iscsi_context *iscsi)
+{
+	struct iscsi_in_pdu *in;
+	unsigned char *data = NULL;
+	size_t data_alloc = 0;
+
+        iscsi_mt_spin_lock(&iscsi->alloc_lock);
+	in = iscsi->in_pdu_pool;
+	if (in != NULL) {
+		iscsi->in_pdu_pool = in->next;
+		iscsi->in_pdu_pool_count--;
+	}
+        iscsi_mt_spin_unlock(&iscsi->alloc_lock);
+
+	if (in == NULL) {
+		in = iscsi_malloc(iscsi, sizeof(struct iscsi_in_pdu));
+		if (in == NULL) {
+			return NULL;
+		}
+	} else {
+		data = in->data;
+		data_alloc = in->data_alloc;
+	}
+	memset(in, 0, offsetof(struct iscsi_in_pdu, hdr_buf));
+	in->hdr = in->hdr_buf;
+	in->data = data;
+	in->data_alloc = data_alloc;
+	crc32c_init(&in->calculated_data_digest);
+
+	return in;
+}
+
 void
 iscsi_free_iscsi_in_pdu(struct iscsi_context *iscsi, struct iscsi_in_pdu *in)
 {
-	iscsi_free(iscsi, in->hdr);
+	if (iscsi->cache_allocations) {
+                iscsi_mt_spin_lock(&iscsi->alloc_lock);
+		if (iscsi->in_pdu_pool_count < ISCSI_IN_PDU_POOL_SIZE) {
+			in->next = iscsi->in_pdu_pool;
+			iscsi->in_pdu_pool = in;
+			iscsi->in_pdu_pool_count++;
+			in = NULL;
+		}
+                iscsi_mt_spin_unlock(&iscsi->alloc_lock);
+		if (in == NULL) {
+			return;
+		}
+	}
 	iscsi_free(iscsi, in->data);
 	in->data=NULL;
 	iscsi_free(iscsi, in);
 	in=NULL;
 }
 
+int iscsi_set_recv_buffer_size(struct iscsi_context *iscsi, int size)
+{
+	if (size < 0) {
+		iscsi_set_error(iscsi, "Invalid receive buffer size %d", size);
+		return -1;
+	}
+	if (iscsi->rx_pos < iscsi->rx_len) {
+		iscsi_set_error(iscsi, "Can not change the receive buffer size "
+				"while it holds data");
+		return -1;
+	}
+
+	iscsi_free(iscsi, iscsi->rx_buf);
+	iscsi->rx_buf = NULL;
+	iscsi->rx_buf_size = size;
+	iscsi->rx_pos = iscsi->rx_len = 0;
+	ISCSI_LOG(iscsi, 2, "receive buffer size set to %d", size);
+	return 0;
+}
+
 void iscsi_set_tcp_syncnt(struct iscsi_context *iscsi, int value)
 {
 	iscsi->tcp_syncnt=value;
@@ -1242,6 +2249,18 @@ void iscsi_set_tcp_keepintvl(struct iscsi_context *iscsi, int value)
 	ISCSI_LOG(iscsi, 2, "TCP_KEEPINTVL will be set to %d on next socket creation",value);
 }
 
+void iscsi_set_zerocopy_threshold(struct iscsi_context *iscsi, int threshold)
+{
+	iscsi->zerocopy_threshold=threshold;
+	ISCSI_LOG(iscsi, 2, "MSG_ZEROCOPY will be used for payloads of %d bytes or more on next socket creation",threshold);
+}
+
+void iscsi_set_data_digest_on_submit(struct iscsi_context *iscsi, int enable)
+{
+	iscsi->data_digest_on_submit=enable;
+	ISCSI_LOG(iscsi, 2, "Write data digests will be computed by the %s thread",enable ? "submitting" : "service");
+}
+
 int iscsi_set_tcp_keepalive(struct iscsi_context *iscsi, int idle, int count, int interval)
 {
 #ifdef SO_KEEPALIVE
@@ -42,6 +42,7 @@
 #include "iscsi.h"
 #include "iscsi-private.h"
 #include "scsi-lowlevel.h"
+#include "utils.h"
 
 struct iscsi_sync_state {
         int finished;
@@ -53,25 +54,72 @@ struct iscsi_sync_state {
 #endif /* HAVE_MULTITHREADING */
 };
 
+#ifdef HAVE_MULTITHREADING
+/*
+ * The service thread expires commands that pass scsi_timeout, which posts
+ * wait_sem through the callback. Should that not happen in time, cancel the
+ * command ourself, a few times. If even that does not complete it, detach
+ * the command from our state and fail it with SCSI_STATUS_TIMEOUT. Either
+ * way no callback may touch the state once we return since it lives on the
+ * caller's stack.
+ */
+static void
+mt_wait(struct iscsi_context *iscsi, struct iscsi_sync_state *state)
+{
+	int timeout = iscsi->scsi_timeout;
+	int retries = 0;
+
+	if (timeout <= 0) {
+		iscsi_mt_sem_wait(&state->wait_sem);
+		return;
+	}
+
+	timeout += ISCSI_SYNC_TIMEOUT_GRACE_MS;
+	while (iscsi_mt_sem_timedwait(&state->wait_sem, timeout) != 0) {
+		if (retries == ISCSI_SYNC_CANCEL_RETRIES) {
+			iscsi_detach_private_data(iscsi, state);
+			/* a callback already on its way still posts */
+			iscsi_mt_service_thread_sync(iscsi);
+			if (iscsi_mt_sem_timedwait(&state->wait_sem, 0) == 0) {
+				return;
+			}
+			iscsi_set_error(iscsi, "command did not complete "
+					"after it was cancelled, giving up");
+			state->status   = SCSI_STATUS_TIMEOUT;
+			state->finished = 1;
+			state->task     = NULL;
+			return;
+		}
+		if (retries++ == 0) {
+			ISCSI_LOG(iscsi, 1, "command did not complete within "
+				  "%d ms, cancelling it", iscsi->scsi_timeout);
+		}
+		iscsi_cancel_private_data(iscsi, state);
+		timeout = ISCSI_TIMEOUT_RECHECK_MS;
+	}
+}
+#endif /* HAVE_MULTITHREADING */
+
 static void
 event_loop(struct iscsi_context *iscsi, struct iscsi_sync_state *state)
 {
-        struct pollfd pfd;
-	int scsi_timeout;
-	int ret;
-	time_t t;
+        struct pollfd pfd[1 + ISCSI_MAX_CONNECTIONS];
+	struct iscsi_context *conns[1 + ISCSI_MAX_CONNECTIONS];
+	struct iscsi_context *conn;
+	uint64_t scsi_timeout, t;
+	int timeout;
+	int ret, i, n;
 
 #ifdef HAVE_MULTITHREADING
         if(iscsi->multithreading_enabled) {
-                /* TODO QQQ Must make sure the service thread event loop handle timeouts properly */
-                iscsi_mt_sem_wait(&state->wait_sem);
+                mt_wait(iscsi, state);
                 iscsi_mt_sem_destroy(&state->wait_sem);
                 return;
         }
 #endif
 
         if (iscsi->scsi_timeout) {
-		scsi_timeout = time(NULL) + iscsi->scsi_timeout;
+		scsi_timeout = iscsi_clock_ms() + iscsi->scsi_timeout;
 	} else {
 		scsi_timeout = 0;
 	}
@@ -79,8 +127,9 @@ event_loop(struct iscsi_context *iscsi, struct iscsi_sync_state *state)
 	while (state->finished == 0) {
 		short revents;
 
+		timeout = 1000;
 		if (scsi_timeout) {
-			t = time(NULL);
+			t = iscsi_clock_ms();
 			if (t > scsi_timeout) {
 				iscsi_timeout_scan(iscsi);
 
@@ -92,23 +141,46 @@ event_loop(struct iscsi_context *iscsi, struct iscsi_sync_state *state)
 				state->status = -1;
 				return;
 			}
+			if (scsi_timeout - t < (uint64_t)timeout) {
+				timeout = scsi_timeout - t + 1;
+			}
 		}
 
-		pfd.fd = iscsi_get_fd(iscsi);
-		pfd.events = iscsi_which_events(iscsi);
+		/* the session may have more connections than this one, and
+		 * any of them may carry the reply we are waiting for */
+		n = 0;
+		ISCSI_FOR_EACH_CONNECTION(iscsi, conn) {
+			if (n == 1 + ISCSI_MAX_CONNECTIONS) {
+				break;
+			}
+			/* wake up in time for the next pdu to time out */
+			ret = iscsi_next_timeout(conn);
+			if (ret >= 0 && ret < timeout) {
+				timeout = ret;
+			}
+			conns[n] = conn;
+			pfd[n].fd = iscsi_get_fd(conn);
+			pfd[n].events = iscsi_which_events(conn);
+			pfd[n].revents = 0;
+			n++;
+		}
 
-		if ((ret = poll(&pfd, 1, 1000)) < 0) {
+		if ((ret = poll(pfd, n, timeout)) < 0) {
 			iscsi_set_error(iscsi, "Poll failed");
 			state->status = -1;
 			return;
 		}
-		revents = (ret == 0) ? 0 : pfd.revents;
-		if (iscsi_service(iscsi, revents) < 0) {
-			iscsi_set_error(iscsi,
-				"iscsi_service failed with : %s",
-				iscsi_get_error(iscsi));
-			state->status = -1;
-			return;
+		/* the leading connection goes last, it picks up the
+		 * failures of the others */
+		for (i = n - 1; i >= 0; i--) {
+			revents = (ret == 0) ? 0 : pfd[i].revents;
+			if (iscsi_service(conns[i], revents) < 0) {
+				iscsi_set_error(iscsi,
+					"iscsi_service failed with : %s",
+					iscsi_get_error(conns[i]));
+				state->status = -1;
+				return;
+			}
 		}
 
 		if (iscsi->fd < 0) {
@@ -181,6 +253,22 @@ iscsi_connect_sync(struct iscsi_context *iscsi, const char *portal)
 	return (state.status == SCSI_STATUS_GOOD) ? 0 : -1;
 }
 
+int
+iscsi_add_connection_sync(struct iscsi_context *iscsi)
+{
+	struct iscsi_sync_state state;
+
+	iscsi_init_sync_state(iscsi, &state);
+
+	if (iscsi_add_connection_async(iscsi, iscsi_sync_cb, &state) != 0) {
+		return -1;
+	}
+
+	event_loop(iscsi, &state);
+
+	return (state.status == SCSI_STATUS_GOOD) ? 0 : -1;
+}
+
 int
 iscsi_full_connect_sync(struct iscsi_context *iscsi,
 			const char *portal, int lun)
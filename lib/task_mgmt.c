@@ -49,12 +49,14 @@ iscsi_task_mgmt_async(struct iscsi_context *iscsi,
 		return -1;
 	}
 
+	iscsi_submit_enter(iscsi);
 	pdu = iscsi_allocate_pdu(iscsi,
 				 ISCSI_PDU_SCSI_TASK_MANAGEMENT_REQUEST,
 				 ISCSI_PDU_SCSI_TASK_MANAGEMENT_RESPONSE,
 				 iscsi_itt_post_increment(iscsi),
 				 ISCSI_PDU_DROP_ON_RECONNECT);
 	if (pdu == NULL) {
+		iscsi_submit_leave(iscsi);
 		iscsi_set_error(iscsi, "Failed to allocate task mgmt pdu");
 		return -1;
 	}
@@ -72,7 +74,7 @@ iscsi_task_mgmt_async(struct iscsi_context *iscsi,
 	iscsi_pdu_set_ritt(pdu, ritt);
 
 	/* cmdsn is not increased if Immediate delivery*/
-	iscsi_pdu_set_cmdsn(pdu, iscsi->cmdsn);
+	iscsi_pdu_set_cmdsn(pdu, ISCSI_SESSION(iscsi)->cmdsn);
 
 	/* rcmdsn */
 	iscsi_pdu_set_rcmdsn(pdu, rcmdsn);
@@ -81,6 +83,7 @@ iscsi_task_mgmt_async(struct iscsi_context *iscsi,
 	pdu->private_data = private_data;
 
 	iscsi_queue_pdu(iscsi, pdu);
+	iscsi_submit_leave(iscsi);
 
 	return 0;
 }
@@ -102,7 +105,8 @@ iscsi_task_mgmt_abort_task_async(struct iscsi_context *iscsi,
 		      struct scsi_task *task,
 		      iscsi_command_cb cb, void *private_data)
 {
-	return iscsi_task_mgmt_async(iscsi,
+	/* abort the task on the connection it was sent on */
+	return iscsi_task_mgmt_async(iscsi_task_connection(iscsi, task),
 		      task->lun, ISCSI_TM_ABORT_TASK,
 		      task->itt, task->cmdsn,
 		      cb, private_data);
@@ -126,7 +130,11 @@ iscsi_task_mgmt_lun_reset_async(struct iscsi_context *iscsi,
 		      uint32_t lun,
 		      iscsi_command_cb cb, void *private_data)
 {
-	iscsi_cancel_lun_pdus(iscsi, lun);
+	struct iscsi_context *conn;
+
+	ISCSI_FOR_EACH_CONNECTION(iscsi, conn) {
+		iscsi_cancel_lun_pdus(conn, lun);
+	}
 
 	return iscsi_task_mgmt_async(iscsi,
 		      lun, ISCSI_TM_LUN_RESET,
@@ -0,0 +1,839 @@
+/*
+   Copyright (C) 2026 by the libiscsi authors
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * TCP transport driven by io_uring.
+ *
+ * The socket is set up and connected exactly like for TCP_TRANSPORT but all
+ * I/O on it goes through a ring:
+ *  - a multishot RECV picks buffers from a provided buffer ring and each
+ *    completion is fed to the same pdu reader that the TCP transport uses.
+ *  - the pdus that are ready to go out are gathered into one SENDMSG, and
+ *    submitted together with any recv re-arm in one io_uring_enter().
+ * The application polls the ring fd, it becomes readable when there are
+ * completions to process. The ring outlives reconnects so that fd does not
+ * change.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <endian.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "iscsi.h"
+#include "iscsi-private.h"
+#include "scsi-lowlevel.h"
+
+#define ISCSI_URING_SQ_ENTRIES	8
+#define ISCSI_URING_CQ_ENTRIES	128
+
+/* provided buffers for the multishot recv */
+#define ISCSI_URING_NBUFS	64
+#define ISCSI_URING_BUF_SIZE	(32 * 1024)
+#define ISCSI_URING_BGID	0
+
+/* what a completion is for, in cqe->user_data */
+enum iscsi_uring_op {
+	ISCSI_URING_OP_POLL   = 1,
+	ISCSI_URING_OP_RECV   = 2,
+	ISCSI_URING_OP_SEND   = 3,
+	ISCSI_URING_OP_CANCEL = 4,
+};
+
+struct iscsi_uring {
+	int ring_fd;
+
+	/* submission queue */
+	void *sq_ring;
+	size_t sq_ring_size;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	unsigned sq_entries;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+	unsigned to_submit;
+
+	/* completion queue, may share the mapping with the sq */
+	void *cq_ring;
+	size_t cq_ring_size;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	/* provided buffer ring */
+	struct io_uring_buf_ring *br;
+	unsigned short br_tail;
+	unsigned char *bufs;
+
+	/* the socket is registered as fixed file 0 */
+	int fixed_file;
+
+	/* requests the kernel has not completed yet */
+	int poll_armed;
+	int recv_armed;
+	int send_armed;
+	int cancel_armed;
+
+	/* bumped every time the ring moves to a new connection */
+	unsigned conn;
+
+	struct msghdr msg;
+	struct iscsi_send_batch batch;
+};
+
+static int
+iscsi_uring_setup_syscall(unsigned entries, struct io_uring_params *p)
+{
+	return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int
+iscsi_uring_enter_syscall(int fd, unsigned to_submit, unsigned min_complete,
+			  unsigned flags)
+{
+	return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+			    flags, NULL, 0);
+}
+
+static int
+iscsi_uring_register_syscall(int fd, unsigned opcode, void *arg,
+			     unsigned nr_args)
+{
+	return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void
+iscsi_uring_recycle_buf(struct iscsi_uring *u, unsigned short bid)
+{
+	struct io_uring_buf *buf;
+
+	buf = &u->br->bufs[u->br_tail & (ISCSI_URING_NBUFS - 1)];
+	buf->addr = (uintptr_t)&u->bufs[bid * ISCSI_URING_BUF_SIZE];
+	buf->len = ISCSI_URING_BUF_SIZE;
+	buf->bid = bid;
+	u->br_tail++;
+	__atomic_store_n(&u->br->tail, u->br_tail, __ATOMIC_RELEASE);
+}
+
+static void
+iscsi_uring_free(struct iscsi_context *iscsi, struct iscsi_uring *u)
+{
+	if (u->br != NULL) {
+		munmap(u->br, ISCSI_URING_NBUFS * sizeof(struct io_uring_buf));
+	}
+	if (u->sqes != NULL) {
+		munmap(u->sqes, u->sqes_size);
+	}
+	if (u->cq_ring != NULL && u->cq_ring != u->sq_ring) {
+		munmap(u->cq_ring, u->cq_ring_size);
+	}
+	if (u->sq_ring != NULL) {
+		munmap(u->sq_ring, u->sq_ring_size);
+	}
+	if (u->ring_fd != -1) {
+		close(u->ring_fd);
+	}
+	iscsi_free(iscsi, u->bufs);
+	iscsi_free(iscsi, u);
+}
+
+static struct iscsi_uring *
+iscsi_uring_create(struct iscsi_context *iscsi)
+{
+	struct io_uring_params p;
+	struct io_uring_buf_reg reg;
+	struct iscsi_uring *u;
+	unsigned char *sq;
+	int i;
+
+	u = iscsi_zmalloc(iscsi, sizeof(*u));
+	if (u == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory: failed to allocate "
+				"io_uring state");
+		return NULL;
+	}
+
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_CQSIZE;
+	p.cq_entries = ISCSI_URING_CQ_ENTRIES;
+	u->ring_fd = iscsi_uring_setup_syscall(ISCSI_URING_SQ_ENTRIES, &p);
+	if (u->ring_fd < 0) {
+		iscsi_set_error(iscsi, "io_uring_setup failed: %s(%d)",
+				strerror(errno), errno);
+		u->ring_fd = -1;
+		goto err;
+	}
+
+	u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	u->cq_ring_size = p.cq_off.cqes +
+		p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		u->sq_ring_size = MAX(u->sq_ring_size, u->cq_ring_size);
+	}
+	u->sq_ring = mmap(NULL, u->sq_ring_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, u->ring_fd,
+			  IORING_OFF_SQ_RING);
+	if (u->sq_ring == MAP_FAILED) {
+		u->sq_ring = NULL;
+		iscsi_set_error(iscsi, "failed to map io_uring sq: %s(%d)",
+				strerror(errno), errno);
+		goto err;
+	}
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		u->cq_ring = u->sq_ring;
+	} else {
+		u->cq_ring = mmap(NULL, u->cq_ring_size,
+				  PROT_READ | PROT_WRITE,
+				  MAP_SHARED | MAP_POPULATE, u->ring_fd,
+				  IORING_OFF_CQ_RING);
+		if (u->cq_ring == MAP_FAILED) {
+			u->cq_ring = NULL;
+			iscsi_set_error(iscsi, "failed to map io_uring cq: "
+					"%s(%d)", strerror(errno), errno);
+			goto err;
+		}
+	}
+	u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, u->ring_fd,
+		       IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED) {
+		u->sqes = NULL;
+		iscsi_set_error(iscsi, "failed to map io_uring sqes: %s(%d)",
+				strerror(errno), errno);
+		goto err;
+	}
+
+	sq = u->sq_ring;
+	u->sq_head = (unsigned *)(sq + p.sq_off.head);
+	u->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	u->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	u->sq_array = (unsigned *)(sq + p.sq_off.array);
+	u->sq_entries = p.sq_entries;
+	sq = u->cq_ring;
+	u->cq_head = (unsigned *)(sq + p.cq_off.head);
+	u->cq_tail = (unsigned *)(sq + p.cq_off.tail);
+	u->cq_mask = (unsigned *)(sq + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)(sq + p.cq_off.cqes);
+
+	/* the buffer ring must be page aligned */
+	u->br = mmap(NULL, ISCSI_URING_NBUFS * sizeof(struct io_uring_buf),
+		     PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+		     -1, 0);
+	if (u->br == MAP_FAILED) {
+		u->br = NULL;
+		iscsi_set_error(iscsi, "failed to map io_uring buffer ring: "
+				"%s(%d)", strerror(errno), errno);
+		goto err;
+	}
+	u->bufs = iscsi_malloc(iscsi, ISCSI_URING_NBUFS * ISCSI_URING_BUF_SIZE);
+	if (u->bufs == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory: failed to allocate "
+				"io_uring receive buffers");
+		goto err;
+	}
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uintptr_t)u->br;
+	reg.ring_entries = ISCSI_URING_NBUFS;
+	reg.bgid = ISCSI_URING_BGID;
+	if (iscsi_uring_register_syscall(u->ring_fd, IORING_REGISTER_PBUF_RING,
+					 &reg, 1) != 0) {
+		iscsi_set_error(iscsi, "failed to register io_uring buffer "
+				"ring: %s(%d)", strerror(errno), errno);
+		goto err;
+	}
+	for (i = 0; i < ISCSI_URING_NBUFS; i++) {
+		iscsi_uring_recycle_buf(u, i);
+	}
+
+	u->msg.msg_iov = (struct iovec *)u->batch.iov;
+	return u;
+
+ err:
+	iscsi_uring_free(iscsi, u);
+	return NULL;
+}
+
+static int
+iscsi_uring_submit(struct iscsi_context *iscsi, struct iscsi_uring *u,
+		   unsigned min_complete)
+{
+	unsigned flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+	int ret;
+
+	if (u->to_submit == 0 && min_complete == 0) {
+		return 0;
+	}
+	iscsi->stats.tx_syscalls++;
+	ret = iscsi_uring_enter_syscall(u->ring_fd, u->to_submit,
+					min_complete, flags);
+	if (ret < 0) {
+		if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+			return 0;
+		}
+		iscsi_set_error(iscsi, "io_uring_enter failed: %s(%d)",
+				strerror(errno), errno);
+		return -1;
+	}
+	u->to_submit -= MIN((unsigned)ret, u->to_submit);
+	return 0;
+}
+
+static struct io_uring_sqe *
+iscsi_uring_get_sqe(struct iscsi_context *iscsi, struct iscsi_uring *u,
+		    enum iscsi_uring_op op)
+{
+	struct io_uring_sqe *sqe;
+	unsigned tail = *u->sq_tail, idx;
+
+	if (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >=
+	    u->sq_entries) {
+		iscsi_uring_submit(iscsi, u, 0);
+		if (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >=
+		    u->sq_entries) {
+			return NULL;
+		}
+	}
+	idx = tail & *u->sq_mask;
+	sqe = &u->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->user_data = op;
+	u->sq_array[idx] = idx;
+	return sqe;
+}
+
+/* hand a filled in sqe to the kernel on the next io_uring_enter() */
+static void
+iscsi_uring_queue_sqe(struct iscsi_uring *u)
+{
+	__atomic_store_n(u->sq_tail, *u->sq_tail + 1, __ATOMIC_RELEASE);
+	u->to_submit++;
+}
+
+static void
+iscsi_uring_set_fd(struct iscsi_context *iscsi, struct iscsi_uring *u,
+		   struct io_uring_sqe *sqe)
+{
+	if (u->fixed_file) {
+		sqe->fd = 0;
+		sqe->flags |= IOSQE_FIXED_FILE;
+	} else {
+		sqe->fd = iscsi->fd;
+	}
+}
+
+static int
+iscsi_uring_arm_poll(struct iscsi_context *iscsi, struct iscsi_uring *u)
+{
+	struct io_uring_sqe *sqe;
+	uint32_t events = POLLOUT;
+
+	sqe = iscsi_uring_get_sqe(iscsi, u, ISCSI_URING_OP_POLL);
+	if (sqe == NULL) {
+		iscsi_set_error(iscsi, "io_uring submission queue is full");
+		return -1;
+	}
+	sqe->opcode = IORING_OP_POLL_ADD;
+	iscsi_uring_set_fd(iscsi, u, sqe);
+#if __BYTE_ORDER == __BIG_ENDIAN
+	events = (events << 16) | (events >> 16);
+#endif
+	sqe->poll32_events = events;
+	iscsi_uring_queue_sqe(u);
+	u->poll_armed = 1;
+	return 0;
+}
+
+static int
+iscsi_uring_arm_recv(struct iscsi_context *iscsi, struct iscsi_uring *u)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = iscsi_uring_get_sqe(iscsi, u, ISCSI_URING_OP_RECV);
+	if (sqe == NULL) {
+		iscsi_set_error(iscsi, "io_uring submission queue is full");
+		return -1;
+	}
+	sqe->opcode = IORING_OP_RECV;
+	iscsi_uring_set_fd(iscsi, u, sqe);
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags |= IOSQE_BUFFER_SELECT;
+	sqe->buf_group = ISCSI_URING_BGID;
+	iscsi_uring_queue_sqe(u);
+	u->recv_armed = 1;
+	return 0;
+}
+
+static void
+iscsi_uring_clear_in_send(struct iscsi_uring *u)
+{
+	int i;
+
+	for (i = 0; i < u->batch.npdu; i++) {
+		u->batch.pdu[i]->flags &= ~ISCSI_PDU_IN_SEND;
+	}
+}
+
+/* gather the pdus we can send into one SENDMSG */
+static int
+iscsi_uring_arm_send(struct iscsi_context *iscsi, struct iscsi_uring *u)
+{
+	struct io_uring_sqe *sqe;
+	int i, err;
+
+	err = iscsi_send_batch_build(iscsi, &u->batch);
+	if (err || u->batch.niov == 0) {
+		if (u->batch.npdu) {
+			iscsi_send_batch_done(iscsi, &u->batch, 0);
+		}
+		return err;
+	}
+
+	sqe = iscsi_uring_get_sqe(iscsi, u, ISCSI_URING_OP_SEND);
+	if (sqe == NULL) {
+		iscsi_send_batch_done(iscsi, &u->batch, 0);
+		return 0;
+	}
+	for (i = 0; i < u->batch.npdu; i++) {
+		u->batch.pdu[i]->flags |= ISCSI_PDU_IN_SEND;
+	}
+	u->msg.msg_iovlen = u->batch.niov;
+	sqe->opcode = IORING_OP_SENDMSG;
+	iscsi_uring_set_fd(iscsi, u, sqe);
+	sqe->addr = (uintptr_t)&u->msg;
+	sqe->len = 1;
+	/* have the kernel retry short sends instead of completing early */
+	sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+	iscsi_uring_queue_sqe(u);
+	u->send_armed = 1;
+	return 0;
+}
+
+static int
+iscsi_uring_update_file(struct iscsi_context *iscsi, struct iscsi_uring *u,
+			int fd)
+{
+	struct io_uring_files_update up;
+	int32_t fds = fd;
+
+	if (!u->fixed_file) {
+		return 0;
+	}
+	memset(&up, 0, sizeof(up));
+	up.offset = 0;
+	up.fds = (uintptr_t)&fds;
+	if (iscsi_uring_register_syscall(u->ring_fd,
+					 IORING_REGISTER_FILES_UPDATE,
+					 &up, 1) < 0) {
+		ISCSI_LOG(iscsi, 1, "failed to update io_uring fixed file: %s",
+			  strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/* returns non-zero while the kernel still owns some of our requests */
+static int
+iscsi_uring_busy(struct iscsi_uring *u)
+{
+	return u->poll_armed || u->recv_armed || u->send_armed ||
+		u->cancel_armed;
+}
+
+/*
+ * Process one completion. When draining, received data is thrown away
+ * since the connection is going away.
+ * Returns -1 if the connection failed.
+ */
+static int
+iscsi_uring_complete(struct iscsi_context *iscsi, struct iscsi_uring *u,
+		     struct io_uring_cqe *cqe, int drain)
+{
+	unsigned short bid;
+	int ret = 0;
+
+	switch (cqe->user_data) {
+	case ISCSI_URING_OP_POLL:
+		/* iscsi_uring_service() handles this one unless draining */
+		u->poll_armed = 0;
+		break;
+	case ISCSI_URING_OP_RECV:
+		if (!(cqe->flags & IORING_CQE_F_MORE)) {
+			u->recv_armed = 0;
+		}
+		if (cqe->flags & IORING_CQE_F_BUFFER) {
+			bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+			if (!drain && cqe->res > 0) {
+				ret = iscsi_read_from_buffer(iscsi,
+					&u->bufs[bid * ISCSI_URING_BUF_SIZE],
+					cqe->res);
+			}
+			iscsi_uring_recycle_buf(u, bid);
+			break;
+		}
+		if (drain || cqe->res == -ENOBUFS) {
+			/* out of buffers, rearmed once they are recycled */
+			break;
+		}
+		if (cqe->res == 0) {
+			iscsi_set_error(iscsi, "recv: remote side closed the "
+					"connection");
+		} else {
+			iscsi_set_error(iscsi, "recv failed: %s(%d)",
+					strerror(-cqe->res), -cqe->res);
+		}
+		ret = -1;
+		break;
+	case ISCSI_URING_OP_SEND:
+		u->send_armed = 0;
+		iscsi_uring_clear_in_send(u);
+		iscsi_send_batch_done(iscsi, &u->batch,
+				      cqe->res > 0 ? cqe->res : 0);
+		if (cqe->res < 0 && !drain) {
+			iscsi_set_error(iscsi, "Error when writing to "
+					"socket :%d", -cqe->res);
+			ret = -1;
+		}
+		break;
+	case ISCSI_URING_OP_CANCEL:
+		u->cancel_armed = 0;
+		break;
+	}
+	return ret;
+}
+
+/* take the next completion off the cq */
+static int
+iscsi_uring_get_cqe(struct iscsi_uring *u, struct io_uring_cqe *cqe)
+{
+	unsigned head = *u->cq_head;
+
+	if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+		return 0;
+	}
+	*cqe = u->cqes[head & *u->cq_mask];
+	__atomic_store_n(u->cq_head, head + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+/*
+ * Cancel everything we have in flight on the ring and wait for it to
+ * complete, so that no pdu or buffer is still in use by the kernel when
+ * the connection goes away.
+ */
+static void
+iscsi_uring_quiesce(struct iscsi_context *iscsi, struct iscsi_uring *u)
+{
+	struct io_uring_cqe cqe;
+	struct io_uring_sqe *sqe;
+
+	if (!iscsi_uring_busy(u)) {
+		return;
+	}
+	if (iscsi->fd != -1) {
+		shutdown(iscsi->fd, SHUT_RDWR);
+	}
+	sqe = iscsi_uring_get_sqe(iscsi, u, ISCSI_URING_OP_CANCEL);
+	if (sqe != NULL) {
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->fd = -1;
+		sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+		iscsi_uring_queue_sqe(u);
+		u->cancel_armed = 1;
+	}
+	while (iscsi_uring_busy(u)) {
+		while (iscsi_uring_get_cqe(u, &cqe)) {
+			iscsi_uring_complete(iscsi, u, &cqe, 1);
+		}
+		if (!iscsi_uring_busy(u)) {
+			break;
+		}
+		if (iscsi_uring_submit(iscsi, u, 1) != 0) {
+			ISCSI_LOG(iscsi, 1, "%s", iscsi_get_error(iscsi));
+			break;
+		}
+	}
+}
+
+static int
+iscsi_uring_connect(struct iscsi_context *iscsi, union socket_address *sa,
+		    int ai_family)
+{
+	struct iscsi_uring *u = iscsi->opaque;
+	int32_t fds;
+
+	if (u == NULL && iscsi->old_iscsi && iscsi->old_iscsi->opaque) {
+		/* take over the ring of the connection we replace so
+		 * that iscsi_get_fd() stays the same */
+		u = iscsi->old_iscsi->opaque;
+		iscsi_uring_quiesce(iscsi->old_iscsi, u);
+		iscsi->old_iscsi->opaque = NULL;
+		iscsi->opaque = u;
+	}
+	if (u == NULL) {
+		u = iscsi_uring_create(iscsi);
+		if (u == NULL) {
+			return -1;
+		}
+		iscsi->opaque = u;
+	}
+	u->conn++;
+
+	if (iscsi_tcp_connect(iscsi, sa, ai_family) != 0) {
+		return -1;
+	}
+	/* zerocopy completions are read off the socket error queue, which
+	 * we never look at */
+	iscsi->zerocopy = 0;
+
+	if (iscsi->uring_flags & ISCSI_URING_FIXED_FILE) {
+		if (u->fixed_file) {
+			if (iscsi_uring_update_file(iscsi, u, iscsi->fd) != 0) {
+				u->fixed_file = 0;
+			}
+		} else {
+			fds = iscsi->fd;
+			if (iscsi_uring_register_syscall(u->ring_fd,
+							 IORING_REGISTER_FILES,
+							 &fds, 1) == 0) {
+				u->fixed_file = 1;
+			} else {
+				ISCSI_LOG(iscsi, 1, "failed to register io_uring "
+					  "fixed file: %s", strerror(errno));
+			}
+		}
+	}
+
+	if (iscsi_uring_arm_poll(iscsi, u) != 0 ||
+	    iscsi_uring_submit(iscsi, u, 0) != 0) {
+		iscsi_tcp_disconnect(iscsi);
+		return -1;
+	}
+	return 0;
+}
+
+static int
+iscsi_uring_disconnect(struct iscsi_context *iscsi)
+{
+	struct iscsi_uring *u = iscsi->opaque;
+
+	if (u != NULL) {
+		iscsi_uring_quiesce(iscsi, u);
+		/* drop the reference the ring holds on the socket */
+		iscsi_uring_update_file(iscsi, u, -1);
+	}
+	return iscsi_tcp_disconnect(iscsi);
+}
+
+static void
+iscsi_uring_destroy(struct iscsi_context *iscsi)
+{
+	struct iscsi_uring *u = iscsi->opaque;
+
+	if (u == NULL) {
+		return;
+	}
+	iscsi_uring_quiesce(iscsi, u);
+	iscsi->opaque = NULL;
+
+	if (iscsi->old_iscsi && iscsi->old_iscsi->opaque == NULL) {
+		/* a failed reconnect attempt, give the ring back so the
+		 * next attempt keeps using the same fd */
+		iscsi_uring_update_file(iscsi, u, -1);
+		iscsi->old_iscsi->opaque = u;
+		return;
+	}
+	iscsi_uring_free(iscsi, u);
+}
+
+static int
+iscsi_uring_error(struct iscsi_context *iscsi, struct iscsi_uring *u)
+{
+	ISCSI_LOG(iscsi, 1, "%s", iscsi_get_error(iscsi));
+	iscsi_uring_quiesce(iscsi, u);
+	return iscsi_service_reconnect_if_loggedin(iscsi);
+}
+
+static int
+iscsi_uring_can_send(struct iscsi_context *iscsi)
+{
+	int ret;
+
+        iscsi_mt_spin_lock(&iscsi->iscsi_lock);
+	iscsi_submitted_drain(iscsi);
+	ret = iscsi->outqueue_current ||
+		(iscsi->outqueue.head && !iscsi->is_corked &&
+		 (iscsi_serial32_compare(iscsi->outqueue.head->cmdsn, iscsi->maxcmdsn) <= 0 ||
+		  iscsi->outqueue.head->outdata.data[0] & ISCSI_PDU_IMMEDIATE));
+        iscsi_mt_spin_unlock(&iscsi->iscsi_lock);
+	return ret;
+}
+
+static int
+iscsi_uring_service(struct iscsi_context *iscsi, int revents)
+{
+	struct iscsi_uring *u = iscsi->opaque;
+	struct io_uring_cqe cqe;
+	unsigned conn;
+	int ret;
+
+	if (iscsi->pending_reconnect) {
+		if (time(NULL) >= iscsi->next_reconnect) {
+			return iscsi_reconnect(iscsi);
+		}
+		if (iscsi->old_iscsi) {
+			goto check_timeout;
+		}
+	}
+	if (u == NULL) {
+		return 0;
+	}
+
+	conn = u->conn;
+	while (iscsi_uring_get_cqe(u, &cqe)) {
+		if (cqe.user_data == ISCSI_URING_OP_POLL) {
+			/* the socket connected, or failed to */
+			u->poll_armed = 0;
+			ret = iscsi_tcp_service(iscsi, cqe.res < 0 ?
+						POLLERR : cqe.res);
+			if (ret != 0) {
+				return ret;
+			}
+		} else if (iscsi_uring_complete(iscsi, u, &cqe, 0) != 0) {
+			return iscsi_uring_error(iscsi, u);
+		}
+		if (iscsi->opaque != u || u->conn != conn) {
+			/* a callback reconnected or tore down the session */
+			return 0;
+		}
+	}
+
+	if (iscsi->fd != -1 && iscsi->is_connected) {
+		if (!u->recv_armed && iscsi_uring_arm_recv(iscsi, u) != 0) {
+			return iscsi_uring_error(iscsi, u);
+		}
+		if (!u->send_armed && iscsi_uring_can_send(iscsi) &&
+		    iscsi_uring_arm_send(iscsi, u) != 0) {
+			return iscsi_uring_error(iscsi, u);
+		}
+	}
+	if (iscsi_uring_submit(iscsi, u, 0) != 0) {
+		return iscsi_uring_error(iscsi, u);
+	}
+
+check_timeout:
+	iscsi_timeout_scan(iscsi);
+
+	if (iscsi->old_iscsi) {
+		iscsi_timeout_scan(iscsi->old_iscsi);
+	}
+
+	return 0;
+}
+
+static int
+iscsi_uring_get_fd(struct iscsi_context *iscsi)
+{
+	struct iscsi_uring *u = iscsi->opaque;
+
+	if (u == NULL && iscsi->old_iscsi) {
+		u = iscsi->old_iscsi->opaque;
+	}
+	return u ? u->ring_fd : -1;
+}
+
+static int
+iscsi_uring_which_events(struct iscsi_context *iscsi)
+{
+	struct iscsi_uring *u = iscsi->opaque;
+
+	if (iscsi->pending_reconnect && iscsi->old_iscsi &&
+		time(NULL) < iscsi->next_reconnect) {
+		return 0;
+	}
+	if (u == NULL) {
+		return POLLIN;
+	}
+
+	/* the ring fd is always writable, ask for POLLOUT only when
+	 * there is something to submit */
+	if (u->to_submit ||
+	    (iscsi->is_connected &&
+	     (!u->recv_armed ||
+	      (!u->send_armed && iscsi_uring_can_send(iscsi))))) {
+		return POLLIN | POLLOUT;
+	}
+	return POLLIN;
+}
+
+/* submissions are batched until the next iscsi_service() */
+static void
+iscsi_uring_queue_pdu(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
+{
+	int is_head = iscsi_outqueue_submit(iscsi, pdu);
+
+#if defined(HAVE_MULTITHREADING) && defined(HAVE_PTHREAD)
+        if (iscsi->multithreading_enabled && is_head) {
+                iscsi_mt_service_thread_wakeup(iscsi);
+        }
+#else
+	(void)is_head;
+#endif
+}
+
+static void
+iscsi_uring_free_pdu(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
+{
+	if (pdu != NULL && pdu->flags & ISCSI_PDU_IN_SEND) {
+		/* the kernel may still be reading it */
+		pdu->flags |= ISCSI_PDU_FREE_AFTER_SEND;
+		return;
+	}
+	iscsi_tcp_free_pdu(iscsi, pdu);
+}
+
+static iscsi_transport iscsi_transport_uring = {
+	.connect      = iscsi_uring_connect,
+	.queue_pdu    = iscsi_uring_queue_pdu,
+	.new_pdu      = iscsi_tcp_new_pdu,
+	.disconnect   = iscsi_uring_disconnect,
+	.free_pdu     = iscsi_uring_free_pdu,
+	.service      = iscsi_uring_service,
+	.get_fd       = iscsi_uring_get_fd,
+	.which_events = iscsi_uring_which_events,
+	.destroy      = iscsi_uring_destroy,
+};
+
+void iscsi_init_uring_transport(struct iscsi_context *iscsi)
+{
+	iscsi->drv = &iscsi_transport_uring;
+	iscsi->transport = URING_TRANSPORT;
+}
@@ -20,6 +20,19 @@
 #include "config.h"
 #endif
 
+#include <stdint.h>
+#ifdef HAVE_CLOCK_GETTIME
+#include <time.h>
+#else
+#include <sys/time.h>
+#endif
+
+#if defined(_WIN32)
+#include <winsock2.h>
+#include "win32/win32_compat.h"
+#define gettimeofday win32_gettimeofday
+#endif
+
 #include "utils.h"
 
 const char *iscsi_value_string_find(struct iscsi_value_string *values,
@@ -33,3 +46,19 @@ const char *iscsi_value_string_find(struct iscsi_value_string *values,
 
 	return not_found;
 }
+
+/* Monotonic time in milliseconds, used for all timeout processing */
+uint64_t iscsi_clock_ms(void)
+{
+#ifdef HAVE_CLOCK_GETTIME
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#else
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+#endif
+}
@@ -563,11 +563,11 @@ wait_until_test_finished(struct iscsi_context *iscsi, struct iscsi_async_state *
                                 state->task->status = SCSI_STATUS_CANCELLED;
                                 iscsi_mt_spin_lock(&iscsi->iscsi_lock);
                                 /* this may leak memory since we don't free the pdu */
-                                while ((pdu = iscsi->outqueue)) {
-                                        ISCSI_LIST_REMOVE(&iscsi->outqueue, pdu);
+                                while ((pdu = iscsi->outqueue.head)) {
+                                        iscsi_outqueue_remove(iscsi, pdu);
                                 }
-                                while ((pdu = iscsi->waitpdu)) {
-                                        ISCSI_LIST_REMOVE(&iscsi->waitpdu, pdu);
+                                while ((pdu = iscsi->waitpdu.head)) {
+                                        iscsi_waitpdu_remove(iscsi, pdu);
                                 }
                                 iscsi_mt_spin_unlock(&iscsi->iscsi_lock);
                                 return;
@@ -43,13 +43,13 @@ test_iscsi_strip_tag(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
 		return -EINVAL;
 	}
 
-	s = memmem(pdu->outdata.data, pdu->outdata.size, tag, toklen);
+	s = memmem(pdu->outdata_seg.data, pdu->outdata_seg.size, tag, toklen);
 	if (s == NULL) {
 		return -ENOENT;
 	}
 
-	remain = pdu->outdata.size - (s - pdu->outdata.data);
-	if ((remain == 0) || (remain > pdu->outdata.size)) {
+	remain = pdu->outdata_seg.size - (s - pdu->outdata_seg.data);
+	if ((remain == 0) || (remain > pdu->outdata_seg.size)) {
 		return -EINVAL;
 	}
 
@@ -67,11 +67,10 @@ test_iscsi_strip_tag(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
 	}
 
 	memmove(s, s + toklen, remain - toklen);
-	pdu->outdata.size -= toklen;
+	pdu->outdata_seg.size -= toklen;
 
 	/* update data segment length */
-	scsi_set_uint32(&pdu->outdata.data[4], pdu->outdata.size
-				- ISCSI_HEADER_SIZE(iscsi->header_digest));
+	scsi_set_uint32(&pdu->outdata.data[4], pdu->outdata_seg.size);
 	logging(LOG_VERBOSE, "stripped %s key and value from PDU", tag);
 
 	return 0;
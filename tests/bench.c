@@ -0,0 +1,176 @@
+/*
+   Copyright (C) 2026 by the libiscsi authors
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include "iscsi.h"
+#include "scsi-lowlevel.h"
+#include "bench.h"
+
+double
+bench_clock_ns(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+double
+bench_now_ns(void)
+{
+	return bench_clock_ns(CLOCK_MONOTONIC);
+}
+
+int
+bench_read(int fd, unsigned char *buf, size_t size, size_t *len)
+{
+	ssize_t count;
+
+	count = read(fd, &buf[*len], size - *len);
+	if (count == 0 || (count < 0 && errno != EAGAIN)) {
+		return -1;
+	}
+	if (count > 0) {
+		*len += count;
+	}
+	return 0;
+}
+
+size_t
+bench_pdu_len(const unsigned char *buf, size_t len)
+{
+	size_t dsl, pdu_len;
+
+	if (len < ISCSI_RAW_HEADER_SIZE) {
+		return 0;
+	}
+	dsl = scsi_get_uint32(&buf[4]) & 0x00ffffff;
+	pdu_len = ISCSI_RAW_HEADER_SIZE + ((dsl + 3) & ~3);
+	return len < pdu_len ? 0 : pdu_len;
+}
+
+void
+bench_consume(unsigned char *buf, size_t *len, size_t pos)
+{
+	memmove(buf, &buf[pos], *len - pos);
+	*len -= pos;
+}
+
+int
+bench_writev(int fd, struct iovec *iov, int *pos, int cnt)
+{
+	struct iovec *v;
+	ssize_t count;
+
+	while (*pos < cnt) {
+		count = writev(fd, &iov[*pos], MIN(cnt - *pos, 1024));
+		if (count < 0) {
+			return errno == EAGAIN ? 1 : -1;
+		}
+		while (count > 0) {
+			v = &iov[*pos];
+			if ((size_t)count >= v->iov_len) {
+				count -= v->iov_len;
+				(*pos)++;
+				continue;
+			}
+			v->iov_base = (unsigned char *)v->iov_base + count;
+			v->iov_len -= count;
+			count = 0;
+		}
+	}
+	return 0;
+}
+
+int
+bench_target_serve(struct bench_target *t)
+{
+	unsigned char *q, *r;
+	size_t pos;
+	ssize_t count;
+	uint32_t cmdsn;
+	int n = 0;
+
+	count = read(t->fd, &t->req[t->len], sizeof(t->req) - t->len);
+	if (count <= 0) {
+		return 0;
+	}
+	t->len += count;
+	for (pos = 0; t->len - pos >= ISCSI_RAW_HEADER_SIZE;
+	     pos += ISCSI_RAW_HEADER_SIZE) {
+		q = &t->req[pos];
+		cmdsn = scsi_get_uint32(&q[24]);
+		if ((int32_t)(cmdsn + t->window - t->maxcmdsn) > 0) {
+			t->maxcmdsn = cmdsn + t->window;
+		}
+		r = &t->rsp[n++ * ISCSI_RAW_HEADER_SIZE];
+		memset(r, 0, ISCSI_RAW_HEADER_SIZE);
+		r[0] = ISCSI_PDU_SCSI_RESPONSE;
+		r[1] = ISCSI_PDU_SCSI_FINAL;
+		memcpy(&r[16], &q[16], 4);
+		scsi_set_uint32(&r[24], t->statsn++);
+		scsi_set_uint32(&r[28], t->maxcmdsn - t->window + 1);
+		scsi_set_uint32(&r[32], t->maxcmdsn);
+	}
+	bench_consume(t->req, &t->len, pos);
+	if (n && write(t->fd, t->rsp, n * ISCSI_RAW_HEADER_SIZE) !=
+	    n * ISCSI_RAW_HEADER_SIZE) {
+		return 0;
+	}
+	return 1;
+}
+
+void *
+bench_target_thread(void *arg)
+{
+	while (bench_target_serve(arg)) {
+		;
+	}
+	return NULL;
+}
+
+int
+bench_listen(int backlog, int *port)
+{
+	struct sockaddr_in sin;
+	socklen_t sin_len = sizeof(sin);
+	int fd;
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0) {
+		return -1;
+	}
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(fd, (struct sockaddr *)&sin, sizeof(sin)) != 0 ||
+	    getsockname(fd, (struct sockaddr *)&sin, &sin_len) != 0 ||
+	    listen(fd, backlog) != 0) {
+		close(fd);
+		return -1;
+	}
+	*port = ntohs(sin.sin_port);
+	return fd;
+}
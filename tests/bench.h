@@ -0,0 +1,86 @@
+/*
+   Copyright (C) 2026 by the libiscsi authors
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * Helpers shared by the prog_bench_* programs: the clock, and the
+ * plumbing of the fake targets that play the other end of a socket.
+ */
+#ifndef __bench_h__
+#define __bench_h__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/uio.h>
+#include "iscsi-private.h"
+
+/* CLOCK_MONOTONIC in nanoseconds */
+double bench_now_ns(void);
+
+/* any other clock, like CLOCK_PROCESS_CPUTIME_ID, in nanoseconds */
+double bench_clock_ns(clockid_t clock);
+
+/*
+ * Append what the initiator sent to buf. Returns -1 once the initiator
+ * hung up or the read failed, 0 otherwise, also when there was nothing
+ * to read on a non-blocking socket.
+ */
+int bench_read(int fd, unsigned char *buf, size_t size, size_t *len);
+
+/*
+ * The size of the pdu at the start of buf, with its padded data segment,
+ * or 0 while not all of it has arrived.
+ */
+size_t bench_pdu_len(const unsigned char *buf, size_t len);
+
+/* drop the first pos bytes of buf */
+void bench_consume(unsigned char *buf, size_t *len, size_t pos);
+
+/*
+ * Write iov[*pos] to iov[cnt - 1] and advance *pos past what went out.
+ * Returns 0 when all of it was written, 1 when the socket is full and
+ * -1 on error.
+ */
+int bench_writev(int fd, struct iovec *iov, int *pos, int cnt);
+
+/*
+ * A target that answers every command with GOOD status as soon as it
+ * arrives, and keeps MaxCmdSN window commands ahead of the newest CmdSN.
+ * Set fd, window, statsn and maxcmdsn before serving.
+ */
+struct bench_target {
+	int fd;
+	uint32_t window;
+	uint32_t statsn;
+	uint32_t maxcmdsn;
+	size_t len;
+	unsigned char req[64 * ISCSI_RAW_HEADER_SIZE];
+	unsigned char rsp[64 * ISCSI_RAW_HEADER_SIZE];
+};
+
+/* answer what one read returns, 0 once the initiator hung up */
+int bench_target_serve(struct bench_target *t);
+
+/* pthread start routine that serves t until the initiator hangs up */
+void *bench_target_thread(void *arg);
+
+/*
+ * Listen on an ephemeral port on 127.0.0.1 and store the port in
+ * *port. Returns the socket, or -1.
+ */
+int bench_listen(int backlog, int *port);
+
+#endif /* __bench_h__ */
@@ -0,0 +1,277 @@
+/*
+   Copyright (C) 2026 by the libiscsi authors
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * Complete TESTUNITREADY commands through callbacks that run on the
+ * service thread, and through the completion queue where the
+ * application thread reaps them in batches, with and without some work
+ * per completion. Report commands per second, and for the completion
+ * queue how many tasks a reap returned on average. A fake target thread
+ * on the other end of a socketpair answers every command right away.
+ * Every task has to come back exactly once with SCSI_STATUS_GOOD.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "iscsi.h"
+#include "iscsi-private.h"
+#include "scsi-lowlevel.h"
+#include "bench.h"
+
+#define COMMANDS    (64 * 1024)
+#define DEPTH       64
+#define BATCH       32
+#define WINDOW      1024
+
+static unsigned char seen[COMMANDS];
+static sem_t slots;
+static int work_us;
+static int bad;
+
+/* what the application does with a completed command, the task
+ * carries its index as private pointer */
+static void
+complete(struct scsi_task *task)
+{
+	uintptr_t i = (uintptr_t)scsi_get_task_private_ptr(task);
+	double end = bench_now_ns() + work_us * 1e3;
+
+	if (task->status != SCSI_STATUS_GOOD || i >= COMMANDS || seen[i]++) {
+		bad++;
+	}
+	scsi_free_scsi_task(task);
+	while (bench_now_ns() < end) {
+		;
+	}
+}
+
+static void
+tur_cb(struct iscsi_context *iscsi, int status, void *command_data,
+       void *private_data)
+{
+	scsi_set_task_private_ptr(command_data, private_data);
+	complete(command_data);
+	sem_post(&slots);
+}
+
+static int
+submit(struct iscsi_context *iscsi, uintptr_t i, int use_cq)
+{
+	struct scsi_task *task;
+
+	task = scsi_cdb_testunitready();
+	if (task == NULL) {
+		return -1;
+	}
+	if (iscsi_scsi_command_async(iscsi, 0, task, use_cq ? NULL : tur_cb,
+				     NULL, (void *)i) != 0) {
+		scsi_free_scsi_task(task);
+		return -1;
+	}
+	return 0;
+}
+
+static int
+run_callbacks(struct iscsi_context *iscsi)
+{
+	int i;
+
+	sem_init(&slots, 0, DEPTH);
+	for (i = 0; i < COMMANDS; i++) {
+		sem_wait(&slots);
+		if (submit(iscsi, i, 0) != 0) {
+			return -1;
+		}
+	}
+	for (i = 0; i < DEPTH; i++) {
+		sem_wait(&slots);
+	}
+	sem_destroy(&slots);
+	return 0;
+}
+
+static int
+run_cq(struct iscsi_context *iscsi, int *reaps)
+{
+	struct scsi_task *tasks[BATCH];
+	int submitted = 0, reaped = 0, i, n;
+
+	while (reaped < COMMANDS) {
+		while (submitted < COMMANDS && submitted - reaped < DEPTH) {
+			if (submit(iscsi, submitted++, 1) != 0) {
+				return -1;
+			}
+		}
+		n = iscsi_reap_completions(iscsi, tasks, BATCH, 1000);
+		if (n <= 0) {
+			fprintf(stderr, "reap failed: %s\n",
+				n ? iscsi_get_error(iscsi) : "timed out");
+			return -1;
+		}
+		for (i = 0; i < n; i++) {
+			complete(tasks[i]);
+		}
+		reaped += n;
+		(*reaps)++;
+	}
+	return 0;
+}
+
+/* an empty queue times out, it cannot be disabled while a task is in
+ * flight or not reaped, and tasks nobody reaped are freed with the
+ * context */
+static int
+check_edges(struct iscsi_context *iscsi)
+{
+	struct scsi_task *task;
+	struct pollfd pfd;
+	double start;
+	int i;
+
+	if (iscsi_reap_completions(iscsi, &task, 1, 0) != 0) {
+		return -1;
+	}
+	start = bench_now_ns();
+	if (iscsi_reap_completions(iscsi, &task, 1, 50) != 0 ||
+	    bench_now_ns() - start < 40e6) {
+		return -1;
+	}
+	for (i = 0; i < 8; i++) {
+		if (submit(iscsi, 0, 1) != 0) {
+			return -1;
+		}
+	}
+	if (iscsi_set_completion_queue(iscsi, 0) == 0) {
+		return -1;
+	}
+	pfd.fd = iscsi_get_completion_fd(iscsi);
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, 1000) != 1) {
+		return -1;
+	}
+	return 0;
+}
+
+static int
+bench(int use_cq)
+{
+	static struct bench_target t;
+	struct iscsi_context *iscsi;
+	pthread_t thread;
+	int sv[2], reaps = 0, ret = -1;
+	double start, ns;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+		return -1;
+	}
+	iscsi = iscsi_create_context("iqn.2007-10.com.github:sahlberg:libiscsi:bench");
+	if (iscsi == NULL) {
+		fprintf(stderr, "Failed to create context\n");
+		goto out;
+	}
+	if (use_cq && iscsi_set_completion_queue(iscsi, 1) != 0) {
+		fprintf(stderr, "%s\n", iscsi_get_error(iscsi));
+		goto out;
+	}
+
+	/* pretend we are logged in */
+	fcntl(sv[0], F_SETFL, O_NONBLOCK);
+	iscsi->fd = sv[0];
+	iscsi->is_connected = 1;
+	iscsi->is_loggedin = 1;
+	iscsi->session_type = ISCSI_SESSION_NORMAL;
+	iscsi->statsn = 0;
+	iscsi->expcmdsn = iscsi->cmdsn;
+	iscsi->maxcmdsn = iscsi->cmdsn + WINDOW - 1;
+
+	memset(&t, 0, sizeof(t));
+	t.fd = sv[1];
+	t.window = WINDOW;
+	t.statsn = 1;
+	t.maxcmdsn = iscsi->maxcmdsn;
+	if (pthread_create(&thread, NULL, bench_target_thread, &t) != 0) {
+		goto out;
+	}
+	if (iscsi_mt_service_thread_start(iscsi) != 0) {
+		fprintf(stderr, "%s\n", iscsi_get_error(iscsi));
+		goto stop_target;
+	}
+
+	memset(seen, 0, sizeof(seen));
+	bad = 0;
+	start = bench_now_ns();
+	if (use_cq) {
+		ret = run_cq(iscsi, &reaps);
+	} else {
+		ret = run_callbacks(iscsi);
+	}
+	ns = bench_now_ns() - start;
+	if (ret == 0 && use_cq && check_edges(iscsi) != 0) {
+		fprintf(stderr, "completion queue edge cases failed\n");
+		ret = -1;
+	}
+
+	iscsi_mt_service_thread_stop(iscsi);
+	if (use_cq) {
+		printf("%-9s %7d %12.0f %9.1f %6d\n", "queue", work_us,
+		       COMMANDS / ns * 1e9, (double)COMMANDS / reaps, bad);
+	} else {
+		printf("%-9s %7d %12.0f %9s %6d\n", "callback", work_us,
+		       COMMANDS / ns * 1e9, "-", bad);
+	}
+	if (bad) {
+		ret = -1;
+	}
+
+ stop_target:
+	shutdown(sv[0], SHUT_RDWR);
+	pthread_join(thread, NULL);
+ out:
+	if (iscsi != NULL) {
+		iscsi->fd = -1;
+		iscsi_destroy_context(iscsi);
+	}
+	close(sv[0]);
+	close(sv[1]);
+	return ret;
+}
+
+int main(void)
+{
+	int use_cq;
+
+	printf("%-9s %7s %12s %9s %6s\n", "complete", "work us", "commands/s",
+	       "per reap", "bad");
+	for (work_us = 0; work_us <= 10; work_us += 10) {
+		for (use_cq = 0; use_cq < 2; use_cq++) {
+			if (bench(use_cq)) {
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,74 @@
+/*
+   Copyright (C) 2026 by the libiscsi authors
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * CRC32C throughput of every implementation this CPU supports, for a
+ * header digest sized buffer up to a large data segment.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "iscsi.h"
+#include "iscsi-private.h"
+#include "bench.h"
+
+#define BYTES_PER_RUN (256 * 1024 * 1024)
+
+static const int sizes[] = { 48, 512, 4096, 65536, 262144 };
+
+int main(void)
+{
+	static uint8_t buf[262144];
+	volatile uint32_t sink = 0;
+	size_t i, s;
+	long n, loops;
+	int impl;
+	double start, ns;
+
+	for (i = 0; i < sizeof(buf); i++) {
+		buf[i] = i * 7;
+	}
+
+	printf("%-14s", "impl");
+	for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		printf(" %9d", sizes[s]);
+	}
+	printf("   (GB/s)\n");
+
+	for (impl = 0; impl < CRC32C_IMPL_MAX; impl++) {
+		printf("%-14s", crc32c_impl_name(impl));
+		if (crc32c_select(impl) != 0) {
+			printf(" not supported\n");
+			continue;
+		}
+		for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+			loops = BYTES_PER_RUN / sizes[s];
+			start = bench_now_ns();
+			for (n = 0; n < loops; n++) {
+				sink += crc32c(buf, sizes[s]);
+			}
+			ns = bench_now_ns() - start;
+			printf(" %9.2f", (double)loops * sizes[s] / ns);
+		}
+		printf("\n");
+	}
+	return 0;
+}
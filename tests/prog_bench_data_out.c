@@ -0,0 +1,249 @@
+/*
+   Copyright (C) 2026 by the libiscsi authors
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * Write 16 MiB WRITE10 commands whose data is solicited by a single R2T
+ * and sent as DATA-OUT pdus of 8 KiB, and report how many pdus were
+ * queued and how many objects had to be allocated for them. A fake
+ * target on the other end of a socketpair checks the DataSN, buffer
+ * offset, F flag and payload of every DATA-OUT pdu.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "iscsi.h"
+#include "iscsi-private.h"
+#include "scsi-lowlevel.h"
+#include "bench.h"
+
+#define IOSIZE    (16 * 1024 * 1024)
+#define SEGMENT   (8 * 1024)
+#define BLOCKSIZE 512
+#define COMMANDS  8
+
+struct target {
+	int fd;
+	int bad;
+	uint32_t statsn;
+	uint32_t itt;
+	uint32_t cmdsn;
+	uint32_t datasn;
+	uint32_t received;
+	unsigned char req[2 * SEGMENT + 1024];
+	size_t req_len;
+};
+
+static unsigned char data[IOSIZE];
+static int completed, bad_completions;
+
+static void
+io_cb(struct iscsi_context *iscsi, int status, void *command_data,
+      void *private_data)
+{
+	if (status != SCSI_STATUS_GOOD) {
+		bad_completions++;
+	}
+	completed++;
+	scsi_free_scsi_task(command_data);
+}
+
+static int
+target_send(struct target *t, int opcode, uint32_t offset)
+{
+	unsigned char r[ISCSI_RAW_HEADER_SIZE];
+
+	memset(r, 0, sizeof(r));
+	r[0] = opcode;
+	r[1] = ISCSI_PDU_SCSI_FINAL;
+	scsi_set_uint32(&r[16], t->itt);
+	scsi_set_uint32(&r[24], t->statsn);
+	scsi_set_uint32(&r[28], t->cmdsn + 1);
+	scsi_set_uint32(&r[32], t->cmdsn + 16);
+	if (opcode == ISCSI_PDU_R2T) {
+		scsi_set_uint32(&r[20], 1);
+		scsi_set_uint32(&r[44], IOSIZE - offset);
+	}
+	if (write(t->fd, r, sizeof(r)) != sizeof(r)) {
+		return -1;
+	}
+	return 0;
+}
+
+static int
+target_data_out(struct target *t, unsigned char *q, uint32_t dsl)
+{
+	uint32_t offset = scsi_get_uint32(&q[40]);
+
+	if (scsi_get_uint32(&q[20]) != 1 ||
+	    scsi_get_uint32(&q[36]) != t->datasn++ ||
+	    offset != t->received || dsl > SEGMENT ||
+	    memcmp(&q[ISCSI_RAW_HEADER_SIZE], &data[offset], dsl)) {
+		t->bad++;
+	}
+	t->received += dsl;
+	if (!!(q[1] & ISCSI_PDU_SCSI_FINAL) != (t->received == IOSIZE)) {
+		t->bad++;
+	}
+	if (t->received == IOSIZE) {
+		if (target_send(t, ISCSI_PDU_SCSI_RESPONSE, 0) != 0) {
+			return -1;
+		}
+		t->statsn++;
+	}
+	return 0;
+}
+
+static int
+fake_target(struct target *t)
+{
+	unsigned char *q;
+	size_t len, dsl, pos = 0;
+
+	if (bench_read(t->fd, t->req, sizeof(t->req), &t->req_len) != 0) {
+		return -1;
+	}
+	while ((len = bench_pdu_len(&t->req[pos], t->req_len - pos)) != 0) {
+		q = &t->req[pos];
+		dsl = scsi_get_uint32(&q[4]) & 0x00ffffff;
+		switch (q[0] & 0x3f) {
+		case ISCSI_PDU_SCSI_REQUEST:
+			t->itt = scsi_get_uint32(&q[16]);
+			t->cmdsn = scsi_get_uint32(&q[24]);
+			t->datasn = 0;
+			t->received = 0;
+			if (dsl) {
+				t->bad++;
+			}
+			if (target_send(t, ISCSI_PDU_R2T, 0) != 0) {
+				return -1;
+			}
+			break;
+		case ISCSI_PDU_DATA_OUT:
+			if (target_data_out(t, q, dsl) != 0) {
+				return -1;
+			}
+			break;
+		default:
+			return -1;
+		}
+		pos += len;
+	}
+	bench_consume(t->req, &t->req_len, pos);
+	return 0;
+}
+
+int main(void)
+{
+	static struct target t;
+	struct scsi_iovec iov;
+	struct iscsi_context *iscsi;
+	struct scsi_task *task;
+	struct pollfd pfd;
+	int sv[2], i, mallocs, queued, max_queued = 0, ret = 1;
+	double start, ns;
+
+	for (i = 0; i < IOSIZE; i++) {
+		data[i] = i * 7 + i / SEGMENT;
+	}
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+		return 1;
+	}
+	memset(&t, 0, sizeof(t));
+	t.fd = sv[1];
+	t.statsn = 1;
+	iscsi = iscsi_create_context("iqn.2007-10.com.github:sahlberg:libiscsi:bench");
+	if (iscsi == NULL) {
+		fprintf(stderr, "Failed to create context\n");
+		goto out;
+	}
+
+	/* pretend we are logged in */
+	fcntl(sv[0], F_SETFL, O_NONBLOCK);
+	fcntl(sv[1], F_SETFL, O_NONBLOCK);
+	iscsi->fd = sv[0];
+	iscsi->is_connected = 1;
+	iscsi->is_loggedin = 1;
+	iscsi->session_type = ISCSI_SESSION_NORMAL;
+	iscsi->statsn = 0;
+	iscsi->maxcmdsn = iscsi->cmdsn + 16;
+	iscsi->use_immediate_data = ISCSI_IMMEDIATE_DATA_NO;
+	iscsi->use_initial_r2t = ISCSI_INITIAL_R2T_YES;
+	iscsi->max_burst_length = IOSIZE;
+	iscsi->target_max_recv_data_segment_length = SEGMENT;
+
+	iov.iov_base = data;
+	iov.iov_len = sizeof(data);
+
+	mallocs = iscsi->mallocs;
+	start = bench_now_ns();
+	for (i = 0; i < COMMANDS; i++) {
+		task = iscsi_write10_iov_task(iscsi, 0, 0, NULL, IOSIZE,
+					      BLOCKSIZE, 0, 0, 0, 0, 0,
+					      io_cb, NULL, &iov, 1);
+		if (task == NULL) {
+			fprintf(stderr, "Failed to queue command\n");
+			goto out;
+		}
+		while (completed <= i) {
+			pfd.fd = iscsi_get_fd(iscsi);
+			pfd.events = iscsi_which_events(iscsi);
+			if (poll(&pfd, 1, 0) < 0 ||
+			    iscsi_service(iscsi, pfd.revents) != 0) {
+				fprintf(stderr, "iscsi_service failed: %s\n",
+					iscsi_get_error(iscsi));
+				goto out;
+			}
+			queued = iscsi->outqueue.count;
+			if (queued > max_queued) {
+				max_queued = queued;
+			}
+			if (fake_target(&t) != 0) {
+				fprintf(stderr, "Bad pdu on the wire\n");
+				goto out;
+			}
+		}
+	}
+	ns = (bench_now_ns() - start) / COMMANDS;
+
+	bad_completions += t.bad;
+	printf("%d KiB segments: %d data-out pdus per command, "
+	       "max %d queued, %d allocations\n", SEGMENT / 1024,
+	       IOSIZE / SEGMENT, max_queued, iscsi->mallocs - mallocs);
+	printf("%.2f ms/cmd %.0f MB/s bad %d\n", ns / 1e6,
+	       IOSIZE / ns * 1e3, bad_completions);
+	if (bad_completions == 0) {
+		ret = 0;
+	}
+
+ out:
+	if (iscsi != NULL) {
+		iscsi->fd = -1;
+		iscsi_destroy_context(iscsi);
+	}
+	close(sv[0]);
+	close(sv[1]);
+	return ret;
+}
@@ -0,0 +1,342 @@
+/*
+   Copyright (C) 2026 by the libiscsi authors
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * Time 1 MiB WRITE10 and READ10 commands with and without data digests.
+ * Reads land either in a user iovector or in the reassembly buffer.
+ * A fake target on the other end of a socketpair takes the data-out and
+ * answers reads with 256 KiB data-in pdus. It checks the data digest of
+ * the first write and the client checks the digests of every read.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "iscsi.h"
+#include "iscsi-private.h"
+#include "scsi-lowlevel.h"
+#include "bench.h"
+
+#define IOSIZE    (1024 * 1024)
+#define SEGMENT   (256 * 1024)
+#define BLOCKSIZE 512
+#define COMMANDS  256
+
+enum mode { WRITE, READ_IOV, READ_REASSEMBLY };
+
+struct target {
+	int fd;
+	int digest;
+	int check_digest;
+	uint32_t statsn;
+	uint32_t itt;
+	uint32_t cmdsn;
+	size_t received;
+	unsigned char req[2 * IOSIZE];
+	size_t req_len;
+	/* queued responses */
+	unsigned char hdr[IOSIZE / SEGMENT][ISCSI_RAW_HEADER_SIZE];
+	struct iovec rsp[3 * IOSIZE / SEGMENT];
+	int rsp_cnt;
+	int rsp_pos;
+};
+
+static unsigned char seg_data[SEGMENT];
+static unsigned char seg_digest[ISCSI_DIGEST_SIZE];
+static int completed, bad_completions;
+
+static void
+io_cb(struct iscsi_context *iscsi, int status, void *command_data,
+      void *private_data)
+{
+	struct scsi_task *task = command_data;
+
+	if (status != SCSI_STATUS_GOOD ||
+	    (task->xfer_dir == SCSI_XFER_READ &&
+	     task->iovector_in.iov == NULL &&
+	     (task->datain.size != IOSIZE ||
+	      memcmp(task->datain.data, seg_data, SEGMENT)))) {
+		bad_completions++;
+	}
+	completed++;
+	scsi_free_scsi_task(task);
+}
+
+static void
+target_header(struct target *t, unsigned char *r, int opcode, int flags)
+{
+	memset(r, 0, ISCSI_RAW_HEADER_SIZE);
+	r[0] = opcode;
+	r[1] = flags;
+	scsi_set_uint32(&r[16], t->itt);
+	scsi_set_uint32(&r[24], t->statsn);
+	scsi_set_uint32(&r[28], t->cmdsn + 1);
+	scsi_set_uint32(&r[32], t->cmdsn + 16);
+}
+
+static void
+target_queue(struct target *t, void *buf, size_t len)
+{
+	t->rsp[t->rsp_cnt].iov_base = buf;
+	t->rsp[t->rsp_cnt].iov_len = len;
+	t->rsp_cnt++;
+}
+
+static void
+target_read(struct target *t)
+{
+	unsigned char *r;
+	int i, flags;
+
+	for (i = 0; i < IOSIZE / SEGMENT; i++) {
+		r = t->hdr[i];
+		flags = 0;
+		if (i == IOSIZE / SEGMENT - 1) {
+			flags = ISCSI_PDU_SCSI_FINAL |
+				ISCSI_PDU_DATA_CONTAINS_STATUS;
+		}
+		target_header(t, r, ISCSI_PDU_DATA_IN, flags);
+		scsi_set_uint32(&r[4], SEGMENT);
+		scsi_set_uint32(&r[36], i);
+		scsi_set_uint32(&r[40], i * SEGMENT);
+		target_queue(t, r, ISCSI_RAW_HEADER_SIZE);
+		target_queue(t, seg_data, SEGMENT);
+		if (t->digest) {
+			target_queue(t, seg_digest, ISCSI_DIGEST_SIZE);
+		}
+	}
+	t->statsn++;
+}
+
+/* consume complete pdus from the request buffer */
+static int
+target_parse(struct target *t)
+{
+	unsigned char *q;
+	size_t pos = 0, dsl, len;
+	uint32_t crc, rcvd;
+
+	while (t->req_len - pos >= ISCSI_RAW_HEADER_SIZE) {
+		q = &t->req[pos];
+		dsl = scsi_get_uint32(&q[4]) & 0x00ffffff;
+		len = ISCSI_RAW_HEADER_SIZE;
+		if (dsl) {
+			len += ((dsl + 3) & ~3) +
+				(t->digest ? ISCSI_DIGEST_SIZE : 0);
+		}
+		if (t->req_len - pos < len) {
+			break;
+		}
+		if (dsl && t->digest && t->check_digest) {
+			crc = crc32c(&q[ISCSI_RAW_HEADER_SIZE],
+				     (dsl + 3) & ~3);
+			rcvd = q[len - 4] | q[len - 3] << 8 |
+				q[len - 2] << 16 | (uint32_t)q[len - 1] << 24;
+			if (crc != rcvd) {
+				return -1;
+			}
+		}
+		switch (q[0] & 0x3f) {
+		case ISCSI_PDU_SCSI_REQUEST:
+			t->itt = scsi_get_uint32(&q[16]);
+			t->cmdsn = scsi_get_uint32(&q[24]);
+			t->received = dsl;
+			if (q[32] == SCSI_OPCODE_READ10) {
+				target_read(t);
+			}
+			break;
+		case ISCSI_PDU_DATA_OUT:
+			t->received += dsl;
+			break;
+		default:
+			return -1;
+		}
+		if ((q[0] & 0x3f) != ISCSI_PDU_SCSI_REQUEST ||
+		    q[32] == SCSI_OPCODE_WRITE10) {
+			if (t->received == IOSIZE) {
+				target_header(t, t->hdr[0],
+					      ISCSI_PDU_SCSI_RESPONSE,
+					      ISCSI_PDU_SCSI_FINAL);
+				target_queue(t, t->hdr[0],
+					     ISCSI_RAW_HEADER_SIZE);
+				t->statsn++;
+				t->received = 0;
+				t->check_digest = 0;
+			}
+		}
+		pos += len;
+	}
+	bench_consume(t->req, &t->req_len, pos);
+	return 0;
+}
+
+static int
+fake_target(struct target *t)
+{
+	switch (bench_writev(t->fd, t->rsp, &t->rsp_pos, t->rsp_cnt)) {
+	case 1:
+		return 0;
+	case -1:
+		return -1;
+	}
+	t->rsp_pos = t->rsp_cnt = 0;
+
+	if (bench_read(t->fd, t->req, sizeof(t->req), &t->req_len) != 0) {
+		return -1;
+	}
+	return target_parse(t);
+}
+
+static int
+bench(enum mode mode, int digest)
+{
+	static unsigned char data[IOSIZE];
+	static struct target t;
+	struct scsi_iovec iov;
+	struct iscsi_context *iscsi;
+	struct scsi_task *task;
+	struct pollfd pfd;
+	int sv[2], i, ret = -1;
+	double start, ns;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+		return -1;
+	}
+	memset(&t, 0, sizeof(t));
+	t.fd = sv[1];
+	t.digest = digest;
+	t.check_digest = 1;
+	t.statsn = 1;
+	iscsi = iscsi_create_context("iqn.2007-10.com.github:sahlberg:libiscsi:bench");
+	if (iscsi == NULL) {
+		fprintf(stderr, "Failed to create context\n");
+		goto out;
+	}
+
+	/* pretend we are logged in */
+	fcntl(sv[0], F_SETFL, O_NONBLOCK);
+	fcntl(sv[1], F_SETFL, O_NONBLOCK);
+	iscsi->fd = sv[0];
+	iscsi->is_connected = 1;
+	iscsi->is_loggedin = 1;
+	iscsi->session_type = ISCSI_SESSION_NORMAL;
+	iscsi->statsn = 0;
+	iscsi->maxcmdsn = iscsi->cmdsn + 16;
+	iscsi->data_digest = digest ? ISCSI_DATA_DIGEST_CRC32C :
+		ISCSI_DATA_DIGEST_NONE;
+	iscsi->use_immediate_data = ISCSI_IMMEDIATE_DATA_YES;
+	iscsi->use_initial_r2t = ISCSI_INITIAL_R2T_NO;
+	iscsi->first_burst_length = IOSIZE;
+	iscsi->max_burst_length = IOSIZE;
+	iscsi->target_max_recv_data_segment_length = SEGMENT;
+	iscsi->initiator_max_recv_data_segment_length = SEGMENT;
+
+	iov.iov_base = data;
+	iov.iov_len = sizeof(data);
+
+	completed = bad_completions = 0;
+	start = bench_now_ns();
+	for (i = 0; i < COMMANDS; i++) {
+		switch (mode) {
+		case WRITE:
+			task = iscsi_write10_iov_task(iscsi, 0, 0, NULL,
+					IOSIZE, BLOCKSIZE, 0, 0, 0, 0, 0,
+					io_cb, NULL, &iov, 1);
+			break;
+		case READ_IOV:
+			task = iscsi_read10_iov_task(iscsi, 0, 0, IOSIZE,
+					BLOCKSIZE, 0, 0, 0, 0, 0,
+					io_cb, NULL, &iov, 1);
+			break;
+		default:
+			task = iscsi_read10_task(iscsi, 0, 0, IOSIZE,
+					BLOCKSIZE, 0, 0, 0, 0, 0,
+					io_cb, NULL);
+			break;
+		}
+		if (task == NULL) {
+			fprintf(stderr, "Failed to queue command\n");
+			goto out;
+		}
+		while (completed <= i) {
+			pfd.fd = iscsi_get_fd(iscsi);
+			pfd.events = iscsi_which_events(iscsi);
+			if (poll(&pfd, 1, 0) < 0 ||
+			    iscsi_service(iscsi, pfd.revents) != 0) {
+				fprintf(stderr, "iscsi_service failed: %s\n",
+					iscsi_get_error(iscsi));
+				goto out;
+			}
+			if (fake_target(&t) != 0) {
+				fprintf(stderr, "Bad pdu on the wire\n");
+				goto out;
+			}
+		}
+	}
+	ns = (bench_now_ns() - start) / COMMANDS;
+
+	if (mode == READ_IOV && memcmp(data, seg_data, SEGMENT)) {
+		bad_completions++;
+	}
+	printf("%-16s %6s %12.1f %10.0f %6d\n",
+	       mode == WRITE ? "write" : mode == READ_IOV ? "read iovector" :
+	       "read reassembly", digest ? "crc32c" : "none",
+	       ns / 1000, IOSIZE / ns * 1e3, bad_completions);
+	ret = bad_completions ? -1 : 0;
+
+ out:
+	if (iscsi != NULL) {
+		iscsi->fd = -1;
+		iscsi_destroy_context(iscsi);
+	}
+	close(sv[0]);
+	close(sv[1]);
+	return ret;
+}
+
+int main(void)
+{
+	uint32_t crc;
+	int i;
+
+	for (i = 0; i < SEGMENT; i++) {
+		seg_data[i] = i * 7;
+	}
+	crc = crc32c(seg_data, SEGMENT);
+	seg_digest[0] = crc;
+	seg_digest[1] = crc >> 8;
+	seg_digest[2] = crc >> 16;
+	seg_digest[3] = crc >> 24;
+
+	printf("%-16s %6s %12s %10s %6s\n", "command", "digest", "us/MiB",
+	       "MB/s", "bad");
+	for (i = 0; i < 2; i++) {
+		if (bench(WRITE, i) || bench(READ_IOV, i) ||
+		    bench(READ_REASSEMBLY, i)) {
+			return 1;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,326 @@
+/*
+   Copyright (C) 2026 by the libiscsi authors
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * 1 MiB WRITE10 commands with data digests from several submitting
+ * threads through the service thread, with the digests computed on the
+ * service thread or on the submitting threads. Besides the throughput it
+ * reports how much CPU time the service thread spends per MiB, which is
+ * what limits the throughput once there are enough cores.
+ * A fake target thread on the other end of a socketpair takes the data
+ * and checks the data digests of the first pdus.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "iscsi.h"
+#include "iscsi-private.h"
+#include "scsi-lowlevel.h"
+#include "bench.h"
+
+#define IOSIZE      (1024 * 1024)
+#define SEGMENT     (64 * 1024)
+#define BLOCKSIZE   512
+#define COMMANDS    512
+#define DEPTH       4
+#define MAX_THREADS 4
+#define CMDSN_WINDOW 64
+#define CHECKED_PDUS 64
+
+struct target {
+	int fd;
+	int bad;
+	int checked;
+	uint32_t statsn;
+	uint32_t expcmdsn;
+	/* the cmdsns and itts in flight fit in these tables */
+	unsigned char cmdsn_seen[256];
+	uint32_t received[256];
+	unsigned char req[2 * IOSIZE];
+	size_t req_len;
+};
+
+struct submitter {
+	pthread_t thread;
+	struct iscsi_context *iscsi;
+	sem_t slots;
+	int commands;
+	int bad;
+	unsigned char data[IOSIZE];
+};
+
+static struct submitter submitters[MAX_THREADS];
+
+static int
+target_respond(struct target *t, uint32_t itt)
+{
+	unsigned char r[ISCSI_RAW_HEADER_SIZE];
+	size_t done = 0;
+	ssize_t count;
+
+	memset(r, 0, sizeof(r));
+	r[0] = ISCSI_PDU_SCSI_RESPONSE;
+	r[1] = ISCSI_PDU_SCSI_FINAL;
+	scsi_set_uint32(&r[16], itt);
+	scsi_set_uint32(&r[24], t->statsn++);
+	scsi_set_uint32(&r[28], t->expcmdsn);
+	scsi_set_uint32(&r[32], t->expcmdsn + CMDSN_WINDOW);
+	while (done < sizeof(r)) {
+		count = write(t->fd, &r[done], sizeof(r) - done);
+		if (count < 0) {
+			return -1;
+		}
+		done += count;
+	}
+	return 0;
+}
+
+/* consume complete pdus from the request buffer */
+static int
+target_parse(struct target *t)
+{
+	unsigned char *q;
+	size_t pos = 0, dsl, len;
+	uint32_t crc, rcvd, itt, cmdsn;
+
+	while (t->req_len - pos >= ISCSI_RAW_HEADER_SIZE) {
+		q = &t->req[pos];
+		dsl = scsi_get_uint32(&q[4]) & 0x00ffffff;
+		len = ISCSI_RAW_HEADER_SIZE;
+		if (dsl) {
+			len += ((dsl + 3) & ~3) + ISCSI_DIGEST_SIZE;
+		}
+		if (t->req_len - pos < len) {
+			break;
+		}
+		if (dsl && t->checked < CHECKED_PDUS) {
+			crc = crc32c(&q[ISCSI_RAW_HEADER_SIZE],
+				     (dsl + 3) & ~3);
+			rcvd = q[len - 4] | q[len - 3] << 8 |
+				q[len - 2] << 16 | (uint32_t)q[len - 1] << 24;
+			if (crc != rcvd) {
+				t->bad++;
+			}
+			t->checked++;
+		}
+		itt = scsi_get_uint32(&q[16]);
+		switch (q[0] & 0x3f) {
+		case ISCSI_PDU_SCSI_REQUEST:
+			/* commands from different threads can arrive
+			 * out of cmdsn order */
+			cmdsn = scsi_get_uint32(&q[24]);
+			t->cmdsn_seen[cmdsn & 0xff] = 1;
+			while (t->cmdsn_seen[t->expcmdsn & 0xff]) {
+				t->cmdsn_seen[t->expcmdsn++ & 0xff] = 0;
+			}
+			t->received[itt & 0xff] = dsl;
+			break;
+		case ISCSI_PDU_DATA_OUT:
+			t->received[itt & 0xff] += dsl;
+			break;
+		default:
+			return -1;
+		}
+		if (t->received[itt & 0xff] == IOSIZE) {
+			t->received[itt & 0xff] = 0;
+			if (target_respond(t, itt) != 0) {
+				return -1;
+			}
+		}
+		pos += len;
+	}
+	memmove(t->req, &t->req[pos], t->req_len - pos);
+	t->req_len -= pos;
+	return 0;
+}
+
+static void *
+fake_target(void *arg)
+{
+	struct target *t = arg;
+	ssize_t count;
+
+	for (;;) {
+		count = read(t->fd, &t->req[t->req_len],
+			     sizeof(t->req) - t->req_len);
+		if (count <= 0) {
+			break;
+		}
+		t->req_len += count;
+		if (target_parse(t) != 0) {
+			t->bad++;
+			break;
+		}
+	}
+	return NULL;
+}
+
+static void
+io_cb(struct iscsi_context *iscsi, int status, void *command_data,
+      void *private_data)
+{
+	struct submitter *s = private_data;
+
+	if (status != SCSI_STATUS_GOOD) {
+		s->bad++;
+	}
+	scsi_free_scsi_task(command_data);
+	sem_post(&s->slots);
+}
+
+static void *
+submit(void *arg)
+{
+	struct submitter *s = arg;
+	struct scsi_iovec iov;
+	int i;
+
+	iov.iov_base = s->data;
+	iov.iov_len = sizeof(s->data);
+	for (i = 0; i < s->commands; i++) {
+		sem_wait(&s->slots);
+		if (iscsi_write10_iov_task(s->iscsi, 0, 0, NULL, IOSIZE,
+					   BLOCKSIZE, 0, 0, 0, 0, 0,
+					   io_cb, s, &iov, 1) == NULL) {
+			s->bad++;
+			sem_post(&s->slots);
+		}
+	}
+	for (i = 0; i < DEPTH; i++) {
+		sem_wait(&s->slots);
+	}
+	return NULL;
+}
+
+static int
+bench(int threads, int on_submit)
+{
+	static struct target t;
+	struct iscsi_context *iscsi;
+	pthread_t target_thread;
+	clockid_t service_clock;
+	int sv[2], i, bad, ret = -1;
+	double start, service_start, ns, service_ns;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+		return -1;
+	}
+	memset(&t, 0, sizeof(t));
+	t.fd = sv[1];
+	t.statsn = 1;
+	iscsi = iscsi_create_context("iqn.2007-10.com.github:sahlberg:libiscsi:bench");
+	if (iscsi == NULL) {
+		fprintf(stderr, "Failed to create context\n");
+		goto out;
+	}
+
+	/* pretend we are logged in */
+	fcntl(sv[0], F_SETFL, O_NONBLOCK);
+	iscsi->fd = sv[0];
+	iscsi->is_connected = 1;
+	iscsi->is_loggedin = 1;
+	iscsi->session_type = ISCSI_SESSION_NORMAL;
+	iscsi->statsn = 0;
+	iscsi->maxcmdsn = iscsi->cmdsn + CMDSN_WINDOW;
+	t.expcmdsn = iscsi->cmdsn;
+	iscsi->data_digest = ISCSI_DATA_DIGEST_CRC32C;
+	iscsi->use_immediate_data = ISCSI_IMMEDIATE_DATA_YES;
+	iscsi->use_initial_r2t = ISCSI_INITIAL_R2T_NO;
+	iscsi->first_burst_length = IOSIZE;
+	iscsi->max_burst_length = IOSIZE;
+	iscsi->target_max_recv_data_segment_length = SEGMENT;
+	iscsi->initiator_max_recv_data_segment_length = SEGMENT;
+	iscsi_set_data_digest_on_submit(iscsi, on_submit);
+
+	if (pthread_create(&target_thread, NULL, fake_target, &t) != 0) {
+		goto out;
+	}
+	if (iscsi_mt_service_thread_start(iscsi) != 0 ||
+	    pthread_getcpuclockid(iscsi->service_thread,
+				  &service_clock) != 0) {
+		fprintf(stderr, "Failed to start service thread\n");
+		exit(1);
+	}
+
+	start = bench_clock_ns(CLOCK_MONOTONIC);
+	service_start = bench_clock_ns(service_clock);
+	for (i = 0; i < threads; i++) {
+		submitters[i].iscsi = iscsi;
+		submitters[i].commands = COMMANDS / threads;
+		submitters[i].bad = 0;
+		sem_init(&submitters[i].slots, 0, DEPTH);
+		pthread_create(&submitters[i].thread, NULL, submit, &submitters[i]);
+	}
+	bad = 0;
+	for (i = 0; i < threads; i++) {
+		pthread_join(submitters[i].thread, NULL);
+		sem_destroy(&submitters[i].slots);
+		bad += submitters[i].bad;
+	}
+	ns = (bench_clock_ns(CLOCK_MONOTONIC) - start) / COMMANDS;
+	service_ns = (bench_clock_ns(service_clock) - service_start) / COMMANDS;
+
+	iscsi_mt_service_thread_stop(iscsi);
+	shutdown(sv[0], SHUT_RDWR);
+	pthread_join(target_thread, NULL);
+	bad += t.bad;
+
+	printf("%7d %9s %10.0f %12.1f %6d\n", threads,
+	       on_submit ? "submit" : "service", IOSIZE / ns * 1e3,
+	       service_ns / 1000, bad);
+	ret = bad ? -1 : 0;
+
+ out:
+	if (iscsi != NULL) {
+		iscsi->fd = -1;
+		iscsi_destroy_context(iscsi);
+	}
+	close(sv[0]);
+	close(sv[1]);
+	return ret;
+}
+
+int main(void)
+{
+	int threads, on_submit, i, j;
+
+	for (i = 0; i < MAX_THREADS; i++) {
+		for (j = 0; j < IOSIZE; j++) {
+			submitters[i].data[j] = j * (i + 7);
+		}
+	}
+	printf("%7s %9s %10s %12s %6s\n", "threads", "digest on", "MB/s",
+	       "svc us/MiB", "bad");
+	for (threads = 1; threads <= MAX_THREADS; threads *= 2) {
+		for (on_submit = 0; on_submit < 2; on_submit++) {
+			if (bench(threads, on_submit)) {
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,118 @@
+/*
+   Copyright (C) 2026 by the libiscsi authors
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * Measure the cost of looking up an in-flight pdu by its ITT, which is
+ * what happens for every Data-In, R2T and SCSI Response we receive.
+ * The lookup through the ITT hash should stay flat as the queue depth
+ * grows while walking the waitpdu list grows linearly.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include "iscsi.h"
+#include "iscsi-private.h"
+#include "scsi-lowlevel.h"
+#include "bench.h"
+
+static struct iscsi_pdu *
+linear_find(struct iscsi_context *iscsi, uint32_t itt)
+{
+	struct iscsi_pdu *pdu;
+
+	for (pdu = iscsi->waitpdu.head; pdu; pdu = pdu->next) {
+		if (pdu->itt == itt) {
+			break;
+		}
+	}
+	return pdu;
+}
+
+static int
+bench(int depth)
+{
+	struct iscsi_context *iscsi;
+	struct iscsi_pdu *pdu;
+	uint32_t first_itt;
+	int i, lookups, linear_lookups, misses = 0;
+	uint32_t idx;
+	double start, hash_ns, linear_ns;
+
+	iscsi = iscsi_create_context("iqn.2007-10.com.github:sahlberg:libiscsi:bench");
+	if (iscsi == NULL) {
+		fprintf(stderr, "Failed to create context\n");
+		return -1;
+	}
+
+	first_itt = iscsi->itt;
+	for (i = 0; i < depth; i++) {
+		pdu = iscsi_allocate_pdu(iscsi, ISCSI_PDU_SCSI_REQUEST,
+					 ISCSI_PDU_SCSI_RESPONSE,
+					 iscsi_itt_post_increment(iscsi), 0);
+		if (pdu == NULL) {
+			fprintf(stderr, "Failed to allocate pdu\n");
+			iscsi_destroy_context(iscsi);
+			return -1;
+		}
+		iscsi_waitpdu_add(iscsi, pdu);
+	}
+
+	/* step through the queue in a scattered order */
+	lookups = 1 << 22;
+	idx = 0;
+	start = bench_now_ns();
+	for (i = 0; i < lookups; i++) {
+		idx = (idx + 7919) % depth;
+		if (iscsi_waitpdu_find(iscsi, first_itt + idx) == NULL) {
+			misses++;
+		}
+	}
+	hash_ns = (bench_now_ns() - start) / lookups;
+
+	linear_lookups = (1 << 24) / depth;
+	idx = 0;
+	start = bench_now_ns();
+	for (i = 0; i < linear_lookups; i++) {
+		idx = (idx + 7919) % depth;
+		if (linear_find(iscsi, first_itt + idx) == NULL) {
+			misses++;
+		}
+	}
+	linear_ns = (bench_now_ns() - start) / linear_lookups;
+
+	printf("%8d %14.1f %14.1f\n", depth, hash_ns, linear_ns);
+
+	iscsi_destroy_context(iscsi);
+	return misses ? -1 : 0;
+}
+
+int main(void)
+{
+	int depth;
+
+	printf("%8s %14s %14s\n", "depth", "hash ns/pdu", "linear ns/pdu");
+	for (depth = 16; depth <= 16384; depth *= 4) {
+		if (bench(depth)) {
+			fprintf(stderr, "ITT lookup failed at depth %d\n", depth);
+			return 1;
+		}
+	}
+	return 0;
+}
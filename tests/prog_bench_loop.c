@@ -0,0 +1,346 @@
+/*
+   Copyright (C) 2026 by the libiscsi authors
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * Drive 500 sessions from one thread, of which only some are busy with
+ * TESTUNITREADY commands, once with a loop that polls every context like
+ * the utilities do and once with iscsi_loop_run(). Report the commands
+ * per second for each number of busy sessions. A fake target thread on
+ * the other end of a socketpair per session answers every command right
+ * away. Every command has to complete with SCSI_STATUS_GOOD.
+ * Then check that a command to a target that never answers times out
+ * through the loop, without any event on its socket.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "iscsi.h"
+#include "iscsi-private.h"
+#include "scsi-lowlevel.h"
+#include "bench.h"
+
+#define SESSIONS    500
+#define COMMANDS    (64 * 1024)  /* per run, spread over the busy sessions */
+#define DEPTH       4            /* outstanding commands per session */
+#define WINDOW      1024
+#define TIMEOUT_MS  200
+
+struct session {
+	struct iscsi_context *iscsi;
+	int sv[2];
+	int left;                    /* commands still to submit */
+};
+
+static struct session sessions[SESSIONS];
+static struct bench_target peers[SESSIONS];
+static int busy;
+static int total;
+static int stop;
+static int completed;
+static int bad;
+
+/* only the busy sessions have a target that answers */
+static void *
+target_thread(void *arg)
+{
+	static struct pollfd pfd[SESSIONS];
+	int i;
+
+	for (i = 0; i < busy; i++) {
+		pfd[i].fd = peers[i].fd;
+		pfd[i].events = POLLIN;
+	}
+	while (!__atomic_load_n(&stop, __ATOMIC_ACQUIRE)) {
+		if (poll(pfd, busy, 100) <= 0) {
+			continue;
+		}
+		for (i = 0; i < busy; i++) {
+			if (pfd[i].revents && !bench_target_serve(&peers[i])) {
+				pfd[i].fd = -1;
+			}
+		}
+	}
+	return NULL;
+}
+
+static void tur_cb(struct iscsi_context *iscsi, int status,
+		   void *command_data, void *private_data);
+
+static int
+submit(struct session *s)
+{
+	if (s->left == 0) {
+		return 0;
+	}
+	s->left--;
+	if (iscsi_testunitready_task(s->iscsi, 0, tur_cb, s) == NULL) {
+		bad++;
+		return -1;
+	}
+	return 0;
+}
+
+static void
+tur_cb(struct iscsi_context *iscsi, int status, void *command_data,
+       void *private_data)
+{
+	if (status != SCSI_STATUS_GOOD) {
+		bad++;
+	}
+	completed++;
+	scsi_free_scsi_task(command_data);
+	submit(private_data);
+}
+
+/* what an application does without iscsi_loop */
+static int
+run_poll(void)
+{
+	static struct pollfd pfd[SESSIONS];
+	int i, t, timeout;
+
+	while (completed < total && !bad) {
+		timeout = 1000;
+		for (i = 0; i < SESSIONS; i++) {
+			pfd[i].fd = iscsi_get_fd(sessions[i].iscsi);
+			pfd[i].events = iscsi_which_events(sessions[i].iscsi);
+			pfd[i].revents = 0;
+			t = iscsi_next_timeout(sessions[i].iscsi);
+			if (t >= 0 && t < timeout) {
+				timeout = t;
+			}
+		}
+		if (poll(pfd, SESSIONS, timeout) < 0) {
+			return -1;
+		}
+		for (i = 0; i < SESSIONS; i++) {
+			if (pfd[i].revents &&
+			    iscsi_service(sessions[i].iscsi,
+					  pfd[i].revents) < 0) {
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+static int
+run_loop(struct iscsi_loop *loop)
+{
+	while (completed < total && !bad) {
+		if (iscsi_loop_run(loop, 1000) < 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static void
+timeout_cb(struct iscsi_context *iscsi, int status, void *command_data,
+	   void *private_data)
+{
+	*(int *)private_data = status;
+	scsi_free_scsi_task(command_data);
+}
+
+/* the last session never gets an answer */
+static int
+check_timeout(struct iscsi_loop *loop)
+{
+	struct iscsi_context *iscsi = sessions[SESSIONS - 1].iscsi;
+	int status = -1;
+	double start, ms;
+
+	iscsi_set_timeout_ms(iscsi, TIMEOUT_MS);
+	start = bench_now_ns();
+	if (iscsi_testunitready_task(iscsi, 0, timeout_cb, &status) == NULL) {
+		return -1;
+	}
+	while (status == -1 && (bench_now_ns() - start) / 1e6 < 10 * TIMEOUT_MS) {
+		if (iscsi_loop_run(loop, -1) < 0) {
+			return -1;
+		}
+	}
+	ms = (bench_now_ns() - start) / 1e6;
+	iscsi_set_timeout_ms(iscsi, 0);
+
+	printf("timeout: status %d after %.0f ms\n", status, ms);
+	/* only the status counts, how late the timer fires depends on the
+	 * load of the machine */
+	if (status != SCSI_STATUS_TIMEOUT || ms < TIMEOUT_MS - 1) {
+		fprintf(stderr, "expected SCSI_STATUS_TIMEOUT after %d ms\n",
+			TIMEOUT_MS);
+		return -1;
+	}
+	if (iscsi_loop_next_timeout(loop) != -1) {
+		fprintf(stderr, "timer still armed\n");
+		return -1;
+	}
+	return 0;
+}
+
+static int
+setup(void)
+{
+	struct iscsi_context *iscsi;
+	int i;
+
+	for (i = 0; i < SESSIONS; i++) {
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, sessions[i].sv) != 0) {
+			return -1;
+		}
+		iscsi = iscsi_create_context("iqn.2007-10.com.github:sahlberg:libiscsi:bench");
+		if (iscsi == NULL) {
+			fprintf(stderr, "Failed to create context\n");
+			return -1;
+		}
+		sessions[i].iscsi = iscsi;
+
+		/* pretend we are logged in */
+		fcntl(sessions[i].sv[0], F_SETFL, O_NONBLOCK);
+		iscsi->fd = sessions[i].sv[0];
+		iscsi->is_connected = 1;
+		iscsi->is_loggedin = 1;
+		iscsi->session_type = ISCSI_SESSION_NORMAL;
+		iscsi->statsn = 0;
+		iscsi->expcmdsn = iscsi->cmdsn;
+		iscsi->maxcmdsn = iscsi->cmdsn + WINDOW - 1;
+
+		memset(&peers[i], 0, sizeof(peers[i]));
+		peers[i].fd = sessions[i].sv[1];
+		peers[i].window = WINDOW;
+		peers[i].statsn = 1;
+		peers[i].maxcmdsn = iscsi->maxcmdsn;
+	}
+	return 0;
+}
+
+static void
+teardown(void)
+{
+	int i;
+
+	for (i = 0; i < SESSIONS; i++) {
+		if (sessions[i].iscsi != NULL) {
+			sessions[i].iscsi->fd = -1;
+			iscsi_destroy_context(sessions[i].iscsi);
+		}
+		if (sessions[i].sv[0] != -1) {
+			close(sessions[i].sv[0]);
+			close(sessions[i].sv[1]);
+		}
+	}
+}
+
+static int
+bench(int nbusy, int use_loop)
+{
+	struct iscsi_loop *loop = NULL;
+	pthread_t target;
+	int i, j, ret = -1;
+	double start, ns;
+
+	for (i = 0; i < SESSIONS; i++) {
+		sessions[i].iscsi = NULL;
+		sessions[i].sv[0] = sessions[i].sv[1] = -1;
+	}
+	if (setup() != 0) {
+		goto out;
+	}
+	if (use_loop) {
+		loop = iscsi_create_loop();
+		if (loop == NULL) {
+			fprintf(stderr, "Failed to create loop\n");
+			goto out;
+		}
+		for (i = 0; i < SESSIONS; i++) {
+			if (iscsi_loop_add(loop, sessions[i].iscsi) != 0) {
+				fprintf(stderr, "%s\n",
+					iscsi_get_error(sessions[i].iscsi));
+				goto out;
+			}
+		}
+	}
+
+	busy = nbusy;
+	total = COMMANDS / busy * busy;
+	stop = 0;
+	completed = 0;
+	bad = 0;
+	if (pthread_create(&target, NULL, target_thread, NULL) != 0) {
+		goto out;
+	}
+
+	start = bench_now_ns();
+	for (i = 0; i < busy; i++) {
+		sessions[i].left = COMMANDS / busy;
+	}
+	for (i = 0; i < busy; i++) {
+		for (j = 0; j < DEPTH; j++) {
+			submit(&sessions[i]);
+		}
+	}
+	if (use_loop) {
+		ret = run_loop(loop);
+	} else {
+		ret = run_poll();
+	}
+	ns = bench_now_ns() - start;
+
+	__atomic_store_n(&stop, 1, __ATOMIC_RELEASE);
+	pthread_join(target, NULL);
+
+	printf("%5d %-5s %12.0f %6d\n", busy, use_loop ? "loop" : "poll",
+	       completed / ns * 1e9, bad);
+	if (bad || completed != total) {
+		ret = -1;
+	}
+	if (ret == 0 && use_loop && busy == 1) {
+		ret = check_timeout(loop);
+	}
+
+ out:
+	/* destroying a context takes it out of the loop */
+	teardown();
+	iscsi_destroy_loop(loop);
+	return ret;
+}
+
+int main(void)
+{
+	int nbusy, use_loop;
+
+	printf("%5s %-5s %12s %6s\n", "busy", "loop", "commands/s", "bad");
+	for (nbusy = 1; nbusy <= SESSIONS; nbusy = nbusy == 256 ?
+		     SESSIONS : nbusy * 4) {
+		for (use_loop = 0; use_loop < 2; use_loop++) {
+			if (bench(nbusy, use_loop)) {
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
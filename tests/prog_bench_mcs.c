@@ -0,0 +1,654 @@
+/*
+   Copyright (C) 2026 by the libiscsi authors
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * Stripe READ10 and WRITE10 commands over a session with 1, 2 and 4
+ * connections to a fake target that runs in a thread on loopback TCP.
+ * The target checks that the non-leading connections log in with the
+ * TSIH and ISID of the session, that every CmdSN of the session arrives
+ * exactly once no matter which connection carries it, and that no two
+ * outstanding commands share an ITT.
+ * It then holds back its responses so that commands pile up in the
+ * outqueues behind MaxCmdSN, cancels one of them, and checks that a
+ * NOP-Out with the CmdSN of the cancelled command closes the gap on the
+ * wire.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "iscsi.h"
+#include "iscsi-private.h"
+#include "scsi-lowlevel.h"
+#include "bench.h"
+
+#define BLOCKSIZE   512
+#define IOSIZE      (8 * 1024)
+#define COMMANDS    20000
+#define QUEUE_DEPTH 32
+#define MAX_CONNS   4
+#define MAX_CMDSN   (COMMANDS + 1024)
+#define TSIH        0x1234
+#define HOLD_CMDS   8
+#define HOLD_WINDOW 4
+#define HOLD_CANCEL 5
+
+struct tconn {
+	volatile int fd;
+	int leading;
+	uint32_t statsn;
+	uint32_t commands;
+	unsigned char buf[IOSIZE + 2 * ISCSI_RAW_HEADER_SIZE];
+	size_t len;
+};
+
+struct held {
+	struct tconn *c;
+	unsigned char hdr[ISCSI_RAW_HEADER_SIZE];
+};
+
+struct target {
+	int listen_fd;
+	volatile int stop;
+	volatile int hold;
+	uint32_t window;
+	int bad;
+	unsigned char isid[6];
+	uint32_t base;
+	uint32_t expcmdsn;
+	uint32_t done;
+	unsigned char seen[MAX_CMDSN];
+	uint32_t itts[QUEUE_DEPTH * 2];
+	int nitts;
+	uint32_t filler_cmdsn, filler_itt;
+	int fillers;
+	struct held held[HOLD_CMDS];
+	volatile int nheld;
+	struct tconn conns[MAX_CONNS];
+};
+
+static struct target t;
+static unsigned char disk[IOSIZE];
+static int completed, good, cancelled;
+
+static void
+target_bad(const char *what, uint32_t val)
+{
+	fprintf(stderr, "target: %s (%08x)\n", what, val);
+	t.bad++;
+}
+
+static int
+target_send(struct tconn *c, unsigned char *hdr, uint32_t itt,
+	    const unsigned char *data, uint32_t dsl)
+{
+	unsigned char pad[4] = {0, 0, 0, 0};
+
+	scsi_set_uint32(&hdr[4], dsl);
+	scsi_set_uint32(&hdr[16], itt);
+	scsi_set_uint32(&hdr[24], c->statsn++);
+	scsi_set_uint32(&hdr[28], t.expcmdsn);
+	scsi_set_uint32(&hdr[32], t.base + t.done + t.window - 1);
+	if (write(c->fd, hdr, ISCSI_RAW_HEADER_SIZE) != ISCSI_RAW_HEADER_SIZE ||
+	    (dsl && write(c->fd, data, dsl) != (ssize_t)dsl) ||
+	    ((dsl & 3) && write(c->fd, pad, 4 - (dsl & 3)) !=
+	     (ssize_t)(4 - (dsl & 3)))) {
+		return -1;
+	}
+	return 0;
+}
+
+/* account for a CmdSN and slide ExpCmdSN over what has arrived */
+static void
+target_cmdsn(uint32_t cmdsn)
+{
+	uint32_t idx = cmdsn - t.base;
+
+	if (idx >= MAX_CMDSN || t.seen[idx]) {
+		target_bad("CmdSN out of range or seen twice", cmdsn);
+		return;
+	}
+	t.seen[idx] = 1;
+	while (t.expcmdsn - t.base < MAX_CMDSN && t.seen[t.expcmdsn - t.base]) {
+		t.expcmdsn++;
+	}
+}
+
+static void
+target_itt_add(uint32_t itt)
+{
+	int i;
+
+	for (i = 0; i < t.nitts; i++) {
+		if (t.itts[i] == itt) {
+			target_bad("ITT of an outstanding command reused", itt);
+			return;
+		}
+	}
+	if (t.nitts < (int)(sizeof(t.itts) / sizeof(t.itts[0]))) {
+		t.itts[t.nitts++] = itt;
+	}
+}
+
+static void
+target_itt_remove(uint32_t itt)
+{
+	int i;
+
+	for (i = 0; i < t.nitts; i++) {
+		if (t.itts[i] == itt) {
+			t.itts[i] = t.itts[--t.nitts];
+			return;
+		}
+	}
+}
+
+static int
+target_respond(struct tconn *c, const unsigned char *q)
+{
+	unsigned char r[ISCSI_RAW_HEADER_SIZE];
+	uint32_t itt = scsi_get_uint32(&q[16]);
+
+	memset(r, 0, sizeof(r));
+	target_itt_remove(itt);
+	t.done++;
+	if (q[32] == SCSI_OPCODE_READ10) {
+		r[0] = ISCSI_PDU_DATA_IN;
+		r[1] = ISCSI_PDU_DATA_FINAL | ISCSI_PDU_DATA_CONTAINS_STATUS;
+		scsi_set_uint32(&r[20], 0xffffffff);
+		return target_send(c, r, itt, disk, scsi_get_uint32(&q[20]));
+	}
+	r[0] = ISCSI_PDU_SCSI_RESPONSE;
+	r[1] = ISCSI_PDU_SCSI_FINAL;
+	return target_send(c, r, itt, NULL, 0);
+}
+
+static int
+target_login(struct tconn *c, const unsigned char *q)
+{
+	unsigned char r[ISCSI_RAW_HEADER_SIZE];
+	char keys[256];
+	uint16_t tsih = scsi_get_uint16(&q[14]);
+	int len;
+
+	if (tsih == 0) {
+		/* a new session */
+		c->leading = 1;
+		memcpy(t.isid, &q[8], 6);
+		t.base = t.expcmdsn = scsi_get_uint32(&q[24]);
+		t.done = 0;
+		t.nitts = 0;
+		t.fillers = 0;
+		memset(t.seen, 0, sizeof(t.seen));
+	} else if (tsih != TSIH || memcmp(t.isid, &q[8], 6)) {
+		target_bad("connection logs in to another session", tsih);
+	} else if (scsi_get_uint16(&q[20]) == 0) {
+		target_bad("connection reuses the CID of the leading connection", 0);
+	}
+	if ((q[1] & 0x0c) != ISCSI_PDU_LOGIN_CSG_OPNEG) {
+		target_bad("unexpected login stage", q[1]);
+	}
+
+	len = snprintf(keys, sizeof(keys), "HeaderDigest=None") + 1;
+	len += snprintf(&keys[len], sizeof(keys) - len, "DataDigest=None") + 1;
+	len += snprintf(&keys[len], sizeof(keys) - len,
+			"MaxRecvDataSegmentLength=262144") + 1;
+	if (c->leading) {
+		len += snprintf(&keys[len], sizeof(keys) - len,
+				"MaxConnections=%d", MAX_CONNS) + 1;
+	}
+
+	memset(r, 0, sizeof(r));
+	r[0] = ISCSI_PDU_LOGIN_RESPONSE;
+	r[1] = ISCSI_PDU_LOGIN_TRANSIT | ISCSI_PDU_LOGIN_CSG_OPNEG |
+		ISCSI_PDU_LOGIN_NSG_FF;
+	memcpy(&r[8], &q[8], 6);
+	scsi_set_uint16(&r[14], TSIH);
+	return target_send(c, r, scsi_get_uint32(&q[16]),
+			   (unsigned char *)keys, len);
+}
+
+static int
+target_pdu(struct tconn *c, const unsigned char *q)
+{
+	unsigned char r[ISCSI_RAW_HEADER_SIZE];
+	uint32_t itt = scsi_get_uint32(&q[16]);
+	uint32_t cmdsn = scsi_get_uint32(&q[24]);
+
+	switch (q[0] & 0x3f) {
+	case ISCSI_PDU_LOGIN_REQUEST:
+		return target_login(c, q);
+	case ISCSI_PDU_SCSI_REQUEST:
+		target_cmdsn(cmdsn);
+		target_itt_add(itt);
+		c->commands++;
+		if (t.hold) {
+			t.held[t.nheld].c = c;
+			memcpy(t.held[t.nheld].hdr, q, ISCSI_RAW_HEADER_SIZE);
+			t.nheld++;
+			return 0;
+		}
+		return target_respond(c, q);
+	case ISCSI_PDU_NOP_OUT:
+		/* a NOP-Out that takes a CmdSN stands in for a command */
+		if (!(q[0] & ISCSI_PDU_IMMEDIATE)) {
+			target_cmdsn(cmdsn);
+			t.filler_cmdsn = cmdsn;
+			t.filler_itt = itt;
+			t.fillers++;
+			t.done++;
+		}
+		memset(r, 0, sizeof(r));
+		r[0] = ISCSI_PDU_NOP_IN;
+		r[1] = 0x80;
+		scsi_set_uint32(&r[20], 0xffffffff);
+		return target_send(c, r, itt, NULL, 0);
+	case ISCSI_PDU_LOGOUT_REQUEST:
+		memset(r, 0, sizeof(r));
+		r[0] = ISCSI_PDU_LOGOUT_RESPONSE;
+		r[1] = 0x80;
+		return target_send(c, r, itt, NULL, 0);
+	default:
+		target_bad("unexpected opcode", q[0]);
+		return -1;
+	}
+}
+
+static int
+target_read(struct tconn *c)
+{
+	size_t dsl, len, pos = 0;
+	ssize_t count;
+
+	count = read(c->fd, &c->buf[c->len], sizeof(c->buf) - c->len);
+	if (count <= 0) {
+		return -1;
+	}
+	c->len += count;
+	while (c->len - pos >= ISCSI_RAW_HEADER_SIZE) {
+		dsl = scsi_get_uint32(&c->buf[pos + 4]) & 0x00ffffff;
+		len = ISCSI_RAW_HEADER_SIZE + ((dsl + 3) & ~3);
+		if (c->len - pos < len) {
+			break;
+		}
+		if (target_pdu(c, &c->buf[pos]) != 0) {
+			return -1;
+		}
+		pos += len;
+	}
+	memmove(c->buf, &c->buf[pos], c->len - pos);
+	c->len -= pos;
+	return 0;
+}
+
+static void *
+target_thread(void *arg)
+{
+	struct pollfd pfd[1 + MAX_CONNS];
+	int i, fd;
+
+	while (!t.stop) {
+		if (!t.hold && t.nheld) {
+			for (i = 0; i < t.nheld; i++) {
+				target_respond(t.held[i].c, t.held[i].hdr);
+			}
+			t.nheld = 0;
+		}
+
+		pfd[0].fd = t.listen_fd;
+		pfd[0].events = POLLIN;
+		for (i = 0; i < MAX_CONNS; i++) {
+			pfd[1 + i].fd = t.conns[i].fd;
+			pfd[1 + i].events = POLLIN;
+		}
+		if (poll(pfd, 1 + MAX_CONNS, 10) <= 0) {
+			continue;
+		}
+		if (pfd[0].revents & POLLIN) {
+			fd = accept(t.listen_fd, NULL, NULL);
+			for (i = 0; fd >= 0 && i < MAX_CONNS; i++) {
+				if (t.conns[i].fd == -1) {
+					memset(&t.conns[i], 0, sizeof(t.conns[i]));
+					t.conns[i].fd = fd;
+					fd = -1;
+				}
+			}
+			if (fd >= 0) {
+				target_bad("too many connections", 0);
+				close(fd);
+			}
+		}
+		for (i = 0; i < MAX_CONNS; i++) {
+			if (t.conns[i].fd != -1 && pfd[1 + i].revents &&
+			    target_read(&t.conns[i]) != 0) {
+				close(t.conns[i].fd);
+				t.conns[i].fd = -1;
+			}
+		}
+	}
+	return arg;
+}
+
+static void
+io_cb(struct iscsi_context *iscsi, int status, void *command_data,
+      void *private_data)
+{
+	struct scsi_task *task = command_data;
+
+	completed++;
+	if (status == SCSI_STATUS_GOOD) {
+		if (task->cdb[0] == SCSI_OPCODE_READ10 &&
+		    (task->datain.size != IOSIZE ||
+		     memcmp(task->datain.data, disk, IOSIZE))) {
+			fprintf(stderr, "READ10 returned the wrong data\n");
+		} else {
+			good++;
+		}
+	} else if (status == SCSI_STATUS_CANCELLED) {
+		cancelled++;
+	}
+	scsi_free_scsi_task(task);
+}
+
+/* service every connection of the session until done() says so */
+static int
+run(struct iscsi_context *iscsi, int (*done)(void))
+{
+	struct pollfd pfd[1 + ISCSI_MAX_CONNECTIONS];
+	struct iscsi_context *conn;
+	int i, n;
+
+	while (!done()) {
+		n = iscsi_get_connection_count(iscsi);
+		for (i = 0; i < n; i++) {
+			conn = iscsi_get_connection(iscsi, i);
+			pfd[i].fd = iscsi_get_fd(conn);
+			pfd[i].events = iscsi_which_events(conn);
+			pfd[i].revents = 0;
+		}
+		if (poll(pfd, n, 10) < 0) {
+			return -1;
+		}
+		for (i = n - 1; i >= 0; i--) {
+			if (iscsi_service(iscsi_get_connection(iscsi, i),
+					  pfd[i].revents) != 0) {
+				fprintf(stderr, "iscsi_service failed: %s\n",
+					iscsi_get_error(iscsi));
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+static int submitted;
+
+static int
+queue_not_full(void)
+{
+	return submitted - completed < QUEUE_DEPTH;
+}
+
+static int
+all_done(void)
+{
+	return completed == submitted;
+}
+
+static int
+target_holds_window(void)
+{
+	return t.nheld == HOLD_WINDOW;
+}
+
+static struct iscsi_context *
+login(const char *portal, int nconns, uint32_t window)
+{
+	struct iscsi_context *iscsi;
+	int i;
+
+	t.window = window;
+	iscsi = iscsi_create_context("iqn.2007-10.com.github:sahlberg:libiscsi:bench");
+	if (iscsi == NULL) {
+		fprintf(stderr, "Failed to create context\n");
+		return NULL;
+	}
+	iscsi_set_targetname(iscsi, "iqn.2007-10.com.github:sahlberg:libiscsi:target");
+	iscsi_set_session_type(iscsi, ISCSI_SESSION_NORMAL);
+	if (iscsi_set_max_connections(iscsi, MAX_CONNS) != 0 ||
+	    iscsi_connect_sync(iscsi, portal) != 0 ||
+	    iscsi_login_sync(iscsi) != 0) {
+		fprintf(stderr, "Failed to log in: %s\n", iscsi_get_error(iscsi));
+		goto failed;
+	}
+	for (i = 1; i < nconns; i++) {
+		if (iscsi_add_connection_sync(iscsi) != 0) {
+			fprintf(stderr, "Failed to add a connection: %s\n",
+				iscsi_get_error(iscsi));
+			goto failed;
+		}
+	}
+	if (iscsi_get_connection_count(iscsi) != nconns) {
+		fprintf(stderr, "Session has %d connections, not %d\n",
+			iscsi_get_connection_count(iscsi), nconns);
+		goto failed;
+	}
+	return iscsi;
+
+ failed:
+	iscsi_destroy_context(iscsi);
+	return NULL;
+}
+
+static int
+logout(struct iscsi_context *iscsi)
+{
+	int i, ret = iscsi_logout_sync(iscsi);
+
+	iscsi_destroy_context(iscsi);
+
+	/* wait for the target to see all connections go away */
+	for (i = 0; i < MAX_CONNS; i++) {
+		while (t.conns[i].fd != -1) {
+			usleep(1000);
+		}
+	}
+	return ret;
+}
+
+static struct scsi_task *
+submit(struct iscsi_context *iscsi, int write)
+{
+	struct scsi_task *task;
+	uint32_t lba = (submitted % 1024) * (IOSIZE / BLOCKSIZE);
+
+	if (write) {
+		task = iscsi_write10_task(iscsi, 0, lba, disk, IOSIZE,
+					  BLOCKSIZE, 0, 0, 0, 0, 0,
+					  io_cb, NULL);
+	} else {
+		task = iscsi_read10_task(iscsi, 0, lba, IOSIZE, BLOCKSIZE,
+					 0, 0, 0, 0, 0, io_cb, NULL);
+	}
+	if (task != NULL) {
+		submitted++;
+	}
+	return task;
+}
+
+static int
+bench(const char *portal, int nconns)
+{
+	struct iscsi_context *iscsi;
+	double start, ns;
+	int i;
+
+	iscsi = login(portal, nconns, 64);
+	if (iscsi == NULL) {
+		return -1;
+	}
+
+	submitted = completed = good = cancelled = 0;
+	start = bench_now_ns();
+	while (submitted < COMMANDS) {
+		if (run(iscsi, queue_not_full) != 0) {
+			goto failed;
+		}
+		if (submit(iscsi, submitted & 1) == NULL) {
+			fprintf(stderr, "Failed to queue command\n");
+			goto failed;
+		}
+	}
+	if (run(iscsi, all_done) != 0) {
+		goto failed;
+	}
+	ns = bench_now_ns() - start;
+
+	if (good != COMMANDS || t.expcmdsn != t.base + COMMANDS) {
+		fprintf(stderr, "%d of %d commands good, ExpCmdSN %08x "
+			"expected %08x\n", good, COMMANDS, t.expcmdsn,
+			t.base + COMMANDS);
+		t.bad++;
+	}
+	printf("%11d %10.0f %8.1f  ", nconns, COMMANDS / ns * 1e9,
+	       (double)COMMANDS * IOSIZE / ns * 1e3);
+	for (i = 0; i < MAX_CONNS; i++) {
+		if (t.conns[i].fd != -1) {
+			printf(" %u", t.conns[i].commands);
+		}
+	}
+	printf("\n");
+
+	return logout(iscsi) == 0 && t.bad == 0 ? 0 : -1;
+
+ failed:
+	iscsi_destroy_context(iscsi);
+	return -1;
+}
+
+/*
+ * Let the target sit on the commands it gets so that the rest stay
+ * queued behind MaxCmdSN, and cancel one of those.
+ */
+static int
+cancel_queued(const char *portal)
+{
+	struct scsi_task *tasks[HOLD_CMDS];
+	struct iscsi_context *iscsi;
+	uint32_t cmdsn, itt;
+	int i;
+
+	iscsi = login(portal, 2, HOLD_WINDOW);
+	if (iscsi == NULL) {
+		return -1;
+	}
+
+	submitted = completed = good = cancelled = 0;
+	t.hold = 1;
+	for (i = 0; i < HOLD_CMDS; i++) {
+		tasks[i] = submit(iscsi, 0);
+		if (tasks[i] == NULL) {
+			fprintf(stderr, "Failed to queue command\n");
+			goto failed;
+		}
+	}
+	if (run(iscsi, target_holds_window) != 0) {
+		goto failed;
+	}
+
+	if (!iscsi_scsi_is_task_in_outqueue(iscsi, tasks[HOLD_CANCEL])) {
+		fprintf(stderr, "Command was sent beyond MaxCmdSN\n");
+		goto failed;
+	}
+	cmdsn = tasks[HOLD_CANCEL]->cmdsn;
+	itt = tasks[HOLD_CANCEL]->itt;
+	if (iscsi_scsi_cancel_task(iscsi, tasks[HOLD_CANCEL]) != 0) {
+		fprintf(stderr, "Failed to cancel task\n");
+		goto failed;
+	}
+
+	t.hold = 0;
+	if (run(iscsi, all_done) != 0) {
+		goto failed;
+	}
+
+	printf("cancelled CmdSN %08x ITT %08x, filler CmdSN %08x ITT %08x, "
+	       "ExpCmdSN %08x, %d good, %d cancelled\n", cmdsn, itt,
+	       t.filler_cmdsn, t.filler_itt, t.expcmdsn, good, cancelled);
+	if (t.fillers != 1 || t.filler_cmdsn != cmdsn ||
+	    t.filler_itt != itt || t.expcmdsn != t.base + HOLD_CMDS ||
+	    good != HOLD_CMDS - 1 || cancelled != 1) {
+		fprintf(stderr, "CmdSN gap of the cancelled command was not "
+			"filled\n");
+		t.bad++;
+	}
+
+	return logout(iscsi) == 0 && t.bad == 0 ? 0 : -1;
+
+ failed:
+	t.hold = 0;
+	iscsi_destroy_context(iscsi);
+	return -1;
+}
+
+int main(void)
+{
+	pthread_t thread;
+	char portal[64];
+	int i, port, ret = 0;
+
+	for (i = 0; i < IOSIZE; i++) {
+		disk[i] = i * 7;
+	}
+	for (i = 0; i < MAX_CONNS; i++) {
+		t.conns[i].fd = -1;
+	}
+
+	t.listen_fd = bench_listen(MAX_CONNS, &port);
+	if (t.listen_fd < 0) {
+		fprintf(stderr, "Failed to listen: %s\n", strerror(errno));
+		return 1;
+	}
+	snprintf(portal, sizeof(portal), "127.0.0.1:%d", port);
+	if (pthread_create(&thread, NULL, target_thread, NULL) != 0) {
+		return 1;
+	}
+
+	printf("%d KiB commands, queue depth %d\n", IOSIZE / 1024, QUEUE_DEPTH);
+	printf("%11s %10s %8s   %s\n", "connections", "cmds/s", "MB/s",
+	       "commands per connection");
+	for (i = 1; i <= MAX_CONNS && ret == 0; i *= 2) {
+		ret = bench(portal, i);
+	}
+	if (ret == 0) {
+		ret = cancel_queued(portal);
+	}
+
+	t.stop = 1;
+	pthread_join(thread, NULL);
+	close(t.listen_fd);
+	return ret ? 1 : 0;
+}
@@ -0,0 +1,144 @@
+/*
+   Copyright (C) 2026 by the libiscsi authors
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * Stress the outqueue the way a closed MaxCmdSN window does: nothing can
+ * be sent so every submitted command piles up in the outqueue.
+ * Mixed in are immediate NOP-Outs and DATA-OUT for already sent commands.
+ * Prints the average submit cost for the first and the last quarter of
+ * the submissions, which should be about the same regardless of depth.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include "iscsi.h"
+#include "iscsi-private.h"
+#include "scsi-lowlevel.h"
+#include "bench.h"
+
+static int
+check_order(struct iscsi_context *iscsi)
+{
+	struct iscsi_pdu *pdu;
+	int in_prio = 1;
+
+	for (pdu = iscsi->outqueue.head; pdu; pdu = pdu->next) {
+		if (!(pdu->flags & ISCSI_PDU_PRIO_LANE)) {
+			in_prio = 0;
+		} else if (!in_prio) {
+			return -1;
+		}
+		if (!in_prio && pdu->next &&
+		    iscsi_serial32_compare(pdu->cmdsn, pdu->next->cmdsn) > 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int
+bench(int depth)
+{
+	struct iscsi_context *iscsi;
+	struct iscsi_pdu **pdus;
+	int i, quarter = depth / 4;
+	double start, first_ns = 0, last_ns = 0, t;
+
+	iscsi = iscsi_create_context("iqn.2007-10.com.github:sahlberg:libiscsi:bench");
+	if (iscsi == NULL) {
+		fprintf(stderr, "Failed to create context\n");
+		return -1;
+	}
+	pdus = calloc(depth, sizeof(struct iscsi_pdu *));
+	if (pdus == NULL) {
+		iscsi_destroy_context(iscsi);
+		return -1;
+	}
+
+	for (i = 0; i < depth; i++) {
+		if (i % 64 == 63) {
+			pdus[i] = iscsi_allocate_pdu(iscsi,
+					ISCSI_PDU_NOP_OUT|ISCSI_PDU_IMMEDIATE,
+					ISCSI_PDU_NOP_IN,
+					iscsi_itt_post_increment(iscsi), 0);
+		} else if (i % 16 == 15) {
+			/* ITT of a command that is no longer queued */
+			pdus[i] = iscsi_allocate_pdu(iscsi,
+					ISCSI_PDU_DATA_OUT, ISCSI_PDU_NO_PDU,
+					0x7fffffff,
+					ISCSI_PDU_DELETE_WHEN_SENT);
+		} else {
+			pdus[i] = iscsi_allocate_pdu(iscsi,
+					ISCSI_PDU_SCSI_REQUEST,
+					ISCSI_PDU_SCSI_RESPONSE,
+					iscsi_itt_post_increment(iscsi), 0);
+		}
+		if (pdus[i] == NULL) {
+			fprintf(stderr, "Failed to allocate pdu\n");
+			break;
+		}
+		if ((pdus[i]->outdata.data[0] & 0x3f) == ISCSI_PDU_SCSI_REQUEST) {
+			iscsi_pdu_set_cmdsn(pdus[i], iscsi->cmdsn++);
+		}
+	}
+	if (i < depth) {
+		while (i-- > 0) {
+			iscsi->drv->free_pdu(iscsi, pdus[i]);
+		}
+		free(pdus);
+		iscsi_destroy_context(iscsi);
+		return -1;
+	}
+
+	for (i = 0; i < depth; i++) {
+		start = bench_now_ns();
+		iscsi_add_to_outqueue(iscsi, pdus[i]);
+		t = bench_now_ns() - start;
+		if (i < quarter) {
+			first_ns += t;
+		} else if (i >= depth - quarter) {
+			last_ns += t;
+		}
+	}
+
+	printf("%8d %14.1f %14.1f\n", depth,
+	       first_ns / quarter, last_ns / quarter);
+
+	i = iscsi_out_queue_length(iscsi) == depth ? check_order(iscsi) : -1;
+
+	free(pdus);
+	iscsi_destroy_context(iscsi);
+	return i;
+}
+
+int main(void)
+{
+	int depth;
+
+	printf("%8s %14s %14s\n", "depth", "first ns/pdu", "last ns/pdu");
+	for (depth = 1024; depth <= 65536; depth *= 4) {
+		if (bench(depth)) {
+			fprintf(stderr, "outqueue out of order at depth %d\n",
+				depth);
+			return 1;
+		}
+	}
+	return 0;
+}
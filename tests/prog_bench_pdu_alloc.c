@@ -0,0 +1,88 @@
+/*
+   Copyright (C) 2026 by the libiscsi authors
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * Allocate and free pdus the way a steady stream of commands does,
+ * with a number of them in flight at any time, and print the cost per
+ * pdu and the number of malloc() calls with and without
+ * iscsi_set_cache_allocations().
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include "iscsi.h"
+#include "iscsi-private.h"
+#include "scsi-lowlevel.h"
+#include "bench.h"
+
+#define IN_FLIGHT 32
+#define ROUNDS    (1 << 16)
+
+static int
+bench(int cache)
+{
+	struct iscsi_context *iscsi;
+	struct iscsi_pdu *pdus[IN_FLIGHT];
+	int i, j, mallocs, frees;
+	double start, ns;
+
+	iscsi = iscsi_create_context("iqn.2007-10.com.github:sahlberg:libiscsi:bench");
+	if (iscsi == NULL) {
+		fprintf(stderr, "Failed to create context\n");
+		return -1;
+	}
+	iscsi_set_cache_allocations(iscsi, cache);
+	mallocs = iscsi->mallocs;
+	frees = iscsi->frees;
+
+	start = bench_now_ns();
+	for (i = 0; i < ROUNDS; i++) {
+		for (j = 0; j < IN_FLIGHT; j++) {
+			pdus[j] = iscsi_allocate_pdu(iscsi,
+					ISCSI_PDU_SCSI_REQUEST,
+					ISCSI_PDU_SCSI_RESPONSE,
+					iscsi_itt_post_increment(iscsi), 0);
+			if (pdus[j] == NULL) {
+				fprintf(stderr, "Failed to allocate pdu\n");
+				iscsi_destroy_context(iscsi);
+				return -1;
+			}
+		}
+		for (j = 0; j < IN_FLIGHT; j++) {
+			iscsi->drv->free_pdu(iscsi, pdus[j]);
+		}
+	}
+	ns = (bench_now_ns() - start) / ((double)ROUNDS * IN_FLIGHT);
+
+	printf("%8s %14.1f %10d %10d\n", cache ? "on" : "off", ns,
+	       iscsi->mallocs - mallocs, iscsi->frees - frees);
+
+	iscsi_destroy_context(iscsi);
+	return 0;
+}
+
+int main(void)
+{
+	printf("%8s %14s %10s %10s\n", "cache", "ns/pdu", "mallocs", "frees");
+	if (bench(0) || bench(1)) {
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,309 @@
+/*
+   Copyright (C) 2026 by the libiscsi authors
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * Time 16 MiB WRITE10 commands with InitialR2T=Yes and no immediate data,
+ * so all data is solicited with R2Ts, for different MaxOutstandingR2T.
+ * A fake target on the other end of a socketpair delays every pdu it
+ * sends by a fixed latency, like a target across a WAN, and keeps up to
+ * MaxOutstandingR2T bursts in flight. It checks that the data-out pdus of
+ * each burst carry its TTT, their own DataSN sequence and the right
+ * buffer offsets.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "iscsi.h"
+#include "iscsi-private.h"
+#include "scsi-lowlevel.h"
+#include "bench.h"
+
+#define IOSIZE    (16 * 1024 * 1024)
+#define BURST     (256 * 1024)
+#define BURSTS    (IOSIZE / BURST)
+#define SEGMENT   (64 * 1024)
+#define BLOCKSIZE 512
+#define COMMANDS  4
+#define LATENCY   500000 /* ns */
+#define MAX_R2T   16
+
+struct burst {
+	uint32_t received;
+	uint32_t datasn;
+};
+
+struct target {
+	int fd;
+	int max_r2t;
+	int bad;
+	uint32_t statsn;
+	uint32_t itt;
+	uint32_t cmdsn;
+	uint32_t r2tsn;
+	int next_burst;
+	int outstanding;
+	uint32_t received;
+	struct burst bursts[BURSTS];
+	unsigned char req[2 * SEGMENT + 1024];
+	size_t req_len;
+	/* pdus waiting for their latency to pass, in the order they go out */
+	unsigned char hdr[MAX_R2T + 1][ISCSI_RAW_HEADER_SIZE];
+	double due[MAX_R2T + 1];
+	int head, count;
+};
+
+static unsigned char data[IOSIZE];
+static int completed, bad_completions;
+
+static void
+io_cb(struct iscsi_context *iscsi, int status, void *command_data,
+      void *private_data)
+{
+	if (status != SCSI_STATUS_GOOD) {
+		bad_completions++;
+	}
+	completed++;
+	scsi_free_scsi_task(command_data);
+}
+
+static unsigned char *
+target_queue(struct target *t, int opcode, int flags)
+{
+	int slot = (t->head + t->count++) % (MAX_R2T + 1);
+	unsigned char *r = t->hdr[slot];
+
+	memset(r, 0, ISCSI_RAW_HEADER_SIZE);
+	r[0] = opcode;
+	r[1] = flags;
+	scsi_set_uint32(&r[16], t->itt);
+	scsi_set_uint32(&r[24], t->statsn);
+	scsi_set_uint32(&r[28], t->cmdsn + 1);
+	scsi_set_uint32(&r[32], t->cmdsn + 16);
+	t->due[slot] = bench_now_ns() + LATENCY;
+	return r;
+}
+
+/* solicit bursts until max_r2t of them are outstanding */
+static void
+target_solicit(struct target *t)
+{
+	unsigned char *r;
+
+	while (t->outstanding < t->max_r2t && t->next_burst < BURSTS) {
+		r = target_queue(t, ISCSI_PDU_R2T, ISCSI_PDU_SCSI_FINAL);
+		scsi_set_uint32(&r[20], t->next_burst);
+		scsi_set_uint32(&r[36], t->r2tsn++);
+		scsi_set_uint32(&r[40], t->next_burst * BURST);
+		scsi_set_uint32(&r[44], BURST);
+		t->bursts[t->next_burst].received = 0;
+		t->bursts[t->next_burst].datasn = 0;
+		t->next_burst++;
+		t->outstanding++;
+	}
+}
+
+static void
+target_data_out(struct target *t, unsigned char *q, uint32_t dsl)
+{
+	uint32_t ttt = scsi_get_uint32(&q[20]);
+	uint32_t offset = scsi_get_uint32(&q[40]);
+	struct burst *b;
+
+	if (ttt >= BURSTS) {
+		t->bad++;
+		return;
+	}
+	b = &t->bursts[ttt];
+	if (scsi_get_uint32(&q[36]) != b->datasn++ ||
+	    offset != ttt * BURST + b->received ||
+	    memcmp(&q[ISCSI_RAW_HEADER_SIZE], &data[offset], dsl)) {
+		t->bad++;
+	}
+	b->received += dsl;
+	t->received += dsl;
+	if (b->received == BURST) {
+		if (!(q[1] & ISCSI_PDU_SCSI_FINAL)) {
+			t->bad++;
+		}
+		t->outstanding--;
+		target_solicit(t);
+	}
+	if (t->received == IOSIZE) {
+		target_queue(t, ISCSI_PDU_SCSI_RESPONSE, ISCSI_PDU_SCSI_FINAL);
+		t->statsn++;
+	}
+}
+
+static int
+fake_target(struct target *t)
+{
+	unsigned char *q;
+	size_t len, dsl, pos = 0;
+
+	while (t->count && t->due[t->head] <= bench_now_ns()) {
+		if (write(t->fd, t->hdr[t->head], ISCSI_RAW_HEADER_SIZE) !=
+		    ISCSI_RAW_HEADER_SIZE) {
+			return -1;
+		}
+		t->head = (t->head + 1) % (MAX_R2T + 1);
+		t->count--;
+	}
+
+	if (bench_read(t->fd, t->req, sizeof(t->req), &t->req_len) != 0) {
+		return -1;
+	}
+	while ((len = bench_pdu_len(&t->req[pos], t->req_len - pos)) != 0) {
+		q = &t->req[pos];
+		dsl = scsi_get_uint32(&q[4]) & 0x00ffffff;
+		switch (q[0] & 0x3f) {
+		case ISCSI_PDU_SCSI_REQUEST:
+			t->itt = scsi_get_uint32(&q[16]);
+			t->cmdsn = scsi_get_uint32(&q[24]);
+			t->r2tsn = 0;
+			t->next_burst = 0;
+			t->outstanding = 0;
+			t->received = 0;
+			if (dsl) {
+				t->bad++;
+			}
+			target_solicit(t);
+			break;
+		case ISCSI_PDU_DATA_OUT:
+			target_data_out(t, q, dsl);
+			break;
+		default:
+			return -1;
+		}
+		pos += len;
+	}
+	bench_consume(t->req, &t->req_len, pos);
+	return 0;
+}
+
+static int
+bench(int max_r2t)
+{
+	static struct target t;
+	struct scsi_iovec iov;
+	struct iscsi_context *iscsi;
+	struct scsi_task *task;
+	struct pollfd pfd;
+	int sv[2], i, ret = -1;
+	double start, ns;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+		return -1;
+	}
+	memset(&t, 0, sizeof(t));
+	t.fd = sv[1];
+	t.max_r2t = max_r2t;
+	t.statsn = 1;
+	iscsi = iscsi_create_context("iqn.2007-10.com.github:sahlberg:libiscsi:bench");
+	if (iscsi == NULL) {
+		fprintf(stderr, "Failed to create context\n");
+		goto out;
+	}
+	if (iscsi_set_max_outstanding_r2t(iscsi, max_r2t) != 0) {
+		fprintf(stderr, "%s\n", iscsi_get_error(iscsi));
+		goto out;
+	}
+
+	/* pretend we are logged in */
+	fcntl(sv[0], F_SETFL, O_NONBLOCK);
+	fcntl(sv[1], F_SETFL, O_NONBLOCK);
+	iscsi->fd = sv[0];
+	iscsi->is_connected = 1;
+	iscsi->is_loggedin = 1;
+	iscsi->session_type = ISCSI_SESSION_NORMAL;
+	iscsi->statsn = 0;
+	iscsi->maxcmdsn = iscsi->cmdsn + 16;
+	iscsi->use_immediate_data = ISCSI_IMMEDIATE_DATA_NO;
+	iscsi->use_initial_r2t = ISCSI_INITIAL_R2T_YES;
+	iscsi->max_burst_length = BURST;
+	iscsi->max_outstanding_r2t = max_r2t;
+	iscsi->target_max_recv_data_segment_length = SEGMENT;
+
+	iov.iov_base = data;
+	iov.iov_len = sizeof(data);
+
+	completed = bad_completions = 0;
+	start = bench_now_ns();
+	for (i = 0; i < COMMANDS; i++) {
+		task = iscsi_write10_iov_task(iscsi, 0, 0, NULL, IOSIZE,
+					      BLOCKSIZE, 0, 0, 0, 0, 0,
+					      io_cb, NULL, &iov, 1);
+		if (task == NULL) {
+			fprintf(stderr, "Failed to queue command\n");
+			goto out;
+		}
+		while (completed <= i) {
+			pfd.fd = iscsi_get_fd(iscsi);
+			pfd.events = iscsi_which_events(iscsi);
+			if (poll(&pfd, 1, 0) < 0 ||
+			    iscsi_service(iscsi, pfd.revents) != 0) {
+				fprintf(stderr, "iscsi_service failed: %s\n",
+					iscsi_get_error(iscsi));
+				goto out;
+			}
+			if (fake_target(&t) != 0) {
+				fprintf(stderr, "Bad pdu on the wire\n");
+				goto out;
+			}
+		}
+	}
+	ns = (bench_now_ns() - start) / COMMANDS;
+
+	bad_completions += t.bad;
+	printf("%7d %12.2f %10.0f %6d\n", max_r2t, ns / 1e6,
+	       IOSIZE / ns * 1e3, bad_completions);
+	ret = bad_completions ? -1 : 0;
+
+ out:
+	if (iscsi != NULL) {
+		iscsi->fd = -1;
+		iscsi_destroy_context(iscsi);
+	}
+	close(sv[0]);
+	close(sv[1]);
+	return ret;
+}
+
+int main(void)
+{
+	int i, max_r2t;
+
+	for (i = 0; i < IOSIZE; i++) {
+		data[i] = i * 7 + i / BURST;
+	}
+
+	printf("latency %d us, %d KiB bursts\n", LATENCY / 1000, BURST / 1024);
+	printf("%7s %12s %10s %6s\n", "max r2t", "ms/cmd", "MB/s", "bad");
+	for (max_r2t = 1; max_r2t <= MAX_R2T; max_r2t *= 2) {
+		if (bench(max_r2t)) {
+			return 1;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,257 @@
+/*
+   Copyright (C) 2026 by the libiscsi authors
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * Time 4 MiB READ10 commands without a user iovector, so the data is
+ * reassembled by the library, from 8 KiB data-in pdus. A fake target on
+ * the other end of a socketpair sends the data-in pdus either in order or
+ * in reverse order, as a target may when DataPDUInOrder=No. Every byte
+ * of the reassembled data is checked. Last, the target skips a segment,
+ * which has to read back as zeroes.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "iscsi.h"
+#include "iscsi-private.h"
+#include "scsi-lowlevel.h"
+#include "bench.h"
+
+#define IOSIZE    (4 * 1024 * 1024)
+#define SEGMENT   (8 * 1024)
+#define SEGMENTS  (IOSIZE / SEGMENT)
+#define BLOCKSIZE 512
+#define COMMANDS  64
+#define HOLE      1            /* the segment a broken target skips */
+
+enum order { IN_ORDER, REVERSE, SKIP };
+
+struct target {
+	int fd;
+	enum order order;
+	uint32_t statsn;
+	unsigned char req[4096];
+	size_t req_len;
+	/* queued responses */
+	unsigned char hdr[SEGMENTS][ISCSI_RAW_HEADER_SIZE];
+	struct iovec rsp[2 * SEGMENTS];
+	int rsp_cnt;
+	int rsp_pos;
+};
+
+static unsigned char data[IOSIZE];
+static unsigned char zero[SEGMENT];
+static int completed, bad_completions;
+static enum order order;
+
+static void
+io_cb(struct iscsi_context *iscsi, int status, void *command_data,
+      void *private_data)
+{
+	struct scsi_task *task = command_data;
+
+	if (status != SCSI_STATUS_GOOD || task->datain.size != IOSIZE) {
+		bad_completions++;
+	} else if (order != SKIP) {
+		if (memcmp(task->datain.data, data, IOSIZE)) {
+			bad_completions++;
+		}
+	} else if (memcmp(task->datain.data, data, HOLE * SEGMENT) ||
+		   memcmp(&task->datain.data[HOLE * SEGMENT], zero,
+			  SEGMENT) ||
+		   memcmp(&task->datain.data[(HOLE + 1) * SEGMENT],
+			  &data[(HOLE + 1) * SEGMENT],
+			  IOSIZE - (HOLE + 1) * SEGMENT)) {
+		bad_completions++;
+	}
+	completed++;
+	scsi_free_scsi_task(task);
+}
+
+static void
+target_read(struct target *t, uint32_t itt, uint32_t cmdsn)
+{
+	unsigned char *r;
+	int i, seg, flags;
+
+	for (i = 0; i < SEGMENTS; i++) {
+		seg = t->order == REVERSE ? SEGMENTS - 1 - i : i;
+		if (t->order == SKIP && seg == HOLE) {
+			continue;
+		}
+		r = t->hdr[i];
+		flags = 0;
+		if (i == SEGMENTS - 1) {
+			flags = ISCSI_PDU_SCSI_FINAL |
+				ISCSI_PDU_DATA_CONTAINS_STATUS;
+		}
+		memset(r, 0, ISCSI_RAW_HEADER_SIZE);
+		r[0] = ISCSI_PDU_DATA_IN;
+		r[1] = flags;
+		scsi_set_uint32(&r[4], SEGMENT);
+		scsi_set_uint32(&r[16], itt);
+		scsi_set_uint32(&r[24], t->statsn);
+		scsi_set_uint32(&r[28], cmdsn + 1);
+		scsi_set_uint32(&r[32], cmdsn + 16);
+		scsi_set_uint32(&r[36], i);
+		scsi_set_uint32(&r[40], seg * SEGMENT);
+		t->rsp[t->rsp_cnt].iov_base = r;
+		t->rsp[t->rsp_cnt].iov_len = ISCSI_RAW_HEADER_SIZE;
+		t->rsp_cnt++;
+		t->rsp[t->rsp_cnt].iov_base = &data[seg * SEGMENT];
+		t->rsp[t->rsp_cnt].iov_len = SEGMENT;
+		t->rsp_cnt++;
+	}
+	t->statsn++;
+}
+
+static int
+fake_target(struct target *t)
+{
+	unsigned char *q;
+
+	switch (bench_writev(t->fd, t->rsp, &t->rsp_pos, t->rsp_cnt)) {
+	case 1:
+		return 0;
+	case -1:
+		return -1;
+	}
+	t->rsp_pos = t->rsp_cnt = 0;
+
+	if (bench_read(t->fd, t->req, sizeof(t->req), &t->req_len) != 0) {
+		return -1;
+	}
+	while (t->req_len >= ISCSI_RAW_HEADER_SIZE) {
+		q = t->req;
+		if ((q[0] & 0x3f) != ISCSI_PDU_SCSI_REQUEST ||
+		    q[32] != SCSI_OPCODE_READ10) {
+			return -1;
+		}
+		target_read(t, scsi_get_uint32(&q[16]),
+			    scsi_get_uint32(&q[24]));
+		bench_consume(t->req, &t->req_len, ISCSI_RAW_HEADER_SIZE);
+	}
+	return 0;
+}
+
+static int
+bench(void)
+{
+	static struct target t;
+	struct iscsi_context *iscsi;
+	struct scsi_task *task;
+	struct pollfd pfd;
+	int sv[2], i, mallocs, reallocs, ret = -1;
+	double start, ns;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+		return -1;
+	}
+	memset(&t, 0, sizeof(t));
+	t.fd = sv[1];
+	t.order = order;
+	t.statsn = 1;
+	iscsi = iscsi_create_context("iqn.2007-10.com.github:sahlberg:libiscsi:bench");
+	if (iscsi == NULL) {
+		fprintf(stderr, "Failed to create context\n");
+		goto out;
+	}
+
+	/* pretend we are logged in */
+	fcntl(sv[0], F_SETFL, O_NONBLOCK);
+	fcntl(sv[1], F_SETFL, O_NONBLOCK);
+	iscsi->fd = sv[0];
+	iscsi->is_connected = 1;
+	iscsi->is_loggedin = 1;
+	iscsi->session_type = ISCSI_SESSION_NORMAL;
+	iscsi->statsn = 0;
+	iscsi->maxcmdsn = iscsi->cmdsn + 16;
+	iscsi->target_max_recv_data_segment_length = SEGMENT;
+	iscsi->initiator_max_recv_data_segment_length = SEGMENT;
+
+	completed = bad_completions = 0;
+	mallocs = iscsi->mallocs;
+	reallocs = iscsi->reallocs;
+	start = bench_now_ns();
+	for (i = 0; i < COMMANDS; i++) {
+		task = iscsi_read10_task(iscsi, 0, 0, IOSIZE, BLOCKSIZE,
+					 0, 0, 0, 0, 0, io_cb, NULL);
+		if (task == NULL) {
+			fprintf(stderr, "Failed to queue command\n");
+			goto out;
+		}
+		while (completed <= i) {
+			pfd.fd = iscsi_get_fd(iscsi);
+			pfd.events = iscsi_which_events(iscsi);
+			if (poll(&pfd, 1, 0) < 0 ||
+			    iscsi_service(iscsi, pfd.revents) != 0) {
+				fprintf(stderr, "iscsi_service failed: %s\n",
+					iscsi_get_error(iscsi));
+				goto out;
+			}
+			if (fake_target(&t) != 0) {
+				fprintf(stderr, "Bad pdu on the wire\n");
+				goto out;
+			}
+		}
+	}
+	ns = (bench_now_ns() - start) / COMMANDS;
+
+	printf("%-9s %10.1f %8.0f %9.1f %10.1f %6d\n",
+	       order == IN_ORDER ? "in order" : order == REVERSE ? "reverse" :
+	       "skipped", ns / 1000, IOSIZE / ns * 1e3,
+	       (double)(iscsi->mallocs - mallocs) / COMMANDS,
+	       (double)(iscsi->reallocs - reallocs) / COMMANDS,
+	       bad_completions);
+	ret = bad_completions ? -1 : 0;
+
+ out:
+	if (iscsi != NULL) {
+		iscsi->fd = -1;
+		iscsi_destroy_context(iscsi);
+	}
+	close(sv[0]);
+	close(sv[1]);
+	return ret;
+}
+
+int main(void)
+{
+	int i;
+
+	for (i = 0; i < IOSIZE; i++) {
+		data[i] = i * 7 + i / SEGMENT;
+	}
+
+	printf("%-9s %10s %8s %9s %10s %6s\n", "data-in", "us/cmd", "MB/s",
+	       "mallocs", "reallocs", "bad");
+	for (order = IN_ORDER; order <= SKIP; order++) {
+		if (bench()) {
+			return 1;
+		}
+	}
+	return 0;
+}
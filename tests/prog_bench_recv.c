@@ -0,0 +1,170 @@
+/*
+   Copyright (C) 2026 by the libiscsi authors
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * Count the system calls spent per command when a burst of SCSI
+ * responses arrives at once, with and without a receive buffer.
+ * The target is faked on the other end of a socketpair: it reads the
+ * TESTUNITREADY requests and answers all of them in one write.
+ * Every command has to complete with SCSI_STATUS_GOOD.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "iscsi.h"
+#include "iscsi-private.h"
+#include "scsi-lowlevel.h"
+#include "bench.h"
+
+#define BATCH  256
+#define ROUNDS 64
+
+static int completed, bad_completions;
+
+static void
+tur_cb(struct iscsi_context *iscsi, int status, void *command_data,
+       void *private_data)
+{
+	if (status != SCSI_STATUS_GOOD) {
+		bad_completions++;
+	}
+	completed++;
+	scsi_free_scsi_task(command_data);
+}
+
+/* answer every request we can read with a SCSI response */
+static int
+fake_target(int fd, uint32_t *statsn)
+{
+	static unsigned char req[BATCH * ISCSI_RAW_HEADER_SIZE];
+	static unsigned char rsp[BATCH * ISCSI_RAW_HEADER_SIZE];
+	unsigned char *r;
+	size_t got = 0;
+	ssize_t count;
+	int i;
+
+	while (got < sizeof(req)) {
+		count = read(fd, &req[got], sizeof(req) - got);
+		if (count <= 0) {
+			return -1;
+		}
+		got += count;
+	}
+
+	memset(rsp, 0, sizeof(rsp));
+	for (i = 0; i < BATCH; i++) {
+		r = &rsp[i * ISCSI_RAW_HEADER_SIZE];
+		r[0] = ISCSI_PDU_SCSI_RESPONSE;
+		r[1] = ISCSI_PDU_SCSI_FINAL;
+		memcpy(&r[16], &req[i * ISCSI_RAW_HEADER_SIZE + 16], 4);
+		scsi_set_uint32(&r[24], (*statsn)++);
+		scsi_set_uint32(&r[28], scsi_get_uint32(&req[i * ISCSI_RAW_HEADER_SIZE + 24]) + 1);
+		scsi_set_uint32(&r[32], scsi_get_uint32(&req[i * ISCSI_RAW_HEADER_SIZE + 24]) + BATCH);
+	}
+	if (write(fd, rsp, sizeof(rsp)) != sizeof(rsp)) {
+		return -1;
+	}
+	return 0;
+}
+
+static int
+bench(int bufsize)
+{
+	struct iscsi_context *iscsi;
+	struct iscsi_stats stats;
+	uint32_t statsn = 1;
+	int sv[2], i, j, ret = -1;
+	double start, ns;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+		return -1;
+	}
+	iscsi = iscsi_create_context("iqn.2007-10.com.github:sahlberg:libiscsi:bench");
+	if (iscsi == NULL) {
+		fprintf(stderr, "Failed to create context\n");
+		goto out;
+	}
+	iscsi_set_recv_buffer_size(iscsi, bufsize);
+
+	/* pretend we are logged in */
+	fcntl(sv[0], F_SETFL, O_NONBLOCK);
+	iscsi->fd = sv[0];
+	iscsi->is_connected = 1;
+	iscsi->is_loggedin = 1;
+	iscsi->session_type = ISCSI_SESSION_NORMAL;
+	iscsi->maxcmdsn = iscsi->cmdsn + BATCH;
+
+	completed = bad_completions = 0;
+	start = bench_now_ns();
+	for (i = 0; i < ROUNDS; i++) {
+		for (j = 0; j < BATCH; j++) {
+			if (iscsi_testunitready_task(iscsi, 0, tur_cb,
+						     NULL) == NULL) {
+				fprintf(stderr, "Failed to queue TUR\n");
+				goto out;
+			}
+		}
+		if (iscsi_service(iscsi, POLLOUT) != 0 ||
+		    fake_target(sv[1], &statsn) != 0) {
+			fprintf(stderr, "Failed to send TURs\n");
+			goto out;
+		}
+		while (completed < (i + 1) * BATCH) {
+			if (iscsi_service(iscsi, POLLIN) != 0) {
+				fprintf(stderr, "iscsi_service failed: %s\n",
+					iscsi_get_error(iscsi));
+				goto out;
+			}
+		}
+	}
+	ns = (bench_now_ns() - start) / ((double)ROUNDS * BATCH);
+
+	iscsi_get_stats(iscsi, &stats);
+	printf("%8d %14.3f %14.3f %12.1f %6d\n", bufsize,
+	       (double)stats.rx_syscalls / stats.commands,
+	       (double)(stats.rx_syscalls + stats.tx_syscalls) / stats.commands,
+	       ns, bad_completions);
+	ret = bad_completions ? -1 : 0;
+
+ out:
+	if (iscsi != NULL) {
+		iscsi->fd = -1;
+		iscsi_destroy_context(iscsi);
+	}
+	close(sv[0]);
+	close(sv[1]);
+	return ret;
+}
+
+int main(void)
+{
+	printf("%8s %14s %14s %12s %6s\n", "rxbuf", "rx calls/cmd", "calls/cmd",
+	       "ns/cmd", "bad");
+	if (bench(0) || bench(16384) || bench(65536)) {
+		return 1;
+	}
+	return 0;
+}
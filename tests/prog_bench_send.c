@@ -0,0 +1,202 @@
+/*
+   Copyright (C) 2026 by the libiscsi authors
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * Count the system calls spent sending a burst of WRITE10 commands with
+ * immediate data and data digests.
+ * The commands are queued while the MaxCmdSN window is closed and then
+ * flushed at once, so they can be batched into a few sendmsg() calls.
+ * The other end of a socketpair reads the stream back and checks the
+ * length and data digest of every pdu.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "iscsi.h"
+#include "iscsi-private.h"
+#include "scsi-lowlevel.h"
+#include "bench.h"
+
+#define BATCH     256
+#define ROUNDS    16
+#define BLOCKSIZE 512
+#define BLOCKS    8
+
+static unsigned char rbuf[1 << 20];
+static size_t rlen;
+
+static void
+write_cb(struct iscsi_context *iscsi, int status, void *command_data,
+	 void *private_data)
+{
+	scsi_free_scsi_task(command_data);
+}
+
+/*
+ * Read what is available and check every complete pdu in it.
+ * Returns the number of pdus checked or -1 on a bad pdu.
+ */
+static int
+fake_target(int fd)
+{
+	unsigned char *hdr;
+	size_t dsl, len, pos = 0;
+	uint32_t crc;
+	ssize_t count;
+	int pdus = 0;
+
+	count = read(fd, &rbuf[rlen], sizeof(rbuf) - rlen);
+	if (count > 0) {
+		rlen += count;
+	}
+
+	while (rlen - pos >= ISCSI_RAW_HEADER_SIZE) {
+		hdr = &rbuf[pos];
+		dsl = scsi_get_uint32(&hdr[4]) & 0x00ffffff;
+		len = ISCSI_RAW_HEADER_SIZE;
+		if (dsl) {
+			len += ((dsl + 3) & ~3) + ISCSI_DIGEST_SIZE;
+		}
+		if (rlen - pos < len) {
+			break;
+		}
+		if ((hdr[0] & 0x3f) != ISCSI_PDU_SCSI_REQUEST ||
+		    dsl != BLOCKSIZE * BLOCKS) {
+			return -1;
+		}
+		crc = crc32c(&hdr[ISCSI_RAW_HEADER_SIZE], (dsl + 3) & ~3);
+		if (hdr[len - 4] != (crc & 0xff) ||
+		    hdr[len - 3] != ((crc >> 8) & 0xff) ||
+		    hdr[len - 2] != ((crc >> 16) & 0xff) ||
+		    hdr[len - 1] != (crc >> 24)) {
+			return -1;
+		}
+		pos += len;
+		pdus++;
+	}
+	memmove(rbuf, &rbuf[pos], rlen - pos);
+	rlen -= pos;
+	return pdus;
+}
+
+static int
+bench(int batched)
+{
+	static unsigned char data[BLOCKSIZE * BLOCKS];
+	struct scsi_iovec iov[BLOCKS];
+	struct iscsi_context *iscsi;
+	struct iscsi_stats stats;
+	struct scsi_task *task;
+	int sv[2], i, j, n, received = 0, ret = -1;
+	double start, ns;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+		return -1;
+	}
+	iscsi = iscsi_create_context("iqn.2007-10.com.github:sahlberg:libiscsi:bench");
+	if (iscsi == NULL) {
+		fprintf(stderr, "Failed to create context\n");
+		goto out;
+	}
+
+	/* pretend we are logged in */
+	fcntl(sv[0], F_SETFL, O_NONBLOCK);
+	fcntl(sv[1], F_SETFL, O_NONBLOCK);
+	iscsi->fd = sv[0];
+	iscsi->is_connected = 1;
+	iscsi->is_loggedin = 1;
+	iscsi->session_type = ISCSI_SESSION_NORMAL;
+	iscsi->data_digest = ISCSI_DATA_DIGEST_CRC32C;
+
+	for (i = 0; i < (int)sizeof(data); i++) {
+		data[i] = i * 7;
+	}
+	/* scatter each write over one iovec per block */
+	for (i = 0; i < BLOCKS; i++) {
+		iov[i].iov_base = &data[i * BLOCKSIZE];
+		iov[i].iov_len = BLOCKSIZE;
+	}
+
+	start = bench_now_ns();
+	for (i = 0; i < ROUNDS; i++) {
+		iscsi->maxcmdsn = batched ? iscsi->cmdsn - 1 :
+			iscsi->cmdsn + BATCH;
+		for (j = 0; j < BATCH; j++) {
+			task = iscsi_write10_iov_task(iscsi, 0, j * BLOCKS,
+					NULL, sizeof(data), BLOCKSIZE,
+					0, 0, 0, 0, 0, write_cb, NULL,
+					iov, BLOCKS);
+			if (task == NULL) {
+				fprintf(stderr, "Failed to queue WRITE10\n");
+				goto out;
+			}
+			n = fake_target(sv[1]);
+			if (n < 0) {
+				fprintf(stderr, "Bad pdu on the wire\n");
+				goto out;
+			}
+			received += n;
+		}
+		iscsi->maxcmdsn = iscsi->cmdsn + BATCH;
+		while (received < (i + 1) * BATCH) {
+			if (iscsi_service(iscsi, POLLOUT) != 0) {
+				fprintf(stderr, "iscsi_service failed: %s\n",
+					iscsi_get_error(iscsi));
+				goto out;
+			}
+			n = fake_target(sv[1]);
+			if (n < 0) {
+				fprintf(stderr, "Bad pdu on the wire\n");
+				goto out;
+			}
+			received += n;
+		}
+	}
+	ns = (bench_now_ns() - start) / ((double)ROUNDS * BATCH);
+
+	iscsi_get_stats(iscsi, &stats);
+	printf("%8s %14.3f %12.1f\n", batched ? "yes" : "no",
+	       (double)stats.tx_syscalls / stats.commands, ns);
+	ret = 0;
+
+ out:
+	if (iscsi != NULL) {
+		iscsi->fd = -1;
+		iscsi_destroy_context(iscsi);
+	}
+	close(sv[0]);
+	close(sv[1]);
+	return ret;
+}
+
+int main(void)
+{
+	printf("%8s %14s %12s\n", "batched", "tx calls/cmd", "ns/cmd");
+	if (bench(0) || bench(1)) {
+		return 1;
+	}
+	return 0;
+}
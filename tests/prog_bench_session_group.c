@@ -0,0 +1,479 @@
+/*
+   Copyright (C) 2026 by the libiscsi authors
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * Spread 8 KiB READ10 commands over session groups of 1, 2 and 4
+ * sessions to a fake target that runs in a thread on loopback TCP, with
+ * least-outstanding and with round robin dispatch. The target checks
+ * that the sessions log in with distinct ISIDs and that each of them
+ * numbers its commands without gaps.
+ * Then the target drops the connection of one member in the middle of
+ * a run, with a command outstanding, and every command still has to
+ * complete: the member reconnects with its own ISID and the command is
+ * sent again.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "iscsi.h"
+#include "iscsi-private.h"
+#include "scsi-lowlevel.h"
+#include "bench.h"
+
+#define BLOCKSIZE   512
+#define IOSIZE      (8 * 1024)
+#define COMMANDS    20000
+#define QUEUE_DEPTH 32
+#define MAX_SESSIONS 4
+#define WINDOW      64
+
+struct tconn {
+	volatile int fd;
+	int drop;		/* swallow the next command and hang up */
+	unsigned char isid[6];
+	uint32_t statsn;
+	uint32_t expcmdsn;
+	uint32_t commands;
+	unsigned char buf[2 * ISCSI_RAW_HEADER_SIZE + 1024];
+	size_t len;
+};
+
+struct target {
+	int listen_fd;
+	volatile int stop;
+	volatile int drop;	/* ask the target to drop a connection */
+	int dropped;
+	int logins;
+	int bad;
+	struct tconn conns[MAX_SESSIONS];
+};
+
+static struct target t;
+static unsigned char disk[IOSIZE];
+static int submitted, completed, good;
+
+static void
+target_bad(const char *what, uint32_t val)
+{
+	fprintf(stderr, "target: %s (%08x)\n", what, val);
+	t.bad++;
+}
+
+static int
+target_send(struct tconn *c, unsigned char *hdr, uint32_t itt,
+	    const unsigned char *data, uint32_t dsl)
+{
+	unsigned char pad[4] = {0, 0, 0, 0};
+
+	scsi_set_uint32(&hdr[4], dsl);
+	scsi_set_uint32(&hdr[16], itt);
+	scsi_set_uint32(&hdr[24], c->statsn++);
+	scsi_set_uint32(&hdr[28], c->expcmdsn);
+	scsi_set_uint32(&hdr[32], c->expcmdsn + WINDOW - 1);
+	if (write(c->fd, hdr, ISCSI_RAW_HEADER_SIZE) != ISCSI_RAW_HEADER_SIZE ||
+	    (dsl && write(c->fd, data, dsl) != (ssize_t)dsl) ||
+	    ((dsl & 3) && write(c->fd, pad, 4 - (dsl & 3)) !=
+	     (ssize_t)(4 - (dsl & 3)))) {
+		return -1;
+	}
+	return 0;
+}
+
+static int
+target_login(struct tconn *c, const unsigned char *q)
+{
+	unsigned char r[ISCSI_RAW_HEADER_SIZE];
+	char keys[128];
+	int i, len;
+
+	memcpy(c->isid, &q[8], 6);
+	for (i = 0; i < MAX_SESSIONS; i++) {
+		if (&t.conns[i] != c && t.conns[i].fd != -1 &&
+		    !memcmp(t.conns[i].isid, c->isid, 6)) {
+			target_bad("two sessions with the same ISID", i);
+		}
+	}
+	c->expcmdsn = scsi_get_uint32(&q[24]);
+	t.logins++;
+
+	len = snprintf(keys, sizeof(keys), "HeaderDigest=None") + 1;
+	len += snprintf(&keys[len], sizeof(keys) - len, "DataDigest=None") + 1;
+	len += snprintf(&keys[len], sizeof(keys) - len,
+			"MaxRecvDataSegmentLength=262144") + 1;
+
+	memset(r, 0, sizeof(r));
+	r[0] = ISCSI_PDU_LOGIN_RESPONSE;
+	r[1] = ISCSI_PDU_LOGIN_TRANSIT | ISCSI_PDU_LOGIN_CSG_OPNEG |
+		ISCSI_PDU_LOGIN_NSG_FF;
+	memcpy(&r[8], &q[8], 6);
+	scsi_set_uint16(&r[14], 1 + (c - t.conns));
+	return target_send(c, r, scsi_get_uint32(&q[16]),
+			   (unsigned char *)keys, len);
+}
+
+/* the standard INQUIRY data of a disk and its unit serial number */
+static int
+target_inquiry(struct tconn *c, const unsigned char *q)
+{
+	unsigned char r[ISCSI_RAW_HEADER_SIZE], data[96];
+	uint32_t len = scsi_get_uint32(&q[20]);
+
+	memset(data, 0, sizeof(data));
+	if (q[33] & 0x01) {
+		data[1] = SCSI_INQUIRY_PAGECODE_UNIT_SERIAL_NUMBER;
+		data[3] = 8;
+		memcpy(&data[4], "BENCH001", 8);
+		len = MIN(len, 12);
+	} else {
+		data[2] = 5;
+		data[3] = 2;
+		data[4] = sizeof(data) - 5;
+		memcpy(&data[8], "LIBISCSI", 8);
+		memcpy(&data[16], "BENCH           ", 16);
+		memcpy(&data[32], "0001", 4);
+		len = MIN(len, sizeof(data));
+	}
+
+	memset(r, 0, sizeof(r));
+	r[0] = ISCSI_PDU_DATA_IN;
+	r[1] = ISCSI_PDU_DATA_FINAL | ISCSI_PDU_DATA_CONTAINS_STATUS;
+	scsi_set_uint32(&r[20], 0xffffffff);
+	return target_send(c, r, scsi_get_uint32(&q[16]), data, len);
+}
+
+static int
+target_pdu(struct tconn *c, const unsigned char *q)
+{
+	unsigned char r[ISCSI_RAW_HEADER_SIZE];
+	uint32_t itt = scsi_get_uint32(&q[16]);
+	uint32_t cmdsn = scsi_get_uint32(&q[24]);
+
+	memset(r, 0, sizeof(r));
+	switch (q[0] & 0x3f) {
+	case ISCSI_PDU_LOGIN_REQUEST:
+		return target_login(c, q);
+	case ISCSI_PDU_SCSI_REQUEST:
+		if (cmdsn != c->expcmdsn) {
+			target_bad("CmdSN out of sequence", cmdsn);
+		}
+		c->expcmdsn = cmdsn + 1;
+		if (c->drop) {
+			t.dropped++;
+			return -1;
+		}
+		c->commands++;
+		if (q[32] == SCSI_OPCODE_READ10) {
+			r[0] = ISCSI_PDU_DATA_IN;
+			r[1] = ISCSI_PDU_DATA_FINAL |
+				ISCSI_PDU_DATA_CONTAINS_STATUS;
+			scsi_set_uint32(&r[20], 0xffffffff);
+			return target_send(c, r, itt, disk,
+					   scsi_get_uint32(&q[20]));
+		}
+		if (q[32] == SCSI_OPCODE_INQUIRY) {
+			return target_inquiry(c, q);
+		}
+		/* TEST UNIT READY after a login */
+		r[0] = ISCSI_PDU_SCSI_RESPONSE;
+		r[1] = ISCSI_PDU_SCSI_FINAL;
+		return target_send(c, r, itt, NULL, 0);
+	case ISCSI_PDU_NOP_OUT:
+		r[0] = ISCSI_PDU_NOP_IN;
+		r[1] = 0x80;
+		scsi_set_uint32(&r[20], 0xffffffff);
+		return target_send(c, r, itt, NULL, 0);
+	case ISCSI_PDU_LOGOUT_REQUEST:
+		r[0] = ISCSI_PDU_LOGOUT_RESPONSE;
+		r[1] = 0x80;
+		return target_send(c, r, itt, NULL, 0);
+	default:
+		target_bad("unexpected opcode", q[0]);
+		return -1;
+	}
+}
+
+static int
+target_read(struct tconn *c)
+{
+	size_t dsl, len, pos = 0;
+	ssize_t count;
+
+	count = read(c->fd, &c->buf[c->len], sizeof(c->buf) - c->len);
+	if (count <= 0) {
+		return -1;
+	}
+	c->len += count;
+	while (c->len - pos >= ISCSI_RAW_HEADER_SIZE) {
+		dsl = scsi_get_uint32(&c->buf[pos + 4]) & 0x00ffffff;
+		len = ISCSI_RAW_HEADER_SIZE + ((dsl + 3) & ~3);
+		if (c->len - pos < len) {
+			break;
+		}
+		if (target_pdu(c, &c->buf[pos]) != 0) {
+			return -1;
+		}
+		pos += len;
+	}
+	memmove(c->buf, &c->buf[pos], c->len - pos);
+	c->len -= pos;
+	return 0;
+}
+
+static void *
+target_thread(void *arg)
+{
+	struct pollfd pfd[1 + MAX_SESSIONS];
+	int i, fd;
+
+	while (!t.stop) {
+		if (t.drop && t.conns[1].fd != -1) {
+			t.conns[1].drop = 1;
+			t.drop = 0;
+		}
+
+		pfd[0].fd = t.listen_fd;
+		pfd[0].events = POLLIN;
+		for (i = 0; i < MAX_SESSIONS; i++) {
+			pfd[1 + i].fd = t.conns[i].fd;
+			pfd[1 + i].events = POLLIN;
+		}
+		if (poll(pfd, 1 + MAX_SESSIONS, 10) <= 0) {
+			continue;
+		}
+		if (pfd[0].revents & POLLIN) {
+			fd = accept(t.listen_fd, NULL, NULL);
+			for (i = 0; fd >= 0 && i < MAX_SESSIONS; i++) {
+				if (t.conns[i].fd == -1) {
+					memset(&t.conns[i], 0, sizeof(t.conns[i]));
+					t.conns[i].fd = fd;
+					fd = -1;
+				}
+			}
+			if (fd >= 0) {
+				target_bad("too many connections", 0);
+				close(fd);
+			}
+		}
+		for (i = 0; i < MAX_SESSIONS; i++) {
+			if (t.conns[i].fd != -1 && pfd[1 + i].revents &&
+			    target_read(&t.conns[i]) != 0) {
+				close(t.conns[i].fd);
+				t.conns[i].fd = -1;
+			}
+		}
+	}
+	return arg;
+}
+
+static void
+io_cb(struct iscsi_context *iscsi, int status, void *command_data,
+      void *private_data)
+{
+	struct scsi_task *task = command_data;
+
+	completed++;
+	if (status == SCSI_STATUS_GOOD && task->datain.size == IOSIZE &&
+	    !memcmp(task->datain.data, disk, IOSIZE)) {
+		good++;
+	}
+	scsi_free_scsi_task(task);
+}
+
+/* service every member of the group until done() says so */
+static int
+run(struct iscsi_session_group *group, int (*done)(void))
+{
+	struct pollfd pfd[MAX_SESSIONS];
+	struct iscsi_context *iscsi;
+	int i, n = iscsi_session_group_get_count(group);
+
+	while (!done()) {
+		for (i = 0; i < n; i++) {
+			iscsi = iscsi_session_group_get_context(group, i);
+			pfd[i].fd = iscsi_get_fd(iscsi);
+			pfd[i].events = iscsi_which_events(iscsi);
+			pfd[i].revents = 0;
+		}
+		if (poll(pfd, n, 10) < 0) {
+			return -1;
+		}
+		for (i = 0; i < n; i++) {
+			iscsi = iscsi_session_group_get_context(group, i);
+			if (iscsi_service(iscsi, pfd[i].revents) != 0) {
+				fprintf(stderr, "iscsi_service failed: %s\n",
+					iscsi_get_error(iscsi));
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+static int
+queue_not_full(void)
+{
+	return submitted - completed < QUEUE_DEPTH;
+}
+
+static int
+all_done(void)
+{
+	return completed == submitted;
+}
+
+static void
+wait_for_hangup(void)
+{
+	int i;
+
+	for (i = 0; i < MAX_SESSIONS; i++) {
+		while (t.conns[i].fd != -1) {
+			usleep(1000);
+		}
+	}
+}
+
+static int
+bench(const char *portal, int sessions,
+      enum iscsi_session_group_dispatch dispatch, int drop)
+{
+	struct iscsi_session_group *group;
+	struct scsi_task *task;
+	double start, ns;
+	uint32_t lba;
+	int i, ret = -1;
+
+	group = iscsi_create_session_group("iqn.2007-10.com.github:sahlberg:libiscsi:bench",
+					   sessions);
+	if (group == NULL) {
+		fprintf(stderr, "Failed to create session group\n");
+		return -1;
+	}
+	iscsi_session_group_set_dispatch(group, dispatch);
+	iscsi_session_group_set_targetname(group,
+		"iqn.2007-10.com.github:sahlberg:libiscsi:target");
+	if (iscsi_session_group_connect_sync(group, portal, 0) != 0) {
+		fprintf(stderr, "Failed to log in the session group\n");
+		goto out;
+	}
+
+	t.logins = t.dropped = 0;
+	submitted = completed = good = 0;
+	start = bench_now_ns();
+	while (submitted < COMMANDS) {
+		if (run(group, queue_not_full) != 0) {
+			goto out;
+		}
+		if (drop && submitted == COMMANDS / 2) {
+			t.drop = 1;
+		}
+		lba = (submitted % 1024) * (IOSIZE / BLOCKSIZE);
+		task = iscsi_read10_task(iscsi_session_group_select(group), 0,
+					 lba, IOSIZE, BLOCKSIZE, 0, 0, 0, 0, 0,
+					 io_cb, NULL);
+		if (task == NULL) {
+			fprintf(stderr, "Failed to queue command\n");
+			goto out;
+		}
+		submitted++;
+	}
+	if (run(group, all_done) != 0) {
+		goto out;
+	}
+	ns = bench_now_ns() - start;
+
+	if (good != COMMANDS) {
+		fprintf(stderr, "%d of %d commands good\n", good, COMMANDS);
+		t.bad++;
+	}
+	if (drop && (t.dropped != 1 || t.logins != 1)) {
+		fprintf(stderr, "%d commands dropped, %d logins after the "
+			"drop\n", t.dropped, t.logins);
+		t.bad++;
+	}
+	printf("%8d %-18s %10.0f %8.1f  ", sessions,
+	       drop ? "reconnect" : dispatch == ISCSI_SESSION_GROUP_ROUND_ROBIN ?
+	       "round robin" : "least outstanding",
+	       COMMANDS / ns * 1e9, (double)COMMANDS * IOSIZE / ns * 1e3);
+	for (i = 0; i < MAX_SESSIONS; i++) {
+		if (t.conns[i].fd != -1) {
+			printf(" %u", t.conns[i].commands);
+		}
+	}
+	printf("\n");
+
+	if (iscsi_session_group_logout_sync(group) == 0 && t.bad == 0) {
+		ret = 0;
+	}
+
+ out:
+	iscsi_destroy_session_group(group);
+	wait_for_hangup();
+	return ret;
+}
+
+int main(void)
+{
+	pthread_t thread;
+	char portal[64];
+	int i, port, ret = 0;
+
+	for (i = 0; i < IOSIZE; i++) {
+		disk[i] = i * 7;
+	}
+	for (i = 0; i < MAX_SESSIONS; i++) {
+		t.conns[i].fd = -1;
+	}
+
+	t.listen_fd = bench_listen(MAX_SESSIONS, &port);
+	if (t.listen_fd < 0) {
+		fprintf(stderr, "Failed to listen: %s\n", strerror(errno));
+		return 1;
+	}
+	snprintf(portal, sizeof(portal), "127.0.0.1:%d", port);
+	if (pthread_create(&thread, NULL, target_thread, NULL) != 0) {
+		return 1;
+	}
+
+	printf("%d KiB reads, queue depth %d\n", IOSIZE / 1024, QUEUE_DEPTH);
+	printf("%8s %-18s %10s %8s   %s\n", "sessions", "dispatch", "cmds/s",
+	       "MB/s", "commands per session");
+	for (i = 1; i <= MAX_SESSIONS && ret == 0; i *= 2) {
+		ret = bench(portal, i, ISCSI_SESSION_GROUP_LEAST_OUTSTANDING, 0);
+	}
+	if (ret == 0) {
+		ret = bench(portal, MAX_SESSIONS,
+			    ISCSI_SESSION_GROUP_ROUND_ROBIN, 0);
+	}
+	if (ret == 0) {
+		ret = bench(portal, 2, ISCSI_SESSION_GROUP_LEAST_OUTSTANDING, 1);
+	}
+
+	t.stop = 1;
+	pthread_join(thread, NULL);
+	close(t.listen_fd);
+	return ret ? 1 : 0;
+}
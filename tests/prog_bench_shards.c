@@ -0,0 +1,247 @@
+/*
+   Copyright (C) 2026 by the libiscsi authors
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * Scale a session group over 1 to N CPUs. Every member gets a service
+ * thread bound to its own CPU, and one application thread per CPU
+ * submits TESTUNITREADY commands, picking the member either by the CPU
+ * it runs on or by hashing the LBA it would access. Report the commands
+ * per second for each number of CPUs. Every member talks to its own fake
+ * target thread on the other end of a socketpair.
+ * A completion that does not run on the service thread of its member, or
+ * not on the CPU of that thread, is counted as bad.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "iscsi.h"
+#include "iscsi-private.h"
+#include "scsi-lowlevel.h"
+#include "bench.h"
+
+#if defined(HAVE_MULTITHREADING) && defined(HAVE_PTHREAD_SETAFFINITY_NP) && \
+    defined(HAVE_SCHED_GETCPU)
+
+#define MAX_CPUS    ISCSI_MAX_GROUP_SESSIONS
+#define COMMANDS    (64 * 1024)  /* per CPU */
+#define DEPTH       16           /* outstanding commands per thread */
+#define WINDOW      1024
+
+struct submitter {
+	pthread_t thread;
+	struct iscsi_session_group *group;
+	int cpu;
+	int by_lba;
+	sem_t slots;
+	int failed;
+	int bad;
+};
+
+static int
+bind_cpu(pthread_t thread, int cpu)
+{
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return pthread_setaffinity_np(thread, sizeof(set), &set);
+}
+
+static void
+tur_cb(struct iscsi_context *iscsi, int status, void *command_data,
+       void *private_data)
+{
+	struct submitter *s = private_data;
+
+	/* with LBA routing several service threads complete for us */
+	if (status != SCSI_STATUS_GOOD) {
+		__atomic_add_fetch(&s->failed, 1, __ATOMIC_RELAXED);
+	}
+	if (!pthread_equal(pthread_self(), iscsi->service_thread) ||
+	    sched_getcpu() != iscsi->service_cpu) {
+		__atomic_add_fetch(&s->bad, 1, __ATOMIC_RELAXED);
+	}
+	scsi_free_scsi_task(command_data);
+	sem_post(&s->slots);
+}
+
+static void *
+submit_thread(void *arg)
+{
+	struct submitter *s = arg;
+	struct iscsi_context *iscsi;
+	uint64_t lba;
+	int i;
+
+	if (bind_cpu(pthread_self(), s->cpu) != 0) {
+		s->failed = COMMANDS;
+		return NULL;
+	}
+	for (i = 0; i < COMMANDS; i++) {
+		sem_wait(&s->slots);
+		if (s->by_lba) {
+			/* each thread walks its own part of the LUN */
+			lba = ((uint64_t)s->cpu << 32) + (uint64_t)i * 16;
+			iscsi = iscsi_session_group_select_lba(s->group, lba);
+		} else {
+			iscsi = iscsi_session_group_select(s->group);
+		}
+		if (iscsi_testunitready_task(iscsi, 0, tur_cb, s) == NULL) {
+			__atomic_add_fetch(&s->failed, 1, __ATOMIC_RELAXED);
+			sem_post(&s->slots);
+		}
+	}
+	/* wait for our commands to complete */
+	for (i = 0; i < DEPTH; i++) {
+		sem_wait(&s->slots);
+	}
+	return NULL;
+}
+
+static int
+bench(int cpus, int by_lba)
+{
+	static struct submitter s[MAX_CPUS];
+	static struct bench_target t[MAX_CPUS];
+	static pthread_t thread[MAX_CPUS];
+	static int sv[MAX_CPUS][2];
+	struct iscsi_session_group *group;
+	struct iscsi_context *iscsi;
+	int i, started = 0, failed = 0, bad = 0, ret = -1;
+	double start, ns;
+
+	group = iscsi_create_session_group("iqn.2007-10.com.github:sahlberg:libiscsi:bench", cpus);
+	if (group == NULL) {
+		fprintf(stderr, "Failed to create session group\n");
+		return -1;
+	}
+	iscsi_session_group_set_dispatch(group, ISCSI_SESSION_GROUP_LOCAL_CPU);
+
+	for (i = 0; i < cpus; i++) {
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv[i]) != 0) {
+			goto out;
+		}
+		iscsi = iscsi_session_group_get_context(group, i);
+
+		/* pretend we are logged in */
+		fcntl(sv[i][0], F_SETFL, O_NONBLOCK);
+		iscsi->fd = sv[i][0];
+		iscsi->is_connected = 1;
+		iscsi->is_loggedin = 1;
+		iscsi->statsn = 0;
+		iscsi->expcmdsn = iscsi->cmdsn;
+		iscsi->maxcmdsn = iscsi->cmdsn + WINDOW - 1;
+
+		memset(&t[i], 0, sizeof(t[i]));
+		t[i].fd = sv[i][1];
+		t[i].window = WINDOW;
+		t[i].statsn = 1;
+		t[i].maxcmdsn = iscsi->maxcmdsn;
+		if (pthread_create(&thread[i], NULL, bench_target_thread,
+				   &t[i]) != 0) {
+			close(sv[i][0]);
+			close(sv[i][1]);
+			goto out;
+		}
+		started++;
+	}
+
+	/* member i runs on CPU i */
+	if (iscsi_session_group_start_service_threads(group, NULL, 0) != 0) {
+		fprintf(stderr, "%s\n", iscsi_get_error(
+				iscsi_session_group_get_context(group, 0)));
+		goto out;
+	}
+
+	start = bench_now_ns();
+	for (i = 0; i < cpus; i++) {
+		s[i].group = group;
+		s[i].cpu = i;
+		s[i].by_lba = by_lba;
+		s[i].failed = 0;
+		s[i].bad = 0;
+		sem_init(&s[i].slots, 0, DEPTH);
+		pthread_create(&s[i].thread, NULL, submit_thread, &s[i]);
+	}
+	for (i = 0; i < cpus; i++) {
+		pthread_join(s[i].thread, NULL);
+		sem_destroy(&s[i].slots);
+		failed += s[i].failed;
+		bad += s[i].bad;
+	}
+	ns = bench_now_ns() - start;
+
+	printf("%5d %-5s %12.0f %6d\n", cpus, by_lba ? "lba" : "local",
+	       (double)COMMANDS * cpus / ns * 1e9, failed + bad);
+	ret = failed + bad ? -1 : 0;
+
+ out:
+	iscsi_session_group_stop_service_threads(group);
+	for (i = 0; i < started; i++) {
+		shutdown(sv[i][0], SHUT_RDWR);
+		pthread_join(thread[i], NULL);
+		iscsi_session_group_get_context(group, i)->fd = -1;
+		close(sv[i][0]);
+		close(sv[i][1]);
+	}
+	iscsi_destroy_session_group(group);
+	return ret;
+}
+
+int main(void)
+{
+	int cpus, ncpus, by_lba;
+
+	ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (ncpus > MAX_CPUS) {
+		ncpus = MAX_CPUS;
+	}
+	printf("%5s %-5s %12s %6s\n", "cpus", "route", "commands/s", "bad");
+	for (cpus = 1; cpus <= ncpus; cpus = cpus * 2 > ncpus &&
+		     cpus < ncpus ? ncpus : cpus * 2) {
+		for (by_lba = 0; by_lba < 2; by_lba++) {
+			if (bench(cpus, by_lba)) {
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+#else
+
+int main(void)
+{
+	printf("CPU affinity is not supported, skipping\n");
+	return 0;
+}
+
+#endif
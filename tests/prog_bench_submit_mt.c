@@ -0,0 +1,246 @@
+/*
+   Copyright (C) 2026 by the libiscsi authors
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * Submit TESTUNITREADY commands from several application threads to one
+ * context with a service thread, and report the commands per second for
+ * different numbers of submitting threads. A fake target thread on the
+ * other end of a socketpair answers every command right away and checks
+ * that the CmdSNs and ITTs it sees are not reused.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "iscsi.h"
+#include "iscsi-private.h"
+#include "scsi-lowlevel.h"
+#include "bench.h"
+
+#define MAX_THREADS 16
+#define COMMANDS    (64 * 1024)  /* per run, spread over the threads */
+#define DEPTH       8            /* outstanding commands per thread */
+#define WINDOW      1024
+
+struct submitter {
+	pthread_t thread;
+	struct iscsi_context *iscsi;
+	sem_t slots;
+	int count;
+	int failed;
+};
+
+struct target {
+	pthread_t thread;
+	int fd;
+	int bad;
+	uint32_t statsn;
+	uint32_t expcmdsn;
+	/* CmdSNs at or above expcmdsn that arrived early */
+	unsigned char early[WINDOW];
+	unsigned char req[64 * ISCSI_RAW_HEADER_SIZE];
+	unsigned char rsp[64 * ISCSI_RAW_HEADER_SIZE];
+};
+
+static void
+tur_cb(struct iscsi_context *iscsi, int status, void *command_data,
+       void *private_data)
+{
+	struct submitter *s = private_data;
+
+	if (status != SCSI_STATUS_GOOD) {
+		s->failed++;
+	}
+	scsi_free_scsi_task(command_data);
+	sem_post(&s->slots);
+}
+
+static void *
+submit_thread(void *arg)
+{
+	struct submitter *s = arg;
+	int i;
+
+	for (i = 0; i < s->count; i++) {
+		sem_wait(&s->slots);
+		if (iscsi_testunitready_task(s->iscsi, 0, tur_cb, s) == NULL) {
+			s->failed++;
+			sem_post(&s->slots);
+		}
+	}
+	/* wait for our commands to complete */
+	for (i = 0; i < DEPTH; i++) {
+		sem_wait(&s->slots);
+	}
+	return NULL;
+}
+
+/* CmdSNs may arrive out of order, but each one only once */
+static void
+target_check_cmdsn(struct target *t, uint32_t cmdsn)
+{
+	uint32_t d = cmdsn - t->expcmdsn;
+
+	if (d >= WINDOW || t->early[cmdsn % WINDOW]) {
+		t->bad++;
+		return;
+	}
+	t->early[cmdsn % WINDOW] = 1;
+	while (t->early[t->expcmdsn % WINDOW]) {
+		t->early[t->expcmdsn % WINDOW] = 0;
+		t->expcmdsn++;
+	}
+}
+
+static void *
+target_thread(void *arg)
+{
+	struct target *t = arg;
+	unsigned char *q, *r;
+	size_t len = 0, pos;
+	ssize_t count;
+	int n;
+
+	for (;;) {
+		count = read(t->fd, &t->req[len], sizeof(t->req) - len);
+		if (count <= 0) {
+			return NULL;
+		}
+		len += count;
+		n = 0;
+		for (pos = 0; len - pos >= ISCSI_RAW_HEADER_SIZE;
+		     pos += ISCSI_RAW_HEADER_SIZE) {
+			q = &t->req[pos];
+			if ((q[0] & 0x3f) != ISCSI_PDU_SCSI_REQUEST ||
+			    q[4] || q[5] || q[6] || q[7]) {
+				t->bad++;
+				continue;
+			}
+			target_check_cmdsn(t, scsi_get_uint32(&q[24]));
+			r = &t->rsp[n++ * ISCSI_RAW_HEADER_SIZE];
+			memset(r, 0, ISCSI_RAW_HEADER_SIZE);
+			r[0] = ISCSI_PDU_SCSI_RESPONSE;
+			r[1] = ISCSI_PDU_SCSI_FINAL;
+			memcpy(&r[16], &q[16], 4);
+			scsi_set_uint32(&r[24], t->statsn++);
+			scsi_set_uint32(&r[28], t->expcmdsn);
+			scsi_set_uint32(&r[32], t->expcmdsn + WINDOW / 2);
+		}
+		memmove(t->req, &t->req[pos], len - pos);
+		len -= pos;
+		if (n && write(t->fd, t->rsp, n * ISCSI_RAW_HEADER_SIZE) !=
+		    n * ISCSI_RAW_HEADER_SIZE) {
+			return NULL;
+		}
+	}
+}
+
+static int
+bench(int threads)
+{
+	static struct submitter s[MAX_THREADS];
+	static struct target t;
+	struct iscsi_context *iscsi;
+	int sv[2], i, failed = 0, ret = -1;
+	double start, ns;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+		return -1;
+	}
+	iscsi = iscsi_create_context("iqn.2007-10.com.github:sahlberg:libiscsi:bench");
+	if (iscsi == NULL) {
+		fprintf(stderr, "Failed to create context\n");
+		goto out;
+	}
+
+	/* pretend we are logged in */
+	fcntl(sv[0], F_SETFL, O_NONBLOCK);
+	iscsi->fd = sv[0];
+	iscsi->is_connected = 1;
+	iscsi->is_loggedin = 1;
+	iscsi->session_type = ISCSI_SESSION_NORMAL;
+	iscsi->statsn = 0;
+	iscsi->expcmdsn = iscsi->cmdsn;
+	iscsi->maxcmdsn = iscsi->cmdsn + WINDOW / 2;
+
+	memset(&t, 0, sizeof(t));
+	t.fd = sv[1];
+	t.statsn = 1;
+	t.expcmdsn = iscsi->cmdsn;
+	if (pthread_create(&t.thread, NULL, target_thread, &t) != 0) {
+		goto out;
+	}
+
+	if (iscsi_mt_service_thread_start(iscsi) != 0) {
+		fprintf(stderr, "%s\n", iscsi_get_error(iscsi));
+		goto stop_target;
+	}
+
+	start = bench_now_ns();
+	for (i = 0; i < threads; i++) {
+		s[i].iscsi = iscsi;
+		s[i].count = COMMANDS / threads;
+		s[i].failed = 0;
+		sem_init(&s[i].slots, 0, DEPTH);
+		pthread_create(&s[i].thread, NULL, submit_thread, &s[i]);
+	}
+	for (i = 0; i < threads; i++) {
+		pthread_join(s[i].thread, NULL);
+		sem_destroy(&s[i].slots);
+		failed += s[i].failed;
+	}
+	ns = bench_now_ns() - start;
+
+	iscsi_mt_service_thread_stop(iscsi);
+	printf("%7d %12.0f %6d\n", threads,
+	       (COMMANDS / threads) * threads / ns * 1e9, failed + t.bad);
+	ret = failed + t.bad ? -1 : 0;
+
+ stop_target:
+	shutdown(sv[0], SHUT_RDWR);
+	pthread_join(t.thread, NULL);
+ out:
+	if (iscsi != NULL) {
+		iscsi->fd = -1;
+		iscsi_destroy_context(iscsi);
+	}
+	close(sv[0]);
+	close(sv[1]);
+	return ret;
+}
+
+int main(void)
+{
+	int threads;
+
+	printf("%7s %12s %6s\n", "threads", "commands/s", "bad");
+	for (threads = 1; threads <= MAX_THREADS; threads *= 2) {
+		if (bench(threads)) {
+			return 1;
+		}
+	}
+	return 0;
+}
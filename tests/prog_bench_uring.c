@@ -0,0 +1,256 @@
+/*
+   Copyright (C) 2026 by the libiscsi authors
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * 4k random read style workload over loopback TCP with the TCP transport
+ * and with the io_uring transport. A fake target on the other end of the
+ * connection answers every READ10 with a Data-In that carries the status.
+ * Reports the system calls the library makes per command, and the poll()
+ * calls of the event loop that drives it.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "iscsi.h"
+#include "iscsi-private.h"
+#include "scsi-lowlevel.h"
+#include "bench.h"
+
+#define IOSIZE    4096
+#define BLOCKSIZE 512
+#define IN_FLIGHT 32
+#define READS     50000
+
+struct target {
+	int fd;
+	unsigned char req[IN_FLIGHT * ISCSI_RAW_HEADER_SIZE];
+	size_t req_len;
+	uint32_t statsn;
+	unsigned char rsp[IN_FLIGHT * (ISCSI_RAW_HEADER_SIZE + IOSIZE)];
+	size_t rsp_len;
+	size_t rsp_pos;
+};
+
+static int completed, bad_completions, connected;
+
+static void
+connect_cb(struct iscsi_context *iscsi, int status, void *command_data,
+	   void *private_data)
+{
+	connected = status == SCSI_STATUS_GOOD ? 1 : -1;
+}
+
+static void
+read_cb(struct iscsi_context *iscsi, int status, void *command_data,
+	void *private_data)
+{
+	struct scsi_task *task = command_data;
+
+	if (status != SCSI_STATUS_GOOD || task->datain.size != IOSIZE) {
+		bad_completions++;
+	}
+	completed++;
+	scsi_free_scsi_task(task);
+}
+
+/* answer every READ10 we have read so far with a Data-In + status */
+static int
+fake_target(struct target *t)
+{
+	unsigned char *q, *r;
+	ssize_t count;
+	size_t i;
+
+	if (t->rsp_pos < t->rsp_len) {
+		count = write(t->fd, &t->rsp[t->rsp_pos],
+			      t->rsp_len - t->rsp_pos);
+		if (count < 0 && errno != EAGAIN) {
+			return -1;
+		}
+		if (count > 0) {
+			t->rsp_pos += count;
+		}
+		if (t->rsp_pos < t->rsp_len) {
+			return 0;
+		}
+	}
+	t->rsp_pos = t->rsp_len = 0;
+
+	if (bench_read(t->fd, t->req, sizeof(t->req), &t->req_len) != 0) {
+		return -1;
+	}
+
+	for (i = 0; i + ISCSI_RAW_HEADER_SIZE <= t->req_len;
+	     i += ISCSI_RAW_HEADER_SIZE) {
+		q = &t->req[i];
+		if ((q[0] & 0x3f) != ISCSI_PDU_SCSI_REQUEST) {
+			return -1;
+		}
+		r = &t->rsp[t->rsp_len];
+		memset(r, 0, ISCSI_RAW_HEADER_SIZE);
+		r[0] = ISCSI_PDU_DATA_IN;
+		r[1] = ISCSI_PDU_SCSI_FINAL | ISCSI_PDU_DATA_CONTAINS_STATUS;
+		scsi_set_uint32(&r[4], IOSIZE);
+		memcpy(&r[16], &q[16], 4);
+		scsi_set_uint32(&r[24], t->statsn++);
+		scsi_set_uint32(&r[28], scsi_get_uint32(&q[24]) + 1);
+		scsi_set_uint32(&r[32], scsi_get_uint32(&q[24]) + IN_FLIGHT);
+		memset(&r[ISCSI_RAW_HEADER_SIZE], 0x5a, IOSIZE);
+		t->rsp_len += ISCSI_RAW_HEADER_SIZE + IOSIZE;
+	}
+	bench_consume(t->req, &t->req_len, i);
+	return 0;
+}
+
+static int
+run_loop(struct iscsi_context *iscsi, struct target *t, int *polls)
+{
+	struct pollfd pfd;
+
+	if (t && fake_target(t) != 0) {
+		fprintf(stderr, "Bad pdu on the wire\n");
+		return -1;
+	}
+	pfd.fd = iscsi_get_fd(iscsi);
+	pfd.events = iscsi_which_events(iscsi);
+	(*polls)++;
+	if (poll(&pfd, 1, 1) < 0 ||
+	    iscsi_service(iscsi, pfd.revents) != 0) {
+		fprintf(stderr, "iscsi_service failed: %s\n",
+			iscsi_get_error(iscsi));
+		return -1;
+	}
+	return 0;
+}
+
+static int
+bench(const char *name, enum iscsi_transport_type transport, int flags)
+{
+	struct iscsi_context *iscsi;
+	struct iscsi_stats stats;
+	struct target t;
+	char portal[64];
+	int lfd, port, submitted = 0, polls = 0, ret = -1;
+	double start, ns;
+
+	memset(&t, 0, sizeof(t));
+	t.fd = -1;
+	t.statsn = 1;
+	lfd = bench_listen(1, &port);
+	if (lfd == -1) {
+		fprintf(stderr, "Failed to listen on loopback\n");
+		return -1;
+	}
+	iscsi = iscsi_create_context("iqn.2007-10.com.github:sahlberg:libiscsi:bench");
+	if (iscsi == NULL) {
+		fprintf(stderr, "Failed to create context\n");
+		goto out;
+	}
+	if (iscsi_init_transport(iscsi, transport) != 0) {
+		printf("%-18s not supported\n", name);
+		ret = 0;
+		goto out;
+	}
+	iscsi_set_uring_flags(iscsi, flags);
+
+	connected = 0;
+	snprintf(portal, sizeof(portal), "127.0.0.1:%d", port);
+	if (iscsi_connect_async(iscsi, portal, connect_cb, NULL) != 0) {
+		fprintf(stderr, "Failed to connect: %s\n",
+			iscsi_get_error(iscsi));
+		goto out;
+	}
+	t.fd = accept(lfd, NULL, NULL);
+	if (t.fd == -1) {
+		fprintf(stderr, "Failed to accept\n");
+		goto out;
+	}
+	fcntl(t.fd, F_SETFL, O_NONBLOCK);
+	while (connected == 0) {
+		if (run_loop(iscsi, NULL, &polls) != 0) {
+			goto out;
+		}
+	}
+	if (connected < 0) {
+		fprintf(stderr, "Connect failed\n");
+		goto out;
+	}
+
+	/* pretend we are logged in */
+	iscsi->is_loggedin = 1;
+	iscsi->session_type = ISCSI_SESSION_NORMAL;
+	iscsi->maxcmdsn = iscsi->cmdsn + IN_FLIGHT;
+	memset(&iscsi->stats, 0, sizeof(iscsi->stats));
+	polls = 0;
+
+	completed = bad_completions = 0;
+	start = bench_now_ns();
+	while (completed < READS) {
+		while (submitted < READS && submitted - completed < IN_FLIGHT) {
+			if (iscsi_read10_task(iscsi, 0, 0, IOSIZE, BLOCKSIZE,
+					      0, 0, 0, 0, 0, read_cb,
+					      NULL) == NULL) {
+				fprintf(stderr, "Failed to queue READ10\n");
+				goto out;
+			}
+			submitted++;
+		}
+		if (run_loop(iscsi, &t, &polls) != 0) {
+			goto out;
+		}
+	}
+	ns = (bench_now_ns() - start) / READS;
+
+	iscsi_get_stats(iscsi, &stats);
+	printf("%-18s %10.3f %10.3f %10.3f %10.1f %6d\n", name,
+	       (double)stats.tx_syscalls / stats.commands,
+	       (double)stats.rx_syscalls / stats.commands,
+	       (double)polls / stats.commands, ns, bad_completions);
+	ret = bad_completions ? -1 : 0;
+
+ out:
+	if (iscsi != NULL) {
+		iscsi_destroy_context(iscsi);
+	}
+	if (t.fd != -1) {
+		close(t.fd);
+	}
+	close(lfd);
+	return ret;
+}
+
+int main(void)
+{
+	printf("%-18s %10s %10s %10s %10s %6s\n", "transport", "tx/cmd",
+	       "rx/cmd", "poll/cmd", "ns/cmd", "bad");
+	if (bench("tcp", TCP_TRANSPORT, 0) ||
+	    bench("uring", URING_TRANSPORT, 0) ||
+	    bench("uring fixed file", URING_TRANSPORT,
+		  ISCSI_URING_FIXED_FILE)) {
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,197 @@
+/*
+   Copyright (C) 2026 by the libiscsi authors
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * Time how long a command submitted while the service thread sleeps in
+ * poll takes to reach the wire. The main thread queues a TESTUNITREADY
+ * and then reads the other end of a socketpair until the command shows
+ * up, then answers it and waits for the completion before the next one.
+ * A burst of commands is also submitted at once to check that they all
+ * go out after a single wakeup.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "iscsi.h"
+#include "iscsi-private.h"
+#include "scsi-lowlevel.h"
+#include "bench.h"
+
+#define ROUNDS 2000
+#define BURST  32
+
+static volatile int completed;
+
+static void
+tur_cb(struct iscsi_context *iscsi, int status, void *command_data,
+       void *private_data)
+{
+	scsi_free_scsi_task(command_data);
+	__atomic_add_fetch(&completed, 1, __ATOMIC_SEQ_CST);
+}
+
+static int
+cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* read one pdu header, the commands carry no data */
+static int
+read_pdu(int fd, unsigned char *q)
+{
+	ssize_t count;
+	size_t len = 0;
+
+	while (len < ISCSI_RAW_HEADER_SIZE) {
+		count = read(fd, &q[len], ISCSI_RAW_HEADER_SIZE - len);
+		if (count <= 0) {
+			return -1;
+		}
+		len += count;
+	}
+	return 0;
+}
+
+static int
+respond(int fd, unsigned char *q, uint32_t statsn)
+{
+	unsigned char r[ISCSI_RAW_HEADER_SIZE];
+
+	memset(r, 0, sizeof(r));
+	r[0] = ISCSI_PDU_SCSI_RESPONSE;
+	r[1] = ISCSI_PDU_SCSI_FINAL;
+	memcpy(&r[16], &q[16], 4);
+	scsi_set_uint32(&r[24], statsn);
+	scsi_set_uint32(&r[28], scsi_get_uint32(&q[24]) + 1);
+	scsi_set_uint32(&r[32], scsi_get_uint32(&q[24]) + 64);
+	if (write(fd, r, sizeof(r)) != sizeof(r)) {
+		return -1;
+	}
+	return 0;
+}
+
+static void
+wait_completed(int count)
+{
+	struct timespec ts = {0, 10000};
+
+	while (__atomic_load_n(&completed, __ATOMIC_SEQ_CST) < count) {
+		nanosleep(&ts, NULL);
+	}
+}
+
+int main(void)
+{
+	static double lat[ROUNDS];
+	unsigned char q[ISCSI_RAW_HEADER_SIZE];
+	struct iscsi_context *iscsi;
+	struct timespec idle = {0, 200000};
+	uint32_t statsn = 1;
+	int sv[2], i, ret = 1;
+	double start, burst;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+		return 1;
+	}
+	iscsi = iscsi_create_context("iqn.2007-10.com.github:sahlberg:libiscsi:bench");
+	if (iscsi == NULL) {
+		fprintf(stderr, "Failed to create context\n");
+		goto out;
+	}
+
+	/* pretend we are logged in */
+	fcntl(sv[0], F_SETFL, O_NONBLOCK);
+	iscsi->fd = sv[0];
+	iscsi->is_connected = 1;
+	iscsi->is_loggedin = 1;
+	iscsi->session_type = ISCSI_SESSION_NORMAL;
+	iscsi->statsn = 0;
+	iscsi->maxcmdsn = iscsi->cmdsn + 64;
+
+	if (iscsi_mt_service_thread_start(iscsi) != 0) {
+		fprintf(stderr, "%s\n", iscsi_get_error(iscsi));
+		goto out;
+	}
+
+	for (i = 0; i < ROUNDS; i++) {
+		/* let the service thread go back to sleep in poll */
+		nanosleep(&idle, NULL);
+		start = bench_now_ns();
+		if (iscsi_testunitready_task(iscsi, 0, tur_cb, NULL) == NULL) {
+			fprintf(stderr, "Failed to queue command\n");
+			goto stop;
+		}
+		if (read_pdu(sv[1], q) != 0) {
+			fprintf(stderr, "Failed to read command\n");
+			goto stop;
+		}
+		lat[i] = bench_now_ns() - start;
+		if (respond(sv[1], q, statsn++) != 0) {
+			goto stop;
+		}
+		wait_completed(i + 1);
+	}
+
+	nanosleep(&idle, NULL);
+	start = bench_now_ns();
+	for (i = 0; i < BURST; i++) {
+		if (iscsi_testunitready_task(iscsi, 0, tur_cb, NULL) == NULL) {
+			fprintf(stderr, "Failed to queue command\n");
+			goto stop;
+		}
+	}
+	for (i = 0; i < BURST; i++) {
+		if (read_pdu(sv[1], q) != 0 ||
+		    respond(sv[1], q, statsn++) != 0) {
+			fprintf(stderr, "Failed to read command\n");
+			goto stop;
+		}
+	}
+	burst = bench_now_ns() - start;
+	wait_completed(ROUNDS + BURST);
+
+	qsort(lat, ROUNDS, sizeof(lat[0]), cmp_double);
+	printf("submit to wire: median %.1f us, p99 %.1f us, max %.1f us\n",
+	       lat[ROUNDS / 2] / 1e3, lat[ROUNDS * 99 / 100] / 1e3,
+	       lat[ROUNDS - 1] / 1e3);
+	printf("%d commands at once: %.1f us until the last is on the wire\n",
+	       BURST, burst / 1e3);
+	ret = 0;
+
+ stop:
+	iscsi_mt_service_thread_stop(iscsi);
+ out:
+	if (iscsi != NULL) {
+		iscsi->fd = -1;
+		iscsi_destroy_context(iscsi);
+	}
+	close(sv[0]);
+	close(sv[1]);
+	return ret;
+}
@@ -0,0 +1,273 @@
+/*
+   Copyright (C) 2026 by the libiscsi authors
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * iscsi-perf style write workload over loopback TCP, with and without
+ * MSG_ZEROCOPY for the payloads. A fake target on the other end of the
+ * connection swallows the WRITE10s and answers each with a SCSI response.
+ * Every completion checks that the kernel had already released the pages
+ * of a zerocopy write before its callback ran.
+ * Note that loopback turns zerocopy sends into deferred copies so this
+ * shows the bookkeeping overhead, not the gain seen on a real NIC.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include "iscsi.h"
+#include "iscsi-private.h"
+#include "scsi-lowlevel.h"
+#include "bench.h"
+
+#define IOSIZE    (1024 * 1024)
+#define BLOCKSIZE 512
+#define IN_FLIGHT 16
+#define WRITES    1024
+
+struct target {
+	int fd;
+	unsigned char hdr[ISCSI_RAW_HEADER_SIZE];
+	size_t hdr_len;
+	size_t skip;
+	uint32_t statsn;
+	unsigned char rsp[WRITES * ISCSI_RAW_HEADER_SIZE];
+	size_t rsp_len;
+};
+
+static int completed, bad_completions;
+
+static void
+write_cb(struct iscsi_context *iscsi, int status, void *command_data,
+	 void *private_data)
+{
+	struct scsi_task *task = command_data;
+	struct iscsi_scsi_cbdata *cbdata = scsi_get_task_private_ptr(task);
+
+	if (status != SCSI_STATUS_GOOD ||
+	    (cbdata->zc_pending &&
+	     iscsi_serial32_compare(cbdata->zc_seq, iscsi->zc_done) >= 0)) {
+		bad_completions++;
+	}
+	completed++;
+	scsi_free_scsi_task(task);
+}
+
+/* consume whatever has arrived and answer every complete command */
+static int
+fake_target(struct target *t)
+{
+	static unsigned char scratch[256 * 1024];
+	unsigned char *r;
+	ssize_t count;
+
+	for (;;) {
+		if (t->hdr_len < ISCSI_RAW_HEADER_SIZE) {
+			count = read(t->fd, &t->hdr[t->hdr_len],
+				     ISCSI_RAW_HEADER_SIZE - t->hdr_len);
+		} else {
+			count = read(t->fd, scratch,
+				     MIN(t->skip, sizeof(scratch)));
+		}
+		if (count <= 0) {
+			break;
+		}
+		if (t->hdr_len < ISCSI_RAW_HEADER_SIZE) {
+			t->hdr_len += count;
+			if (t->hdr_len == ISCSI_RAW_HEADER_SIZE) {
+				t->skip = (scsi_get_uint32(&t->hdr[4]) &
+					   0x00ffffff) + 3;
+				t->skip &= ~3;
+			}
+		} else {
+			t->skip -= count;
+		}
+		if (t->hdr_len < ISCSI_RAW_HEADER_SIZE || t->skip) {
+			continue;
+		}
+
+		if ((t->hdr[0] & 0x3f) != ISCSI_PDU_SCSI_REQUEST) {
+			return -1;
+		}
+		r = &t->rsp[t->rsp_len];
+		memset(r, 0, ISCSI_RAW_HEADER_SIZE);
+		r[0] = ISCSI_PDU_SCSI_RESPONSE;
+		r[1] = ISCSI_PDU_SCSI_FINAL;
+		memcpy(&r[16], &t->hdr[16], 4);
+		scsi_set_uint32(&r[24], t->statsn++);
+		scsi_set_uint32(&r[28], scsi_get_uint32(&t->hdr[24]) + 1);
+		scsi_set_uint32(&r[32], scsi_get_uint32(&t->hdr[24]) + IN_FLIGHT);
+		t->rsp_len += ISCSI_RAW_HEADER_SIZE;
+		t->hdr_len = 0;
+	}
+
+	if (t->rsp_len) {
+		if (write(t->fd, t->rsp, t->rsp_len) != (ssize_t)t->rsp_len) {
+			return -1;
+		}
+		t->rsp_len = 0;
+	}
+	return 0;
+}
+
+static int
+tcp_pair(int *client, int *server)
+{
+	struct sockaddr_in sin;
+	socklen_t len = sizeof(sin);
+	int lfd;
+
+	lfd = socket(AF_INET, SOCK_STREAM, 0);
+	if (lfd == -1) {
+		return -1;
+	}
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(lfd, (struct sockaddr *)&sin, sizeof(sin)) != 0 ||
+	    listen(lfd, 1) != 0 ||
+	    getsockname(lfd, (struct sockaddr *)&sin, &len) != 0) {
+		close(lfd);
+		return -1;
+	}
+	*client = socket(AF_INET, SOCK_STREAM, 0);
+	if (*client == -1 ||
+	    connect(*client, (struct sockaddr *)&sin, sizeof(sin)) != 0) {
+		close(lfd);
+		return -1;
+	}
+	*server = accept(lfd, NULL, NULL);
+	close(lfd);
+	return *server == -1 ? -1 : 0;
+}
+
+static int
+bench(int threshold)
+{
+	struct iscsi_context *iscsi;
+	struct pollfd pfd;
+	struct scsi_iovec iov;
+	struct target t;
+	unsigned char *data;
+	int client, submitted = 0, ret = -1;
+	double start, cpu_start, ns, cpu_ns;
+
+	memset(&t, 0, sizeof(t));
+	t.statsn = 1;
+	if (tcp_pair(&client, &t.fd) != 0) {
+		fprintf(stderr, "Failed to set up loopback connection\n");
+		return -1;
+	}
+	data = malloc(IOSIZE);
+	iscsi = iscsi_create_context("iqn.2007-10.com.github:sahlberg:libiscsi:bench");
+	if (data == NULL || iscsi == NULL) {
+		fprintf(stderr, "Failed to create context\n");
+		goto out;
+	}
+	memset(data, 0xa5, IOSIZE);
+	iov.iov_base = data;
+	iov.iov_len = IOSIZE;
+
+	/* pretend we are logged in and send every write as immediate data */
+	fcntl(client, F_SETFL, O_NONBLOCK);
+	fcntl(t.fd, F_SETFL, O_NONBLOCK);
+	iscsi->fd = client;
+	iscsi->is_connected = 1;
+	iscsi->is_loggedin = 1;
+	iscsi->session_type = ISCSI_SESSION_NORMAL;
+	iscsi->maxcmdsn = iscsi->cmdsn + IN_FLIGHT;
+	iscsi->first_burst_length = IOSIZE;
+	iscsi->target_max_recv_data_segment_length = IOSIZE;
+	iscsi->zerocopy_threshold = threshold;
+#ifdef HAVE_MSG_ZEROCOPY
+	if (threshold) {
+		int value = 1;
+
+		if (setsockopt(client, SOL_SOCKET, SO_ZEROCOPY, &value,
+			       sizeof(value)) == 0) {
+			iscsi->zerocopy = 1;
+		}
+	}
+#endif
+
+	completed = bad_completions = 0;
+	start = bench_clock_ns(CLOCK_MONOTONIC);
+	cpu_start = bench_clock_ns(CLOCK_PROCESS_CPUTIME_ID);
+	while (completed < WRITES) {
+		while (submitted < WRITES && submitted - completed < IN_FLIGHT) {
+			if (iscsi_write10_iov_task(iscsi, 0, 0, NULL, IOSIZE,
+						   BLOCKSIZE, 0, 0, 0, 0, 0,
+						   write_cb, NULL, &iov,
+						   1) == NULL) {
+				fprintf(stderr, "Failed to queue WRITE10\n");
+				goto out;
+			}
+			submitted++;
+		}
+		if (fake_target(&t) != 0) {
+			fprintf(stderr, "Bad pdu on the wire\n");
+			goto out;
+		}
+		pfd.fd = client;
+		pfd.events = iscsi_which_events(iscsi);
+		if (poll(&pfd, 1, 1) < 0 ||
+		    iscsi_service(iscsi, pfd.revents) != 0) {
+			fprintf(stderr, "iscsi_service failed: %s\n",
+				iscsi_get_error(iscsi));
+			goto out;
+		}
+	}
+	ns = bench_clock_ns(CLOCK_MONOTONIC) - start;
+	cpu_ns = bench_clock_ns(CLOCK_PROCESS_CPUTIME_ID) - cpu_start;
+
+	printf("%10d %8s %10.0f %12.1f %8u %6d\n", threshold,
+	       iscsi->zerocopy ? "yes" : "no",
+	       (double)WRITES * IOSIZE / (1 << 20) / (ns / 1e9),
+	       cpu_ns / 1e3 / ((double)WRITES * IOSIZE / (1 << 20)),
+	       iscsi->zc_done, bad_completions);
+	ret = bad_completions ? -1 : 0;
+
+ out:
+	if (iscsi != NULL) {
+		iscsi->fd = -1;
+		iscsi_destroy_context(iscsi);
+	}
+	free(data);
+	close(client);
+	close(t.fd);
+	return ret;
+}
+
+int main(void)
+{
+	printf("%10s %8s %10s %12s %8s %6s\n", "threshold", "zerocopy",
+	       "MB/s", "cpu us/MB", "zc done", "bad");
+	if (bench(0) || bench(IOSIZE)) {
+		return 1;
+	}
+	return 0;
+}
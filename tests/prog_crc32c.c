@@ -0,0 +1,180 @@
+/*
+   Copyright (C) 2026 by the libiscsi authors
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * Known answer tests for every CRC32C implementation this CPU supports.
+ * Checks the RFC 3720 B.4 vectors and compares all lengths, alignments
+ * and chain splits that reach each code path against a bitwise reference.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "iscsi.h"
+#include "iscsi-private.h"
+
+/* enough for several iterations of the long 3 lane loop plus a tail */
+#define BUFSIZE (3 * 3 * 8192 + 3 * 256 + 64)
+
+static uint8_t buf[BUFSIZE + 8];
+
+static uint32_t
+crc32c_bitwise(const uint8_t *p, size_t len)
+{
+	uint32_t crc = 0xffffffff;
+	int i;
+
+	while (len-- > 0) {
+		crc ^= *p++;
+		for (i = 0; i < 8; i++) {
+			crc = crc & 1 ? (crc >> 1) ^ 0x82F63B78 : crc >> 1;
+		}
+	}
+	return crc ^ 0xffffffff;
+}
+
+/* RFC 3720 B.4 */
+static int
+check_rfc3720(const char *name)
+{
+	static const uint8_t read_pdu[48] = {
+		0x01, 0xc0, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+		0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+		0x14, 0x00, 0x00, 0x00, 0x00, 0x00, 0x04, 0x00,
+		0x00, 0x00, 0x00, 0x14, 0x00, 0x00, 0x00, 0x18,
+		0x28, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+		0x02, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	};
+	uint8_t v[48];
+	uint32_t crc;
+	int i, ret = 0;
+
+	memset(v, 0, 32);
+	if ((crc = crc32c(v, 32)) != 0x8a9136aa) {
+		fprintf(stderr, "%s: 32 zeros: %08x\n", name, crc);
+		ret = -1;
+	}
+	memset(v, 0xff, 32);
+	if ((crc = crc32c(v, 32)) != 0x62a8ab43) {
+		fprintf(stderr, "%s: 32 0xff: %08x\n", name, crc);
+		ret = -1;
+	}
+	for (i = 0; i < 32; i++) {
+		v[i] = i;
+	}
+	if ((crc = crc32c(v, 32)) != 0x46dd794e) {
+		fprintf(stderr, "%s: incrementing: %08x\n", name, crc);
+		ret = -1;
+	}
+	for (i = 0; i < 32; i++) {
+		v[i] = 31 - i;
+	}
+	if ((crc = crc32c(v, 32)) != 0x113fdb5c) {
+		fprintf(stderr, "%s: decrementing: %08x\n", name, crc);
+		ret = -1;
+	}
+	memcpy(v, read_pdu, sizeof(read_pdu));
+	if ((crc = crc32c(v, sizeof(read_pdu))) != 0xd9963a56) {
+		fprintf(stderr, "%s: read pdu: %08x\n", name, crc);
+		ret = -1;
+	}
+	memcpy(v, "123456789", 9);
+	if ((crc = crc32c(v, 9)) != 0xe3069283) {
+		fprintf(stderr, "%s: 123456789: %08x\n", name, crc);
+		ret = -1;
+	}
+	return ret;
+}
+
+/* lengths around every lane and block boundary of the implementations */
+static const size_t lengths[] = {
+	0, 1, 7, 8, 9, 15, 16, 48, 63, 64, 65,
+	767, 768, 769, 1535, 1536, 1537, 4096, 8192,
+	24575, 24576, 24577, 24576 + 768, 24576 + 768 + 9,
+	49151, 49152, 49153, BUFSIZE,
+};
+
+static int
+check_reference(const char *name)
+{
+	uint32_t crc, ref;
+	size_t i, off, split, len;
+
+	for (i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+		for (off = 0; off < 8; off++) {
+			len = lengths[i];
+			ref = crc32c_bitwise(&buf[off], len);
+			crc = crc32c(&buf[off], len);
+			if (crc != ref) {
+				fprintf(stderr, "%s: len %zu offset %zu: "
+					"%08x expected %08x\n", name, len,
+					off, crc, ref);
+				return -1;
+			}
+			/* chaining across an arbitrary split */
+			split = len / 3 + off;
+			if (split > len) {
+				split = len;
+			}
+			crc32c_init(&crc);
+			crc = crc32c_chain(crc, &buf[off], split);
+			crc = crc32c_chain(crc, &buf[off + split], len - split);
+			crc = crc32c_chain_done(crc);
+			if (crc != ref) {
+				fprintf(stderr, "%s: len %zu offset %zu split "
+					"%zu: %08x expected %08x\n", name, len,
+					off, split, crc, ref);
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+int main(void)
+{
+	int impl, tested = 0, ret = 0;
+	size_t i;
+
+	srandom(3720);
+	for (i = 0; i < sizeof(buf); i++) {
+		buf[i] = random();
+	}
+
+	for (impl = 0; impl < CRC32C_IMPL_MAX; impl++) {
+		const char *name = crc32c_impl_name(impl);
+
+		if (crc32c_select(impl) != 0) {
+			printf("%-14s not supported\n", name);
+			continue;
+		}
+		tested++;
+		if (check_rfc3720(name) || check_reference(name)) {
+			printf("%-14s FAILED\n", name);
+			ret = 1;
+			continue;
+		}
+		printf("%-14s ok\n", name);
+	}
+	if (tested == 0) {
+		ret = 1;
+	}
+	return ret;
+}
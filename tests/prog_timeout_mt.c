@@ -0,0 +1,186 @@
+/*
+   Copyright (C) 2026 by the libiscsi authors
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * Check that sync commands fail within their timeout when the service
+ * thread is running and the target never answers. One command is sent
+ * and left waiting for a reply, another one never leaves the outqueue
+ * because the target closed the CmdSN window. Last, a logout is queued
+ * while the service thread is stuck in a callback, and has to be given up
+ * on once its cancels did not complete it.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "iscsi.h"
+#include "iscsi-private.h"
+#include "scsi-lowlevel.h"
+
+#define TIMEOUT_MS 500
+/* longer than a sync command waits before it gives up */
+#define BUSY_MS    (TIMEOUT_MS + ISCSI_SYNC_TIMEOUT_GRACE_MS + \
+		    ISCSI_SYNC_CANCEL_RETRIES * ISCSI_TIMEOUT_RECHECK_MS + 500)
+
+static int busy;
+
+static double
+now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static int
+check_timeout(struct iscsi_context *iscsi, const char *what)
+{
+	struct scsi_task *task;
+	double start, ms;
+	int status;
+
+	start = now_ms();
+	task = iscsi_testunitready_sync(iscsi, 0);
+	ms = now_ms() - start;
+	if (task == NULL) {
+		fprintf(stderr, "%s: failed to send command\n", what);
+		return -1;
+	}
+	status = task->status;
+	scsi_free_scsi_task(task);
+
+	printf("%s: status %d after %.0f ms\n", what, status, ms);
+	if (status != SCSI_STATUS_TIMEOUT) {
+		fprintf(stderr, "%s: expected SCSI_STATUS_TIMEOUT\n", what);
+		return -1;
+	}
+	if (ms < TIMEOUT_MS - 1 ||
+	    ms > TIMEOUT_MS + ISCSI_SYNC_TIMEOUT_GRACE_MS) {
+		fprintf(stderr, "%s: timed out after %.0f ms, expected %d\n",
+			what, ms, TIMEOUT_MS);
+		return -1;
+	}
+	return 0;
+}
+
+static void
+busy_cb(struct iscsi_context *iscsi, int status, void *command_data,
+	void *private_data)
+{
+	struct timespec ts = {BUSY_MS / 1000, BUSY_MS % 1000 * 1000000L};
+
+	__atomic_store_n(&busy, 1, __ATOMIC_RELEASE);
+	nanosleep(&ts, NULL);
+	scsi_free_scsi_task(command_data);
+}
+
+static int
+check_give_up(struct iscsi_context *iscsi)
+{
+	struct timespec ts = {0, 1000000};
+	double start, ms;
+	int ret;
+
+	if (iscsi_testunitready_task(iscsi, 0, busy_cb, NULL) == NULL) {
+		fprintf(stderr, "service thread busy: failed to send command\n");
+		return -1;
+	}
+	/* the command times out and its callback keeps the thread busy */
+	while (!__atomic_load_n(&busy, __ATOMIC_ACQUIRE)) {
+		nanosleep(&ts, NULL);
+	}
+
+	start = now_ms();
+	ret = iscsi_logout_sync(iscsi);
+	ms = now_ms() - start;
+
+	printf("service thread busy: logout %d after %.0f ms\n", ret, ms);
+	if (ret == 0) {
+		fprintf(stderr, "service thread busy: expected logout to fail\n");
+		return -1;
+	}
+	if (ms > BUSY_MS + ISCSI_SYNC_TIMEOUT_GRACE_MS) {
+		fprintf(stderr, "service thread busy: gave up after %.0f ms\n",
+			ms);
+		return -1;
+	}
+	return 0;
+}
+
+int main(void)
+{
+	struct iscsi_context *iscsi;
+	int sv[2], ret = 1;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+		return 1;
+	}
+	iscsi = iscsi_create_context("iqn.2007-10.com.github:sahlberg:libiscsi:test");
+	if (iscsi == NULL) {
+		fprintf(stderr, "Failed to create context\n");
+		goto out;
+	}
+
+	/* pretend we are logged in to a target that never answers */
+	fcntl(sv[0], F_SETFL, O_NONBLOCK);
+	iscsi->fd = sv[0];
+	iscsi->is_connected = 1;
+	iscsi->is_loggedin = 1;
+	iscsi->session_type = ISCSI_SESSION_NORMAL;
+	iscsi->statsn = 0;
+	iscsi->maxcmdsn = iscsi->cmdsn + 16;
+	iscsi_set_timeout_ms(iscsi, TIMEOUT_MS);
+
+	if (iscsi_mt_service_thread_start(iscsi) != 0) {
+		fprintf(stderr, "%s\n", iscsi_get_error(iscsi));
+		goto out;
+	}
+
+	if (check_timeout(iscsi, "waiting for reply") != 0) {
+		goto stop;
+	}
+
+	iscsi_mt_spin_lock(&iscsi->iscsi_lock);
+	iscsi->maxcmdsn = iscsi->cmdsn - 1;
+	iscsi_mt_spin_unlock(&iscsi->iscsi_lock);
+	if (check_timeout(iscsi, "window closed") != 0) {
+		goto stop;
+	}
+	if (check_give_up(iscsi) != 0) {
+		goto stop;
+	}
+	ret = 0;
+
+ stop:
+	iscsi_mt_service_thread_stop(iscsi);
+ out:
+	if (iscsi != NULL) {
+		iscsi->fd = -1;
+		iscsi_destroy_context(iscsi);
+	}
+	close(sv[0]);
+	close(sv[1]);
+	return ret;
+}
@@ -0,0 +1,11 @@
+#!/bin/sh
+
+. ./functions.sh
+
+echo "CRC32C tests"
+
+echo -n "Test the CRC32C implementations against known answers ..."
+./prog_crc32c > /dev/null || failure
+success
+
+exit 0
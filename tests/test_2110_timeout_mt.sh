@@ -0,0 +1,11 @@
+#!/bin/sh
+
+. ./functions.sh
+
+echo "Timeout tests with the service thread"
+
+echo -n "Test that sync commands time out while the service thread runs ..."
+./prog_timeout_mt > /dev/null || failure
+success
+
+exit 0
@@ -0,0 +1,12 @@
+#!/bin/sh
+
+. ./functions.sh
+
+echo "Reassembly of Data-In segments"
+
+echo -n "Test that Data-In segments are put together in and out of order ..."
+# fill new heap memory with garbage so a skipped segment shows
+MALLOC_PERTURB_=165 ./prog_bench_reassembly > /dev/null || failure
+success
+
+exit 0
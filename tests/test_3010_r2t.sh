@@ -0,0 +1,11 @@
+#!/bin/sh
+
+. ./functions.sh
+
+echo "R2T tests"
+
+echo -n "Test that every R2T is answered with the data it asked for ..."
+./prog_bench_r2t > /dev/null || failure
+success
+
+exit 0
@@ -0,0 +1,11 @@
+#!/bin/sh
+
+. ./functions.sh
+
+echo "Data-Out tests"
+
+echo -n "Test that a large WRITE is sent as Data-Out pdus in order ..."
+./prog_bench_data_out > /dev/null || failure
+success
+
+exit 0
@@ -0,0 +1,11 @@
+#!/bin/sh
+
+. ./functions.sh
+
+echo "Multiple connections per session"
+
+echo -n "Test that the connections of a session share CmdSNs and ITTs ..."
+./prog_bench_mcs > /dev/null || failure
+success
+
+exit 0
@@ -0,0 +1,11 @@
+#!/bin/sh
+
+. ./functions.sh
+
+echo "Session group tests"
+
+echo -n "Test that a session group spreads commands and survives a reconnect ..."
+./prog_bench_session_group > /dev/null || failure
+success
+
+exit 0
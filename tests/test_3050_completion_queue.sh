@@ -0,0 +1,11 @@
+#!/bin/sh
+
+. ./functions.sh
+
+echo "Completion queue tests"
+
+echo -n "Test that every command is reaped exactly once from the queue ..."
+./prog_bench_completion_queue > /dev/null || failure
+success
+
+exit 0
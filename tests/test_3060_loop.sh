@@ -0,0 +1,11 @@
+#!/bin/sh
+
+. ./functions.sh
+
+echo "Event loop tests"
+
+echo -n "Test that the event loop services busy sessions and expires timeouts ..."
+./prog_bench_loop > /dev/null || failure
+success
+
+exit 0
@@ -0,0 +1,11 @@
+#!/bin/sh
+
+. ./functions.sh
+
+echo "Receive buffer tests"
+
+echo -n "Test that a burst of responses completes with and without a receive buffer ..."
+./prog_bench_recv > /dev/null || failure
+success
+
+exit 0
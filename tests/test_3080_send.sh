@@ -0,0 +1,11 @@
+#!/bin/sh
+
+. ./functions.sh
+
+echo "Batched send tests"
+
+echo -n "Test that batched sends put every pdu and data digest on the wire intact ..."
+./prog_bench_send > /dev/null || failure
+success
+
+exit 0
@@ -0,0 +1,11 @@
+#!/bin/sh
+
+. ./functions.sh
+
+echo "MSG_ZEROCOPY tests"
+
+echo -n "Test that zerocopy writes complete only after the kernel released their pages ..."
+./prog_bench_zerocopy > /dev/null || failure
+success
+
+exit 0
@@ -0,0 +1,11 @@
+#!/bin/sh
+
+. ./functions.sh
+
+echo "io_uring transport tests"
+
+echo -n "Test that READ10s complete over the TCP and io_uring transports ..."
+./prog_bench_uring > /dev/null || failure
+success
+
+exit 0